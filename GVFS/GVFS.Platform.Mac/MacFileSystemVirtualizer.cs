@@ -258,6 +258,7 @@ protected override bool TryStart(out string error)
             this.virtualizationInstance.OnFileRenamed = this.OnFileRenamed;
             this.virtualizationInstance.OnHardLinkCreated = this.OnHardLinkCreated;
             this.virtualizationInstance.OnFilePreConvertToFull = this.NotifyFilePreConvertToFull;
+            this.virtualizationInstance.OnNotificationsDropped = this.OnNotificationsDropped;
 
             uint threadCount = (uint)Environment.ProcessorCount * 2;
 
@@ -497,6 +498,12 @@ private void OnLogInfo(string infoMessage)
             this.Context.Tracer.RelatedInfo($"{nameof(MacFileSystemVirtualizer)}::{nameof(this.OnLogInfo)}: {infoMessage}");
         }
 
+        private void OnNotificationsDropped()
+        {
+            // Changes made while notifications were being dropped are missing from the modified paths
+            this.Context.Tracer.RelatedError($"{nameof(MacFileSystemVirtualizer)}::{nameof(this.OnNotificationsDropped)}: notifications were dropped, modified paths may be incomplete");
+        }
+
         private void OnFileModified(string relativePath)
         {
             try
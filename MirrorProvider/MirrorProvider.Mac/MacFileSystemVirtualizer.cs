@@ -33,6 +33,7 @@ public override bool TryStartVirtualizationInstance(Enlistment enlistment, out s
             this.virtualizationInstance.OnFileRenamed = this.OnFileRenamed;
             this.virtualizationInstance.OnHardLinkCreated = this.OnHardLinkCreated;
             this.virtualizationInstance.OnFilePreConvertToFull = this.OnFilePreConvertToFull;
+            this.virtualizationInstance.OnNotificationsDropped = this.OnNotificationsDropped;
 
             Result result = this.virtualizationInstance.StartVirtualizationInstance(
                 enlistment.SrcRoot,
@@ -226,6 +227,11 @@ private Result OnFilePreConvertToFull(string relativePath)
             return Result.Success;
         }
 
+        private void OnNotificationsDropped()
+        {
+            Console.WriteLine("OnNotificationsDropped");
+        }
+
         private bool TryGetSymLinkTarget(string relativePath, out string symLinkTarget)
         {
             symLinkTarget = null;
@@ -1,6 +1,7 @@
 #include <kern/debug.h>
 #include <sys/kauth.h>
 #include <sys/proc.h>
+#include <sys/sysctl.h>
 #include <kern/assert.h>
 #include <libkern/version.h>
 #include <kern/thread.h>
@@ -8,6 +9,7 @@
 #include "KauthHandlerPrivate.hpp"
 #include "public/PrjFSCommon.h"
 #include "public/PrjFSPerfCounter.h"
+#include "public/PrjFSProcessPolicy.h"
 #include "public/PrjFSXattrs.h"
 #include "VirtualizationRoots.hpp"
 #include "VnodeUtilities.hpp"
@@ -47,6 +49,65 @@ struct PendingRenameOperation
     thread_t thread;
 };
 
+// Pending renames are mainly kept in a table of slots keyed by thread. A thread only ever adds and
+// removes its own entry, so claiming a free slot is the only step that can race with other threads,
+// and that's done with a compare-and-swap. Each thread's entry lives within a fixed number of slots
+// of its hash, so lookups check those rather than stopping at an empty slot, and removal doesn't
+// need tombstones. Threads that find all of those slots taken fall back to the locked array.
+static const uint32_t PendingRenameSlotsPerCPU = 4;
+static const uint32_t MinPendingRenameSlotCount = 64;
+static const uint32_t PendingRenameSlotProbeLength = 8;
+
+// A file whose modification was reported to the provider with the given generation
+struct ReportedModifiedFile
+{
+    FsidInode fileId;
+    uint64_t providerGeneration;
+};
+
+// Direct-mapped, so a collision merely evicts an entry and costs one redundant notification
+static const uint32_t ReportedModifiedFileSlotBits = 10;
+static const uint32_t ReportedModifiedFileSlotCount = 1u << ReportedModifiedFileSlotBits;
+
+// Whether a process or one of its ancestors runs as a non-service user. A pid that is reused by a
+// process with the same parent and UID has the same ancestry, so the decision still applies.
+struct HydrationDecision
+{
+    pid_t pid;
+    pid_t parentPID;
+    uid_t uid;
+    bool isValid;
+    bool ancestryHasNonServiceUser;
+};
+
+static const uint32_t HydrationDecisionSlotBits = 8;
+static const uint32_t HydrationDecisionSlotCount = 1u << HydrationDecisionSlotBits;
+
+struct ProcessPolicy
+{
+    char processName[MAXCOMLEN + 1]; // empty if the slot is unused
+    PrjFSProcessPolicyAction action;
+};
+
+// Open-addressed with linear probing, and kept at most a quarter full
+static const uint32_t ProcessPolicySlotBits = 8;
+static const uint32_t ProcessPolicySlotCount = 1u << ProcessPolicySlotBits;
+static_assert(ProcessPolicySlotCount >= 4 * PrjFSProcessPolicyMaxCount, "Process policy table must stay sparse");
+
+// These processes will crawl the file system and force a full hydration unless denied
+static const char* const DefaultDenyHydrateProcessNames[] =
+{
+    "mds",
+    "mdworker",
+    "mdworker_shared",
+    "mds_stores",
+    "fseventsd",
+    "Spotlight",
+};
+static_assert(
+    sizeof(DefaultDenyHydrateProcessNames) / sizeof(DefaultDenyHydrateProcessNames[0]) <= PrjFSProcessPolicyMaxCount - PrjFSProcessPolicyMaxSettableCount,
+    "Default policies must leave room for those set by user space");
+
 // Function prototypes
 KEXT_STATIC int HandleVnodeOperation(
     kauth_cred_t    credential,
@@ -71,11 +132,18 @@ KEXT_STATIC_INLINE bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit);
 KEXT_STATIC_INLINE bool TryGetFileIsFlaggedAsInRoot(vnode_t vnode, vfs_context_t _Nonnull context, bool* flaggedInRoot);
 KEXT_STATIC_INLINE bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask);
 KEXT_STATIC bool CurrentProcessIsAllowedToHydrate();
-KEXT_STATIC bool IsFileSystemCrawler(const char* procname);
+KEXT_STATIC PrjFSProcessPolicyAction GetProcessPolicyAction(const char* procname, uint32_t* policySlot);
+KEXT_STATIC bool InitProcessPolicies();
+KEXT_STATIC void CleanupProcessPolicies();
+static uint32_t HashProcessName(const char* processName);
+static void InsertProcessPolicy_Locked(const char* processName, PrjFSProcessPolicyAction action);
+static void ReplaceProcessPolicies_Locked(const PrjFSProcessPolicy* policies, uint32_t policyCount);
 
 static void WaitForListenerCompletion();
+static uint32_t GetMaxLogicalCPUCount();
 KEXT_STATIC bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode);
 static bool VnodeIsEligibleForEventHandling(vnode_t vnode);
+static bool OpenedFileIsKnownToBeOutsideActiveRoots(PerfTracer* perfTracer, vnode_t vnode);
 
 KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     // In params:
@@ -85,7 +153,7 @@ KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     kauth_action_t action,
 
     // Out params:
-    uint32_t* vnodeFileFlags,
+    VnodeAttributes* vnodeAttributes,
     int* pid,
     char procname[MAXCOMLEN + 1],
     int* kauthResult,
@@ -102,7 +170,6 @@ static bool TryGetVirtualizationRoot(
 
     // Out params:
     VirtualizationRootHandle* root,
-    FsidInode* vnodeFsidInode,
     int* kauthResult,
     int* kauthError,
     ProviderStatus* _Nullable providerStatus = nullptr);
@@ -123,17 +190,50 @@ KEXT_STATIC bool ShouldHandleFileOpEvent(
 KEXT_STATIC bool InitPendingRenames();
 KEXT_STATIC void CleanupPendingRenames();
 KEXT_STATIC void ResizePendingRenames(uint32_t newMaxPendingRenames);
+static uint32_t GetPendingRenameSlotIndex(thread_t thread);
+static bool TryRecordPendingRenameInSlots(thread_t thread, vnode_t vnode);
+static bool TryRemovePendingRenameFromSlots(thread_t thread, vnode_t vnode);
+KEXT_STATIC bool InitReportedModifiedFiles();
+KEXT_STATIC void CleanupReportedModifiedFiles();
+KEXT_STATIC bool FileModificationWasReported(const FsidInode& fileId, uint64_t providerGeneration);
+KEXT_STATIC void RecordReportedFileModification(const FsidInode& fileId, uint64_t providerGeneration);
+KEXT_STATIC bool InitHydrationDecisions();
+KEXT_STATIC void CleanupHydrationDecisions();
+static bool TryGetHydrationDecision(pid_t pid, pid_t parentPID, uid_t uid, bool* ancestryHasNonServiceUser);
+static void RecordHydrationDecision(pid_t pid, pid_t parentPID, uid_t uid, bool ancestryHasNonServiceUser);
+static uid_t GetProcessUID(proc_t process);
 
 // State
 static kauth_listener_t s_vnodeListener = nullptr;
 static kauth_listener_t s_fileopListener = nullptr;
 
 static atomic_int s_numActiveKauthEvents;
+static PendingRenameOperation* s_pendingRenameSlots = nullptr;
+// Power of 2
+KEXT_STATIC uint32_t s_pendingRenameSlotCount = 0;
+static uint32_t s_pendingRenameSlotAllocationCount = 0;
+// Overflow for renames that didn't find a free slot
 static SpinLock s_renameLock;
 static PendingRenameOperation* s_pendingRenames = nullptr;
 KEXT_STATIC uint32_t s_pendingRenameCount = 0;
 KEXT_STATIC uint32_t s_maxPendingRenames = 0;
 static bool s_osSupportsRenameDetection = false;
+// Editors and build tools close the same file as modified many times over, but the provider only
+// needs to hear about it once. Entries are tagged with the provider generation, so they lapse
+// when the provider reconnects.
+static SpinLock s_reportedModifiedFilesLock;
+static ReportedModifiedFile s_reportedModifiedFiles[ReportedModifiedFileSlotCount] = {};
+// Walking a process's ancestors on every hydration or enumeration is costly; builds keep
+// asking on behalf of the same few processes.
+static SpinLock s_hydrationDecisionsLock;
+static HydrationDecision s_hydrationDecisions[HydrationDecisionSlotCount] = {};
+// Looked up on every access to an empty placeholder, so readers don't take the lock, which only
+// serialises replacement of the table. They validate what they read against the sequence number
+// instead, which is odd while the table is being replaced.
+static SpinLock s_processPoliciesLock;
+static atomic_uint_least32_t s_processPoliciesSequence;
+static ProcessPolicy s_processPolicies[ProcessPolicySlotCount] = {};
+static atomic_uint_least64_t s_processPolicyDenialCounts[ProcessPolicySlotCount];
 
 // Public functions
 kern_return_t KauthHandler_Init()
@@ -153,7 +253,8 @@ kern_return_t KauthHandler_Init()
         goto CleanupAndFail;
     }
     
-    if (VnodeCache_Init())
+    // One vnode cache shard per CPU keeps an insert storm on one CPU from stalling lookups on the others
+    if (VnodeCache_Init(GetMaxLogicalCPUCount()))
     {
         goto CleanupAndFail;
     }
@@ -162,6 +263,21 @@ kern_return_t KauthHandler_Init()
     {
         goto CleanupAndFail;
     }
+    
+    if (!InitReportedModifiedFiles())
+    {
+        goto CleanupAndFail;
+    }
+    
+    if (!InitHydrationDecisions())
+    {
+        goto CleanupAndFail;
+    }
+    
+    if (!InitProcessPolicies())
+    {
+        goto CleanupAndFail;
+    }
 
     s_vnodeListener = kauth_listen_scope(KAUTH_SCOPE_VNODE, HandleVnodeOperation, nullptr);
     if (nullptr == s_vnodeListener)
@@ -212,6 +328,9 @@ kern_return_t KauthHandler_Cleanup()
     WaitForListenerCompletion();
 
     CleanupPendingRenames();
+    CleanupReportedModifiedFiles();
+    CleanupHydrationDecisions();
+    CleanupProcessPolicies();
     
     if (VnodeCache_Cleanup())
     {
@@ -257,15 +376,28 @@ KEXT_STATIC bool InitPendingRenames()
     s_osSupportsRenameDetection = (version_major >= PrjFSDarwinMajorVersion::MacOS10_14_Mojave);
     if (s_osSupportsRenameDetection)
     {
+        // Each CPU can only be running one rename at a time, but threads may block between recording
+        // the rename and its delete authorization, so leave plenty of room
+        uint32_t wantedSlotCount = GetMaxLogicalCPUCount() * PendingRenameSlotsPerCPU;
+        s_pendingRenameSlotCount = MinPendingRenameSlotCount;
+        while (s_pendingRenameSlotCount < wantedSlotCount)
+        {
+            s_pendingRenameSlotCount *= 2;
+        }
+        
+        s_pendingRenameSlotAllocationCount = s_pendingRenameSlotCount;
+        s_pendingRenameSlots = Memory_AllocArray<PendingRenameOperation>(s_pendingRenameSlotAllocationCount);
+        
         s_renameLock = SpinLock_Alloc();
-        s_maxPendingRenames = 8; // Arbitrary choice, should be maximum number of expected concurrent threads performing renames, but array will resize on demand
+        s_maxPendingRenames = 8; // Arbitrary choice, as the array is only used when the slots around a thread's hash are taken, and resizes on demand
         s_pendingRenameCount = 0;
         s_pendingRenames = Memory_AllocArray<PendingRenameOperation>(s_maxPendingRenames);
-        if (!SpinLock_IsValid(s_renameLock) || s_pendingRenames == nullptr)
+        if (!SpinLock_IsValid(s_renameLock) || s_pendingRenames == nullptr || s_pendingRenameSlots == nullptr)
         {
             return false;
         }
 
+        Array_DefaultInit(s_pendingRenameSlots, s_pendingRenameSlotAllocationCount);
         Array_DefaultInit(s_pendingRenames, s_maxPendingRenames);
     }
     
@@ -288,6 +420,14 @@ KEXT_STATIC void CleanupPendingRenames()
             s_pendingRenames = nullptr;
             s_maxPendingRenames = 0;
         }
+        
+        if (s_pendingRenameSlots != nullptr)
+        {
+            Memory_FreeArray(s_pendingRenameSlots, s_pendingRenameSlotAllocationCount);
+            s_pendingRenameSlots = nullptr;
+            s_pendingRenameSlotCount = 0;
+            s_pendingRenameSlotAllocationCount = 0;
+        }
     }
 }
 
@@ -331,6 +471,11 @@ KEXT_STATIC void RecordPendingRenameOperation(vnode_t vnode)
     assertf(s_osSupportsRenameDetection, "This function should only be called from the KAUTH_FILEOP_WILL_RENAME handler, which is only supported by Darwin 18 (macOS 10.14 Mojave) and newer (version_major = %u)", version_major);
     thread_t myThread = current_thread();
     
+    if (TryRecordPendingRenameInSlots(myThread, vnode))
+    {
+        return;
+    }
+    
     bool resizeTable;
     do
     {
@@ -381,10 +526,21 @@ KEXT_STATIC bool DeleteOpIsForRename(vnode_t vnode)
         return true;
     }
     
-    bool isRename = false;
-    
     thread_t myThread = current_thread();
     
+    if (TryRemovePendingRenameFromSlots(myThread, vnode))
+    {
+        return true;
+    }
+    
+    // Deletes vastly outnumber renames, so don't contend on the lock unless there are renames to check
+    if (0 == __atomic_load_n(&s_pendingRenameCount, __ATOMIC_RELAXED))
+    {
+        return false;
+    }
+    
+    bool isRename = false;
+    
     SpinLock_Acquire(s_renameLock);
     {
         for (uint32_t i = 0; i < s_pendingRenameCount; ++i)
@@ -409,6 +565,343 @@ KEXT_STATIC bool DeleteOpIsForRename(vnode_t vnode)
     return isRename;
 }
 
+static uint32_t GetPendingRenameSlotIndex(thread_t thread)
+{
+    // Fibonacci hash, taking the top bits of the product
+    uint64_t hash = reinterpret_cast<uintptr_t>(thread) * UINT64_C(11400714819323198485);
+    return static_cast<uint32_t>(hash >> 32) & (s_pendingRenameSlotCount - 1);
+}
+
+static bool TryRecordPendingRenameInSlots(thread_t thread, vnode_t vnode)
+{
+    uint32_t probeLength = s_pendingRenameSlotCount < PendingRenameSlotProbeLength ? s_pendingRenameSlotCount : PendingRenameSlotProbeLength;
+    uint32_t slotIndex = GetPendingRenameSlotIndex(thread);
+    for (uint32_t i = 0; i < probeLength; ++i, slotIndex = (slotIndex + 1) & (s_pendingRenameSlotCount - 1))
+    {
+        PendingRenameOperation& slot = s_pendingRenameSlots[slotIndex];
+        thread_t slotThread = __atomic_load_n(&slot.thread, __ATOMIC_RELAXED);
+        assert(slotThread != thread);
+        if (nullptr == slotThread &&
+            __atomic_compare_exchange_n(&slot.thread, &slotThread, thread, false /* weak */, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            // Only this thread reads the slot's vnode
+            slot.vnode = vnode;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static bool TryRemovePendingRenameFromSlots(thread_t thread, vnode_t vnode)
+{
+    uint32_t probeLength = s_pendingRenameSlotCount < PendingRenameSlotProbeLength ? s_pendingRenameSlotCount : PendingRenameSlotProbeLength;
+    uint32_t slotIndex = GetPendingRenameSlotIndex(thread);
+    for (uint32_t i = 0; i < probeLength; ++i, slotIndex = (slotIndex + 1) & (s_pendingRenameSlotCount - 1))
+    {
+        PendingRenameOperation& slot = s_pendingRenameSlots[slotIndex];
+        if (thread == __atomic_load_n(&slot.thread, __ATOMIC_RELAXED))
+        {
+            assert(slot.vnode == vnode);
+            slot.vnode = nullptr;
+            __atomic_store_n(&slot.thread, nullptr, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+KEXT_STATIC bool InitReportedModifiedFiles()
+{
+    s_reportedModifiedFilesLock = SpinLock_Alloc();
+    Array_DefaultInit(s_reportedModifiedFiles, ReportedModifiedFileSlotCount);
+    return SpinLock_IsValid(s_reportedModifiedFilesLock);
+}
+
+KEXT_STATIC void CleanupReportedModifiedFiles()
+{
+    if (SpinLock_IsValid(s_reportedModifiedFilesLock))
+    {
+        SpinLock_FreeMemory(&s_reportedModifiedFilesLock);
+    }
+}
+
+static ReportedModifiedFile& GetReportedModifiedFileSlot(const FsidInode& fileId)
+{
+    uint64_t key =
+        fileId.inode
+        ^ (static_cast<uint64_t>(static_cast<uint32_t>(fileId.fsid.val[0])) << 32)
+        ^ static_cast<uint32_t>(fileId.fsid.val[1]);
+    // Fibonacci hashing, as inode numbers tend to be sequential
+    uint64_t slot = (key * UINT64_C(11400714819323198485)) >> (64 - ReportedModifiedFileSlotBits);
+    return s_reportedModifiedFiles[slot];
+}
+
+KEXT_STATIC bool FileModificationWasReported(const FsidInode& fileId, uint64_t providerGeneration)
+{
+    if (0 == providerGeneration)
+    {
+        return false;
+    }
+    
+    bool wasReported;
+    SpinLock_Acquire(s_reportedModifiedFilesLock);
+    {
+        const ReportedModifiedFile& entry = GetReportedModifiedFileSlot(fileId);
+        wasReported =
+            entry.providerGeneration == providerGeneration
+            && entry.fileId.inode == fileId.inode
+            && entry.fileId.fsid.val[0] == fileId.fsid.val[0]
+            && entry.fileId.fsid.val[1] == fileId.fsid.val[1];
+    }
+    SpinLock_Release(s_reportedModifiedFilesLock);
+    
+    return wasReported;
+}
+
+KEXT_STATIC void RecordReportedFileModification(const FsidInode& fileId, uint64_t providerGeneration)
+{
+    if (0 == providerGeneration)
+    {
+        return;
+    }
+    
+    SpinLock_Acquire(s_reportedModifiedFilesLock);
+    {
+        GetReportedModifiedFileSlot(fileId) = ReportedModifiedFile{ fileId, providerGeneration };
+    }
+    SpinLock_Release(s_reportedModifiedFilesLock);
+}
+
+KEXT_STATIC bool InitHydrationDecisions()
+{
+    s_hydrationDecisionsLock = SpinLock_Alloc();
+    Array_DefaultInit(s_hydrationDecisions, HydrationDecisionSlotCount);
+    return SpinLock_IsValid(s_hydrationDecisionsLock);
+}
+
+KEXT_STATIC void CleanupHydrationDecisions()
+{
+    if (SpinLock_IsValid(s_hydrationDecisionsLock))
+    {
+        SpinLock_FreeMemory(&s_hydrationDecisionsLock);
+    }
+}
+
+static HydrationDecision& GetHydrationDecisionSlot(pid_t pid)
+{
+    // Fibonacci hashing, as pids are handed out sequentially
+    uint32_t slot = (static_cast<uint32_t>(pid) * UINT32_C(2654435769)) >> (32 - HydrationDecisionSlotBits);
+    return s_hydrationDecisions[slot];
+}
+
+static bool TryGetHydrationDecision(pid_t pid, pid_t parentPID, uid_t uid, bool* ancestryHasNonServiceUser)
+{
+    bool found;
+    SpinLock_Acquire(s_hydrationDecisionsLock);
+    {
+        const HydrationDecision& decision = GetHydrationDecisionSlot(pid);
+        found = decision.isValid && decision.pid == pid && decision.parentPID == parentPID && decision.uid == uid;
+        if (found)
+        {
+            *ancestryHasNonServiceUser = decision.ancestryHasNonServiceUser;
+        }
+    }
+    SpinLock_Release(s_hydrationDecisionsLock);
+    
+    return found;
+}
+
+static void RecordHydrationDecision(pid_t pid, pid_t parentPID, uid_t uid, bool ancestryHasNonServiceUser)
+{
+    SpinLock_Acquire(s_hydrationDecisionsLock);
+    {
+        GetHydrationDecisionSlot(pid) = HydrationDecision{ pid, parentPID, uid, true, ancestryHasNonServiceUser };
+    }
+    SpinLock_Release(s_hydrationDecisionsLock);
+}
+
+bool KauthHandler_SetProcessPolicies(const PrjFSProcessPolicyTable& table)
+{
+    if (table.policyCount > PrjFSProcessPolicyMaxSettableCount)
+    {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < table.policyCount; ++i)
+    {
+        const PrjFSProcessPolicy& policy = table.policies[i];
+        size_t nameLength = strnlen(policy.processName, sizeof(policy.processName));
+        if (nameLength == 0 || nameLength == sizeof(policy.processName)
+            || policy.action <= ProcessPolicyAction_Invalid || policy.action >= ProcessPolicyAction_Count)
+        {
+            KextLog_Error("KauthHandler_SetProcessPolicies: policy %u is invalid (name length %lu, action %u)", i, nameLength, policy.action);
+            return false;
+        }
+    }
+    
+    SpinLock_Acquire(s_processPoliciesLock);
+    {
+        ReplaceProcessPolicies_Locked(table.policies, table.policyCount);
+    }
+    SpinLock_Release(s_processPoliciesLock);
+    
+    return true;
+}
+
+void KauthHandler_GetProcessPolicies(PrjFSProcessPolicyTable& table)
+{
+    table = PrjFSProcessPolicyTable{};
+    
+    SpinLock_Acquire(s_processPoliciesLock);
+    {
+        for (uint32_t slot = 0; slot < ProcessPolicySlotCount && table.policyCount < PrjFSProcessPolicyMaxCount; ++slot)
+        {
+            const ProcessPolicy& policy = s_processPolicies[slot];
+            if (policy.processName[0] != '\0')
+            {
+                PrjFSProcessPolicy& reportedPolicy = table.policies[table.policyCount];
+                strlcpy(reportedPolicy.processName, policy.processName, sizeof(reportedPolicy.processName));
+                reportedPolicy.action = policy.action;
+                reportedPolicy.denialCount = atomic_load_explicit(&s_processPolicyDenialCounts[slot], memory_order_relaxed);
+                ++table.policyCount;
+            }
+        }
+    }
+    SpinLock_Release(s_processPoliciesLock);
+}
+
+KEXT_STATIC bool InitProcessPolicies()
+{
+    s_processPoliciesLock = SpinLock_Alloc();
+    if (!SpinLock_IsValid(s_processPoliciesLock))
+    {
+        return false;
+    }
+    
+    SpinLock_Acquire(s_processPoliciesLock);
+    {
+        ReplaceProcessPolicies_Locked(nullptr, 0);
+    }
+    SpinLock_Release(s_processPoliciesLock);
+    
+    return true;
+}
+
+KEXT_STATIC void CleanupProcessPolicies()
+{
+    if (SpinLock_IsValid(s_processPoliciesLock))
+    {
+        SpinLock_FreeMemory(&s_processPoliciesLock);
+    }
+}
+
+static uint32_t HashProcessName(const char* processName)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < MAXCOMLEN && processName[i] != '\0'; ++i)
+    {
+        hash = (hash ^ static_cast<uint8_t>(processName[i])) * 16777619u;
+    }
+    
+    return hash;
+}
+
+// Returns the policy for the named process, and the slot of the policy table it was found in, or
+// UINT32_MAX if the process has no policy.
+KEXT_STATIC PrjFSProcessPolicyAction GetProcessPolicyAction(const char* procname, uint32_t* policySlot)
+{
+    uint32_t hash = HashProcessName(procname);
+    
+    while (true)
+    {
+        uint32_t sequence = atomic_load_explicit(&s_processPoliciesSequence, memory_order_acquire);
+        if (0 != (sequence & 1))
+        {
+            // The table is being replaced, which is quick and rare
+            continue;
+        }
+        
+        PrjFSProcessPolicyAction action = ProcessPolicyAction_Allow;
+        *policySlot = UINT32_MAX;
+        for (uint32_t probe = 0; probe < ProcessPolicySlotCount; ++probe)
+        {
+            uint32_t slot = (hash + probe) & (ProcessPolicySlotCount - 1);
+            const ProcessPolicy& policy = s_processPolicies[slot];
+            if (policy.processName[0] == '\0')
+            {
+                break;
+            }
+            
+            if (0 == strncmp(policy.processName, procname, sizeof(policy.processName)))
+            {
+                action = policy.action;
+                *policySlot = slot;
+                break;
+            }
+        }
+        
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence == atomic_load_explicit(&s_processPoliciesSequence, memory_order_relaxed))
+        {
+            return action;
+        }
+    }
+}
+
+static void InsertProcessPolicy_Locked(const char* processName, PrjFSProcessPolicyAction action)
+{
+    uint32_t hash = HashProcessName(processName);
+    for (uint32_t probe = 0; probe < ProcessPolicySlotCount; ++probe)
+    {
+        uint32_t slot = (hash + probe) & (ProcessPolicySlotCount - 1);
+        ProcessPolicy& policy = s_processPolicies[slot];
+        if (policy.processName[0] == '\0')
+        {
+            strlcpy(policy.processName, processName, sizeof(policy.processName));
+            policy.action = action;
+            return;
+        }
+        
+        if (0 == strncmp(policy.processName, processName, sizeof(policy.processName)))
+        {
+            // Pushed policies override the defaults
+            policy.action = action;
+            return;
+        }
+    }
+    
+    assertf(false, "The process policy table is kept sparse, so there must be a free slot");
+}
+
+// Replaces the table with the default policies, overridden by the given ones
+static void ReplaceProcessPolicies_Locked(const PrjFSProcessPolicy* policies, uint32_t policyCount)
+{
+    uint32_t sequence = atomic_load_explicit(&s_processPoliciesSequence, memory_order_relaxed);
+    atomic_store_explicit(&s_processPoliciesSequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    for (uint32_t slot = 0; slot < ProcessPolicySlotCount; ++slot)
+    {
+        s_processPolicies[slot] = ProcessPolicy{};
+        atomic_store_explicit(&s_processPolicyDenialCounts[slot], UINT64_C(0), memory_order_relaxed);
+    }
+    
+    for (const char* processName : DefaultDenyHydrateProcessNames)
+    {
+        InsertProcessPolicy_Locked(processName, ProcessPolicyAction_DenyHydrate);
+    }
+    
+    for (uint32_t i = 0; i < policyCount; ++i)
+    {
+        InsertProcessPolicy_Locked(policies[i].processName, static_cast<PrjFSProcessPolicyAction>(policies[i].action));
+    }
+    
+    atomic_store_explicit(&s_processPoliciesSequence, sequence + 2, memory_order_release);
+}
+
 // Private functions
 KEXT_STATIC int HandleVnodeOperation(
     kauth_cred_t    credential,
@@ -434,13 +927,14 @@ KEXT_STATIC int HandleVnodeOperation(
     UseMainForkIfNamedStream(currentVnode, putVnodeWhenDone);
 
     VirtualizationRootHandle root = RootHandle_None;
-    uint32_t currentVnodeFileFlags;
-    FsidInode vnodeFsidInode;
+    VnodeAttributes currentVnodeAttributes;
     int pid = 0;
     char procname[MAXCOMLEN + 1] = "";
     bool isDeleteAction = false;
     bool isDirectory = false;
     bool isRename = false;
+    // Set while the vnode is a placeholder that the provider hasn't been asked to fill in
+    bool vnodeIsUnfilledPlaceholder = false;
 
     {
         PerfSample considerVnodeSample(&perfTracer, PrjFSPerfCounter_VnodeOp_BasicVnodeChecks);
@@ -464,7 +958,7 @@ KEXT_STATIC int HandleVnodeOperation(
             context,
             currentVnode,
             action,
-            &currentVnodeFileFlags,
+            &currentVnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -473,6 +967,7 @@ KEXT_STATIC int HandleVnodeOperation(
         goto CleanupAndReturn;
     }
     
+    vnodeIsUnfilledPlaceholder = FileFlagsBitIsSet(currentVnodeAttributes.fileFlags, FileFlags_IsEmpty);
     isDirectory = vnode_isdir(currentVnode);
     
     if (isDirectory)
@@ -501,7 +996,6 @@ KEXT_STATIC int HandleVnodeOperation(
                         // so on those versions, isRename is true for all delete events.
                         s_osSupportsRenameDetection,
                         &root,
-                        &vnodeFsidInode,
                         &kauthResult,
                         kauthError))
                 {
@@ -514,7 +1008,7 @@ KEXT_STATIC int HandleVnodeOperation(
                         root,
                         MessageType_KtoU_RecursivelyEnumerateDirectory,
                         currentVnode,
-                        vnodeFsidInode,
+                        currentVnodeAttributes.fsidInode,
                         nullptr, // path not needed, use fsid/inode
                         nullptr, // source path N/A
                         pid,
@@ -524,8 +1018,10 @@ KEXT_STATIC int HandleVnodeOperation(
                 {
                     goto CleanupAndReturn;
                 }
+
+                vnodeIsUnfilledPlaceholder = false;
             }
-            else if (FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
+            else if (FileFlagsBitIsSet(currentVnodeAttributes.fileFlags, FileFlags_IsEmpty))
             {
                 if (!TryGetVirtualizationRoot(
                         &perfTracer,
@@ -536,7 +1032,6 @@ KEXT_STATIC int HandleVnodeOperation(
                         CallbackPolicy_UserInitiatedOnly,
                         false, // allow reading offline directories even if not expanded
                         &root,
-                        &vnodeFsidInode,
                         &kauthResult,
                         kauthError))
                 {
@@ -549,7 +1044,7 @@ KEXT_STATIC int HandleVnodeOperation(
                         root,
                         MessageType_KtoU_EnumerateDirectory,
                         currentVnode,
-                        vnodeFsidInode,
+                        currentVnodeAttributes.fsidInode,
                         nullptr, // path not needed, use fsid/inode
                         nullptr, // source path N/A
                         pid,
@@ -559,6 +1054,8 @@ KEXT_STATIC int HandleVnodeOperation(
                 {
                     goto CleanupAndReturn;
                 }
+
+                vnodeIsUnfilledPlaceholder = false;
             }
         }
         else if (ActionBitIsSet(action, KAUTH_VNODE_ADD_FILE | KAUTH_VNODE_ADD_SUBDIRECTORY))
@@ -572,7 +1069,6 @@ KEXT_STATIC int HandleVnodeOperation(
                     // Block creating new files in offline roots.
                     true,
                     &root,
-                    &vnodeFsidInode,
                     &kauthResult,
                     kauthError))
             {
@@ -594,7 +1090,7 @@ KEXT_STATIC int HandleVnodeOperation(
                 KAUTH_VNODE_EXECUTE |
                 KAUTH_VNODE_APPEND_DATA))
         {
-            if (FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
+            if (FileFlagsBitIsSet(currentVnodeAttributes.fileFlags, FileFlags_IsEmpty))
             {
                 // Prevent access to empty files in offline roots, except always allow the user to delete files.
                 bool shouldBlockIfOffline =
@@ -620,7 +1116,6 @@ KEXT_STATIC int HandleVnodeOperation(
                         CallbackPolicy_UserInitiatedOnly,
                         shouldBlockIfOffline,
                         &root,
-                        &vnodeFsidInode,
                         &kauthResult,
                         kauthError))
                 {
@@ -633,7 +1128,7 @@ KEXT_STATIC int HandleVnodeOperation(
                         root,
                         MessageType_KtoU_HydrateFile,
                         currentVnode,
-                        vnodeFsidInode,
+                        currentVnodeAttributes.fsidInode,
                         nullptr, // path not needed, use fsid/inode
                         nullptr, // source path N/A
                         pid,
@@ -643,6 +1138,8 @@ KEXT_STATIC int HandleVnodeOperation(
                 {
                     goto CleanupAndReturn;
                 }
+
+                vnodeIsUnfilledPlaceholder = false;
             }
             
             if (ActionBitIsSet(action, KAUTH_VNODE_WRITE_DATA | KAUTH_VNODE_APPEND_DATA))
@@ -672,7 +1169,6 @@ KEXT_STATIC int HandleVnodeOperation(
                     // At this stage, we don't yet know if the file is still a placeholder, so don't deny yet even if offline
                     false, // denyIfOffline
                     &root,
-                    &vnodeFsidInode,
                     &kauthResult,
                     kauthError,
                     &providerStatus);
@@ -715,7 +1211,7 @@ KEXT_STATIC int HandleVnodeOperation(
                         root,
                         MessageType_KtoU_NotifyFilePreConvertToFull,
                         currentVnode,
-                        vnodeFsidInode,
+                        currentVnodeAttributes.fsidInode,
                         nullptr, // path not needed, use fsid/inode,
                         nullptr, // source path N/A
                         pid,
@@ -742,7 +1238,6 @@ KEXT_STATIC int HandleVnodeOperation(
                 // on OS versions where we can't distinguish renames & other deletes.
                 isRename && s_osSupportsRenameDetection,
                 &root,
-                &vnodeFsidInode,
                 &kauthResult,
                 kauthError))
         {
@@ -758,7 +1253,7 @@ KEXT_STATIC int HandleVnodeOperation(
                 MessageType_KtoU_NotifyDirectoryPreDelete :
                 isRename ? MessageType_KtoU_NotifyFilePreDeleteFromRename : MessageType_KtoU_NotifyFilePreDelete,
                 currentVnode,
-                vnodeFsidInode,
+                currentVnodeAttributes.fsidInode,
                 nullptr, // path not needed, use fsid/inode
                 nullptr, // source path N/A
                 pid,
@@ -772,6 +1267,16 @@ KEXT_STATIC int HandleVnodeOperation(
 
     
 CleanupAndReturn:
+    if (vnodeIsUnfilledPlaceholder)
+    {
+        // Whatever the outcome, the placeholder is still empty, and rights left in the vnode's
+        // authorization cache (granted by this or an earlier listener, e.g. for the provider itself
+        // or when the provider is offline) let lookups bypass this listener. Drop them so that the
+        // next access to the placeholder is seen here again.
+        PerfSample purgeSample(&perfTracer, PrjFSPerfCounter_VnodeOp_PurgeAuthorizationCache);
+        cache_purge(currentVnode);
+    }
+    
     if (putVnodeWhenDone)
     {
         vnode_put(currentVnode);
@@ -852,9 +1357,7 @@ KEXT_STATIC int HandleFileOpOperation(
                 ? MessageType_KtoU_NotifyDirectoryRenamed
                 : MessageType_KtoU_NotifyFileRenamed;
 
-            int kauthResult;
-            int kauthError;
-            if (!ProviderMessaging_TrySendRequestAndWaitForResponse(
+            if (!ProviderMessaging_TrySendNotification(
                     root,
                     messageType,
                     currentVnode,
@@ -862,9 +1365,7 @@ KEXT_STATIC int HandleFileOpOperation(
                     newPath,
                     nullptr, // fromPath
                     pid,
-                    procname,
-                    &kauthResult,
-                    &kauthError))
+                    procname))
             {
                 goto CleanupAndReturn;
             }
@@ -936,9 +1437,7 @@ KEXT_STATIC int HandleFileOpOperation(
 
             if (messageTargetProvider)
             {
-                int kauthResult;
-                int kauthError = 0;
-                if (!ProviderMessaging_TrySendRequestAndWaitForResponse(
+                if (!ProviderMessaging_TrySendNotification(
                         targetRoot,
                         MessageType_KtoU_NotifyFileHardLinkCreated,
                         currentVnode,
@@ -946,20 +1445,15 @@ KEXT_STATIC int HandleFileOpOperation(
                         newPath,
                         (messageFromProvider && targetRoot == fromRoot) ? fromPath : "", // Send "", to specify that the fromPath is not in the same root
                         pid,
-                        procname,
-                        &kauthResult,
-                        &kauthError))
+                        procname))
                 {
-                    KextLog_Error("HandleFileOpOperation: Request NotifyFileHardLinkCreated to destination provider %d failed, kauthResult = %u, kauthError = %u",
-                        targetRoot, kauthResult, kauthError);
+                    KextLog_Error("HandleFileOpOperation: Notification NotifyFileHardLinkCreated to destination provider %d failed", targetRoot);
                 }
             }
             
             if (messageFromProvider && (!messageTargetProvider || targetRoot != fromRoot)) // Don't send the same message to the same provider twice
             {
-                int kauthResult;
-                int kauthError = 0;
-                if (!ProviderMessaging_TrySendRequestAndWaitForResponse(
+                if (!ProviderMessaging_TrySendNotification(
                         fromRoot,
                         MessageType_KtoU_NotifyFileHardLinkCreated,
                         // vnode & target path are not in "fromRoot", so don't send them
@@ -968,12 +1462,9 @@ KEXT_STATIC int HandleFileOpOperation(
                         "", // Send target path as "" to signal the path is outside the Virtualization Root 
                         fromPath,
                         pid,
-                        procname,
-                        &kauthResult,
-                        &kauthError))
+                        procname))
                 {
-                    KextLog_Error("HandleFileOpOperation: Request NotifyFileHardLinkCreated to source provider %d failed, kauthResult = %u, kauthError = %u",
-                        fromRoot, kauthResult, kauthError);
+                    KextLog_Error("HandleFileOpOperation: Notification NotifyFileHardLinkCreated to source provider %d failed", fromRoot);
                 }
             }
         }
@@ -991,6 +1482,11 @@ KEXT_STATIC int HandleFileOpOperation(
 
         UseMainForkIfNamedStream(currentVnode, putCurrentVnode);
 
+        if (OpenedFileIsKnownToBeOutsideActiveRoots(&perfTracer, currentVnode))
+        {
+            goto CleanupAndReturn;
+        }
+
         bool fileFlaggedInRoot;
         if (!TryGetFileIsFlaggedAsInRoot(currentVnode, context, &fileFlaggedInRoot))
         {
@@ -1024,9 +1520,7 @@ KEXT_STATIC int HandleFileOpOperation(
         char procname[MAXCOMLEN + 1];
         proc_name(pid, procname, MAXCOMLEN + 1);
         PerfSample fileCreatedSample(&perfTracer, PrjFSPerfCounter_FileOp_FileCreated);
-        int kauthResult;
-        int kauthError;
-        if (!ProviderMessaging_TrySendRequestAndWaitForResponse(
+        if (!ProviderMessaging_TrySendNotification(
                 root,
                 MessageType_KtoU_NotifyFileCreated,
                 currentVnode,
@@ -1034,9 +1528,7 @@ KEXT_STATIC int HandleFileOpOperation(
                 path,
                 nullptr, // fromPath
                 pid,
-                procname,
-                &kauthResult,
-                &kauthError))
+                procname))
         {
             goto CleanupAndReturn;
         }
@@ -1076,13 +1568,18 @@ KEXT_STATIC int HandleFileOpOperation(
         }
 
         FsidInode vnodeFsidInode = Vnode_GetFsidAndInode(currentVnode, context, true /* the inode is used for getting the path in the provider, so use linkid */);
+        
+        uint64_t providerGeneration = VirtualizationRoot_GetActiveProvider(root).generation;
+        if (FileModificationWasReported(vnodeFsidInode, providerGeneration))
+        {
+            perfTracer.IncrementCount(PrjFSPerfCounter_FileOp_FileModifiedAlreadyReported);
+            goto CleanupAndReturn;
+        }
 
         char procname[MAXCOMLEN + 1];
         proc_name(pid, procname, MAXCOMLEN + 1);
         PerfSample fileModifiedSample(&perfTracer, PrjFSPerfCounter_FileOp_FileModified);
-        int kauthResult;
-        int kauthError;
-        if (!ProviderMessaging_TrySendRequestAndWaitForResponse(
+        if (!ProviderMessaging_TrySendNotification(
                 root,
                 MessageType_KtoU_NotifyFileModified,
                 currentVnode,
@@ -1090,12 +1587,12 @@ KEXT_STATIC int HandleFileOpOperation(
                 path,
                 nullptr, // fromPath
                 pid,
-                procname,
-                &kauthResult,
-                &kauthError))
+                procname))
         {
             goto CleanupAndReturn;
         }
+        
+        RecordReportedFileModification(vnodeFsidInode, providerGeneration);
     }
     else if (KAUTH_FILEOP_WILL_RENAME == action)
     {
@@ -1137,6 +1634,50 @@ static bool VnodeIsEligibleForEventHandling(vnode_t vnode)
     return true;
 }
 
+// Every open() on the system produces a KAUTH_FILEOP_OPEN event, so those for files that can't be in a
+// root with an active provider are dismissed before reading the file's flags or looking for its root.
+static bool OpenedFileIsKnownToBeOutsideActiveRoots(PerfTracer* perfTracer, vnode_t vnode)
+{
+    PerfSample checkOutsideRootsSample(perfTracer, PrjFSPerfCounter_FileOp_Open_CheckOutsideRoots);
+    
+    if (!VirtualizationRoots_MountMayHaveActiveProvider(vnode_mount(vnode)))
+    {
+        perfTracer->IncrementCount(PrjFSPerfCounter_FileOp_Open_NoProviderOnMount);
+        return true;
+    }
+    
+    VirtualizationRootHandle cachedRoot;
+    if (VnodeCache_TryGetCachedRootForVnode(vnode, cachedRoot))
+    {
+        if (RootHandle_None == cachedRoot || RootHandle_ProviderTemporaryDirectory == cachedRoot)
+        {
+            perfTracer->IncrementCount(PrjFSPerfCounter_FileOp_Open_FileOutsideRootsCache_Hit);
+            return true;
+        }
+        
+        return false;
+    }
+    
+    // A file that hasn't been seen before is outside all roots if its directory is known to be
+    vnode_t parentVnode = vnode_getparent(vnode);
+    if (NULLVP != parentVnode)
+    {
+        bool parentIsOutsideRoots =
+            VnodeCache_TryGetCachedRootForVnode(parentVnode, cachedRoot) &&
+            (RootHandle_None == cachedRoot || RootHandle_ProviderTemporaryDirectory == cachedRoot);
+        vnode_put(parentVnode);
+        
+        if (parentIsOutsideRoots)
+        {
+            perfTracer->IncrementCount(PrjFSPerfCounter_FileOp_Open_ParentOutsideRootsCache_Hit);
+            return true;
+        }
+    }
+    
+    perfTracer->IncrementCount(PrjFSPerfCounter_FileOp_Open_OutsideRootsCache_Miss);
+    return false;
+}
+
 KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     // In params:
     PerfTracer* perfTracer,
@@ -1145,7 +1686,7 @@ KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     kauth_action_t action,
 
     // Out params:
-    uint32_t* vnodeFileFlags,
+    VnodeAttributes* vnodeAttributes,
     int* pid,
     char procname[MAXCOMLEN + 1],
     int* kauthResult,
@@ -1172,16 +1713,41 @@ KEXT_STATIC bool ShouldHandleVnodeOpEvent(
         }
     }
     
+    {
+        PerfSample outsideRootsCacheSample(perfTracer, PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckOutsideRootsCache);
+        
+        // Reading the file flags below is a vnode_getattr call, which is relatively expensive given that this
+        // runs for every vnode authorization on the system.  If the vnode cache already knows that the vnode
+        // is outside of every virtualization root, the flags don't matter: even if FileFlags_IsInVirtualizationRoot
+        // were set, TryGetVirtualizationRoot would find the same cached root and defer.
+        VirtualizationRootHandle cachedRoot;
+        if (VnodeCache_TryGetCachedRootForVnode(vnode, cachedRoot) &&
+            (RootHandle_None == cachedRoot || RootHandle_ProviderTemporaryDirectory == cachedRoot))
+        {
+            perfTracer->IncrementCount(PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Hit);
+            
+            *kauthResult = KAUTH_RESULT_DEFER;
+            return false;
+        }
+        
+        perfTracer->IncrementCount(PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Miss);
+    }
+    
     {
         PerfSample readFlagsSample(perfTracer, PrjFSPerfCounter_VnodeOp_ShouldHandle_ReadFileFlags);
-        if (!TryReadVNodeFileFlags(vnode, context, vnodeFileFlags))
+        
+        // Fetch the fsid and inode along with the flags, so that the rest of the callback doesn't need another vnode_getattr
+        perfTracer->IncrementCount(PrjFSPerfCounter_VnodeOp_GetAttr);
+        errno_t error = Vnode_GetAttributes(vnode, context, vnodeAttributes);
+        if (0 != error)
         {
+            KextLog_FileError(vnode, "ShouldHandleVnodeOpEvent: Vnode_GetAttributes failed with error %d; vnode type: %d, recycled: %s", error, vnode_vtype(vnode), vnode_isrecycled(vnode) ? "yes" : "no");
             *kauthError = EBADF;
             *kauthResult = KAUTH_RESULT_DENY;
             return false;
         }
 
-        if (!FileFlagsBitIsSet(*vnodeFileFlags, FileFlags_IsInVirtualizationRoot))
+        if (!FileFlagsBitIsSet(vnodeAttributes->fileFlags, FileFlags_IsInVirtualizationRoot))
         {
             // This vnode is not part of ANY virtualization root, so exit now before doing any more work.
             // This gives us a cheap way to avoid adding overhead to IO outside of a virtualization root.
@@ -1196,20 +1762,27 @@ KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     *pid = vfs_context_pid(context);
     proc_name(*pid, procname, MAXCOMLEN + 1);
     
-    if (FileFlagsBitIsSet(*vnodeFileFlags, FileFlags_IsEmpty))
+    if (FileFlagsBitIsSet(vnodeAttributes->fileFlags, FileFlags_IsEmpty))
     {
         // This vnode is not yet hydrated, so do not allow a file system crawler to force hydration.
         // Once a vnode is hydrated, it's fine to allow crawlers to access those contents.
         
         PerfSample crawlerSample(perfTracer, PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckFileSystemCrawler);
-        if (IsFileSystemCrawler(procname))
+        uint32_t policySlot;
+        PrjFSProcessPolicyAction policyAction = GetProcessPolicyAction(procname, &policySlot);
+        bool deniedEnumeration = (ProcessPolicyAction_AllowWithoutEnumerate == policyAction && vnode_isdir(vnode));
+        if (ProcessPolicyAction_DenyHydrate == policyAction || deniedEnumeration)
         {
             // We must DENY file system crawlers rather than DEFER.
             // If we allow the crawler's access to succeed without hydrating, the kauth result will be cached and we won't
             // get called again, so we lose the opportunity to hydrate the file/directory and it will appear as though
             // it is missing its contents.
 
-            perfTracer->IncrementCount(PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedFileSystemCrawler);
+            perfTracer->IncrementCount(
+                deniedEnumeration ?
+                PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedEnumeration :
+                PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedFileSystemCrawler);
+            atomic_fetch_add_explicit(&s_processPolicyDenialCounts[policySlot], UINT64_C(1), memory_order_relaxed);
             
             *kauthResult = KAUTH_RESULT_DENY;
             return false;
@@ -1230,7 +1803,6 @@ static bool TryGetVirtualizationRoot(
 
     // Out params:
     VirtualizationRootHandle* root,
-    FsidInode* vnodeFsidInode,
     int* kauthResult,
     int* kauthError,
     ProviderStatus* _Nullable providerStatus)
@@ -1305,46 +1877,65 @@ static bool TryGetVirtualizationRoot(
         return false;
     }
     
-    *vnodeFsidInode = Vnode_GetFsidAndInode(vnode, context, true /* the inode is used for getting the path in the provider, so use linkid */);
-    
     return true;
 }
 
+static uid_t GetProcessUID(proc_t process)
+{
+    kauth_cred_t credential = kauth_cred_proc_ref(process);
+    uid_t processUID = kauth_cred_getuid(credential);
+    kauth_cred_unref(&credential);
+    return processUID;
+}
+
 KEXT_STATIC bool CurrentProcessIsAllowedToHydrate()
 {
     bool nonServiceUser = false;
     
     proc_t process = proc_self();
+    pid_t selfPID = proc_selfpid();
+    pid_t selfParentPID = proc_ppid(process);
+    uid_t selfUID = GetProcessUID(process);
     
-    while (true)
+    if (!TryGetHydrationDecision(selfPID, selfParentPID, selfUID, &nonServiceUser))
     {
-        kauth_cred_t credential = kauth_cred_proc_ref(process);
-        uid_t processUID = kauth_cred_getuid(credential);
-        kauth_cred_unref(&credential);
+        bool ancestryComplete = true;
+        uid_t processUID = selfUID;
         
-        if (processUID >= 500)
+        while (true)
         {
-            nonServiceUser = true;
-            break;
-        }
-        
-        pid_t parentPID = proc_ppid(process);
-        if (parentPID <= 1)
-        {
-            break;
+            if (processUID >= 500)
+            {
+                nonServiceUser = true;
+                break;
+            }
+            
+            pid_t parentPID = proc_ppid(process);
+            if (parentPID <= 1)
+            {
+                break;
+            }
+            
+            proc_t parentProcess = proc_find(parentPID);
+            proc_rele(process);
+            process = parentProcess;
+            if (parentProcess == nullptr)
+            {
+                KextLog_Error("CurrentProcessIsAllowedToHydrate: Failed to locate ancestor process %d for current process %d\n", parentPID, selfPID);
+                ancestryComplete = false;
+                break;
+            }
+            
+            processUID = GetProcessUID(process);
         }
         
-        proc_t parentProcess = proc_find(parentPID);
-        proc_rele(process);
-        process = parentProcess;
-        if (parentProcess == nullptr)
+        // An ancestor that vanished mid-walk will be replaced by launchd as parent, so try again next time
+        if (ancestryComplete)
         {
-            KextLog_Error("CurrentProcessIsAllowedToHydrate: Failed to locate ancestor process %d for current process %d\n", parentPID, proc_selfpid());
-            break;
+            RecordHydrationDecision(selfPID, selfParentPID, selfUID, nonServiceUser);
         }
     }
     
-    
     if (process != nullptr)
     {
         proc_rele(process);
@@ -1379,25 +1970,30 @@ static VirtualizationRootHandle FindRootForVnodeWithFileOpEvent(
     {
         if (KAUTH_FILEOP_RENAME == action)
         {
-            // Directory renames into (or out) of virtualization roots require invalidating all of the entries
-            // within the directory being renamed (because all of those entires now have a new virtualzation root).
-            // Rather than trying to find all vnodes in the cache that are children of the directory being renamed
-            // we simply invalidate the entire cache.
-            //
-            // Potential future optimizations include:
-            //   - Only invalidate the cache if the rename moves a directory in or out of a directory
-            //   - Keeping a per-root generation ID in the cache to allow invalidating a subset of the cache
-            VnodeCache_InvalidateCache(perfTracer);
+            // Directory renames into (or out) of virtualization roots change the root of every entry
+            // within the directory being renamed.  Rather than trying to find all vnodes in the cache that
+            // are children of the directory, we invalidate the root the directory was previously in (the
+            // entries of other roots are unaffected).
+            root = VnodeCache_RefreshRootForRenamedDirectory(
+                perfTracer,
+                PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
+                PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
+                PrjFSPerfCounter_FileOp_FindRoot,
+                PrjFSPerfCounter_FileOp_FindRoot_Iteration,
+                vnode,
+                context);
+        }
+        else
+        {
+            root = VnodeCache_FindRootForVnode(
+                perfTracer,
+                PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
+                PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
+                PrjFSPerfCounter_FileOp_FindRoot,
+                PrjFSPerfCounter_FileOp_FindRoot_Iteration,
+                vnode,
+                context);
         }
-        
-        root = VnodeCache_FindRootForVnode(
-            perfTracer,
-            PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
-            PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
-            PrjFSPerfCounter_FileOp_FindRoot,
-            PrjFSPerfCounter_FileOp_FindRoot_Iteration,
-            vnode,
-            context);
     }
     else
     {
@@ -1530,6 +2126,19 @@ static void WaitForListenerCompletion()
     } while (atomic_load(&s_numActiveKauthEvents) > 0);
 }
 
+static uint32_t GetMaxLogicalCPUCount()
+{
+    int cpuCount = 0;
+    size_t cpuCountSize = sizeof(cpuCount);
+    if (0 != sysctlbyname("hw.logicalcpu_max", &cpuCount, &cpuCountSize, nullptr, 0) || cpuCount < 1)
+    {
+        KextLog_Error("GetMaxLogicalCPUCount: failed to read hw.logicalcpu_max, using a single vnode cache shard");
+        return 1;
+    }
+    
+    return static_cast<uint32_t>(cpuCount);
+}
+
 
 static errno_t GetVNodeAttributes(vnode_t vn, vfs_context_t _Nonnull context, struct vnode_attr* attrs)
 {
@@ -1583,22 +2192,6 @@ KEXT_STATIC_INLINE bool ActionBitIsSet(kauth_action_t action, kauth_action_t mas
     return action & mask;
 }
 
-KEXT_STATIC bool IsFileSystemCrawler(const char* procname)
-{
-    // These process will crawl the file system and force a full hydration
-    if (!strcmp(procname, "mds") ||
-        !strcmp(procname, "mdworker") ||
-        !strcmp(procname, "mdworker_shared") ||
-        !strcmp(procname, "mds_stores") ||
-        !strcmp(procname, "fseventsd") ||
-        !strcmp(procname, "Spotlight"))
-    {
-        return true;
-    }
-    
-    return false;
-}
-
 KEXT_STATIC bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode)
 {
     switch (vnodeType)
@@ -4,7 +4,14 @@
 #include "public/Message.h"
 #include "VirtualizationRoots.hpp"
 
+struct PrjFSProcessPolicyTable;
+
 kern_return_t KauthHandler_Init();
 kern_return_t KauthHandler_Cleanup();
 
+// Replaces the process policies set by user space. The built-in policies for file system crawlers
+// apply unless overridden. Returns false without changing anything if any policy is invalid.
+bool KauthHandler_SetProcessPolicies(const PrjFSProcessPolicyTable& table);
+void KauthHandler_GetProcessPolicies(PrjFSProcessPolicyTable& table);
+
 #endif /* KauthHandler_h */
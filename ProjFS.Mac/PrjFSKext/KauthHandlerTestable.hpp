@@ -1,4 +1,5 @@
 #include "public/PrjFSCommon.h"
+#include "public/PrjFSProcessPolicy.h"
 #include <sys/kernel_types.h>
 #include "../PrjFSKext/kernel-header-wrappers/kauth.h"
 #include "../PrjFSKext/kernel-header-wrappers/vnode.h"
@@ -16,14 +17,18 @@
 #endif
 
 struct FsidInode;
+struct VnodeAttributes;
 
 extern uint32_t s_maxPendingRenames;
 extern uint32_t s_pendingRenameCount;
+extern uint32_t s_pendingRenameSlotCount;
 
 KEXT_STATIC_INLINE bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit);
 KEXT_STATIC_INLINE bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask);
 KEXT_STATIC_INLINE bool TryGetFileIsFlaggedAsInRoot(vnode_t vnode, vfs_context_t context, bool* flaggedInRoot);
-KEXT_STATIC bool IsFileSystemCrawler(const char* procname);
+KEXT_STATIC PrjFSProcessPolicyAction GetProcessPolicyAction(const char* procname, uint32_t* policySlot);
+KEXT_STATIC bool InitProcessPolicies();
+KEXT_STATIC void CleanupProcessPolicies();
 KEXT_STATIC bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode);
 KEXT_STATIC int HandleVnodeOperation(
     kauth_cred_t    credential,
@@ -49,7 +54,7 @@ KEXT_STATIC bool ShouldHandleVnodeOpEvent(
     kauth_action_t action,
 
     // Out params:
-    uint32_t* vnodeFileFlags,
+    VnodeAttributes* vnodeAttributes,
     int* pid,
     char procname[MAXCOMLEN + 1],
     int* kauthResult,
@@ -73,4 +78,10 @@ KEXT_STATIC void CleanupPendingRenames();
 KEXT_STATIC void ResizePendingRenames(uint32_t newMaxPendingRenames);
 KEXT_STATIC void RecordPendingRenameOperation(vnode_t vnode);
 KEXT_STATIC bool DeleteOpIsForRename(vnode_t vnode);
+KEXT_STATIC bool InitReportedModifiedFiles();
+KEXT_STATIC void CleanupReportedModifiedFiles();
+KEXT_STATIC bool FileModificationWasReported(const FsidInode& fileId, uint64_t providerGeneration);
+KEXT_STATIC void RecordReportedFileModification(const FsidInode& fileId, uint64_t providerGeneration);
+KEXT_STATIC bool InitHydrationDecisions();
+KEXT_STATIC void CleanupHydrationDecisions();
 
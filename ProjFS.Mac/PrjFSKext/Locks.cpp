@@ -75,6 +75,15 @@ void Mutex_Sleep(int seconds, void* channel, Mutex* _Nullable mutex)
     msleep(channel, nullptr != mutex ? mutex->p : nullptr, PUSER, "org.vfsforgit.PrjFSKext.Sleep", &timeout);
 }
 
+void Mutex_SleepMilliseconds(int milliseconds, void* channel, Mutex* _Nullable mutex)
+{
+    struct timespec timeout;
+    timeout.tv_sec  = milliseconds / 1000;
+    timeout.tv_nsec = (milliseconds % 1000) * 1000000;
+    
+    msleep(channel, nullptr != mutex ? mutex->p : nullptr, PUSER, "org.vfsforgit.PrjFSKext.Sleep", &timeout);
+}
+
 // RWLock implementation functions
 
 RWLock RWLock_Alloc()
@@ -16,3 +16,23 @@ uint32_t Message_EncodedSize(const MessageHeader* messageHeader)
     }
     return size;
 }
+
+MessagePriority Message_GetPriority(MessageType messageType)
+{
+    switch (messageType)
+    {
+    case MessageType_KtoU_EnumerateDirectory:
+    case MessageType_KtoU_RecursivelyEnumerateDirectory:
+    case MessageType_KtoU_HydrateFile:
+        return MessagePriority_Blocking;
+        
+    case MessageType_KtoU_NotifyFilePreDelete:
+    case MessageType_KtoU_NotifyFilePreDeleteFromRename:
+    case MessageType_KtoU_NotifyDirectoryPreDelete:
+    case MessageType_KtoU_NotifyFilePreConvertToFull:
+        return MessagePriority_PreOperation;
+        
+    default:
+        return MessagePriority_Informational;
+    }
+}
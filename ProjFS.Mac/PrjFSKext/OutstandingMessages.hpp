@@ -0,0 +1,148 @@
+#pragma once
+
+#include "VirtualizationRoots.hpp"
+#include "PrjFSProviderUserClient.hpp"
+#include "public/Message.h"
+#include "public/PrjFSProviderClientShared.h"
+
+#include <sys/queue.h>
+
+// A request sent to a provider, for which the sending thread is waiting for the response
+struct OutstandingMessage
+{
+    MessageHeader                  request;
+    MessageType                    result;
+    bool                           receivedResult;
+    VirtualizationRootHandle       rootHandle;
+    // Number of threads sharing this message's result instead of sending their own identical request
+    uint32_t                       coalescedWaiterCount;
+    bool                           isCoalescable;
+
+    LIST_ENTRY(OutstandingMessage) _list_privates;
+    LIST_ENTRY(OutstandingMessage) _coalescable_list_privates;
+};
+
+LIST_HEAD(OutstandingMessage_Head, OutstandingMessage);
+
+// Once this many requests to the same provider are awaiting a response, further requests wait for one
+// of them to complete. Providers take messages off their queue as soon as they start on them, and may
+// complete them asynchronously much later, so this doesn't depend on how many messages fit into the
+// queue; a request that doesn't fit waits for room in the queue instead.
+static const uint16_t ProviderInFlightMessageWindow = 1024;
+
+// Message IDs are handed out sequentially, so their low bits spread the outstanding messages evenly
+static const uint32_t OutstandingMessageBucketCount = 64;
+static_assert((OutstandingMessageBucketCount & (OutstandingMessageBucketCount - 1)) == 0, "Bucket count must be a power of 2");
+
+// Hash table of outstanding messages keyed by (root, message ID). Not synchronised; callers
+// provide their own locking.
+struct OutstandingMessageBuckets
+{
+    OutstandingMessage_Head buckets[OutstandingMessageBucketCount];
+    // Index of the coalescable messages, keyed by (root, message type, fsid/inode)
+    OutstandingMessage_Head coalescableBuckets[OutstandingMessageBucketCount];
+};
+
+// Requests whose outcome only depends on the file they target: a thread that needs the same
+// file hydrated or directory enumerated as an in-flight request can share that request's result.
+static inline bool OutstandingMessage_IsCoalescable(MessageType messageType, const FsidInode& fsidInode)
+{
+    if (fsidInode.fsid.val[0] == 0 && fsidInode.fsid.val[1] == 0)
+    {
+        return false;
+    }
+    
+    switch (messageType)
+    {
+        case MessageType_KtoU_EnumerateDirectory:
+        case MessageType_KtoU_RecursivelyEnumerateDirectory:
+        case MessageType_KtoU_HydrateFile:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline OutstandingMessage_Head& OutstandingMessageBuckets_GetBucket(OutstandingMessageBuckets& table, uint64_t messageId)
+{
+    return table.buckets[messageId & (OutstandingMessageBucketCount - 1)];
+}
+
+static inline OutstandingMessage_Head& OutstandingMessageBuckets_GetCoalescableBucket(OutstandingMessageBuckets& table, uint64_t inode)
+{
+    // Inode numbers are frequently allocated sequentially too
+    return table.coalescableBuckets[inode & (OutstandingMessageBucketCount - 1)];
+}
+
+static inline void OutstandingMessageBuckets_Init(OutstandingMessageBuckets& table)
+{
+    for (uint32_t i = 0; i < OutstandingMessageBucketCount; ++i)
+    {
+        LIST_INIT(&table.buckets[i]);
+        LIST_INIT(&table.coalescableBuckets[i]);
+    }
+}
+
+static inline void OutstandingMessageBuckets_Insert(OutstandingMessageBuckets& table, OutstandingMessage* message)
+{
+    LIST_INSERT_HEAD(&OutstandingMessageBuckets_GetBucket(table, message->request.messageId), message, _list_privates);
+    
+    message->isCoalescable = OutstandingMessage_IsCoalescable(static_cast<MessageType>(message->request.messageType), message->request.fsidInode);
+    if (message->isCoalescable)
+    {
+        LIST_INSERT_HEAD(&OutstandingMessageBuckets_GetCoalescableBucket(table, message->request.fsidInode.inode), message, _coalescable_list_privates);
+    }
+}
+
+// Stops further identical requests from joining the message, without affecting response delivery
+static inline void OutstandingMessageBuckets_RemoveCoalescable(OutstandingMessage* message)
+{
+    if (message->isCoalescable)
+    {
+        LIST_REMOVE(message, _coalescable_list_privates);
+        message->isCoalescable = false;
+    }
+}
+
+static inline void OutstandingMessageBuckets_Remove(OutstandingMessage* message)
+{
+    LIST_REMOVE(message, _list_privates);
+    OutstandingMessageBuckets_RemoveCoalescable(message);
+}
+
+static inline OutstandingMessage* OutstandingMessageBuckets_FindCoalescable(
+    OutstandingMessageBuckets& table,
+    VirtualizationRootHandle rootHandle,
+    MessageType messageType,
+    const FsidInode& fsidInode)
+{
+    OutstandingMessage* outstandingMessage;
+    LIST_FOREACH(outstandingMessage, &OutstandingMessageBuckets_GetCoalescableBucket(table, fsidInode.inode), _coalescable_list_privates)
+    {
+        const MessageHeader& request = outstandingMessage->request;
+        if (request.fsidInode.inode == fsidInode.inode &&
+            request.fsidInode.fsid.val[0] == fsidInode.fsid.val[0] &&
+            request.fsidInode.fsid.val[1] == fsidInode.fsid.val[1] &&
+            request.messageType == messageType &&
+            outstandingMessage->rootHandle == rootHandle)
+        {
+            return outstandingMessage;
+        }
+    }
+
+    return nullptr;
+}
+
+static inline OutstandingMessage* OutstandingMessageBuckets_Find(OutstandingMessageBuckets& table, VirtualizationRootHandle rootHandle, uint64_t messageId)
+{
+    OutstandingMessage* outstandingMessage;
+    LIST_FOREACH(outstandingMessage, &OutstandingMessageBuckets_GetBucket(table, messageId), _list_privates)
+    {
+        if (outstandingMessage->request.messageId == messageId && outstandingMessage->rootHandle == rootHandle)
+        {
+            return outstandingMessage;
+        }
+    }
+
+    return nullptr;
+}
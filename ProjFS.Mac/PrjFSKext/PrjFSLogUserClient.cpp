@@ -3,8 +3,12 @@
 #include "KextLog.hpp"
 #include "public/PrjFSCommon.h"
 #include "public/PrjFSVnodeCacheHealth.h"
+#include "public/PrjFSProviderQueueStats.h"
+#include "public/PrjFSProcessPolicy.h"
+#include "KauthHandler.hpp"
 #include "PerformanceTracing.hpp"
 #include "VnodeCache.hpp"
+#include "VirtualizationRoots.hpp"
 #include <IOKit/IOSharedDataQueue.h>
 
 
@@ -31,6 +35,30 @@ static const IOExternalMethodDispatch LogUserClientDispatch[] =
             .checkScalarOutputCount =   0,
             .checkStructureOutputSize = sizeof(PrjFSVnodeCacheHealth),
         },
+    [LogSelector_FetchProviderQueueStats] =
+        {
+            .function =                 &PrjFSLogUserClient::fetchProviderQueueStats,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = sizeof(PrjFSProviderQueueStatsReport),
+        },
+    [LogSelector_SetProcessPolicies] =
+        {
+            .function =                 &PrjFSLogUserClient::setProcessPolicies,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  sizeof(PrjFSProcessPolicyTable),
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0,
+        },
+    [LogSelector_FetchProcessPolicies] =
+        {
+            .function =                 &PrjFSLogUserClient::fetchProcessPolicies,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = sizeof(PrjFSProcessPolicyTable),
+        },
 };
 
 
@@ -45,6 +73,10 @@ bool PrjFSLogUserClient::initWithTask(
         return false;
     }
     
+    // Process policies affect every user's processes, so only administrators may change them
+    this->clientIsAdministrator =
+        (kIOReturnSuccess == IOUserClient::clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator));
+    
     this->dataQueueWriterMutex = Mutex_Alloc();
     if (!Mutex_IsValid(this->dataQueueWriterMutex))
     {
@@ -200,3 +232,45 @@ IOReturn PrjFSLogUserClient::fetchVnodeCacheHealth(
     return VnodeCache_ExportHealthData(arguments);
 }
 
+IOReturn PrjFSLogUserClient::fetchProviderQueueStats(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments)
+{
+    return ActiveProvider_ExportMessageQueueStats(arguments);
+}
+
+IOReturn PrjFSLogUserClient::setProcessPolicies(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments)
+{
+    if (!static_cast<PrjFSLogUserClient*>(target)->clientIsAdministrator)
+    {
+        return kIOReturnNotPrivileged;
+    }
+    
+    // Small enough to always be passed directly rather than as a memory descriptor
+    if (nullptr == arguments->structureInput || arguments->structureInputSize != sizeof(PrjFSProcessPolicyTable))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    bool success = KauthHandler_SetProcessPolicies(*static_cast<const PrjFSProcessPolicyTable*>(arguments->structureInput));
+    return success ? kIOReturnSuccess : kIOReturnBadArgument;
+}
+
+IOReturn PrjFSLogUserClient::fetchProcessPolicies(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments)
+{
+    if (nullptr == arguments->structureOutput || arguments->structureOutputSize != sizeof(PrjFSProcessPolicyTable))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    KauthHandler_GetProcessPolicies(*static_cast<PrjFSProcessPolicyTable*>(arguments->structureOutput));
+    return kIOReturnSuccess;
+}
+
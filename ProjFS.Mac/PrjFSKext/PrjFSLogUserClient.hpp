@@ -17,6 +17,7 @@ private:
     IOMemoryDescriptor* dataQueueMemory;
     Mutex dataQueueWriterMutex;
     bool logMessageDropped;
+    bool clientIsAdministrator;
     void cleanUp();
 public:
     virtual bool initWithTask(task_t owningTask, void* securityToken, UInt32 type, OSDictionary* properties) override;
@@ -44,5 +45,20 @@ public:
         void* reference,
         IOExternalMethodArguments* arguments);
     
+    static IOReturn fetchProviderQueueStats(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    
+    static IOReturn setProcessPolicies(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    
+    static IOReturn fetchProcessPolicies(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    
     void sendLogMessage(KextLog_MessageHeader* message, uint32_t size);
 };
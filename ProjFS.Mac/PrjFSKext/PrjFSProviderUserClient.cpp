@@ -1,19 +1,23 @@
 #include "PrjFSProviderUserClientPrivate.hpp"
 #include "public/PrjFSCommon.h"
 #include "public/PrjFSProviderClientShared.h"
+#include "public/PrjFSProviderQueueStats.h"
 #include "public/Message.h"
 #include "ProviderMessaging.hpp"
 #include "VirtualizationRoots.hpp"
+#include "VnodeCache.hpp"
+#include "PerformanceTracing.hpp"
+#include "ProviderMessageQueue.hpp"
+#include "ProviderResponseRing.hpp"
+#include "KextLog.hpp"
+#include "Message_Kernel.hpp"
 
 #include <IOKit/IOSharedDataQueue.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <sys/proc.h>
 
 OSDefineMetaClassAndStructors(PrjFSProviderUserClient, IOUserClient);
-
-// Amount of memory to set aside for kernel -> userspace messages.
-// Should be chosen to comfortably hold "enough" Message structs and associated path strings.
-static const uint32_t ProviderMessageQueueCapacityBytes = 100 * 1024;
-
+OSDefineMetaClassAndStructors(PrjFSProviderMessageQueue, IOSharedDataQueue);
 
 const IOExternalMethodDispatch PrjFSProviderUserClient::ProviderUserClientDispatch[] =
 {
@@ -33,6 +37,22 @@ const IOExternalMethodDispatch PrjFSProviderUserClient::ProviderUserClientDispat
             .checkScalarOutputCount =   0,
             .checkStructureOutputSize = 0
         },
+    [ProviderSelector_ResponseRingDoorbell] =
+        {
+            .function =                 &PrjFSProviderUserClient::responseRingDoorbell,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetMessageQueueCapacity] =
+        {
+            .function =                 &PrjFSProviderUserClient::setMessageQueueCapacity,
+            .checkScalarInputCount =    1, // requested capacity in bytes
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // actual capacity in bytes
+            .checkStructureOutputSize = 0
+        },
 };
 
 bool PrjFSProviderUserClient::initWithTask(
@@ -55,7 +75,8 @@ bool PrjFSProviderUserClient::initWithTask(
         goto CleanupAndFail;
     }
     
-    this->dataQueue = IOSharedDataQueue::withCapacity(ProviderMessageQueueCapacityBytes);
+    this->dataQueueCapacityBytes = ProviderMessageQueueMinCapacityBytes;
+    this->dataQueue = PrjFSProviderMessageQueue::withCapacity(this->dataQueueCapacityBytes);
     if (nullptr == this->dataQueue)
     {
         goto CleanupAndFail;
@@ -67,6 +88,24 @@ bool PrjFSProviderUserClient::initWithTask(
         goto CleanupAndFail;
     }
     
+    this->responseRingMutex = Mutex_Alloc();
+    if (!Mutex_IsValid(this->responseRingMutex))
+    {
+        goto CleanupAndFail;
+    }
+    
+    this->responseRingMemory = IOBufferMemoryDescriptor::withOptions(
+        kIODirectionInOut | kIOMemoryKernelUserShared,
+        sizeof(ProviderResponseRing),
+        PAGE_SIZE);
+    if (nullptr == this->responseRingMemory)
+    {
+        goto CleanupAndFail;
+    }
+    
+    memset(this->responseRingMemory->getBytesNoCopy(), 0, sizeof(ProviderResponseRing));
+    this->responseRingReadIndex = 0;
+    
     return true;
     
 CleanupAndFail:
@@ -75,6 +114,12 @@ CleanupAndFail:
         Mutex_FreeMemory(&this->dataQueueWriterMutex);
     }
     
+    if (Mutex_IsValid(this->responseRingMutex))
+    {
+        Mutex_FreeMemory(&this->responseRingMutex);
+    }
+    
+    OSSafeReleaseNULL(this->responseRingMemory);
     OSSafeReleaseNULL(this->dataQueueMemory);
     OSSafeReleaseNULL(this->dataQueue);
     return false;
@@ -99,6 +144,12 @@ void PrjFSProviderUserClient::free()
         Mutex_FreeMemory(&this->dataQueueWriterMutex);
     }
     
+    OSSafeReleaseNULL(this->responseRingMemory);
+    if (Mutex_IsValid(this->responseRingMutex))
+    {
+        Mutex_FreeMemory(&this->responseRingMutex);
+    }
+    
     this->super::free();
 }
 
@@ -141,6 +192,7 @@ IOReturn PrjFSProviderUserClient::clientMemoryForType(
             
             Mutex_Acquire(this->dataQueueWriterMutex);
             {
+                this->dataQueueInUse = true;
                 queueMemory = this->dataQueueMemory;
                 if (queueMemory != nullptr)
                 {
@@ -153,6 +205,14 @@ IOReturn PrjFSProviderUserClient::clientMemoryForType(
             return nullptr == queueMemory ? kIOReturnError : kIOReturnSuccess;
         }
         break;
+    case ProviderMemoryType_ResponseRing:
+        {
+            // Only released in free(), so can't go away while the user client is open
+            this->responseRingMemory->retain(); // Matched internally in IOUserClient
+            *memory = this->responseRingMemory;
+            return kIOReturnSuccess;
+        }
+        break;
     }
     
     return kIOReturnError;
@@ -173,6 +233,7 @@ IOReturn PrjFSProviderUserClient::registerNotificationPort(
         Mutex_Acquire(this->dataQueueWriterMutex);
         {
             assert(nullptr != this->dataQueue);
+            this->dataQueueInUse = true;
             this->dataQueue->setNotificationPort(port);
         }
         Mutex_Release(this->dataQueueWriterMutex);
@@ -221,6 +282,53 @@ IOReturn PrjFSProviderUserClient::kernelMessageResponse(uint64_t messageId, Mess
     return kIOReturnSuccess;
 }
 
+IOReturn PrjFSProviderUserClient::responseRingDoorbell(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->drainResponseRing();
+}
+
+IOReturn PrjFSProviderUserClient::drainResponseRing()
+{
+    IOReturn result = kIOReturnSuccess;
+    ProviderResponseRing* ring = static_cast<ProviderResponseRing*>(this->responseRingMemory->getBytesNoCopy());
+    
+    Mutex_Acquire(this->responseRingMutex);
+    {
+        // Keep going until the ring is empty, picking up anything the provider adds in the meantime
+        ProviderResponseRingEntry responses[ProviderResponseRingDrainBatchSize];
+        uint32_t responseCount;
+        while (true)
+        {
+            if (!ProviderResponseRing_TakeResponses(ring, this->responseRingReadIndex, responses, ProviderResponseRingDrainBatchSize, responseCount))
+            {
+                KextLog_Error("PrjFSProviderUserClient::drainResponseRing: provider (PID %d) published a bad write index, read index is %u",
+                    this->pid, this->responseRingReadIndex);
+                result = kIOReturnBadArgument;
+                break;
+            }
+            
+            if (0 == responseCount)
+            {
+                break;
+            }
+            
+            ProviderMessaging_HandleKernelMessageResponses(this->virtualizationRootHandle, responses, responseCount);
+        }
+    }
+    Mutex_Release(this->responseRingMutex);
+    
+    // The doorbell may also mean that the provider has made room in the message queue
+    if (__atomic_exchange_n(&this->messageQueueSpaceWanted, false, __ATOMIC_RELAXED))
+    {
+        ProviderMessaging_MessageQueueSpaceAvailable(this->virtualizationRootHandle);
+    }
+    
+    return result;
+}
+
 IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(
     OSObject* target,
     void* reference,
@@ -252,10 +360,21 @@ IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(const char* rootPat
         return kIOReturnSuccess;
     }
     
+    Mutex_Acquire(this->dataQueueWriterMutex);
+    {
+        this->dataQueueInUse = true;
+    }
+    Mutex_Release(this->dataQueueWriterMutex);
+    
     VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(this, this->pid, rootPath);
     if (0 == result.error)
     {
         this->virtualizationRootHandle = result.root;
+        
+        // Vnodes inside the root that were looked up before it was registered may be cached as being
+        // outside of every root, which would also make vnode operations skip them
+        PerfTracer perfTracer;
+        VnodeCache_InvalidateRoot(&perfTracer, RootHandle_None);
 
         // Sets the root index in the IORegistry for diagnostic purposes
         char location[5] = "";
@@ -268,22 +387,185 @@ IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(const char* rootPat
     return kIOReturnSuccess;
 }
 
-void PrjFSProviderUserClient::sendMessage(const void* message, uint32_t size)
+bool PrjFSProviderUserClient::sendMessage(const Message& message)
+{
+    uint32_t messageSize = Message_EncodedSize(message.messageHeader);
+    ProviderResponseRing* ring = static_cast<ProviderResponseRing*>(this->responseRingMemory->getBytesNoCopy());
+    
+    bool ok;
+    Mutex_Acquire(this->dataQueueWriterMutex);
+    {
+        void* messageMemory = this->dataQueue->reserve(messageSize);
+        if (nullptr == messageMemory)
+        {
+            // Requests are limited to what fits into the queue, but notifications aren't waited for,
+            // so can fill it up if the provider falls behind; the caller deals with that. Ask the
+            // provider to ring the doorbell once it has made room, then check again in case it
+            // made room before it could see the request.
+            __atomic_store_n(&ring->messageQueueSpaceWanted, 1u, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&this->messageQueueSpaceWanted, true, __ATOMIC_RELAXED);
+            messageMemory = this->dataQueue->reserve(messageSize);
+        }
+        
+        ok = (nullptr != messageMemory);
+        if (ok)
+        {
+            uint32_t bytesUsed OS_UNUSED = Message_Encode(messageMemory, messageSize, message);
+            assertf(bytesUsed == messageSize, "bytes used by Message_Encode (%u) should match Message_EncodedSize's prediction (%u)", bytesUsed, messageSize);
+            
+            this->dataQueue->commitReservation();
+            
+            uint32_t bytesInUse = this->dataQueue->getBytesInUse();
+            if (bytesInUse > this->dataQueueHighWaterBytes)
+            {
+                this->dataQueueHighWaterBytes = bytesInUse;
+            }
+        }
+        else
+        {
+            ++this->enqueueFailureCount;
+        }
+    }
+    Mutex_Release(this->dataQueueWriterMutex);
+    
+    return ok;
+}
+
+bool ProviderUserClient_SendMessage(PrjFSProviderUserClient* userClient, const Message& message)
+{
+    return userClient->sendMessage(message);
+}
+
+void PrjFSProviderUserClient::getMessageQueueStats(PrjFSProviderQueueStats& stats)
 {
     Mutex_Acquire(this->dataQueueWriterMutex);
     {
-        // IOSharedDataQueue::enqueue() only reads (memcpy source), but doesn't take a const pointer for some reason
-        bool ok = this->dataQueue->enqueue(const_cast<void*>(message), size);
-        assert(ok);
+        stats.queueCapacityBytes = this->dataQueueCapacityBytes;
+        stats.queueHighWaterBytes = this->dataQueueHighWaterBytes;
+        stats.enqueueFailures = this->enqueueFailureCount;
+        
+        this->dataQueueHighWaterBytes = this->dataQueue->getBytesInUse();
+        this->enqueueFailureCount = 0;
+    }
+    Mutex_Release(this->dataQueueWriterMutex);
+}
 
-        // TODO: block here and try again when space has cleared if enqueueing fails
+void ProviderUserClient_GetMessageQueueStats(PrjFSProviderUserClient* userClient, PrjFSProviderQueueStats& stats)
+{
+    userClient->getMessageQueueStats(stats);
+}
+
+IOReturn PrjFSProviderUserClient::setMessageQueueCapacity(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setMessageQueueCapacity(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::setMessageQueueCapacity(uint64_t requestedCapacityBytes, uint64_t* outCapacityBytes)
+{
+    uint32_t capacityBytes =
+        requestedCapacityBytes < ProviderMessageQueueMinCapacityBytes ? ProviderMessageQueueMinCapacityBytes :
+        requestedCapacityBytes > ProviderMessageQueueMaxCapacityBytes ? ProviderMessageQueueMaxCapacityBytes :
+        static_cast<uint32_t>(requestedCapacityBytes);
+    
+    PrjFSProviderMessageQueue* queue = PrjFSProviderMessageQueue::withCapacity(capacityBytes);
+    if (nullptr == queue)
+    {
+        return kIOReturnNoMemory;
+    }
+    
+    IOMemoryDescriptor* queueMemory = queue->getMemoryDescriptor();
+    if (nullptr == queueMemory)
+    {
+        queue->release();
+        return kIOReturnNoMemory;
+    }
+    
+    IOReturn result = kIOReturnSuccess;
+    Mutex_Acquire(this->dataQueueWriterMutex);
+    {
+        // The provider may have mapped the old queue already, and must not miss messages sent to it
+        if (this->dataQueueInUse)
+        {
+            result = kIOReturnBusy;
+        }
+        else
+        {
+            // Swap, so the old queue is released below
+            PrjFSProviderMessageQueue* oldQueue = this->dataQueue;
+            IOMemoryDescriptor* oldQueueMemory = this->dataQueueMemory;
+            this->dataQueue = queue;
+            this->dataQueueMemory = queueMemory;
+            this->dataQueueCapacityBytes = capacityBytes;
+            queue = oldQueue;
+            queueMemory = oldQueueMemory;
+        }
+        
+        *outCapacityBytes = this->dataQueueCapacityBytes;
     }
     Mutex_Release(this->dataQueueWriterMutex);
+    
+    OSSafeReleaseNULL(queueMemory);
+    OSSafeReleaseNULL(queue);
+    return result;
 }
 
-void ProviderUserClient_SendMessage(PrjFSProviderUserClient* userClient, const void* message, uint32_t size)
+PrjFSProviderMessageQueue* PrjFSProviderMessageQueue::withCapacity(uint32_t capacityBytes)
 {
-    userClient->sendMessage(message, size);
+    PrjFSProviderMessageQueue* queue = new PrjFSProviderMessageQueue;
+    if (nullptr != queue && !queue->initWithCapacity(capacityBytes))
+    {
+        queue->release();
+        queue = nullptr;
+    }
+    
+    if (nullptr != queue)
+    {
+        queue->tail = 0;
+    }
+    
+    return queue;
+}
+
+void* PrjFSProviderMessageQueue::reserve(uint32_t dataSize)
+{
+    // The head is written by the consumer at any time, the tail only by us. Sequentially consistent,
+    // so that a consumer that frees up space either sees messageQueueSpaceWanted, or we see its head.
+    const uint32_t head = __atomic_load_n(&this->dataQueue->head, __ATOMIC_SEQ_CST);
+    
+    // Unlike dataQueue->queueSize, getQueueSize() can't be modified from user space
+    return ProviderMessageQueue_Reserve(this->dataQueue, this->getQueueSize(), head, this->tail, dataSize, this->tailAfterReservation);
+}
+
+void PrjFSProviderMessageQueue::commitReservation()
+{
+    // Makes the encoded message visible before the new tail. The consumer dequeues by moving the
+    // head and then checks the tail, so ordering our store before the load below means that either
+    // it sees the new entry, or we see that it had emptied the queue and notify it.
+    const uint32_t reservationTail = this->tail;
+    this->tail = this->tailAfterReservation;
+    __atomic_store_n(&this->dataQueue->tail, this->tail, __ATOMIC_SEQ_CST);
+    
+    if (reservationTail == __atomic_load_n(&this->dataQueue->head, __ATOMIC_SEQ_CST))
+    {
+        this->sendDataAvailableNotification();
+    }
+}
+
+uint32_t PrjFSProviderMessageQueue::getBytesInUse()
+{
+    const uint32_t head = __atomic_load_n(&this->dataQueue->head, __ATOMIC_RELAXED);
+    const uint32_t tail = this->tail;
+    const uint32_t queueSize = this->getQueueSize();
+    
+    // Ignores the unused space at the end of the queue when the entries wrap around.
+    // The head comes from user space, so is only trusted as far as not overflowing.
+    uint32_t bytesInUse = tail >= head ? tail - head : queueSize - head + tail;
+    return bytesInUse > queueSize ? queueSize : bytesInUse;
 }
 
 void ProviderUserClient_UpdatePathProperty(PrjFSProviderUserClient* userClient, const char* providerPath)
@@ -3,7 +3,13 @@
 #include "PrjFSClasses.hpp"
 #include <stdint.h>
 
+struct Message;
+struct PrjFSProviderQueueStats;
+
 void ProviderUserClient_UpdatePathProperty(PrjFSProviderUserClient* userClient, const char* providerPath);
 void ProviderUserClient_Retain(PrjFSProviderUserClient* userClient);
 void ProviderUserClient_Release(PrjFSProviderUserClient* userClient);
-void ProviderUserClient_SendMessage(PrjFSProviderUserClient* userClient, const void* message, uint32_t size);
+// Encodes the message directly into the provider's queue. Returns false if it doesn't fit.
+bool ProviderUserClient_SendMessage(PrjFSProviderUserClient* userClient, const Message& message);
+// Fills in the message queue fields of stats, and restarts the high-water mark and failure count
+void ProviderUserClient_GetMessageQueueStats(PrjFSProviderUserClient* userClient, PrjFSProviderQueueStats& stats);
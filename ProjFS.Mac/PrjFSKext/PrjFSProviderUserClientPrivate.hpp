@@ -9,18 +9,57 @@
 #include "public/Message.h"
 #include "VirtualizationRoots.hpp"
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOSharedDataQueue.h>
 
 struct MessageHeader;
 struct VirtualizationRoot;
-class IOSharedDataQueue;
+class IOBufferMemoryDescriptor;
+
+// Shared data queue which lets messages be encoded straight into the queue memory, instead of
+// being assembled elsewhere and copied in by enqueue().
+class PrjFSProviderMessageQueue : public IOSharedDataQueue
+{
+    OSDeclareDefaultStructors(PrjFSProviderMessageQueue);
+private:
+    typedef IOSharedDataQueue super;
+    // The queue memory is mapped read-write into the provider, so the tail there is only ever written,
+    // never trusted. This is the kernel's own copy.
+    uint32_t tail;
+    uint32_t tailAfterReservation;
+
+public:
+    static PrjFSProviderMessageQueue* withCapacity(uint32_t capacityBytes);
+    
+    // Returns space for a dataSize byte entry in the queue, or nullptr if it's full. The entry only
+    // becomes visible to the consumer with commitReservation(). Callers must serialise writers.
+    void* reserve(uint32_t dataSize);
+    // Publishes the reserved entry, and notifies the consumer if the queue was empty
+    void commitReservation();
+    // Approximate number of bytes taken up by entries the consumer hasn't dequeued yet
+    uint32_t getBytesInUse();
+};
+
 class PrjFSProviderUserClient : public IOUserClient
 {
     OSDeclareDefaultStructors(PrjFSProviderUserClient);
 private:
     typedef IOUserClient super;
-    IOSharedDataQueue* dataQueue;
+    PrjFSProviderMessageQueue* dataQueue;
     IOMemoryDescriptor* dataQueueMemory;
+    // Protects the queue and the fields below it up to the response ring
     Mutex dataQueueWriterMutex;
+    uint32_t dataQueueCapacityBytes;
+    // Once the queue has been mapped or registration has started, its capacity is fixed
+    bool dataQueueInUse;
+    uint32_t dataQueueHighWaterBytes;
+    uint64_t enqueueFailureCount;
+    // Set when a message didn't fit into the queue, until the provider next rings the doorbell
+    bool messageQueueSpaceWanted;
+    // Shared with the provider, see ProviderResponseRing
+    IOBufferMemoryDescriptor* responseRingMemory;
+    // Serialises draining the response ring, and protects responseRingReadIndex
+    Mutex responseRingMutex;
+    uint32_t responseRingReadIndex;
     pid_t pid;
     // The root for which this is the provider; RootHandle_None prior to registration
     VirtualizationRootHandle virtualizationRootHandle;
@@ -57,7 +96,8 @@ public:
     virtual void free() override;
 
 
-    void sendMessage(const void* message, uint32_t size);
+    bool sendMessage(const Message& message);
+    void getMessageQueueStats(PrjFSProviderQueueStats& stats);
 
 private:
     void cleanupProviderRegistration();
@@ -74,4 +114,16 @@ private:
         void* reference,
         IOExternalMethodArguments* arguments);
     IOReturn kernelMessageResponse(uint64_t messageId, MessageType responseType);
+
+    static IOReturn setMessageQueueCapacity(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setMessageQueueCapacity(uint64_t requestedCapacityBytes, uint64_t* outCapacityBytes);
+
+    static IOReturn responseRingDoorbell(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn drainResponseRing();
 };
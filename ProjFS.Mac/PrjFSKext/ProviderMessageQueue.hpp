@@ -0,0 +1,68 @@
+#pragma once
+
+#include <IOKit/IODataQueueShared.h>
+
+// Finds room for a dataSize byte entry in a provider's message queue, following the same layout rules
+// as IOSharedDataQueue::enqueue(), which the user space IODataQueueDequeue() relies on. head comes from
+// queue memory the provider can write to, so it's checked rather than trusted; tail and queueSize must
+// be the kernel's own copies. Writes the entry's size (and, on wrapping around, the marker the consumer
+// uses to find the end of the queue), and returns a pointer to its data, or nullptr if it doesn't fit.
+// The entry becomes visible to the consumer once the shared tail is set to outTailAfterEntry.
+static inline void* ProviderMessageQueue_Reserve(
+    IODataQueueMemory* queueMemory,
+    uint32_t queueSize,
+    uint32_t head,
+    uint32_t tail,
+    uint32_t dataSize,
+    uint32_t& outTailAfterEntry)
+{
+    // Everything below relies on both offsets being within the queue, or it would write past its end
+    if (head > queueSize || tail > queueSize)
+    {
+        return nullptr;
+    }
+
+    if (dataSize > UINT32_MAX - DATA_QUEUE_ENTRY_HEADER_SIZE)
+    {
+        return nullptr;
+    }
+
+    const uint32_t entrySize = dataSize + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    uint32_t entryOffset;
+    if (tail >= head)
+    {
+        if (entrySize <= queueSize - tail)
+        {
+            entryOffset = tail;
+        }
+        else if (head > entrySize)
+        {
+            // Wrap around to the start; the consumer recognises the end of the queue by the
+            // size at the old tail not fitting, if there's room for a size at all
+            entryOffset = 0;
+            if (queueSize - tail >= DATA_QUEUE_ENTRY_HEADER_SIZE)
+            {
+                reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(queueMemory->queue) + tail)->size = dataSize;
+            }
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+    else if (head - tail > entrySize)
+    {
+        // The tail must not catch up with the head, as that would make the queue look empty
+        entryOffset = tail;
+    }
+    else
+    {
+        return nullptr;
+    }
+
+    IODataQueueEntry* entry = reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(queueMemory->queue) + entryOffset);
+    entry->size = dataSize;
+
+    outTailAfterEntry = entryOffset + entrySize;
+    return entry->data;
+}
@@ -1,7 +1,11 @@
 #include "ProviderMessaging.hpp"
+#include "OutstandingMessages.hpp"
 #include "Locks.hpp"
+#include "Memory.hpp"
 #include "KextLog.hpp"
 #include "Message_Kernel.hpp"
+#include "PrjFSProviderUserClient.hpp"
+#include "public/PrjFSProviderQueueStats.h"
 #include "kernel-header-wrappers/stdatomic.h"
 
 #include <kern/assert.h>
@@ -9,37 +13,89 @@
 #include <sys/kauth.h>
 
 // Structs
-struct OutstandingMessage
+struct OutstandingMessageShard
 {
-    MessageHeader                  request;
-    MessageType                    result;
-    bool                           receivedResult;
-    VirtualizationRootHandle       rootHandle;
-    
-    LIST_ENTRY(OutstandingMessage) _list_privates;
-    
+    Mutex                       mutex;
+    OutstandingMessageBuckets   messages;
+    // Incremented whenever one of the shard's providers frees up space in its message queue
+    uint64_t                    queueSpaceSignalCount;
+    // Number of threads in WaitForMessageQueueSpace
+    uint32_t                    queueSpaceWaiterCount;
 };
 
+// Constants
+// Outstanding messages are sharded by root, so that providers don't contend with each other
+static const uint32_t OutstandingMessageShardCount = 16;
+// One in-flight count per possible VirtualizationRootHandle
+static const uint32_t InFlightMessageCountsLength = INT16_MAX + 1u;
+// Providers without a response ring don't tell us when they take messages from their queue, only when
+// they respond to them, so threads waiting for space also check back this often
+static const int MessageQueueSpacePollMilliseconds = 10;
+
 // State
-static LIST_HEAD(OutstandingMessage_Head, OutstandingMessage) s_outstandingMessages = LIST_HEAD_INITIALIZER(OutstandingMessage_Head);
-static Mutex s_outstandingMessagesMutex = {};
+static OutstandingMessageShard s_outstandingMessageShards[OutstandingMessageShardCount] = {};
+// Indexed by root handle, each protected by the mutex of that root's shard
+static uint16_t* s_inFlightMessageCounts = nullptr;
+// Highest in-flight count of each root since its stats were last fetched; same protection
+static uint16_t* s_inFlightMessageHighWaterCounts = nullptr;
+// Number of notifications that didn't fit into each root's provider queue since it was last told; same protection.
+// While non-zero, further notifications are dropped as well, so that none reach the provider ahead of the
+// NotifyNotificationsDropped message telling it about the earlier ones.
+static uint32_t* s_droppedNotificationCounts = nullptr;
 static atomic_uint_least64_t s_nextMessageId;
 static volatile bool s_isShuttingDown;
 
+static OutstandingMessageShard& GetShardForRoot(VirtualizationRootHandle rootHandle);
+static bool GetResponseResult(const OutstandingMessage& message, int* kauthResult, int* kauthError);
+static bool WaitForCoalescedResponse_Locked(OutstandingMessageShard& shard, OutstandingMessage* identicalMessage, int* kauthResult, int* kauthError);
+static bool IsValidResponseType(MessageType responseType);
+static void DeliverResponse_Locked(OutstandingMessageShard& shard, VirtualizationRootHandle providerVirtualizationRootHandle, uint64_t messageId, MessageType responseType);
+static bool WaitForMessageQueueSpace(OutstandingMessageShard& shard, uint64_t& queueSpaceSignalCount);
+static void SignalMessageQueueSpace_Locked(OutstandingMessageShard& shard);
+static void SignalMessageQueueSpaceAndReportDroppedNotifications(VirtualizationRootHandle providerVirtualizationRootHandle);
+static bool TryReportDroppedNotifications_Locked(PrjFSProviderUserClient* userClient, VirtualizationRootHandle root);
+
 
 bool ProviderMessaging_Init()
 {
-    LIST_INIT(&s_outstandingMessages);
     s_nextMessageId = 1;
     
     s_isShuttingDown = false;
     
-    s_outstandingMessagesMutex = Mutex_Alloc();
-    if (!Mutex_IsValid(s_outstandingMessagesMutex))
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
+    {
+        OutstandingMessageBuckets_Init(s_outstandingMessageShards[i].messages);
+        s_outstandingMessageShards[i].mutex = Mutex_Alloc();
+        if (!Mutex_IsValid(s_outstandingMessageShards[i].mutex))
+        {
+            goto CleanupAndFail;
+        }
+    }
+    
+    s_inFlightMessageCounts = Memory_AllocArray<uint16_t>(InFlightMessageCountsLength);
+    if (nullptr == s_inFlightMessageCounts)
     {
         goto CleanupAndFail;
     }
-        
+    
+    memset(s_inFlightMessageCounts, 0, InFlightMessageCountsLength * sizeof(s_inFlightMessageCounts[0]));
+    
+    s_inFlightMessageHighWaterCounts = Memory_AllocArray<uint16_t>(InFlightMessageCountsLength);
+    if (nullptr == s_inFlightMessageHighWaterCounts)
+    {
+        goto CleanupAndFail;
+    }
+    
+    memset(s_inFlightMessageHighWaterCounts, 0, InFlightMessageCountsLength * sizeof(s_inFlightMessageHighWaterCounts[0]));
+    
+    s_droppedNotificationCounts = Memory_AllocArray<uint32_t>(InFlightMessageCountsLength);
+    if (nullptr == s_droppedNotificationCounts)
+    {
+        goto CleanupAndFail;
+    }
+    
+    memset(s_droppedNotificationCounts, 0, InFlightMessageCountsLength * sizeof(s_droppedNotificationCounts[0]));
+    
     return true;
 
 CleanupAndFail:
@@ -50,40 +106,161 @@ CleanupAndFail:
 
 void ProviderMessaging_Cleanup()
 {
-    if (Mutex_IsValid(s_outstandingMessagesMutex))
+    if (nullptr != s_droppedNotificationCounts)
+    {
+        Memory_FreeArray(s_droppedNotificationCounts, InFlightMessageCountsLength);
+        s_droppedNotificationCounts = nullptr;
+    }
+    
+    if (nullptr != s_inFlightMessageHighWaterCounts)
+    {
+        Memory_FreeArray(s_inFlightMessageHighWaterCounts, InFlightMessageCountsLength);
+        s_inFlightMessageHighWaterCounts = nullptr;
+    }
+    
+    if (nullptr != s_inFlightMessageCounts)
+    {
+        Memory_FreeArray(s_inFlightMessageCounts, InFlightMessageCountsLength);
+        s_inFlightMessageCounts = nullptr;
+    }
+    
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
     {
-        Mutex_FreeMemory(&s_outstandingMessagesMutex);
+        if (Mutex_IsValid(s_outstandingMessageShards[i].mutex))
+        {
+            Mutex_FreeMemory(&s_outstandingMessageShards[i].mutex);
+        }
     }
 }
 
+// Root handles that come from the provider's user client must be checked with VirtualizationRoot_IsValidRootHandle first,
+// as it can make calls before registering its root
+static OutstandingMessageShard& GetShardForRoot(VirtualizationRootHandle rootHandle)
+{
+    assert(rootHandle >= 0);
+    return s_outstandingMessageShards[static_cast<uint16_t>(rootHandle) % OutstandingMessageShardCount];
+}
+
+static bool GetResponseResult(const OutstandingMessage& message, int* kauthResult, int* kauthError)
+{
+    if (s_isShuttingDown)
+    {
+        *kauthResult = KAUTH_RESULT_DENY;
+        return false;
+    }
+    else if (MessageType_Response_Success == message.result)
+    {
+        *kauthResult = KAUTH_RESULT_DEFER;
+        return true;
+    }
+    else
+    {
+        // Default error code is EACCES. See errno.h for more codes.
+        *kauthError = EAGAIN;
+        *kauthResult = KAUTH_RESULT_DENY;
+        return false;
+    }
+}
+
+static bool WaitForCoalescedResponse_Locked(OutstandingMessageShard& shard, OutstandingMessage* identicalMessage, int* kauthResult, int* kauthError)
+{
+    // The thread that sent the message won't return (and free it) until coalescedWaiterCount drops back to 0
+    ++identicalMessage->coalescedWaiterCount;
+    
+    // Responses, aborts and shutdown all wake the message's channel, which we share with its sender
+    while (!identicalMessage->receivedResult &&
+           !s_isShuttingDown)
+    {
+        Mutex_Sleep(5, identicalMessage, &shard.mutex);
+    }
+    
+    bool result = GetResponseResult(*identicalMessage, kauthResult, kauthError);
+    
+    if (--identicalMessage->coalescedWaiterCount == 0)
+    {
+        wakeup(&identicalMessage->coalescedWaiterCount);
+    }
+    
+    return result;
+}
 
 void ProviderMessaging_HandleKernelMessageResponse(VirtualizationRootHandle providerVirtualizationRootHandle, uint64_t messageId, MessageType responseType)
 {
-    switch (responseType)
+    if (!VirtualizationRoot_IsValidRootHandle(providerVirtualizationRootHandle))
     {
-        case MessageType_Response_Success:
-        case MessageType_Response_Fail:
+        // Not registered yet, so there can't be any requests awaiting a response
+        return;
+    }
+    
+    if (!IsValidResponseType(responseType))
+    {
+        KextLog_Error("KauthHandler_HandleKernelMessageResponse: Unexpected responseType: %d", responseType);
+        return;
+    }
+    
+    OutstandingMessageShard& shard = GetShardForRoot(providerVirtualizationRootHandle);
+    Mutex_Acquire(shard.mutex);
+    {
+        DeliverResponse_Locked(shard, providerVirtualizationRootHandle, messageId, responseType);
+    }
+    Mutex_Release(shard.mutex);
+    
+    // The provider must have taken the request out of its queue to respond to it
+    SignalMessageQueueSpaceAndReportDroppedNotifications(providerVirtualizationRootHandle);
+}
+
+void ProviderMessaging_HandleKernelMessageResponses(VirtualizationRootHandle providerVirtualizationRootHandle, const ProviderResponseRingEntry* responses, uint32_t responseCount)
+{
+    if (!VirtualizationRoot_IsValidRootHandle(providerVirtualizationRootHandle))
+    {
+        // Not registered yet, so there can't be any requests awaiting a response
+        return;
+    }
+    
+    OutstandingMessageShard& shard = GetShardForRoot(providerVirtualizationRootHandle);
+    Mutex_Acquire(shard.mutex);
+    {
+        for (uint32_t i = 0; i < responseCount; ++i)
         {
-            Mutex_Acquire(s_outstandingMessagesMutex);
+            MessageType responseType = static_cast<MessageType>(responses[i].responseType);
+            if (IsValidResponseType(responseType))
             {
-                OutstandingMessage* outstandingMessage;
-                LIST_FOREACH(outstandingMessage, &s_outstandingMessages, _list_privates)
-                {
-                    if (outstandingMessage->request.messageId == messageId && outstandingMessage->rootHandle == providerVirtualizationRootHandle)
-                    {
-                        // Save the response for the blocked thread.
-                        outstandingMessage->result = responseType;
-                        outstandingMessage->receivedResult = true;
-                        
-                        wakeup(outstandingMessage);
-                        
-                        break;
-                    }
-                }
+                DeliverResponse_Locked(shard, providerVirtualizationRootHandle, responses[i].messageId, responseType);
+            }
+            else
+            {
+                KextLog_Error("ProviderMessaging_HandleKernelMessageResponses: Unexpected responseType: %d", responseType);
             }
-            Mutex_Release(s_outstandingMessagesMutex);
-            break;
         }
+    }
+    Mutex_Release(shard.mutex);
+    
+    if (responseCount > 0)
+    {
+        SignalMessageQueueSpaceAndReportDroppedNotifications(providerVirtualizationRootHandle);
+    }
+}
+
+static void DeliverResponse_Locked(OutstandingMessageShard& shard, VirtualizationRootHandle providerVirtualizationRootHandle, uint64_t messageId, MessageType responseType)
+{
+    OutstandingMessage* outstandingMessage = OutstandingMessageBuckets_Find(shard.messages, providerVirtualizationRootHandle, messageId);
+    if (nullptr != outstandingMessage)
+    {
+        // Save the response for the blocked thread.
+        outstandingMessage->result = responseType;
+        outstandingMessage->receivedResult = true;
+        
+        wakeup(outstandingMessage);
+    }
+}
+
+static bool IsValidResponseType(MessageType responseType)
+{
+    switch (responseType)
+    {
+        case MessageType_Response_Success:
+        case MessageType_Response_Fail:
+            return true;
         
         // The follow are not valid responses to kernel messages
         case MessageType_Invalid:
@@ -98,32 +275,44 @@ void ProviderMessaging_HandleKernelMessageResponse(VirtualizationRootHandle prov
         case MessageType_KtoU_NotifyFileRenamed:
         case MessageType_KtoU_NotifyDirectoryRenamed:
         case MessageType_KtoU_NotifyFileHardLinkCreated:
+        case MessageType_KtoU_NotifyFilePreConvertToFull:
+        case MessageType_KtoU_NotifyNotificationsDropped:
         case MessageType_Result_Aborted:
         default:
-            KextLog_Error("KauthHandler_HandleKernelMessageResponse: Unexpected responseType: %d", responseType);
-            break;
+            return false;
     }
-    
-    return;
 }
 
 void ProviderMessaging_AbortOutstandingEventsForProvider(VirtualizationRootHandle providerVirtualizationRootHandle)
 {
     // Mark all outstanding messages for this root as aborted and wake up the waiting threads
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    OutstandingMessageShard& shard = GetShardForRoot(providerVirtualizationRootHandle);
+    Mutex_Acquire(shard.mutex);
     {
-        OutstandingMessage* outstandingMessage;
-        LIST_FOREACH(outstandingMessage, &s_outstandingMessages, _list_privates)
+        for (uint32_t i = 0; i < OutstandingMessageBucketCount; ++i)
         {
-            if (outstandingMessage->rootHandle == providerVirtualizationRootHandle)
+            OutstandingMessage* outstandingMessage;
+            LIST_FOREACH(outstandingMessage, &shard.messages.buckets[i], _list_privates)
             {
-                outstandingMessage->receivedResult = true;
-                outstandingMessage->result = MessageType_Result_Aborted;
-                wakeup(outstandingMessage);
+                if (outstandingMessage->rootHandle == providerVirtualizationRootHandle)
+                {
+                    outstandingMessage->receivedResult = true;
+                    outstandingMessage->result = MessageType_Result_Aborted;
+                    wakeup(outstandingMessage);
+                }
             }
         }
+        
+        // Requests waiting for room in the window or the queue will find the provider gone when they try to send
+        wakeup(&s_inFlightMessageCounts[providerVirtualizationRootHandle]);
+        ++shard.queueSpaceSignalCount;
+        wakeup(&shard.queueSpaceSignalCount);
+        
+        // The next provider for the root starts from scratch anyway
+        s_droppedNotificationCounts[providerVirtualizationRootHandle] = 0;
+        s_inFlightMessageHighWaterCounts[providerVirtualizationRootHandle] = 0;
     }
-    Mutex_Release(s_outstandingMessagesMutex);
+    Mutex_Release(shard.mutex);
 }
 
 bool ProviderMessaging_TrySendRequestAndWaitForResponse(
@@ -167,20 +356,79 @@ bool ProviderMessaging_TrySendRequestAndWaitForResponse(
         return false;
     }
     
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    OutstandingMessageShard& shard = GetShardForRoot(root);
+    uint16_t& inFlightCount = s_inFlightMessageCounts[root];
+    uint64_t queueSpaceSignalCount;
+    bool isCoalescable = OutstandingMessage_IsCoalescable(messageType, vnodeFsidInode);
+    Mutex_Acquire(shard.mutex);
     {
-        LIST_INSERT_HEAD(&s_outstandingMessages, &message, _list_privates);
+        OutstandingMessage* identicalMessage = nullptr;
+        while (!s_isShuttingDown)
+        {
+            if (isCoalescable)
+            {
+                identicalMessage = OutstandingMessageBuckets_FindCoalescable(shard.messages, root, messageType, vnodeFsidInode);
+                if (nullptr != identicalMessage)
+                {
+                    break;
+                }
+            }
+            
+            if (inFlightCount < ProviderInFlightMessageWindow)
+            {
+                break;
+            }
+            
+            Mutex_Sleep(5, &inFlightCount, &shard.mutex);
+        }
+        
+        if (s_isShuttingDown)
+        {
+            Mutex_Release(shard.mutex);
+            *kauthResult = KAUTH_RESULT_DENY;
+            return false;
+        }
+        
+        if (nullptr != identicalMessage)
+        {
+            // The provider is already handling this exact request, so share its result rather than queueing a duplicate
+            result = WaitForCoalescedResponse_Locked(shard, identicalMessage, kauthResult, kauthError);
+            Mutex_Release(shard.mutex);
+            return result;
+        }
+        
+        if (++inFlightCount > s_inFlightMessageHighWaterCounts[root])
+        {
+            s_inFlightMessageHighWaterCounts[root] = inFlightCount;
+        }
+        
+        OutstandingMessageBuckets_Insert(shard.messages, &message);
+        queueSpaceSignalCount = shard.queueSpaceSignalCount;
     }
-    Mutex_Release(s_outstandingMessagesMutex);
+    Mutex_Release(shard.mutex);
     
-    errno_t sendError = ActiveProvider_SendMessage(root, messageSpec);
+    errno_t sendError;
+    while (ENOBUFS == (sendError = ActiveProvider_SendMessage(root, messageSpec)))
+    {
+        // The window keeps requests from overflowing the queue, but notifications can fill it up.
+        // Rather than failing the operation, wait for the provider to catch up.
+        if (!WaitForMessageQueueSpace(shard, queueSpaceSignalCount))
+        {
+            break;
+        }
+    }
    
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    Mutex_Acquire(shard.mutex);
     {
         if (0 != sendError)
         {
             // If message delivery fails, block the operation to avoid missed messages in the provider.
             *kauthResult = KAUTH_RESULT_DENY;
+            
+            // Fail any threads that joined the request too
+            message.result = MessageType_Response_Fail;
+            message.receivedResult = true;
+            wakeup(&message);
         }
         else
         {
@@ -188,45 +436,212 @@ bool ProviderMessaging_TrySendRequestAndWaitForResponse(
                    !s_isShuttingDown)
             {
                 // TODO: appropriately handle unresponsive providers
-                Mutex_Sleep(5, &message, &s_outstandingMessagesMutex);
+                Mutex_Sleep(5, &message, &shard.mutex);
             }
         
-            if (s_isShuttingDown)
-            {
-                *kauthResult = KAUTH_RESULT_DENY;
-            }
-            else if (MessageType_Response_Success == message.result)
+            result = GetResponseResult(message, kauthResult, kauthError);
+        }
+        
+        OutstandingMessageBuckets_Remove(&message);
+        
+        // Threads that joined this request read the response from our stack, so wait until they have
+        while (message.coalescedWaiterCount > 0)
+        {
+            Mutex_Sleep(5, &message.coalescedWaiterCount, &shard.mutex);
+        }
+        
+        if (inFlightCount-- >= ProviderInFlightMessageWindow)
+        {
+            wakeup(&inFlightCount);
+        }
+    }
+    Mutex_Release(shard.mutex);
+    
+    return result;
+}
+
+bool ProviderMessaging_TrySendNotification(
+    VirtualizationRootHandle root,
+    MessageType messageType,
+    const vnode_t vnode,
+    const FsidInode& vnodeFsidInode,
+    const char* vnodePath,
+    const char* fromPath,
+    int pid,
+    const char* procname)
+{
+    assert(vnodePath != nullptr || (vnodeFsidInode.fsid.val[0] != 0 || vnodeFsidInode.fsid.val[1] != 0) || fromPath != nullptr);
+    
+    if (s_isShuttingDown)
+    {
+        return false;
+    }
+    
+    PrjFSProviderUserClient* userClient = ActiveProvider_RetainUserClient(root);
+    if (nullptr == userClient)
+    {
+        return false;
+    }
+    
+    MessageHeader header = {};
+    Message messageSpec = {};
+    Message_Init(&messageSpec, &header, MessageId_NoResponse, messageType, vnodeFsidInode, pid, procname, vnodePath, fromPath);
+    
+    bool sent;
+    OutstandingMessageShard& shard = GetShardForRoot(root);
+    // Queued under the shard's mutex, so that the dropped notifications check and the send happen together
+    Mutex_Acquire(shard.mutex);
+    {
+        sent =
+            TryReportDroppedNotifications_Locked(userClient, root) &&
+            ProviderUserClient_SendMessage(userClient, messageSpec);
+        if (!sent)
+        {
+            // The provider's queue is full. Rather than block the thread until it drains, count the loss and
+            // report it as soon as there's room again.
+            ++s_droppedNotificationCounts[root];
+        }
+    }
+    Mutex_Release(shard.mutex);
+    
+    ProviderUserClient_Release(userClient);
+    return sent;
+}
+
+// Tells the provider that it has missed notifications, ahead of anything else queued for it from now on.
+// Returns false if there are dropped notifications to report but the message didn't fit into the queue.
+static bool TryReportDroppedNotifications_Locked(PrjFSProviderUserClient* userClient, VirtualizationRootHandle root)
+{
+    uint32_t& droppedCount = s_droppedNotificationCounts[root];
+    if (0 == droppedCount)
+    {
+        return true;
+    }
+    
+    MessageHeader droppedHeader = {};
+    Message droppedSpec = {};
+    Message_Init(&droppedSpec, &droppedHeader, MessageId_NoResponse, MessageType_KtoU_NotifyNotificationsDropped, FsidInode{}, 0, nullptr, nullptr, nullptr);
+    if (!ProviderUserClient_SendMessage(userClient, droppedSpec))
+    {
+        return false;
+    }
+    
+    KextLog_Error("ProviderMessaging: %u notifications to provider for root %d were dropped", droppedCount, root);
+    droppedCount = 0;
+    return true;
+}
+
+void ProviderMessaging_AbortAllOutstandingEvents()
+{
+    // Wake up all sleeping threads so they can see that that we're shutting down and return an error
+    s_isShuttingDown = true;
+    
+    for (uint32_t shardIndex = 0; shardIndex < OutstandingMessageShardCount; ++shardIndex)
+    {
+        OutstandingMessageShard& shard = s_outstandingMessageShards[shardIndex];
+        Mutex_Acquire(shard.mutex);
+        {
+            for (uint32_t i = 0; i < OutstandingMessageBucketCount; ++i)
             {
-                *kauthResult = KAUTH_RESULT_DEFER;
-                result = true;
+                OutstandingMessage* outstandingMessage;
+                LIST_FOREACH(outstandingMessage, &shard.messages.buckets[i], _list_privates)
+                {
+                    wakeup(outstandingMessage);
+                }
             }
-            else
+            
+            // Threads waiting for room in the window of one of this shard's providers
+            for (uint32_t rootIndex = shardIndex; rootIndex < InFlightMessageCountsLength; rootIndex += OutstandingMessageShardCount)
             {
-                // Default error code is EACCES. See errno.h for more codes.
-                *kauthError = EAGAIN;
-                *kauthResult = KAUTH_RESULT_DENY;
+                if (s_inFlightMessageCounts[rootIndex] >= ProviderInFlightMessageWindow)
+                {
+                    wakeup(&s_inFlightMessageCounts[rootIndex]);
+                }
             }
+            
+            wakeup(&shard.queueSpaceSignalCount);
+        }
+        Mutex_Release(shard.mutex);
+    }
+}
+
+static bool WaitForMessageQueueSpace(OutstandingMessageShard& shard, uint64_t& queueSpaceSignalCount)
+{
+    bool shouldRetry;
+    Mutex_Acquire(shard.mutex);
+    {
+        shouldRetry = !s_isShuttingDown;
+        if (shouldRetry && queueSpaceSignalCount == shard.queueSpaceSignalCount)
+        {
+            ++shard.queueSpaceWaiterCount;
+            Mutex_SleepMilliseconds(MessageQueueSpacePollMilliseconds, &shard.queueSpaceSignalCount, &shard.mutex);
+            --shard.queueSpaceWaiterCount;
         }
         
-        LIST_REMOVE(&message, _list_privates);
+        queueSpaceSignalCount = shard.queueSpaceSignalCount;
     }
-    Mutex_Release(s_outstandingMessagesMutex);
+    Mutex_Release(shard.mutex);
     
-    return result;
+    return shouldRetry;
 }
 
-void ProviderMessaging_AbortAllOutstandingEvents()
+void ProviderMessaging_MessageQueueSpaceAvailable(VirtualizationRootHandle providerVirtualizationRootHandle)
 {
-    // Wake up all sleeping threads so they can see that that we're shutting down and return an error
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    if (!VirtualizationRoot_IsValidRootHandle(providerVirtualizationRootHandle))
+    {
+        // Not registered yet, so nothing can be waiting for room in its queue
+        return;
+    }
+    
+    SignalMessageQueueSpaceAndReportDroppedNotifications(providerVirtualizationRootHandle);
+}
+
+static void SignalMessageQueueSpaceAndReportDroppedNotifications(VirtualizationRootHandle providerVirtualizationRootHandle)
+{
+    // Only worth looking up the provider if notifications have been dropped; a stale read just means the
+    // report waits for the next signal or notification. Looked up before taking the shard mutex, as the
+    // roots lock may be held by threads waiting for the shard mutex.
+    PrjFSProviderUserClient* userClient = nullptr;
+    if (0 != __atomic_load_n(&s_droppedNotificationCounts[providerVirtualizationRootHandle], __ATOMIC_RELAXED))
+    {
+        userClient = ActiveProvider_RetainUserClient(providerVirtualizationRootHandle);
+    }
+    
+    OutstandingMessageShard& shard = GetShardForRoot(providerVirtualizationRootHandle);
+    Mutex_Acquire(shard.mutex);
     {
-        s_isShuttingDown = true;
+        SignalMessageQueueSpace_Locked(shard);
         
-        OutstandingMessage* outstandingMessage;
-        LIST_FOREACH(outstandingMessage, &s_outstandingMessages, _list_privates)
+        if (nullptr != userClient)
         {
-            wakeup(outstandingMessage);
+            TryReportDroppedNotifications_Locked(userClient, providerVirtualizationRootHandle);
         }
     }
-    Mutex_Release(s_outstandingMessagesMutex);
+    Mutex_Release(shard.mutex);
+    
+    if (nullptr != userClient)
+    {
+        ProviderUserClient_Release(userClient);
+    }
+}
+
+static void SignalMessageQueueSpace_Locked(OutstandingMessageShard& shard)
+{
+    ++shard.queueSpaceSignalCount;
+    if (shard.queueSpaceWaiterCount > 0)
+    {
+        wakeup(&shard.queueSpaceSignalCount);
+    }
+}
+
+void ProviderMessaging_GetInFlightRequestStats(VirtualizationRootHandle providerVirtualizationRootHandle, PrjFSProviderQueueStats& stats)
+{
+    OutstandingMessageShard& shard = GetShardForRoot(providerVirtualizationRootHandle);
+    Mutex_Acquire(shard.mutex);
+    {
+        stats.inFlightRequestWindow = ProviderInFlightMessageWindow;
+        stats.inFlightRequestHighWater = s_inFlightMessageHighWaterCounts[providerVirtualizationRootHandle];
+        s_inFlightMessageHighWaterCounts[providerVirtualizationRootHandle] = s_inFlightMessageCounts[providerVirtualizationRootHandle];
+    }
+    Mutex_Release(shard.mutex);
 }
@@ -2,6 +2,9 @@
 
 #include "VirtualizationRoots.hpp"
 #include "public/Message.h"
+#include "public/PrjFSProviderClientShared.h"
+
+struct PrjFSProviderQueueStats;
 
 bool ProviderMessaging_Init();
 void ProviderMessaging_AbortAllOutstandingEvents();
@@ -19,5 +22,24 @@ bool ProviderMessaging_TrySendRequestAndWaitForResponse(
     int* kauthResult,
     int* kauthError);
 
+// Queues an informational notification for the provider without waiting for it to be handled.
+// Notifications to the same root are delivered in the order they were sent.
+bool ProviderMessaging_TrySendNotification(
+    VirtualizationRootHandle root,
+    MessageType messageType,
+    const vnode_t vnode,
+    const FsidInode& vnodeFsidInode,
+    const char* vnodePath,
+    const char* fromPath,
+    int pid,
+    const char* procname);
+
 void ProviderMessaging_HandleKernelMessageResponse(VirtualizationRootHandle providerVirtualizationRootHandle, uint64_t messageId, MessageType responseType);
+// Delivers a batch of responses from the same provider, taking the locks once for the whole batch
+void ProviderMessaging_HandleKernelMessageResponses(VirtualizationRootHandle providerVirtualizationRootHandle, const ProviderResponseRingEntry* responses, uint32_t responseCount);
 void ProviderMessaging_AbortOutstandingEventsForProvider(VirtualizationRootHandle providerVirtualizationRootHandle);
+
+// Called when the provider has made room in its message queue after a message didn't fit into it
+void ProviderMessaging_MessageQueueSpaceAvailable(VirtualizationRootHandle providerVirtualizationRootHandle);
+// Fills in the in-flight request fields of stats, and restarts the high-water mark from the current count
+void ProviderMessaging_GetInFlightRequestStats(VirtualizationRootHandle providerVirtualizationRootHandle, PrjFSProviderQueueStats& stats);
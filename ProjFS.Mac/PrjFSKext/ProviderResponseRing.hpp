@@ -0,0 +1,46 @@
+#pragma once
+
+#include "public/PrjFSProviderClientShared.h"
+
+static_assert((ProviderResponseRingCapacity & (ProviderResponseRingCapacity - 1)) == 0, "Ring capacity must be a power of 2");
+
+// Number of responses copied out of the ring at a time
+static const uint32_t ProviderResponseRingDrainBatchSize = 32;
+
+// Copies up to maxCount of the responses the provider has published since readIndex out of the
+// ring and marks them consumed. The ring is mapped into the provider's address space, so each
+// entry is read exactly once, and readIndex is the kernel's own copy of the read position rather
+// than whatever is in the shared memory. Returns false if the provider's write index is implausible.
+static inline bool ProviderResponseRing_TakeResponses(
+    ProviderResponseRing* ring,
+    uint32_t& readIndex,
+    ProviderResponseRingEntry* responses,
+    uint32_t maxCount,
+    uint32_t& outCount)
+{
+    outCount = 0;
+    
+    // Pairs with the provider's release store, so the entries it wrote before are visible
+    uint32_t writeIndex = __atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE);
+    uint32_t available = writeIndex - readIndex;
+    if (available > ProviderResponseRingCapacity)
+    {
+        return false;
+    }
+    
+    uint32_t count = available < maxCount ? available : maxCount;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const ProviderResponseRingEntry& entry = ring->entries[(readIndex + i) & (ProviderResponseRingCapacity - 1)];
+        responses[i].messageId = entry.messageId;
+        responses[i].responseType = entry.responseType;
+        responses[i].reserved = 0;
+    }
+    
+    readIndex += count;
+    // The entries may be overwritten by the provider as soon as it sees the new index
+    __atomic_store_n(&ring->readIndex, readIndex, __ATOMIC_RELEASE);
+    
+    outCount = count;
+    return true;
+}
@@ -1,9 +1,11 @@
 #include <kern/debug.h>
 #include <kern/assert.h>
 #include <sys/proc.h>
+#include <IOKit/IOUserClient.h>
 
 #include "public/PrjFSCommon.h"
 #include "public/PrjFSXattrs.h"
+#include "public/PrjFSProviderQueueStats.h"
 #include "Message_Kernel.hpp"
 #include "VirtualizationRoots.hpp"
 #include "VirtualizationRootsPrivate.hpp"
@@ -28,23 +30,97 @@ static RWLock s_virtualizationRootsLock = {};
 KEXT_STATIC uint16_t s_maxVirtualizationRoots = 0;
 static const uint16_t MaxVirtualizationRootsLimit = INT16_MAX + 1u;
 KEXT_STATIC VirtualizationRoot* s_virtualizationRoots = nullptr;
+// Same length as s_virtualizationRoots, also protected by the lock
+KEXT_STATIC VirtualizationRootBucket* s_virtualizationRootBuckets = nullptr;
+
+// Mounts on which at least one root currently has an active provider, so that file operations on
+// other mounts can be dismissed without looking for their root. Written with the lock held
+// exclusively, but packedFsid is read without the lock.
+struct ProviderMount
+{
+    atomic_uint_least64_t packedFsid; // 0 if the slot is free
+    uint32_t providerCount;
+};
+static constexpr uint32_t MaxProviderMounts = 16;
+static ProviderMount s_providerMounts[MaxProviderMounts] = {};
+// Providers whose mount didn't fit into s_providerMounts. While there are any, every mount is
+// assumed to have a provider.
+static atomic_uint_least32_t s_untrackedProviderMountCount;
+
+// Source of ActiveProviderProperties::generation; protected by the lock. Deliberately not reset
+// by VirtualizationRoots_Cleanup, so generations stay unique for the lifetime of the kext.
+static uint64_t s_lastProviderGeneration = 0;
 
 static constexpr uint32_t MaxOfflineIOPIDs = 128;
 // Also protected by the lock
 static uint32_t s_offlineIOPIDCount = 0;
 static pid_t    s_offlineIOPIDs[MaxOfflineIOPIDs] = {};
 
+// Whether a process or one of its ancestors is registered for offline I/O. A pid that is reused by a
+// process with the same parent has the same ancestors, so the decision still applies. Registering or
+// unregistering an offline I/O process, which also happens when one exits, bumps the generation and so
+// invalidates every decision.
+struct OfflineIODecision
+{
+    pid_t pid;
+    pid_t parentPID;
+    uint64_t offlineIOGeneration; // 0 if the slot is unused
+    bool mayAccessOfflineRoots;
+};
+
+static constexpr uint32_t OfflineIODecisionSlotBits = 8;
+static constexpr uint32_t OfflineIODecisionSlotCount = 1u << OfflineIODecisionSlotBits;
+// Decisions and generation are protected by the spinlock, so that they can be checked without
+// taking s_virtualizationRootsLock. Generations start at 1 and aren't reset by VirtualizationRoots_Cleanup.
+static SpinLock s_offlineIODecisionsLock = {};
+static uint64_t s_offlineIOGeneration = 1;
+static OfflineIODecision s_offlineIODecisions[OfflineIODecisionSlotCount] = {};
+
 // Looks up the vnode/vid and fsid/inode pairs among the known roots
 static VirtualizationRootHandle FindRootAtVnode_Locked(vnode_t vnode, uint32_t vid, FsidInode fileId);
 
 static void RefreshRootVnodeIfNecessary_Locked(VirtualizationRootHandle rootHandle, vnode_t vnode, uint32_t vid, FsidInode fileId);
 static bool FsidsAreEqual(fsid_t a, fsid_t b);
+static uint64_t PackFsid(fsid_t fsid);
+static void AddProviderMount_ExclusiveLocked(fsid_t fsid);
+static void RemoveProviderMount_ExclusiveLocked(fsid_t fsid);
 KEXT_STATIC bool PathInsideDirectory(const char* directoryPath, const char* path);
-static void GrowVirtualizationRootArrayWithMemory_Locked(VirtualizationRoot* newMemory, uint16_t newLength);
+static void GrowVirtualizationRootArrayWithMemory_Locked(VirtualizationRoot* newMemory, VirtualizationRootBucket* newBuckets, uint16_t newLength);
+
+static uint32_t GetVnodeBucketIndex(vnode_t vnode);
+static uint32_t GetFileIdBucketIndex(FsidInode fileId);
+static uint32_t HashPathByte(uint32_t pathHash, char pathByte);
+static uint32_t HashPath(const char* path);
+static void LinkRootIntoVnodeBucket_Locked(VirtualizationRootHandle rootHandle);
+static void UnlinkRootFromVnodeBucket_Locked(VirtualizationRootHandle rootHandle);
+static void LinkRootIntoFileIdBucket_Locked(VirtualizationRootHandle rootHandle);
+static void LinkRootIntoPathBucket_Locked(VirtualizationRootHandle rootHandle);
+static void UnlinkRootFromPathBucket_Locked(VirtualizationRootHandle rootHandle);
+static void FindActiveRootInPathBucket_Locked(const char* path, uint32_t pathPrefixHash, VirtualizationRootHandle& lowestMatchingHandle);
+KEXT_STATIC void RebuildVirtualizationRootIndex_Locked();
+
+static bool TryGetParentPID(pid_t pid, pid_t& parentPID);
+static bool IsOfflineIOProcess(pid_t pid);
+static OfflineIODecision& GetOfflineIODecisionSlot_Locked(pid_t pid);
+static void InvalidateOfflineIODecisions();
+
+// A run of consecutive ancestor directories, nearest first, each holding an iocount
+struct AncestorBatch
+{
+    uint32_t count;
+    vnode_t vnodes[VirtualizationRootAncestorBatchSize];
+    uint32_t vids[VirtualizationRootAncestorBatchSize];
+    FsidInode fsidInodes[VirtualizationRootAncestorBatchSize];
+};
+
+// Looks up the batch's directories among the known roots, and detects hitherto-unknown roots below
+// the nearest known one by checking attributes.  rootLevel is the index into the batch of the root found.
+static VirtualizationRootHandle FindOrDetectRootInAncestorBatch(const AncestorBatch& batch, uint32_t& rootLevel);
+
+// Detects if there is a hitherto-unknown root at vnode by checking attributes.
+static VirtualizationRootHandle DetectRootAtVnode(vnode_t vnode, uint32_t vid, const FsidInode& vnodeFsidInode);
 
-// Looks up the vnode and fsid/inode pair among the known roots, and if not found,
-// detects if there is a hitherto-unknown root at vnode by checking attributes.
-static VirtualizationRootHandle FindOrDetectRootAtVnode(vnode_t vnode, const FsidInode& vnodeFsidInode);
+static void RecordVisitedAncestors(VirtualizationRootAncestors* _Nullable ancestors, const AncestorBatch& batch, uint32_t levelCount, vnode_t initialVnode);
 
 static VirtualizationRootHandle FindUnusedIndex_Locked();
 
@@ -52,7 +128,7 @@ KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnl
 
 ActiveProviderProperties VirtualizationRoot_GetActiveProvider(VirtualizationRootHandle rootHandle)
 {
-    ActiveProviderProperties result = { false, 0 };
+    ActiveProviderProperties result = { false, 0, 0 };
     if (rootHandle < 0)
     {
         return result;
@@ -68,6 +144,7 @@ ActiveProviderProperties VirtualizationRoot_GetActiveProvider(VirtualizationRoot
         if (result.isOnline)
         {
             result.pid = s_virtualizationRoots[rootHandle].providerPid;
+            result.generation = s_virtualizationRoots[rootHandle].providerGeneration;
         }
     }
     RWLock_ReleaseShared(s_virtualizationRootsLock);
@@ -93,10 +170,19 @@ kern_return_t VirtualizationRoots_Init()
         return KERN_FAILURE;
     }
     
+    s_offlineIODecisionsLock = SpinLock_Alloc();
+    if (!SpinLock_IsValid(s_offlineIODecisionsLock))
+    {
+        return KERN_FAILURE;
+    }
+    
+    Array_DefaultInit(s_offlineIODecisions, OfflineIODecisionSlotCount);
+    
     // Start with a small size so the resizing logic is regularly tested
     s_maxVirtualizationRoots = 4;
     s_virtualizationRoots = Memory_AllocArray<VirtualizationRoot>(s_maxVirtualizationRoots);
-    if (nullptr == s_virtualizationRoots)
+    s_virtualizationRootBuckets = Memory_AllocArray<VirtualizationRootBucket>(s_maxVirtualizationRoots);
+    if (nullptr == s_virtualizationRoots || nullptr == s_virtualizationRootBuckets)
     {
         return KERN_RESOURCE_SHORTAGE;
     }
@@ -106,6 +192,8 @@ kern_return_t VirtualizationRoots_Init()
         s_virtualizationRoots[i] = VirtualizationRoot{ };
     }
     
+    RebuildVirtualizationRootIndex_Locked();
+    
     atomic_thread_fence(memory_order_seq_cst);
     
     return KERN_SUCCESS;
@@ -123,10 +211,31 @@ kern_return_t VirtualizationRoots_Cleanup()
         
         Memory_FreeArray(s_virtualizationRoots, s_maxVirtualizationRoots);
         s_virtualizationRoots = nullptr;
-        s_maxVirtualizationRoots = 0;
     }
+    
+    if (s_virtualizationRootBuckets != nullptr)
+    {
+        Memory_FreeArray(s_virtualizationRootBuckets, s_maxVirtualizationRoots);
+        s_virtualizationRootBuckets = nullptr;
+    }
+    
+    s_maxVirtualizationRoots = 0;
 
     assert(s_offlineIOPIDCount == 0);
+    
+    // Every provider has disconnected by now, so this is just a precaution
+    for (uint32_t i = 0; i < MaxProviderMounts; ++i)
+    {
+        atomic_store_explicit(&s_providerMounts[i].packedFsid, UINT64_C(0), memory_order_relaxed);
+        s_providerMounts[i].providerCount = 0;
+    }
+    
+    atomic_store(&s_untrackedProviderMountCount, 0U);
+    
+    if (SpinLock_IsValid(s_offlineIODecisionsLock))
+    {
+        SpinLock_FreeMemory(&s_offlineIODecisionsLock);
+    }
 
     if (RWLock_IsValid(s_virtualizationRootsLock))
     {
@@ -142,13 +251,19 @@ VirtualizationRootHandle VirtualizationRoot_FindForVnode(
     PrjFSPerfCounter functionCounter,
     PrjFSPerfCounter innerLoopCounter,
     vnode_t _Nonnull initialVnode,
-    vfs_context_t _Nonnull context)
+    vfs_context_t _Nonnull context,
+    VirtualizationRootAncestors* _Nullable ancestors)
 {
     PerfSample findForVnodeSample(perfTracer, functionCounter);
     
     VirtualizationRootHandle rootHandle = RootHandle_None;
     errno_t error = 0;
     vnode_t vnode = initialVnode;
+    
+    if (nullptr != ancestors)
+    {
+        ancestors->visitedCount = 0;
+    }
 
     if (vnode_isdir(vnode))
     {
@@ -164,29 +279,69 @@ VirtualizationRootHandle VirtualizationRoot_FindForVnode(
         vnode = vnode_getparent(vnode);
     }
     
-    // Search up the tree until we hit a known virtualization root or THE root of the file system
-    while (RootHandle_None == rootHandle && NULLVP != vnode && !vnode_isvroot(vnode))
+    // Search up the tree until we hit a known virtualization root or THE root of the file system.
+    // Ancestors are collected in batches so that s_virtualizationRootsLock is only taken once per
+    // batch rather than once per level.
+    AncestorBatch batch;
+    bool searchComplete = false;
+    while (!searchComplete && NULLVP != vnode && !vnode_isvroot(vnode))
     {
-        PerfSample iterationSample(perfTracer, innerLoopCounter);
-
-        FsidInode vnodeFsidInode = Vnode_GetFsidAndInode(vnode, context, false /* Here we care about identity, not path */);
-
-        rootHandle = FindOrDetectRootAtVnode(vnode, vnodeFsidInode);
+        bool foundKnownRoot = false;
+        VirtualizationRootHandle knownRootHandle = RootHandle_None;
+        
+        batch.count = 0;
+        while (batch.count < VirtualizationRootAncestorBatchSize && NULLVP != vnode && !vnode_isvroot(vnode))
+        {
+            PerfSample iterationSample(perfTracer, innerLoopCounter);
+            
+            uint32_t vid = vnode_vid(vnode);
+            if (nullptr != ancestors &&
+                nullptr != ancestors->tryGetKnownRoot &&
+                vnode != initialVnode &&
+                ancestors->tryGetKnownRoot(vnode, vid, knownRootHandle))
+            {
+                foundKnownRoot = true;
+                break;
+            }
+            
+            batch.vnodes[batch.count] = vnode;
+            batch.vids[batch.count] = vid;
+            batch.fsidInodes[batch.count] = Vnode_GetFsidAndInode(vnode, context, false /* Here we care about identity, not path */);
+            ++batch.count;
+            
+            // The batch holds on to vnode's iocount until the batch has been resolved
+            vnode_t parent = vnode_getparent(vnode);
+            if (NULLVP == parent)
+            {
+                KextLog_FileError(vnode, "VirtualizationRoot_FindForVnode: vnode_getparent returned nullptr on vnode that is not root of a mount point");
+            }
+            vnode = parent;
+        }
         
-        // If FindOrDetectRootAtVnode returned a "special" handle other
+        uint32_t rootLevel;
+        rootHandle = FindOrDetectRootInAncestorBatch(batch, rootLevel);
+        
+        // If FindOrDetectRootInAncestorBatch returned a "special" handle other
         // than RootHandle_None, we want to stop the search and return that.
         if (rootHandle != RootHandle_None)
         {
-            break;
+            RecordVisitedAncestors(ancestors, batch, rootLevel + 1, initialVnode);
+            searchComplete = true;
+        }
+        else
+        {
+            RecordVisitedAncestors(ancestors, batch, batch.count, initialVnode);
+            if (foundKnownRoot)
+            {
+                rootHandle = knownRootHandle;
+                searchComplete = true;
+            }
         }
         
-        vnode_t parent = vnode_getparent(vnode);
-        if (NULLVP == parent)
+        for (uint32_t level = 0; level < batch.count; ++level)
         {
-            KextLog_FileError(vnode, "VirtualizationRoot_FindForVnode: vnode_getparent returned nullptr on vnode that is not root of a mount point");
+            vnode_put(batch.vnodes[level]);
         }
-        vnode_put(vnode);
-        vnode = parent;
     }
     
     if (NULLVP != vnode)
@@ -197,73 +352,116 @@ VirtualizationRootHandle VirtualizationRoot_FindForVnode(
     return rootHandle;
 }
 
-static VirtualizationRootHandle FindOrDetectRootAtVnode(vnode_t _Nonnull vnode, const FsidInode& vnodeFsidInode)
+static VirtualizationRootHandle FindOrDetectRootInAncestorBatch(const AncestorBatch& batch, uint32_t& rootLevel)
 {
-    uint32_t vid = vnode_vid(vnode);
-    
-    VirtualizationRootHandle rootIndex;
+    VirtualizationRootHandle knownRootIndex = RootHandle_None;
+    uint32_t knownRootLevel = batch.count;
     bool rootVnodeStale = false;
     
     RWLock_AcquireShared(s_virtualizationRootsLock);
     {
-        rootIndex = FindRootAtVnode_Locked(vnode, vid, vnodeFsidInode);
-        rootVnodeStale =
-            rootIndex >= 0
-            && (s_virtualizationRoots[rootIndex].rootVNode != vnode
-                || s_virtualizationRoots[rootIndex].rootVNodeVid != vid);
+        for (uint32_t level = 0; level < batch.count; ++level)
+        {
+            knownRootIndex = FindRootAtVnode_Locked(batch.vnodes[level], batch.vids[level], batch.fsidInodes[level]);
+            if (knownRootIndex != RootHandle_None)
+            {
+                knownRootLevel = level;
+                rootVnodeStale =
+                    knownRootIndex >= 0
+                    && (s_virtualizationRoots[knownRootIndex].rootVNode != batch.vnodes[level]
+                        || s_virtualizationRoots[knownRootIndex].rootVNodeVid != batch.vids[level]);
+                break;
+            }
+        }
     }
     RWLock_ReleaseShared(s_virtualizationRootsLock);
     
-    if (rootIndex == RootHandle_None)
+    // A root that is not known yet takes precedence if it is nearer than the nearest known root
+    for (uint32_t level = 0; level < knownRootLevel; ++level)
     {
-        PrjFSVirtualizationRootXAttrData rootXattr = {};
-        SizeOrError xattrResult = Vnode_ReadXattr(vnode, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr));
-        if (xattrResult.error == 0)
+        VirtualizationRootHandle detectedRootIndex = DetectRootAtVnode(batch.vnodes[level], batch.vids[level], batch.fsidInodes[level]);
+        if (detectedRootIndex != RootHandle_None)
         {
-            // TODO: check xattr contents
-            
-            const char* path = nullptr;
-#if DEBUG // Offline roots shouldn't need their path filled, and vn_getpath() may fail anyway. Poison the value so any dependency will trip over it.
-            char pathBuffer[PrjFSMaxPath + 6] = "DEBUG:";
-            int pathLength = static_cast<int>(sizeof(pathBuffer) - strlen(pathBuffer));
-            assertf(pathLength >= PATH_MAX, "Poisoning the string shouldn't make the buffer too short (vn_getpath expects PATH_MAX = %u, got %u)", PATH_MAX, pathLength);
-            errno_t error = vn_getpath(vnode, pathBuffer + strlen(pathBuffer), &pathLength);
-            if (error != 0)
-            {
-                KextLog_ErrorVnodeProperties(vnode, "FindOrDetectRootAtVnode: vn_getpath failed (error = %d)", error);
-            }
-            else
-            {
-                path = pathBuffer;
-            }
-#endif
- 
-            RWLock_AcquireExclusive(s_virtualizationRootsLock);
-            {
-                rootIndex = FindOrInsertVirtualizationRoot_LockedMayUnlock(vnode, vid, vnodeFsidInode, path);
-                
-                // TODO: error handling
-                assert(rootIndex >= 0);
-            }
-            RWLock_ReleaseExclusive(s_virtualizationRootsLock);
+            rootLevel = level;
+            return detectedRootIndex;
         }
-        else if (xattrResult.error != ENOATTR)
+    }
+    
+    if (rootVnodeStale)
+    {
+        RWLock_AcquireExclusive(s_virtualizationRootsLock);
         {
-            KextLog_FileError(vnode, "FindOrDetectRootAtVnode: Vnode_ReadXattr/mac_vnop_getxattr failed with errno %d", xattrResult.error);
+            RefreshRootVnodeIfNecessary_Locked(knownRootIndex, batch.vnodes[knownRootLevel], batch.vids[knownRootLevel], batch.fsidInodes[knownRootLevel]);
         }
+        RWLock_ReleaseExclusive(s_virtualizationRootsLock);
     }
-    else if (rootVnodeStale)
+    
+    rootLevel = knownRootLevel;
+    return knownRootIndex;
+}
+
+static VirtualizationRootHandle DetectRootAtVnode(vnode_t _Nonnull vnode, uint32_t vid, const FsidInode& vnodeFsidInode)
+{
+    VirtualizationRootHandle rootIndex = RootHandle_None;
+    
+    PrjFSVirtualizationRootXAttrData rootXattr = {};
+    SizeOrError xattrResult = Vnode_ReadXattr(vnode, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr));
+    if (xattrResult.error == 0)
     {
+        // TODO: check xattr contents
+        
+        const char* path = nullptr;
+#if DEBUG // Offline roots shouldn't need their path filled, and vn_getpath() may fail anyway. Poison the value so any dependency will trip over it.
+        char pathBuffer[PrjFSMaxPath + 6] = "DEBUG:";
+        int pathLength = static_cast<int>(sizeof(pathBuffer) - strlen(pathBuffer));
+        assertf(pathLength >= PATH_MAX, "Poisoning the string shouldn't make the buffer too short (vn_getpath expects PATH_MAX = %u, got %u)", PATH_MAX, pathLength);
+        errno_t error = vn_getpath(vnode, pathBuffer + strlen(pathBuffer), &pathLength);
+        if (error != 0)
+        {
+            KextLog_ErrorVnodeProperties(vnode, "DetectRootAtVnode: vn_getpath failed (error = %d)", error);
+        }
+        else
+        {
+            path = pathBuffer;
+        }
+#endif
+ 
         RWLock_AcquireExclusive(s_virtualizationRootsLock);
         {
-            RefreshRootVnodeIfNecessary_Locked(rootIndex, vnode, vid, vnodeFsidInode);
+            rootIndex = FindOrInsertVirtualizationRoot_LockedMayUnlock(vnode, vid, vnodeFsidInode, path);
+            
+            // TODO: error handling
+            assert(rootIndex >= 0);
         }
         RWLock_ReleaseExclusive(s_virtualizationRootsLock);
     }
+    else if (xattrResult.error != ENOATTR)
+    {
+        KextLog_FileError(vnode, "DetectRootAtVnode: Vnode_ReadXattr/mac_vnop_getxattr failed with errno %d", xattrResult.error);
+    }
     
     return rootIndex;
 }
 
+static void RecordVisitedAncestors(VirtualizationRootAncestors* _Nullable ancestors, const AncestorBatch& batch, uint32_t levelCount, vnode_t initialVnode)
+{
+    if (nullptr == ancestors)
+    {
+        return;
+    }
+    
+    for (uint32_t level = 0; level < levelCount && ancestors->visitedCount < VirtualizationRootAncestorBatchSize; ++level)
+    {
+        // The caller already knows about the vnode it asked for
+        if (batch.vnodes[level] != initialVnode)
+        {
+            ancestors->visitedVnodes[ancestors->visitedCount] = batch.vnodes[level];
+            ancestors->visitedVids[ancestors->visitedCount] = batch.vids[level];
+            ++ancestors->visitedCount;
+        }
+    }
+}
+
 static VirtualizationRootHandle FindUnusedIndex_Locked()
 {
     for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
@@ -277,16 +475,138 @@ static VirtualizationRootHandle FindUnusedIndex_Locked()
     return RootHandle_None;
 }
 
-static void GrowVirtualizationRootArrayWithMemory_Locked(VirtualizationRoot* newMemory, uint16_t newLength)
+static void GrowVirtualizationRootArrayWithMemory_Locked(VirtualizationRoot* newMemory, VirtualizationRootBucket* newBuckets, uint16_t newLength)
 {
     uint32_t oldSizeBytes = sizeof(s_virtualizationRoots[0]) * s_maxVirtualizationRoots;
     memcpy(newMemory, s_virtualizationRoots, oldSizeBytes);
     Memory_FreeArray(s_virtualizationRoots, s_maxVirtualizationRoots);
     s_virtualizationRoots = newMemory;
+    
+    Memory_FreeArray(s_virtualizationRootBuckets, s_maxVirtualizationRoots);
+    s_virtualizationRootBuckets = newBuckets;
 
     Array_DefaultInit(&s_virtualizationRoots[s_maxVirtualizationRoots], newLength - s_maxVirtualizationRoots);
 
     s_maxVirtualizationRoots = newLength;
+    
+    // The bucket count has changed, so every chain needs to be rehashed
+    RebuildVirtualizationRootIndex_Locked();
+}
+
+static uint32_t GetVnodeBucketIndex(vnode_t vnode)
+{
+    // Fibonacci hashing spreads the zone allocator's regularly spaced vnode addresses across the buckets
+    uint64_t hash = reinterpret_cast<uintptr_t>(vnode) * 11400714819323198485ull;
+    return static_cast<uint32_t>(hash >> 32) % s_maxVirtualizationRoots;
+}
+
+static uint32_t GetFileIdBucketIndex(FsidInode fileId)
+{
+    uint64_t fsid = (static_cast<uint64_t>(static_cast<uint32_t>(fileId.fsid.val[0])) << 32) | static_cast<uint32_t>(fileId.fsid.val[1]);
+    uint64_t hash = (fileId.inode ^ (fsid * 0x9e3779b97f4a7c15ull)) * 11400714819323198485ull;
+    return static_cast<uint32_t>(hash >> 32) % s_maxVirtualizationRoots;
+}
+
+// 32-bit FNV-1a, which can be computed incrementally while scanning a path for directory boundaries
+static const uint32_t PathHashInitialValue = 2166136261u;
+
+static uint32_t HashPathByte(uint32_t pathHash, char pathByte)
+{
+    return (pathHash ^ static_cast<uint8_t>(pathByte)) * 16777619u;
+}
+
+static uint32_t HashPath(const char* path)
+{
+    uint32_t pathHash = PathHashInitialValue;
+    for (const char* pathByte = path; *pathByte != '\0'; ++pathByte)
+    {
+        pathHash = HashPathByte(pathHash, *pathByte);
+    }
+    
+    return pathHash;
+}
+
+static void LinkRootIntoVnodeBucket_Locked(VirtualizationRootHandle rootHandle)
+{
+    VirtualizationRoot& root = s_virtualizationRoots[rootHandle];
+    VirtualizationRootBucket& bucket = s_virtualizationRootBuckets[GetVnodeBucketIndex(root.rootVNode)];
+    root.nextInVnodeBucket = bucket.vnodeHead;
+    bucket.vnodeHead = rootHandle;
+}
+
+static void UnlinkRootFromVnodeBucket_Locked(VirtualizationRootHandle rootHandle)
+{
+    VirtualizationRoot& root = s_virtualizationRoots[rootHandle];
+    VirtualizationRootHandle* link = &s_virtualizationRootBuckets[GetVnodeBucketIndex(root.rootVNode)].vnodeHead;
+    while (*link != RootHandle_None)
+    {
+        if (*link == rootHandle)
+        {
+            *link = root.nextInVnodeBucket;
+            return;
+        }
+        
+        link = &s_virtualizationRoots[*link].nextInVnodeBucket;
+    }
+    
+    assertf(false, "UnlinkRootFromVnodeBucket_Locked: root %d not found in its vnode bucket", rootHandle);
+}
+
+static void LinkRootIntoFileIdBucket_Locked(VirtualizationRootHandle rootHandle)
+{
+    VirtualizationRoot& root = s_virtualizationRoots[rootHandle];
+    VirtualizationRootBucket& bucket = s_virtualizationRootBuckets[GetFileIdBucketIndex(FsidInode{ root.rootFsid, root.rootInode })];
+    root.nextInFileIdBucket = bucket.fileIdHead;
+    bucket.fileIdHead = rootHandle;
+}
+
+static void LinkRootIntoPathBucket_Locked(VirtualizationRootHandle rootHandle)
+{
+    VirtualizationRoot& root = s_virtualizationRoots[rootHandle];
+    VirtualizationRootBucket& bucket = s_virtualizationRootBuckets[HashPath(root.path) % s_maxVirtualizationRoots];
+    root.nextInPathBucket = bucket.pathHead;
+    bucket.pathHead = rootHandle;
+}
+
+static void UnlinkRootFromPathBucket_Locked(VirtualizationRootHandle rootHandle)
+{
+    VirtualizationRoot& root = s_virtualizationRoots[rootHandle];
+    VirtualizationRootHandle* link = &s_virtualizationRootBuckets[HashPath(root.path) % s_maxVirtualizationRoots].pathHead;
+    while (*link != RootHandle_None)
+    {
+        if (*link == rootHandle)
+        {
+            *link = root.nextInPathBucket;
+            return;
+        }
+        
+        link = &s_virtualizationRoots[*link].nextInPathBucket;
+    }
+    
+    assertf(false, "UnlinkRootFromPathBucket_Locked: root %d (path: \"%s\") not found in its path bucket", rootHandle, root.path);
+}
+
+KEXT_STATIC void RebuildVirtualizationRootIndex_Locked()
+{
+    for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
+    {
+        s_virtualizationRootBuckets[i] = VirtualizationRootBucket{ RootHandle_None, RootHandle_None, RootHandle_None };
+    }
+    
+    for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
+    {
+        VirtualizationRoot& root = s_virtualizationRoots[i];
+        if (root.inUse)
+        {
+            LinkRootIntoVnodeBucket_Locked(i);
+            LinkRootIntoFileIdBucket_Locked(i);
+            
+            if (nullptr != root.providerUserClient)
+            {
+                LinkRootIntoPathBucket_Locked(i);
+            }
+        }
+    }
 }
 
 static bool FsidsAreEqual(fsid_t a, fsid_t b)
@@ -294,16 +614,94 @@ static bool FsidsAreEqual(fsid_t a, fsid_t b)
     return a.val[0] == b.val[0] && a.val[1] == b.val[1];
 }
 
-static VirtualizationRootHandle FindRootAtVnode_Locked(vnode_t vnode, uint32_t vid, FsidInode fileId)
+static uint64_t PackFsid(fsid_t fsid)
 {
-    for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
+    return (static_cast<uint64_t>(static_cast<uint32_t>(fsid.val[0])) << 32) | static_cast<uint32_t>(fsid.val[1]);
+}
+
+static void AddProviderMount_ExclusiveLocked(fsid_t fsid)
+{
+    uint64_t packedFsid = PackFsid(fsid);
+    ProviderMount* freeSlot = nullptr;
+    
+    // An all-zero fsid can't be told apart from a free slot, so it is always counted as untracked
+    if (packedFsid != 0)
     {
-        VirtualizationRoot& rootEntry = s_virtualizationRoots[i];
-        if (!rootEntry.inUse)
+        for (uint32_t i = 0; i < MaxProviderMounts; ++i)
         {
-            continue;
+            uint64_t slotFsid = atomic_load_explicit(&s_providerMounts[i].packedFsid, memory_order_relaxed);
+            if (slotFsid == packedFsid)
+            {
+                ++s_providerMounts[i].providerCount;
+                return;
+            }
+            else if (slotFsid == 0 && freeSlot == nullptr)
+            {
+                freeSlot = &s_providerMounts[i];
+            }
         }
-        
+    }
+    
+    if (freeSlot != nullptr)
+    {
+        freeSlot->providerCount = 1;
+        atomic_store_explicit(&freeSlot->packedFsid, packedFsid, memory_order_release);
+    }
+    else
+    {
+        atomic_fetch_add(&s_untrackedProviderMountCount, 1U);
+    }
+}
+
+static void RemoveProviderMount_ExclusiveLocked(fsid_t fsid)
+{
+    uint64_t packedFsid = PackFsid(fsid);
+    if (packedFsid != 0)
+    {
+        for (uint32_t i = 0; i < MaxProviderMounts; ++i)
+        {
+            if (atomic_load_explicit(&s_providerMounts[i].packedFsid, memory_order_relaxed) == packedFsid)
+            {
+                if (--s_providerMounts[i].providerCount == 0)
+                {
+                    atomic_store_explicit(&s_providerMounts[i].packedFsid, UINT64_C(0), memory_order_release);
+                }
+                
+                return;
+            }
+        }
+    }
+    
+    assert(atomic_load(&s_untrackedProviderMountCount) > 0);
+    atomic_fetch_sub(&s_untrackedProviderMountCount, 1U);
+}
+
+bool VirtualizationRoots_MountMayHaveActiveProvider(mount_t _Nonnull mount)
+{
+    if (atomic_load_explicit(&s_untrackedProviderMountCount, memory_order_relaxed) > 0)
+    {
+        return true;
+    }
+    
+    uint64_t packedFsid = PackFsid(vfs_statfs(mount)->f_fsid);
+    for (uint32_t i = 0; i < MaxProviderMounts; ++i)
+    {
+        if (atomic_load_explicit(&s_providerMounts[i].packedFsid, memory_order_relaxed) == packedFsid)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static VirtualizationRootHandle FindRootAtVnode_Locked(vnode_t vnode, uint32_t vid, FsidInode fileId)
+{
+    for (VirtualizationRootHandle i = s_virtualizationRootBuckets[GetVnodeBucketIndex(vnode)].vnodeHead;
+         i != RootHandle_None;
+         i = s_virtualizationRoots[i].nextInVnodeBucket)
+    {
+        VirtualizationRoot& rootEntry = s_virtualizationRoots[i];
         if (rootEntry.rootVNode == vnode && rootEntry.rootVNodeVid == vid)
         {
             assertf(
@@ -316,8 +714,13 @@ static VirtualizationRootHandle FindRootAtVnode_Locked(vnode_t vnode, uint32_t v
         {
             assert(rootEntry.providerUserClient == nullptr);
         }
-        
-        
+    }
+    
+    for (VirtualizationRootHandle i = s_virtualizationRootBuckets[GetFileIdBucketIndex(fileId)].fileIdHead;
+         i != RootHandle_None;
+         i = s_virtualizationRoots[i].nextInFileIdBucket)
+    {
+        VirtualizationRoot& rootEntry = s_virtualizationRoots[i];
         if (FsidsAreEqual(rootEntry.rootFsid, fileId.fsid) && rootEntry.rootInode == fileId.inode)
         {
             assertf(rootEntry.providerUserClient == nullptr, "Finding root vnode based on FSID/inode equality but not vnode identity (recycled vnode) should only happen if no provider is active. Root index %d, provider PID %d, IOUC %p path '%s'",
@@ -355,8 +758,10 @@ static void RefreshRootVnodeIfNecessary_Locked(VirtualizationRootHandle rootHand
         rootHandle, rootEntry.path, rootEntry.rootFsid.val[0], rootEntry.rootFsid.val[1], rootEntry.rootInode, KextLog_Unslide(rootEntry.rootVNode), rootEntry.rootVNodeVid, KextLog_Unslide(vnode), vid);
     KextLog_File(vnode, "RefreshRootVnodeIfNecessary_Locked: virtualization root %d (path: \"%s\", fsid: 0x%x:%x, inode: 0x%llx) directory vnode %p:%u has gone stale, refreshing with new vnode %p:%u",
         rootHandle, rootEntry.path, rootEntry.rootFsid.val[0], rootEntry.rootFsid.val[1], rootEntry.rootInode, KextLog_Unslide(rootEntry.rootVNode), rootEntry.rootVNodeVid, KextLog_Unslide(vnode), vid);
+    UnlinkRootFromVnodeBucket_Locked(rootHandle);
     rootEntry.rootVNode = vnode;
     rootEntry.rootVNodeVid = vid;
+    LinkRootIntoVnodeBucket_Locked(rootHandle);
 }
 
 KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnlock(vnode_t virtualizationRootVNode, uint32_t rootVid, FsidInode persistentIds, const char* path)
@@ -390,10 +795,21 @@ KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnl
             // Must drop lock to safely allocate memory with blocking alloc
             RWLock_ReleaseExclusive(s_virtualizationRootsLock);
             VirtualizationRoot* grownArray = Memory_AllocArray<VirtualizationRoot>(newLength);
+            VirtualizationRootBucket* grownBuckets = Memory_AllocArray<VirtualizationRootBucket>(newLength);
             RWLock_AcquireExclusive(s_virtualizationRootsLock);
             
-            if (grownArray == nullptr)
+            if (grownArray == nullptr || grownBuckets == nullptr)
             {
+                if (grownArray != nullptr)
+                {
+                    Memory_FreeArray(grownArray, newLength);
+                }
+                
+                if (grownBuckets != nullptr)
+                {
+                    Memory_FreeArray(grownBuckets, newLength);
+                }
+                
                 // Allocation failed; recheck for space since relocking, and if that fails, give up.
                 allocFailed = true;
                 continue;
@@ -405,10 +821,11 @@ KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnl
                 KextLog_Info("FindOrInsertVirtualizationRoot_LockedMayUnlock: Beaten to the resize (newLength = %u, newLengthAgain = %u) by another thread, starting over.", newLength, newLengthAgain);
                 // another thread already resized, start over.
                 Memory_FreeArray(grownArray, newLength);
+                Memory_FreeArray(grownBuckets, newLength);
                 continue;
             }
             
-            GrowVirtualizationRootArrayWithMemory_Locked(grownArray, newLength);
+            GrowVirtualizationRootArrayWithMemory_Locked(grownArray, grownBuckets, newLength);
         }
     } while (rootIndex < 0);
 
@@ -427,6 +844,9 @@ KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnl
     {
         strlcpy(root->path, path, sizeof(root->path));
     }
+    
+    LinkRootIntoVnodeBucket_Locked(rootIndex);
+    LinkRootIntoFileIdBucket_Locked(rootIndex);
 
     KextLog_File(virtualizationRootVNode, "FindOrInsertVirtualizationRoot_LockedMayUnlock: virtualization root inserted at index %d: (path: \"%s\", fsid: 0x%x:%x, inode: 0x%llx) directory vnode %p:%u.",
             rootIndex, path, persistentIds.fsid.val[0], persistentIds.fsid.val[1], persistentIds.inode, KextLog_Unslide(virtualizationRootVNode), rootVid);
@@ -498,7 +918,10 @@ VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProvide
                         {
                             root.providerUserClient = userClient;
                             root.providerPid = clientPID;
+                            root.providerGeneration = ++s_lastProviderGeneration;
                             strlcpy(root.path, virtualizationRootCanonicalPath, sizeof(root.path));
+                            LinkRootIntoPathBucket_Locked(rootIndex);
+                            AddProviderMount_ExclusiveLocked(root.rootFsid);
                             KextLog_File(virtualizationRootVNode, "VirtualizationRoot_RegisterProviderForPath: registered provider (PID %d, IOUC %p) for virtualization root %d: (path: \"%s\", fsid: 0x%x:%x, inode: 0x%llx) directory vnode %p:%u.",
                                 clientPID, KextLog_Unslide(userClient), rootIndex, root.path, root.rootFsid.val[0], root.rootFsid.val[1], root.rootInode, KextLog_Unslide(virtualizationRootVNode), rootVid);
 
@@ -523,11 +946,6 @@ VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProvide
         }
     }
     
-    if (VirtualizationRoot_IsValidRootHandle(rootIndex))
-    {
-        vfs_setauthcache_ttl(vnode_mount(virtualizationRootVNode), 0);
-    }
-
     if (NULLVP != virtualizationRootVNode)
     {
         vnode_put(virtualizationRootVNode);
@@ -558,7 +976,10 @@ void ActiveProvider_Disconnect(VirtualizationRootHandle rootIndex, PrjFSProvider
         
         vnode_put(root->rootVNode);
         root->providerPid = 0;
+        root->providerGeneration = 0;
         
+        UnlinkRootFromPathBucket_Locked(rootIndex);
+        RemoveProviderMount_ExclusiveLocked(root->rootFsid);
         root->providerUserClient = nullptr;
 
         RWLock_DropExclusiveToShared(s_virtualizationRootsLock);
@@ -569,6 +990,21 @@ void ActiveProvider_Disconnect(VirtualizationRootHandle rootIndex, PrjFSProvider
 }
 
 errno_t ActiveProvider_SendMessage(VirtualizationRootHandle rootIndex, const Message& message)
+{
+    PrjFSProviderUserClient* userClient = ActiveProvider_RetainUserClient(rootIndex);
+    if (nullptr != userClient)
+    {
+        bool enqueued = ProviderUserClient_SendMessage(userClient, message);
+        ProviderUserClient_Release(userClient);
+        return enqueued ? 0 : ENOBUFS;
+    }
+    else
+    {
+        return EIO;
+    }
+}
+
+PrjFSProviderUserClient* ActiveProvider_RetainUserClient(VirtualizationRootHandle rootIndex)
 {
     assert(rootIndex >= 0);
 
@@ -586,21 +1022,72 @@ errno_t ActiveProvider_SendMessage(VirtualizationRootHandle rootIndex, const Mes
     }
     RWLock_ReleaseShared(s_virtualizationRootsLock);
     
-    if (nullptr != userClient)
+    return userClient;
+}
+
+IOReturn ActiveProvider_ExportMessageQueueStats(IOExternalMethodArguments* _Nonnull arguments)
+{
+    PrjFSProviderQueueStatsReport report = {};
+    PrjFSProviderUserClient* userClients[PrjFSProviderQueueStatsMaxProviders] = {};
+    
+    RWLock_AcquireShared(s_virtualizationRootsLock);
+    {
+        for (VirtualizationRootHandle rootIndex = 0; rootIndex < s_maxVirtualizationRoots && report.providerCount < PrjFSProviderQueueStatsMaxProviders; ++rootIndex)
+        {
+            VirtualizationRoot& root = s_virtualizationRoots[rootIndex];
+            if (nullptr != root.providerUserClient)
+            {
+                PrjFSProviderQueueStats& stats = report.providers[report.providerCount];
+                stats.rootHandle = rootIndex;
+                stats.providerPid = root.providerPid;
+                
+                userClients[report.providerCount] = root.providerUserClient;
+                ProviderUserClient_Retain(root.providerUserClient);
+                ++report.providerCount;
+            }
+        }
+    }
+    RWLock_ReleaseShared(s_virtualizationRootsLock);
+    
+    // The user client's queue lock is also held while disconnecting, which takes the roots lock
+    for (uint32_t i = 0; i < report.providerCount; ++i)
+    {
+        ProviderUserClient_GetMessageQueueStats(userClients[i], report.providers[i]);
+        ProviderUserClient_Release(userClients[i]);
+        ProviderMessaging_GetInFlightRequestStats(report.providers[i].rootHandle, report.providers[i]);
+    }
+    
+    // The buffer will come in either as a memory descriptor or direct pointer, depending on size
+    if (nullptr != arguments->structureOutputDescriptor)
     {
-        uint32_t messageSize = Message_EncodedSize(message.messageHeader);
-        uint8_t messageMemory[messageSize];
-        uint32_t bytesUsed OS_UNUSED = Message_Encode(messageMemory, messageSize, message);
-        assertf(bytesUsed == messageSize, "bytes used by Message_Encode (%u) should match Message_EncodedSize's prediction (%u)", bytesUsed, messageSize);
+        IOMemoryDescriptor* structureOutput = arguments->structureOutputDescriptor;
+        if (sizeof(report) != structureOutput->getLength())
+        {
+            KextLog(
+                "ActiveProvider_ExportMessageQueueStats: structure output descriptor size %llu, expected %lu\n",
+                static_cast<unsigned long long>(structureOutput->getLength()),
+                sizeof(report));
+            return kIOReturnBadArgument;
+        }
+
+        IOReturn result = structureOutput->prepare(kIODirectionIn);
+        if (kIOReturnSuccess == result)
+        {
+            structureOutput->writeBytes(0 /* offset */, &report, sizeof(report));
+            structureOutput->complete(kIODirectionIn);
+        }
         
-        ProviderUserClient_SendMessage(userClient, messageMemory, messageSize);
-        ProviderUserClient_Release(userClient);
-        return 0;
+        return result;
     }
-    else
+
+    if (arguments->structureOutput == nullptr || arguments->structureOutputSize != sizeof(report))
     {
-        return EIO;
+        KextLog("ActiveProvider_ExportMessageQueueStats: structure output size %u, expected %lu\n", arguments->structureOutputSize, sizeof(report));
+        return kIOReturnBadArgument;
     }
+
+    memcpy(arguments->structureOutput, &report, sizeof(report));
+    return kIOReturnSuccess;
 }
 
 bool VirtualizationRoot_VnodeIsOnAllowedFilesystem(vnode_t vnode)
@@ -644,14 +1131,28 @@ VirtualizationRootHandle ActiveProvider_FindForPath(const char* _Nonnull path)
     
     RWLock_AcquireShared(s_virtualizationRootsLock);
     {
-        for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
+        // Rather than testing every root's path for being a prefix of path, look up each prefix of path
+        // that ends at a directory boundary, which are the only ones PathInsideDirectory can match.
+        uint32_t pathHash = PathHashInitialValue;
+        for (size_t length = 0; ; ++length)
         {
-            VirtualizationRoot& root = s_virtualizationRoots[i];
-            if (root.inUse && root.providerUserClient != nullptr && PathInsideDirectory(root.path, path))
+            char pathByte = path[length];
+            if (pathByte == '/' || pathByte == '\0')
+            {
+                FindActiveRootInPathBucket_Locked(path, pathHash, matchingHandle);
+            }
+            
+            if (pathByte == '\0')
             {
-                matchingHandle = i;
                 break;
             }
+            
+            pathHash = HashPathByte(pathHash, pathByte);
+            if (pathByte == '/')
+            {
+                // Directory paths may themselves end in a "/"
+                FindActiveRootInPathBucket_Locked(path, pathHash, matchingHandle);
+            }
         }
     }
     RWLock_ReleaseShared(s_virtualizationRootsLock);
@@ -659,48 +1160,149 @@ VirtualizationRootHandle ActiveProvider_FindForPath(const char* _Nonnull path)
     return matchingHandle;
 }
 
+static void FindActiveRootInPathBucket_Locked(const char* path, uint32_t pathPrefixHash, VirtualizationRootHandle& lowestMatchingHandle)
+{
+    for (VirtualizationRootHandle i = s_virtualizationRootBuckets[pathPrefixHash % s_maxVirtualizationRoots].pathHead;
+         i != RootHandle_None;
+         i = s_virtualizationRoots[i].nextInPathBucket)
+    {
+        VirtualizationRoot& root = s_virtualizationRoots[i];
+        // If roots are nested, the one with the lowest index wins, as it did when every root was scanned in order
+        if (root.providerUserClient != nullptr
+            && (lowestMatchingHandle == RootHandle_None || i < lowestMatchingHandle)
+            && PathInsideDirectory(root.path, path))
+        {
+            lowestMatchingHandle = i;
+        }
+    }
+}
+
 /// Tests whether pid or its parent, grandparent, etc. process is registered for offline I/O
 bool VirtualizationRoots_ProcessMayAccessOfflineRoots(pid_t pid)
 {
     bool result = false;
+    pid_t parentPID = 0;
+    bool parentKnown = TryGetParentPID(pid, parentPID);
+    // Processes that have exited can't be told apart from a later process reusing the pid
+    bool decisionIsCacheable = parentKnown;
+    uint64_t offlineIOGeneration = 0;
+    bool foundDecision = false;
     
-    RWLock_AcquireShared(s_virtualizationRootsLock);
+    if (parentKnown)
     {
-        while (true)
+        SpinLock_Acquire(s_offlineIODecisionsLock);
         {
-            for (uint32_t i = 0; i < s_offlineIOPIDCount; ++i)
-            {
-                if (s_offlineIOPIDs[i] == pid)
-                {
-                    result = true;
-                    goto done;
-                }
-            }
+            offlineIOGeneration = s_offlineIOGeneration;
+            const OfflineIODecision& decision = GetOfflineIODecisionSlot_Locked(pid);
+            foundDecision =
+                decision.offlineIOGeneration == offlineIOGeneration
+                && decision.pid == pid
+                && decision.parentPID == parentPID;
+            result = foundDecision && decision.mayAccessOfflineRoots;
+        }
+        SpinLock_Release(s_offlineIODecisionsLock);
+        
+        if (foundDecision)
+        {
+            return result;
+        }
+    }
+    
+    // Walk up the process hierarchy. Processes are looked up without holding the roots lock.
+    pid_t ancestorPID = pid;
+    pid_t ancestorParentPID = parentPID;
+    while (true)
+    {
+        if (IsOfflineIOProcess(ancestorPID))
+        {
+            result = true;
+            break;
+        }
+        
+        if (ancestorPID != pid)
+        {
+            parentKnown = TryGetParentPID(ancestorPID, ancestorParentPID);
+        }
+        
+        if (!parentKnown)
+        {
+            // Process exited since last proc_ppid call.
+            decisionIsCacheable = false;
+            break;
+        }
+        
+        ancestorPID = ancestorParentPID;
+        
+        // Stop when we hit the launchd root process
+        if (ancestorPID <= 1)
+        {
+            break;
+        }
+    }
+    
+    if (decisionIsCacheable)
+    {
+        // If offline I/O registrations changed during the walk, the generation won't match any more
+        SpinLock_Acquire(s_offlineIODecisionsLock);
+        {
+            GetOfflineIODecisionSlot_Locked(pid) = OfflineIODecision{ pid, parentPID, offlineIOGeneration, result };
+        }
+        SpinLock_Release(s_offlineIODecisionsLock);
+    }
 
-            // Walk up the process hierarchy
-            proc_t process = proc_find(pid);
-            if (process == nullptr)
-            {
-                // Process exited since last proc_ppid call.
-                break;
-            }
-            
-            pid = proc_ppid(process);
-            proc_rele(process);
-            
-            // Stop when we hit the launchd root process
-            if (pid <= 1)
+    return result;
+}
+
+static bool TryGetParentPID(pid_t pid, pid_t& parentPID)
+{
+    // Offline I/O is nearly always checked on behalf of the current process, which needs no lookup by pid
+    proc_t process = (pid == proc_selfpid()) ? proc_self() : proc_find(pid);
+    if (process == nullptr)
+    {
+        return false;
+    }
+    
+    parentPID = proc_ppid(process);
+    proc_rele(process);
+    return true;
+}
+
+static bool IsOfflineIOProcess(pid_t pid)
+{
+    bool result = false;
+    
+    RWLock_AcquireShared(s_virtualizationRootsLock);
+    {
+        for (uint32_t i = 0; i < s_offlineIOPIDCount; ++i)
+        {
+            if (s_offlineIOPIDs[i] == pid)
             {
+                result = true;
                 break;
             }
         }
-        done: {}
     }
     RWLock_ReleaseShared(s_virtualizationRootsLock);
-
+    
     return result;
 }
 
+static OfflineIODecision& GetOfflineIODecisionSlot_Locked(pid_t pid)
+{
+    // Fibonacci hashing, as pids are handed out sequentially
+    uint32_t slot = (static_cast<uint32_t>(pid) * UINT32_C(2654435769)) >> (32 - OfflineIODecisionSlotBits);
+    return s_offlineIODecisions[slot];
+}
+
+static void InvalidateOfflineIODecisions()
+{
+    SpinLock_Acquire(s_offlineIODecisionsLock);
+    {
+        ++s_offlineIOGeneration;
+    }
+    SpinLock_Release(s_offlineIODecisionsLock);
+}
+
 bool VirtualizationRoots_AddOfflineIOProcess(pid_t pid)
 {
     bool success = false;
@@ -716,6 +1318,11 @@ bool VirtualizationRoots_AddOfflineIOProcess(pid_t pid)
     }
     RWLock_ReleaseExclusive(s_virtualizationRootsLock);
     
+    if (success)
+    {
+        InvalidateOfflineIODecisions();
+    }
+    
     return success;
 }
 
@@ -745,5 +1352,8 @@ void VirtualizationRoots_RemoveOfflineIOProcess(pid_t pid)
     }
     RWLock_ReleaseExclusive(s_virtualizationRootsLock);
     
+    // Processes' offline I/O registrations are removed when they exit
+    InvalidateOfflineIODecisions();
+    
     assert(removed);
 }
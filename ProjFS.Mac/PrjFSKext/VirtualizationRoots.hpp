@@ -20,6 +20,26 @@ enum VirtualizationRootSpecialHandle : VirtualizationRootHandle
     RootHandle_ProviderTemporaryDirectory = -3,
 };
 
+// Number of ancestor directories that VirtualizationRoot_FindForVnode resolves against the known roots
+// per acquisition of the roots lock, which is also the number of ancestors it reports back
+static const uint32_t VirtualizationRootAncestorBatchSize = 16;
+
+// Optional in/out parameter of VirtualizationRoot_FindForVnode, which allows the caller to cut the
+// search short at ancestors whose root it already knows, and to learn the roots of the ancestors
+// that had to be visited.
+struct VirtualizationRootAncestors
+{
+    // In: if set, this is called for every ancestor directory before it is checked for being a root.
+    // Returning true ends the search with rootHandle as the result.
+    bool (* _Nullable tryGetKnownRoot)(vnode_t _Nonnull directoryVnode, uint32_t vid, VirtualizationRootHandle& rootHandle);
+    
+    // Out: the nearest visitedCount ancestor directories that were visited on the way up, all of which
+    // have the root that VirtualizationRoot_FindForVnode returned.  The vnodes are not retained.
+    uint32_t visitedCount;
+    vnode_t _Nullable visitedVnodes[VirtualizationRootAncestorBatchSize];
+    uint32_t visitedVids[VirtualizationRootAncestorBatchSize];
+};
+
 kern_return_t VirtualizationRoots_Init(void);
 kern_return_t VirtualizationRoots_Cleanup(void);
 
@@ -28,7 +48,8 @@ VirtualizationRootHandle VirtualizationRoot_FindForVnode(
     PrjFSPerfCounter functionCounter,
     PrjFSPerfCounter innerLoopCounter,
     vnode_t _Nonnull vnode,
-    vfs_context_t _Nonnull context);
+    vfs_context_t _Nonnull context,
+    VirtualizationRootAncestors* _Nullable ancestors = nullptr);
 
 VirtualizationRootHandle ActiveProvider_FindForPath(
     const char* _Nonnull path);
@@ -37,6 +58,9 @@ struct ActiveProviderProperties
 {
     bool isOnline;
     pid_t pid;
+    // Never reused, even across roots, so state kept on behalf of a provider can be tagged with it
+    // and ignored once that provider has gone. 0 if offline.
+    uint64_t generation;
 };
 
 struct VirtualizationRootResult
@@ -49,8 +73,16 @@ void ActiveProvider_Disconnect(VirtualizationRootHandle rootHandle, PrjFSProvide
 
 struct Message;
 errno_t ActiveProvider_SendMessage(VirtualizationRootHandle rootHandle, const Message& message);
+// Returns the root's provider user client with a reference held, to be dropped with ProviderUserClient_Release,
+// or nullptr if the root has no provider.
+PrjFSProviderUserClient* _Nullable ActiveProvider_RetainUserClient(VirtualizationRootHandle rootHandle);
+// Reports the message queue statistics of the active providers to the log user client
+struct IOExternalMethodArguments;
+IOReturn ActiveProvider_ExportMessageQueueStats(IOExternalMethodArguments* _Nonnull arguments);
 bool VirtualizationRoot_VnodeIsOnAllowedFilesystem(vnode_t _Nonnull vnode);
 bool VirtualizationRoot_IsValidRootHandle(VirtualizationRootHandle rootHandle);
+// False only if no root on the mount has an active provider right now; does not take the roots lock
+bool VirtualizationRoots_MountMayHaveActiveProvider(mount_t _Nonnull mount);
 ActiveProviderProperties VirtualizationRoot_GetActiveProvider(VirtualizationRootHandle rootHandle);
 bool VirtualizationRoots_ProcessMayAccessOfflineRoots(pid_t pid);
 bool VirtualizationRoots_AddOfflineIOProcess(pid_t pid);
@@ -6,6 +6,8 @@ struct VirtualizationRoot
     // If this is a nullptr, there is no active provider for this virtualization root (offline root)
     PrjFSProviderUserClient*    providerUserClient;
     pid_t                       providerPid;
+    // Unique to each provider connection, see ActiveProviderProperties
+    uint64_t                    providerGeneration;
     // For an active root, this is retained (vnode_get), for an offline one, it is not, so it may be stale (check the vid)
     vnode_t                     rootVNode;
     uint32_t                    rootVNodeVid;
@@ -15,10 +17,26 @@ struct VirtualizationRoot
     fsid_t                      rootFsid;
     uint64_t                    rootInode;
     
+    // Next root in the same s_virtualizationRootBuckets chain, or RootHandle_None. Every root in
+    // use is on a vnode and a fsid/inode chain; only online roots are on a path chain.
+    VirtualizationRootHandle    nextInVnodeBucket;
+    VirtualizationRootHandle    nextInFileIdBucket;
+    VirtualizationRootHandle    nextInPathBucket;
+    
     // Only contains a valid path for online roots (active provider)
     char                        path[PrjFSMaxPath];
 };
 
+// Heads of the hash chains which index s_virtualizationRoots by root vnode, by fsid/inode, and
+// by path. There is one bucket per element of s_virtualizationRoots, so the index is resized
+// along with that array.
+struct VirtualizationRootBucket
+{
+    VirtualizationRootHandle    vnodeHead;
+    VirtualizationRootHandle    fileIdHead;
+    VirtualizationRootHandle    pathHead;
+};
+
 #if defined(KEXT_UNIT_TESTING) && !defined(TESTABLE_KEXT_TARGET) // Building unit tests
 #include <type_traits>
 static_assert(std::is_trivially_copyable<VirtualizationRoot>::value, "The array of VirtualizationRoot objects is resized using memcpy");
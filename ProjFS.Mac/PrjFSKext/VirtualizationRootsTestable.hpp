@@ -9,7 +9,9 @@
 
 extern uint16_t s_maxVirtualizationRoots;
 extern VirtualizationRoot* s_virtualizationRoots;
+extern VirtualizationRootBucket* s_virtualizationRootBuckets;
 
 KEXT_STATIC VirtualizationRootHandle FindOrInsertVirtualizationRoot_LockedMayUnlock(vnode_t virtualizationRootVNode, uint32_t rootVid, FsidInode persistentIds, const char* path);
 KEXT_STATIC bool PathInsideDirectory(const char* directoryPath, const char* path);
+KEXT_STATIC void RebuildVirtualizationRootIndex_Locked();
 
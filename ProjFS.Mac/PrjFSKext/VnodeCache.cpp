@@ -1,4 +1,5 @@
 #include <string.h>
+#include <mach/mach_time.h>
 #include <IOKit/IOUserClient.h>
 #include "Locks.hpp"
 #include "VnodeCache.hpp"
@@ -13,9 +14,18 @@
 #include "VnodeCacheTestable.hpp"
 #endif
 
-KEXT_STATIC_INLINE void InvalidateCache_ExclusiveLocked();
+KEXT_STATIC_INLINE void InvalidateShard_ExclusiveLocked(uint32_t shardIndex);
+KEXT_STATIC_INLINE uint32_t BeginEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard);
+KEXT_STATIC_INLINE void EndEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard, uint32_t sequence);
 KEXT_STATIC_INLINE uintptr_t ComputeVnodeHashIndex(vnode_t _Nonnull vnode);
 KEXT_STATIC_INLINE uint32_t ComputePow2CacheCapacity(int expectedVnodeCount);
+KEXT_STATIC_INLINE uint32_t ComputePow2ShardCount(uint32_t requestedShardCount);
+KEXT_STATIC_INLINE VnodeCacheShard& GetShardForIndex(uintptr_t vnodeIndex);
+KEXT_STATIC_INLINE uintptr_t AdvanceIndexInShard(uintptr_t vnodeIndex, uintptr_t distance);
+KEXT_STATIC_INLINE uint32_t GetRootGenerationSlot(VirtualizationRootHandle rootHandle);
+KEXT_STATIC_INLINE uint8_t LoadRootGeneration(VirtualizationRootHandle rootHandle);
+KEXT_STATIC_INLINE void SnapshotRootGenerations(uint8_t* _Nonnull rootGenerations);
+KEXT_STATIC_INLINE void WriteHealthData(IOExternalMethodArguments* _Nonnull arguments, uint32_t offset, const void* _Nonnull data, uint32_t size);
 
 KEXT_STATIC bool TryGetVnodeRootFromCache(
     vnode_t _Nonnull vnode,
@@ -24,6 +34,21 @@ KEXT_STATIC bool TryGetVnodeRootFromCache(
     /* out parameters */
     VirtualizationRootHandle& rootHandle);
 
+KEXT_STATIC bool TryGetVnodeRootFromCache_LockFree(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    bool& rootFound,
+    VirtualizationRootHandle& rootHandle);
+
+KEXT_STATIC bool TryGetVnodeRootFromCache_Locked(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle);
+
 KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
     PerfTracer* _Nonnull perfTracer,
     PrjFSPerfCounter cacheMissFallbackFunctionCounter,
@@ -36,11 +61,11 @@ KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
     /* out parameters */
     VirtualizationRootHandle& rootHandle);
 
-KEXT_STATIC void InsertEntryToInvalidatedCache_ExclusiveLocked(
-    vnode_t _Nonnull vnode,
-    uintptr_t vnodeHashIndex,
-    uint32_t vnodeVid,
-    VirtualizationRootHandle rootHandle);
+KEXT_STATIC bool TryGetAncestorRootFromCache(
+    vnode_t _Nonnull directoryVnode,
+    uint32_t vid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle);
 
 KEXT_STATIC bool TryFindVnodeIndex_Locked(
     vnode_t _Nonnull vnode,
@@ -48,51 +73,103 @@ KEXT_STATIC bool TryFindVnodeIndex_Locked(
     /* out parameters */
     uintptr_t& vnodeIndex);
 
-KEXT_STATIC bool TryInsertOrUpdateEntry_ExclusiveLocked(
+KEXT_STATIC uint32_t InsertOrUpdateEntry_ExclusiveLocked(
     vnode_t _Nonnull vnode,
     uintptr_t vnodeHashIndex,
     uint32_t vnodeVid,
     bool forceRefreshEntry,
-    VirtualizationRootHandle rootHandle);
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration);
+
+KEXT_STATIC bool ProbeWindowHasEmptySlot_Locked(uintptr_t vnodeHashIndex);
+KEXT_STATIC void EvictEntryFromProbeWindow_ExclusiveLocked(uintptr_t vnodeHashIndex);
+KEXT_STATIC void RemoveEntry_ExclusiveLocked(uintptr_t vnodeIndex);
+KEXT_STATIC_INLINE uintptr_t ComputeProbeDistance(vnode_t _Nonnull entryVnode, uintptr_t entryIndex);
+KEXT_STATIC_INLINE void MarkEntryReferenced(uintptr_t vnodeIndex);
+
+KEXT_STATIC_INLINE void WriteEntry_ExclusiveLocked(
+    uintptr_t vnodeIndex,
+    vnode_t _Nullable vnode,
+    uint32_t vnodeVid,
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration);
 
+KEXT_STATIC_INLINE uint32_t ComputeProbeLengthHistogramBucket(uint64_t probeLength);
+KEXT_STATIC_INLINE uint64_t SampleLookupStats();
+KEXT_STATIC_INLINE void RecordLookup(VnodeCacheShard& shard, uint64_t probeLength);
 KEXT_STATIC_INLINE void InitCacheStats();
-KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat healthStat, uint64_t value);
+KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheShard& shard, VnodeCacheHealthStat healthStat, uint64_t value);
 
 KEXT_STATIC uint32_t s_entriesCapacity;
 KEXT_STATIC VnodeCacheEntry* s_entries;
 
-// s_entriesCapacity will always be a power of 2, and so we can compute the modulo
-// using (value & s_ModBitmask) rather than (value % s_entriesCapacity);
-KEXT_STATIC uintptr_t s_ModBitmask;
+// CLOCK reference bits, parallel to s_entries. Set on cache hits, cleared as the eviction hand passes.
+KEXT_STATIC uint8_t* s_entriesReferenced;
 
-KEXT_STATIC VnodeCacheStats s_cacheStats;
+// log2(s_entriesCapacity), ComputeVnodeHashIndex uses the top s_hashBits bits of its product as the index
+KEXT_STATIC uint32_t s_hashBits;
 
-static RWLock s_entriesLock;
+// Each shard owns (1 << s_shardIndexBits) consecutive entries. As that is a power of 2, the index of
+// an entry within its shard is (index & s_shardModBitmask), and its shard is (index >> s_shardIndexBits).
+KEXT_STATIC uint32_t s_shardIndexBits;
+KEXT_STATIC uintptr_t s_shardModBitmask;
 
-kern_return_t VnodeCache_Init()
+KEXT_STATIC uint32_t s_shardCount;
+KEXT_STATIC VnodeCacheShard s_shards[PrjFSVnodeCacheMaxShards];
+
+// Generation counters for the roots that entries map to, indexed by GetRootGenerationSlot.  Incrementing
+// a root's generation invalidates all of its entries at once; they are discarded lazily as lookups come
+// across them.
+KEXT_STATIC _Atomic(uint8_t) s_rootGenerations[VnodeCacheRootGenerationSlots];
+
+// VnodeCacheLookupStatsSampleInterval, except in unit tests that need exact counts
+KEXT_STATIC uint32_t s_lookupStatsSampleInterval = VnodeCacheLookupStatsSampleInterval;
+
+kern_return_t VnodeCache_Init(uint32_t shardCount)
 {
-    if (RWLock_IsValid(s_entriesLock))
+    if (RWLock_IsValid(s_shards[0].entriesLock))
     {
         return KERN_FAILURE;
     }
     
-    s_entriesLock = RWLock_Alloc();
-    if (!RWLock_IsValid(s_entriesLock))
+    s_shardCount = ComputePow2ShardCount(shardCount);
+    for (uint32_t shardIndex = 0; shardIndex < s_shardCount; ++shardIndex)
     {
-        return KERN_FAILURE;
+        // VnodeCache_Cleanup will free any locks that were allocated
+        s_shards[shardIndex].entriesLock = RWLock_Alloc();
+        if (!RWLock_IsValid(s_shards[shardIndex].entriesLock))
+        {
+            return KERN_FAILURE;
+        }
+        
+        s_shards[shardIndex].clockHand = 0;
+        atomic_store_explicit(&s_shards[shardIndex].entriesSequence, 0U, memory_order_relaxed);
+    }
+    
+    for (uint32_t i = 0; i < VnodeCacheRootGenerationSlots; ++i)
+    {
+        atomic_store_explicit(&s_rootGenerations[i], static_cast<uint8_t>(0), memory_order_relaxed);
     }
 
     s_entriesCapacity = ComputePow2CacheCapacity(desiredvnodes);
-    s_ModBitmask = s_entriesCapacity - 1;
+    s_hashBits = __builtin_ctz(s_entriesCapacity);
+    s_shardIndexBits = s_hashBits - __builtin_ctz(s_shardCount);
+    s_shardModBitmask = (1U << s_shardIndexBits) - 1;
     
     s_entries = Memory_AllocArray<VnodeCacheEntry>(s_entriesCapacity);
-    if (nullptr == s_entries)
+    s_entriesReferenced = Memory_AllocArray<uint8_t>(s_entriesCapacity);
+    if (nullptr == s_entries || nullptr == s_entriesReferenced)
     {
-        s_entriesCapacity = 0;
+        // VnodeCache_Cleanup will free whichever allocation succeeded
         return KERN_RESOURCE_SHORTAGE;
     }
     
+    // The cache is large enough that OSMalloc hands out whole pages, and so every cache line holds
+    // VnodeCacheEntriesPerCacheLine complete entries
+    assert(0 == (reinterpret_cast<uintptr_t>(s_entries) % VnodeCacheLineSize));
+    
     memset(s_entries, 0, s_entriesCapacity * sizeof(VnodeCacheEntry));
+    memset(s_entriesReferenced, 0, s_entriesCapacity);
     
     InitCacheStats();
     
@@ -107,16 +184,27 @@ kern_return_t VnodeCache_Cleanup()
     {
         Memory_FreeArray<VnodeCacheEntry>(s_entries, s_entriesCapacity);
         s_entries = nullptr;
-        s_entriesCapacity = 0;
     }
     
-    if (RWLock_IsValid(s_entriesLock))
+    if (nullptr != s_entriesReferenced)
+    {
+        Memory_FreeArray<uint8_t>(s_entriesReferenced, s_entriesCapacity);
+        s_entriesReferenced = nullptr;
+    }
+    
+    s_entriesCapacity = 0;
+    
+    kern_return_t result = RWLock_IsValid(s_shards[0].entriesLock) ? KERN_SUCCESS : KERN_FAILURE;
+    for (uint32_t shardIndex = 0; shardIndex < PrjFSVnodeCacheMaxShards; ++shardIndex)
     {
-        RWLock_FreeMemory(&s_entriesLock);
-        return KERN_SUCCESS;
+        if (RWLock_IsValid(s_shards[shardIndex].entriesLock))
+        {
+            RWLock_FreeMemory(&s_shards[shardIndex].entriesLock);
+        }
     }
     
-    return KERN_FAILURE;
+    s_shardCount = 0;
+    return result;
 }
 
 VirtualizationRootHandle VnodeCache_FindRootForVnode(
@@ -135,12 +223,17 @@ VirtualizationRootHandle VnodeCache_FindRootForVnode(
     if (TryGetVnodeRootFromCache(vnode, vnodeHashIndex, vnodeVid, rootHandle))
     {
         perfTracer->IncrementCount(cacheHitCounter, true /*ignoreSampling*/);
-        AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalFindRootForVnodeHits, 1ULL);
+        uint64_t sampleWeight = SampleLookupStats();
+        if (0 != sampleWeight)
+        {
+            AtomicFetchAddCacheHealthStat(GetShardForIndex(vnodeHashIndex), VnodeCacheHealthStat_TotalFindRootForVnodeHits, sampleWeight);
+        }
+        
         return rootHandle;
     }
     
     perfTracer->IncrementCount(cacheMissCounter, true /*ignoreSampling*/);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalFindRootForVnodeMisses, 1ULL);
+    AtomicFetchAddCacheHealthStat(GetShardForIndex(vnodeHashIndex), VnodeCacheHealthStat_TotalFindRootForVnodeMisses, 1ULL);
     
     FindVnodeRootFromDiskAndUpdateCache(
         perfTracer,
@@ -170,7 +263,7 @@ VirtualizationRootHandle VnodeCache_RefreshRootForVnode(
     uint32_t vnodeVid = vnode_vid(vnode);
     
     perfTracer->IncrementCount(cacheMissCounter, true /*ignoreSampling*/);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalRefreshRootForVnode, 1ULL);
+    AtomicFetchAddCacheHealthStat(GetShardForIndex(vnodeHashIndex), VnodeCacheHealthStat_TotalRefreshRootForVnode, 1ULL);
     
     FindVnodeRootFromDiskAndUpdateCache(
         perfTracer,
@@ -200,7 +293,7 @@ VirtualizationRootHandle VnodeCache_InvalidateVnodeRootAndGetLatestRoot(
     uint32_t vnodeVid = vnode_vid(vnode);
     
     perfTracer->IncrementCount(cacheMissCounter, true /*ignoreSampling*/);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalInvalidateVnodeRoot, 1ULL);
+    AtomicFetchAddCacheHealthStat(GetShardForIndex(vnodeHashIndex), VnodeCacheHealthStat_TotalInvalidateVnodeRoot, 1ULL);
     
     FindVnodeRootFromDiskAndUpdateCache(
         perfTracer,
@@ -216,70 +309,226 @@ VirtualizationRootHandle VnodeCache_InvalidateVnodeRootAndGetLatestRoot(
     return rootHandle;
 }
 
+bool VnodeCache_TryGetCachedRootForVnode(vnode_t _Nonnull vnode, VirtualizationRootHandle& rootHandle)
+{
+    return TryGetVnodeRootFromCache(vnode, ComputeVnodeHashIndex(vnode), vnode_vid(vnode), rootHandle);
+}
+
+VirtualizationRootHandle VnodeCache_RefreshRootForRenamedDirectory(
+    PerfTracer* _Nonnull perfTracer,
+    PrjFSPerfCounter cacheHitCounter,
+    PrjFSPerfCounter cacheMissCounter,
+    PrjFSPerfCounter cacheMissFallbackFunctionCounter,
+    PrjFSPerfCounter cacheMissFallbackFunctionInnerLoopCounter,
+    vnode_t _Nonnull directoryVnode,
+    vfs_context_t _Nonnull context)
+{
+    uintptr_t vnodeHashIndex = ComputeVnodeHashIndex(directoryVnode);
+    uint32_t vnodeVid = vnode_vid(directoryVnode);
+    
+    // The cache still has the root the directory had before it was renamed, and as all of the
+    // directory's cached descendants share that root, they can be invalidated along with it
+    VirtualizationRootHandle previousRootHandle;
+    if (!TryGetVnodeRootFromCache(directoryVnode, vnodeHashIndex, vnodeVid, previousRootHandle))
+    {
+        // Without the previous root there is no telling which entries are stale
+        VnodeCache_InvalidateCache(perfTracer);
+        
+        return VnodeCache_FindRootForVnode(
+            perfTracer,
+            cacheHitCounter,
+            cacheMissCounter,
+            cacheMissFallbackFunctionCounter,
+            cacheMissFallbackFunctionInnerLoopCounter,
+            directoryVnode,
+            context);
+    }
+    
+    VirtualizationRootHandle rootHandle = VnodeCache_RefreshRootForVnode(
+        perfTracer,
+        cacheHitCounter,
+        cacheMissCounter,
+        cacheMissFallbackFunctionCounter,
+        cacheMissFallbackFunctionInnerLoopCounter,
+        directoryVnode,
+        context);
+    
+    // Renames within a root don't change the root of anything in the cache
+    if (rootHandle != previousRootHandle)
+    {
+        VnodeCache_InvalidateRoot(perfTracer, previousRootHandle);
+    }
+    
+    return rootHandle;
+}
+
+void VnodeCache_InvalidateRoot(PerfTracer* _Nonnull perfTracer, VirtualizationRootHandle rootHandle)
+{
+    perfTracer->IncrementCount(PrjFSPerfCounter_CacheInvalidateRootCount, true /*ignoreSampling*/);
+    
+    // Like whole-cache invalidations, root invalidations are only counted in the first shard
+    AtomicFetchAddCacheHealthStat(s_shards[0], VnodeCacheHealthStat_InvalidateRootGenerationCount, 1ULL);
+    
+    uint8_t previousGeneration = atomic_fetch_add_explicit(
+        &s_rootGenerations[GetRootGenerationSlot(rootHandle)],
+        static_cast<uint8_t>(1),
+        memory_order_relaxed);
+    if (UINT8_MAX == previousGeneration)
+    {
+        // The generation has wrapped, and so entries written 256 generations ago would look current
+        // again. Wiping the cache whenever a generation wraps guarantees no such entries are left.
+        VnodeCache_InvalidateCache(perfTracer);
+    }
+}
+
 void VnodeCache_InvalidateCache(PerfTracer* _Nonnull perfTracer)
 {
     perfTracer->IncrementCount(PrjFSPerfCounter_CacheInvalidateCount, true /*ignoreSampling*/);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
+    
+    // Whole-cache invalidations are only counted in the first shard
+    AtomicFetchAddCacheHealthStat(s_shards[0], VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
 
-    RWLock_AcquireExclusive(s_entriesLock);
+    // There is no cache-wide lock, shards are wiped one at a time so that lookups in the
+    // other shards can carry on in the meantime
+    for (uint32_t shardIndex = 0; shardIndex < s_shardCount; ++shardIndex)
     {
-        InvalidateCache_ExclusiveLocked();
+        VnodeCacheShard& shard = s_shards[shardIndex];
+        RWLock_AcquireExclusive(shard.entriesLock);
+        {
+            InvalidateShard_ExclusiveLocked(shardIndex);
+        }
+        RWLock_ReleaseExclusive(shard.entriesLock);
     }
-    RWLock_ReleaseExclusive(s_entriesLock);
 }
 
 IOReturn VnodeCache_ExportHealthData(IOExternalMethodArguments* _Nonnull arguments)
 {
-    PrjFSVnodeCacheHealth healthData =
-    {
-        .cacheCapacity = s_entriesCapacity,
-        .cacheEntries = s_cacheStats.cacheEntries, // cacheEntries is reset to 0 when VnodeCache_InvalidateCache is called
-        .invalidateEntireCacheCount = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount], 0ULL, memory_order_relaxed),
-        .totalCacheLookups = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalCacheLookups], 0ULL, memory_order_relaxed),
-        .totalLookupCollisions = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions], 0ULL, memory_order_relaxed),
-        .totalFindRootForVnodeHits = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits], 0ULL, memory_order_relaxed),
-        .totalFindRootForVnodeMisses = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses], 0ULL, memory_order_relaxed),
-        .totalRefreshRootForVnode = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalRefreshRootForVnode], 0ULL, memory_order_relaxed),
-        .totalInvalidateVnodeRoot = atomic_exchange_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_TotalInvalidateVnodeRoot], 0ULL, memory_order_relaxed),
-    };
-
     // The buffer will come in either as a memory descriptor or direct pointer, depending on size
-    if (nullptr != arguments->structureOutputDescriptor)
+    IOMemoryDescriptor* structureOutput = arguments->structureOutputDescriptor;
+    if (nullptr != structureOutput)
     {
-        IOMemoryDescriptor* structureOutput = arguments->structureOutputDescriptor;
-        if (sizeof(healthData) != structureOutput->getLength())
+        if (sizeof(PrjFSVnodeCacheHealth) != structureOutput->getLength())
         {
             KextLog(
                 "VnodeCache_ExportHealthData: structure output descriptor size %llu, expected %lu\n",
                 static_cast<unsigned long long>(structureOutput->getLength()),
-                sizeof(healthData));
+                sizeof(PrjFSVnodeCacheHealth));
             return kIOReturnBadArgument;
         }
 
         IOReturn result = structureOutput->prepare(kIODirectionIn);
-        if (kIOReturnSuccess == result)
+        if (kIOReturnSuccess != result)
         {
-            structureOutput->writeBytes(0 /* offset */, &healthData, sizeof(healthData));
-            structureOutput->complete(kIODirectionIn);
+            return result;
         }
-        
-        return result;
     }
-
-    if (arguments->structureOutput == nullptr || arguments->structureOutputSize != sizeof(PrjFSVnodeCacheHealth))
+    else if (arguments->structureOutput == nullptr || arguments->structureOutputSize != sizeof(PrjFSVnodeCacheHealth))
     {
-        KextLog("VnodeCache_ExportHealthData: structure output size %u, expected %lu\n", arguments->structureOutputSize, sizeof(healthData));
+        KextLog("VnodeCache_ExportHealthData: structure output size %u, expected %lu\n", arguments->structureOutputSize, sizeof(PrjFSVnodeCacheHealth));
         return kIOReturnBadArgument;
     }
 
-    memcpy(arguments->structureOutput, &healthData, sizeof(healthData));
+    // With up to PrjFSVnodeCacheMaxShards shards the whole report is too big for the kernel stack, so
+    // only the totals are built up here and each shard's breakdown is copied out as soon as it's read
+    PrjFSVnodeCacheHealthSummary summary = {};
+    summary.cacheCapacity = s_entriesCapacity;
+    summary.shardCount = s_shardCount;
+    
+    for (uint32_t shardIndex = 0; shardIndex < PrjFSVnodeCacheMaxShards; ++shardIndex)
+    {
+        PrjFSVnodeCacheShardHealth shardHealth = {};
+        if (shardIndex < s_shardCount)
+        {
+            VnodeCacheStats& shardStats = s_shards[shardIndex].stats;
+            uint64_t shardHealthStats[VnodeCacheHealthStat_Count];
+            for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
+            {
+                shardHealthStats[i] = atomic_exchange_explicit(&shardStats.healthStats[i], 0ULL, memory_order_relaxed);
+            }
+            
+            shardHealth.cacheEntries = shardStats.cacheEntries; // cacheEntries is reset to 0 when the shard is invalidated
+            shardHealth.totalCacheLookups = shardHealthStats[VnodeCacheHealthStat_TotalCacheLookups];
+            shardHealth.totalLookupCollisions = shardHealthStats[VnodeCacheHealthStat_TotalLookupCollisions];
+            shardHealth.totalFindRootForVnodeHits = shardHealthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits];
+            shardHealth.totalFindRootForVnodeMisses = shardHealthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses];
+            shardHealth.totalEvictions = shardHealthStats[VnodeCacheHealthStat_TotalEvictions];
+            
+            summary.cacheEntries += shardHealth.cacheEntries;
+            summary.invalidateEntireCacheCount += shardHealthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount];
+            summary.invalidateRootGenerationCount += shardHealthStats[VnodeCacheHealthStat_InvalidateRootGenerationCount];
+            summary.totalCacheLookups += shardHealth.totalCacheLookups;
+            summary.totalLookupCollisions += shardHealth.totalLookupCollisions;
+            summary.totalFindRootForVnodeHits += shardHealth.totalFindRootForVnodeHits;
+            summary.totalFindRootForVnodeMisses += shardHealth.totalFindRootForVnodeMisses;
+            summary.totalRefreshRootForVnode += shardHealthStats[VnodeCacheHealthStat_TotalRefreshRootForVnode];
+            summary.totalInvalidateVnodeRoot += shardHealthStats[VnodeCacheHealthStat_TotalInvalidateVnodeRoot];
+            summary.totalEvictions += shardHealth.totalEvictions;
+            
+            for (uint32_t i = 0; i < PrjFSVnodeCacheProbeLengthHistogramBuckets; ++i)
+            {
+                summary.probeLengthHistogram[i] += atomic_exchange_explicit(&shardStats.probeLengthHistogram[i], 0ULL, memory_order_relaxed);
+            }
+        }
+        
+        WriteHealthData(
+            arguments,
+            sizeof(PrjFSVnodeCacheHealthSummary) + shardIndex * sizeof(PrjFSVnodeCacheShardHealth),
+            &shardHealth,
+            sizeof(shardHealth));
+    }
+    
+    WriteHealthData(arguments, 0 /* offset */, &summary, sizeof(summary));
+    
+    if (nullptr != structureOutput)
+    {
+        structureOutput->complete(kIODirectionIn);
+    }
+
     return kIOReturnSuccess;
 }
 
-KEXT_STATIC_INLINE void InvalidateCache_ExclusiveLocked()
+KEXT_STATIC_INLINE void WriteHealthData(IOExternalMethodArguments* _Nonnull arguments, uint32_t offset, const void* _Nonnull data, uint32_t size)
 {
-    memset(s_entries, 0, s_entriesCapacity * sizeof(VnodeCacheEntry));
-    atomic_store_explicit(&s_cacheStats.cacheEntries, 0U, memory_order_relaxed);
+    if (nullptr != arguments->structureOutputDescriptor)
+    {
+        arguments->structureOutputDescriptor->writeBytes(offset, data, size);
+    }
+    else
+    {
+        memcpy(static_cast<uint8_t*>(arguments->structureOutput) + offset, data, size);
+    }
+}
+
+KEXT_STATIC_INLINE void InvalidateShard_ExclusiveLocked(uint32_t shardIndex)
+{
+    VnodeCacheShard& shard = s_shards[shardIndex];
+    uintptr_t firstIndex = static_cast<uintptr_t>(shardIndex) << s_shardIndexBits;
+    uintptr_t shardCapacity = s_shardModBitmask + 1;
+    
+    // Lock-free readers must discard anything they read from the shard during the wipe
+    uint32_t sequence = BeginEntriesRelocation_ExclusiveLocked(shard);
+    
+    memset(&s_entries[firstIndex], 0, shardCapacity * sizeof(VnodeCacheEntry));
+    memset(&s_entriesReferenced[firstIndex], 0, shardCapacity);
+    atomic_store_explicit(&shard.stats.cacheEntries, 0U, memory_order_relaxed);
+    
+    EndEntriesRelocation_ExclusiveLocked(shard, sequence);
+}
+
+// Makes the shard's entriesSequence odd while entries are being wiped or moved between slots, so that a
+// lock-free reader whose probe raced with the move retries rather than reporting a false miss
+KEXT_STATIC_INLINE uint32_t BeginEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard)
+{
+    uint32_t sequence = atomic_load_explicit(&shard.entriesSequence, memory_order_relaxed);
+    atomic_store_explicit(&shard.entriesSequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    return sequence;
+}
+
+KEXT_STATIC_INLINE void EndEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard, uint32_t sequence)
+{
+    atomic_store_explicit(&shard.entriesSequence, sequence + 2, memory_order_release);
 }
 
 KEXT_STATIC_INLINE uint32_t ComputePow2CacheCapacity(int expectedVnodeCount)
@@ -300,10 +549,71 @@ KEXT_STATIC_INLINE uint32_t ComputePow2CacheCapacity(int expectedVnodeCount)
     return cacheCapacity;
 }
 
+KEXT_STATIC_INLINE uint32_t ComputePow2ShardCount(uint32_t requestedShardCount)
+{
+    // Round up to a power of 2 so that shards can be selected with the high bits of the hash index
+    uint32_t shardCount = 1;
+    while ((shardCount < requestedShardCount) &&
+           (shardCount < PrjFSVnodeCacheMaxShards))
+    {
+        shardCount = shardCount << 1;
+    }
+    
+    return shardCount;
+}
+
+KEXT_STATIC_INLINE VnodeCacheShard& GetShardForIndex(uintptr_t vnodeIndex)
+{
+    return s_shards[vnodeIndex >> s_shardIndexBits];
+}
+
+// Probes wrap around at the end of the shard rather than moving on into the next shard
+KEXT_STATIC_INLINE uintptr_t AdvanceIndexInShard(uintptr_t vnodeIndex, uintptr_t distance)
+{
+    return (vnodeIndex & ~s_shardModBitmask) | ((vnodeIndex + distance) & s_shardModBitmask);
+}
+
 KEXT_STATIC_INLINE uintptr_t ComputeVnodeHashIndex(vnode_t _Nonnull vnode)
 {
-    uintptr_t vnodeAddress = reinterpret_cast<uintptr_t>(vnode);
-    return (vnodeAddress >> 3) & s_ModBitmask;
+    // vnodes come from a zone allocator, so their addresses are aligned and packed at a fixed stride
+    // inside a handful of zone pages, which leaves the low address bits poorly distributed.  Fibonacci
+    // hashing (multiplying by 2^64 / golden ratio and keeping the top bits) mixes every address bit
+    // into the index.
+    uint64_t vnodeAddress = reinterpret_cast<uintptr_t>(vnode);
+    return static_cast<uintptr_t>((vnodeAddress * VnodeHashMultiplier) >> (64 - s_hashBits));
+}
+
+KEXT_STATIC_INLINE uint32_t GetRootGenerationSlot(VirtualizationRootHandle rootHandle)
+{
+    // Special handles (e.g. RootHandle_None) are negative, and get slots of their own at the top of the table
+    if (rootHandle < 0)
+    {
+        assert(-rootHandle <= static_cast<int32_t>(VnodeCacheSpecialRootGenerationSlots));
+        return VnodeCacheRootGenerationSlots + rootHandle;
+    }
+    
+    return static_cast<uint32_t>(rootHandle) % (VnodeCacheRootGenerationSlots - VnodeCacheSpecialRootGenerationSlots);
+}
+
+KEXT_STATIC_INLINE uint8_t LoadRootGeneration(VirtualizationRootHandle rootHandle)
+{
+    return atomic_load_explicit(&s_rootGenerations[GetRootGenerationSlot(rootHandle)], memory_order_relaxed);
+}
+
+// Copies every root's generation, for when the root whose generation matters isn't known yet.
+// Acquire ordering keeps the loads ahead of whatever the caller reads afterwards.
+KEXT_STATIC_INLINE void SnapshotRootGenerations(uint8_t* _Nonnull rootGenerations)
+{
+    for (uint32_t i = 0; i < VnodeCacheRootGenerationSlots; ++i)
+    {
+        rootGenerations[i] = atomic_load_explicit(&s_rootGenerations[i], memory_order_acquire);
+    }
+}
+
+// Number of slots between an entry's home index (its hash index) and the index it is actually stored at
+KEXT_STATIC_INLINE uintptr_t ComputeProbeDistance(vnode_t _Nonnull entryVnode, uintptr_t entryIndex)
+{
+    return (entryIndex - ComputeVnodeHashIndex(entryVnode)) & s_shardModBitmask;
 }
 
 KEXT_STATIC bool TryGetVnodeRootFromCache(
@@ -312,25 +622,132 @@ KEXT_STATIC bool TryGetVnodeRootFromCache(
     uint32_t vnodeVid,
     /* out parameters */
     VirtualizationRootHandle& rootHandle)
+{
+    // Cache hits are by far the most common case, so first try to find the entry without
+    // touching the shard's entriesLock (which would otherwise bounce between CPUs on every lookup)
+    for (uint32_t attempt = 0; attempt < MaxLockFreeReadAttempts; ++attempt)
+    {
+        bool rootFound;
+        if (TryGetVnodeRootFromCache_LockFree(vnode, vnodeHashIndex, vnodeVid, /*out*/ rootFound, /*out*/ rootHandle))
+        {
+            return rootFound;
+        }
+    }
+    
+    // We kept racing with writers, fall back to a locked lookup
+    return TryGetVnodeRootFromCache_Locked(vnode, vnodeHashIndex, vnodeVid, rootHandle);
+}
+
+// TryGetVnodeRootFromCache_LockFree returns false if the lookup raced with a writer, in which
+// case the out parameters must be ignored and the caller should retry.
+KEXT_STATIC bool TryGetVnodeRootFromCache_LockFree(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    bool& rootFound,
+    VirtualizationRootHandle& rootHandle)
+{
+    rootFound = false;
+    rootHandle = RootHandle_None;
+    
+    VnodeCacheShard& shard = GetShardForIndex(vnodeHashIndex);
+    uint32_t shardSequence = atomic_load_explicit(&shard.entriesSequence, memory_order_acquire);
+    if (0 != (shardSequence & 1))
+    {
+        // Entries in the shard are being wiped or moved
+        return false;
+    }
+
+    // Same probe as TryFindVnodeIndex_Locked, except that each entry is validated
+    // against its sequence number before it is used
+    uintptr_t probeLength;
+    uintptr_t vnodeIndex = vnodeHashIndex;
+    for (probeLength = 0; probeLength < MaxVnodeCacheProbeLength; ++probeLength)
+    {
+        VnodeCacheEntry& entry = s_entries[vnodeIndex];
+        uint8_t entrySequence = atomic_load_explicit(&entry.sequence, memory_order_acquire);
+        if (0 != (entrySequence & 1))
+        {
+            // The entry is being updated
+            return false;
+        }
+        
+        vnode_t entryVnode = entry.vnode;
+        uint32_t entryVid = entry.vid;
+        VirtualizationRootHandle entryRoot = entry.virtualizationRoot;
+        uint8_t entryRootGeneration = entry.rootGeneration;
+        
+        atomic_thread_fence(memory_order_acquire);
+        if (entrySequence != atomic_load_explicit(&entry.sequence, memory_order_relaxed))
+        {
+            return false;
+        }
+        
+        if (vnode == entryVnode)
+        {
+            if (vnodeVid == entryVid &&
+                RootHandle_Indeterminate != entryRoot &&
+                LoadRootGeneration(entryRoot) == entryRootGeneration)
+            {
+                rootFound = true;
+                rootHandle = entryRoot;
+                MarkEntryReferenced(vnodeIndex);
+            }
+            
+            break;
+        }
+        
+        // Robin Hood invariant: the vnode would have displaced any entry that is closer to its own home
+        if (NULLVP == entryVnode || ComputeProbeDistance(entryVnode, vnodeIndex) < probeLength)
+        {
+            break;
+        }
+        
+        vnodeIndex = AdvanceIndexInShard(vnodeIndex, 1);
+    }
+    
+    // Entries that were moved or wiped while we were probing could have been missed
+    atomic_thread_fence(memory_order_acquire);
+    if (shardSequence != atomic_load_explicit(&shard.entriesSequence, memory_order_relaxed))
+    {
+        rootFound = false;
+        rootHandle = RootHandle_None;
+        return false;
+    }
+    
+    RecordLookup(shard, probeLength);
+    return true;
+}
+
+KEXT_STATIC bool TryGetVnodeRootFromCache_Locked(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle)
 {
     bool rootFound = false;
     rootHandle = RootHandle_None;
 
-    RWLock_AcquireShared(s_entriesLock);
+    VnodeCacheShard& shard = GetShardForIndex(vnodeHashIndex);
+    RWLock_AcquireShared(shard.entriesLock);
     {
         uintptr_t vnodeIndex;
         if (TryFindVnodeIndex_Locked(vnode, vnodeHashIndex, /*out*/ vnodeIndex))
         {
-            if (vnode == s_entries[vnodeIndex].vnode &&
-                vnodeVid == s_entries[vnodeIndex].vid &&
-                RootHandle_Indeterminate != s_entries[vnodeIndex].virtualizationRoot)
+            const VnodeCacheEntry& entry = s_entries[vnodeIndex];
+            if (vnodeVid == entry.vid &&
+                RootHandle_Indeterminate != entry.virtualizationRoot &&
+                LoadRootGeneration(entry.virtualizationRoot) == entry.rootGeneration)
             {
                 rootFound = true;
-                rootHandle = s_entries[vnodeIndex].virtualizationRoot;
+                rootHandle = entry.virtualizationRoot;
+                MarkEntryReferenced(vnodeIndex);
             }
         }
     }
-    RWLock_ReleaseShared(s_entriesLock);
+    RWLock_ReleaseShared(shard.entriesLock);
     
     return rootFound;
 }
@@ -347,12 +764,23 @@ KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
     /* out parameters */
     VirtualizationRootHandle& rootHandle)
 {
+    // The root found may be invalidated (by a rename, say) while walking the tree, after the walk
+    // has read the old state. Entries are written with the root's generation from before the walk,
+    // so they're stale in that case, rather than looking current under the new generation.
+    uint8_t rootGenerations[VnodeCacheRootGenerationSlots];
+    SnapshotRootGenerations(rootGenerations);
+
+    // Stop walking up the tree at the first cached ancestor, and cache the ancestors that had to
+    // be visited so that lookups for their other descendants don't need to walk the tree again.
+    VirtualizationRootAncestors ancestors;
+    ancestors.tryGetKnownRoot = TryGetAncestorRootFromCache;
     rootHandle = VirtualizationRoot_FindForVnode(
         perfTracer,
         cacheMissFallbackFunctionCounter,
         cacheMissFallbackFunctionInnerLoopCounter,
         vnode,
-        context);
+        context,
+        &ancestors);
 
     bool forceRefreshEntry;
     VirtualizationRootHandle rootToInsert;
@@ -384,47 +812,51 @@ KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
             break;
     }
 
-    RWLock_AcquireExclusive(s_entriesLock);
+    uint32_t evictedEntries;
+    VnodeCacheShard& shard = GetShardForIndex(vnodeHashIndex);
+    RWLock_AcquireExclusive(shard.entriesLock);
+    {
+        evictedEntries = InsertOrUpdateEntry_ExclusiveLocked(
+            vnode,
+            vnodeHashIndex,
+            vnodeVid,
+            forceRefreshEntry,
+            rootToInsert,
+            rootGenerations[GetRootGenerationSlot(rootToInsert)]);
+    }
+    RWLock_ReleaseExclusive(shard.entriesLock);
+    
+    for (uint32_t i = 0; i < ancestors.visitedCount; ++i)
     {
-        if (!TryInsertOrUpdateEntry_ExclusiveLocked(
-                vnode,
-                vnodeHashIndex,
-                vnodeVid,
-                forceRefreshEntry,
-                rootToInsert))
+        vnode_t ancestorVnode = ancestors.visitedVnodes[i];
+        uintptr_t ancestorHashIndex = ComputeVnodeHashIndex(ancestorVnode);
+        VnodeCacheShard& ancestorShard = GetShardForIndex(ancestorHashIndex);
+        RWLock_AcquireExclusive(ancestorShard.entriesLock);
         {
-            // TryInsertOrUpdateEntry_ExclusiveLocked can only fail if the cache is full
-            perfTracer->IncrementCount(PrjFSPerfCounter_CacheFullCount, true /*ignoreSampling*/);
-            InvalidateCache_ExclusiveLocked();
-            InsertEntryToInvalidatedCache_ExclusiveLocked(vnode, vnodeHashIndex, vnodeVid, rootToInsert);
-
+            evictedEntries += InsertOrUpdateEntry_ExclusiveLocked(
+                ancestorVnode,
+                ancestorHashIndex,
+                ancestors.visitedVids[i],
+                false, // forceRefreshEntry
+                rootHandle,
+                rootGenerations[GetRootGenerationSlot(rootHandle)]);
         }
+        RWLock_ReleaseExclusive(ancestorShard.entriesLock);
+    }
+    
+    if (evictedEntries > 0)
+    {
+        perfTracer->IncrementCount(PrjFSPerfCounter_CacheEvictionCount, true /*ignoreSampling*/);
     }
-    RWLock_ReleaseExclusive(s_entriesLock);
 }
 
-// InsertEntryToInvalidatedCache_ExclusiveLocked is a helper function for inserting a vnode
-// into the cache after the cache has been invalidated.  This functionality is in its own function
-// (rather than in FindVnodeRootFromDiskAndUpdateCache) so that the kext unit tests can force its call
-// to TryInsertOrUpdateEntry_ExclusiveLocked to fail.
-KEXT_STATIC void InsertEntryToInvalidatedCache_ExclusiveLocked(
-    vnode_t _Nonnull vnode,
-    uintptr_t vnodeHashIndex,
-    uint32_t vnodeVid,
-    VirtualizationRootHandle rootToInsert)
+KEXT_STATIC bool TryGetAncestorRootFromCache(
+    vnode_t _Nonnull directoryVnode,
+    uint32_t vid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle)
 {
-    if(!TryInsertOrUpdateEntry_ExclusiveLocked(
-                vnode,
-                vnodeHashIndex,
-                vnodeVid,
-                true, // forceRefreshEntry
-                rootToInsert))
-    {
-        KextLog_Error(
-            "InsertEntryToInvalidatedCache_ExclusiveLocked: inserting vnode (%p:%u) failed",
-            KextLog_Unslide(vnode),
-            vnodeVid);
-    }
+    return TryGetVnodeRootFromCache(directoryVnode, ComputeVnodeHashIndex(directoryVnode), vid, rootHandle);
 }
 
 KEXT_STATIC bool TryFindVnodeIndex_Locked(
@@ -433,58 +865,55 @@ KEXT_STATIC bool TryFindVnodeIndex_Locked(
     /* out parameters */
     uintptr_t& vnodeIndex)
 {
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalCacheLookups, 1ULL);
-
     // Walk from the starting index until we do one of the following:
     //    -> Find the vnode
-    //    -> Find where the vnode should be inserted (i.e. NULLVP)
-    //    -> Have looped all the way back to where we started
-    uint64_t totalSteps = 0;
+    //    -> Find an empty slot, or an entry that is closer to its home index than the
+    //       vnode would be (Robin Hood hashing guarantees the vnode can't be further along)
+    //    -> Have walked MaxVnodeCacheProbeLength entries
+    bool vnodeFound = false;
+    uintptr_t probeLength;
     vnodeIndex = vnodeHashIndex;
-    while (vnode != s_entries[vnodeIndex].vnode && NULLVP != s_entries[vnodeIndex].vnode)
+    for (probeLength = 0; probeLength < MaxVnodeCacheProbeLength; ++probeLength)
     {
-        ++totalSteps;
-        ++vnodeIndex;
-        if (vnodeIndex == s_entriesCapacity)
+        vnode_t entryVnode = s_entries[vnodeIndex].vnode;
+        if (vnode == entryVnode)
         {
-            vnodeIndex = 0;
+            vnodeFound = true;
+            break;
         }
         
-        if (vnodeIndex == vnodeHashIndex)
+        if (NULLVP == entryVnode || ComputeProbeDistance(entryVnode, vnodeIndex) < probeLength)
         {
-            // Looped through the entire cache and didn't find an empty slot or the vnode
-            AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalLookupCollisions, totalSteps);
-            return false;
+            break;
         }
+        
+        vnodeIndex = AdvanceIndexInShard(vnodeIndex, 1);
     }
     
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_TotalLookupCollisions, totalSteps);
-    return true;
+    RecordLookup(GetShardForIndex(vnodeHashIndex), probeLength);
+    return vnodeFound;
 }
 
-KEXT_STATIC bool TryInsertOrUpdateEntry_ExclusiveLocked(
+// Returns the number of entries that had to be evicted from the cache to make space for the vnode.
+// rootGeneration is rootHandle's generation from before the root was looked up.
+KEXT_STATIC uint32_t InsertOrUpdateEntry_ExclusiveLocked(
     vnode_t _Nonnull vnode,
     uintptr_t vnodeHashIndex,
     uint32_t vnodeVid,
     bool forceRefreshEntry,
-    VirtualizationRootHandle rootHandle)
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration)
 {
     uintptr_t vnodeIndex;
     if (TryFindVnodeIndex_Locked(vnode, vnodeHashIndex, /*out*/ vnodeIndex))
     {
+        const VnodeCacheEntry& entry = s_entries[vnodeIndex];
         if (forceRefreshEntry ||
-            NULLVP == s_entries[vnodeIndex].vnode ||
-            vnodeVid != s_entries[vnodeIndex].vid ||
-            RootHandle_Indeterminate == s_entries[vnodeIndex].virtualizationRoot)
+            vnodeVid != entry.vid ||
+            RootHandle_Indeterminate == entry.virtualizationRoot ||
+            LoadRootGeneration(entry.virtualizationRoot) != entry.rootGeneration)
         {
-            if (NULLVP == s_entries[vnodeIndex].vnode)
-            {
-                atomic_fetch_add_explicit(&s_cacheStats.cacheEntries, 1U, memory_order_relaxed);
-            }
-        
-            s_entries[vnodeIndex].vnode = vnode;
-            s_entries[vnodeIndex].vid = vnodeVid;
-            s_entries[vnodeIndex].virtualizationRoot = rootHandle;
+            WriteEntry_ExclusiveLocked(vnodeIndex, vnode, vnodeVid, rootHandle, rootGeneration);
         }
         else
         {
@@ -492,7 +921,7 @@ KEXT_STATIC bool TryInsertOrUpdateEntry_ExclusiveLocked(
             {
                 KextLog_FileError(
                     vnode,
-                    "TryInsertOrUpdateEntry_ExclusiveLocked: vnode (%p:%u) has different root in cache(%hd) than was found walking tree(%hd)",
+                    "InsertOrUpdateEntry_ExclusiveLocked: vnode (%p:%u) has different root in cache(%hd) than was found walking tree(%hd)",
                     KextLog_Unslide(vnode),
                     vnodeVid,
                     s_entries[vnodeIndex].virtualizationRoot,
@@ -500,25 +929,263 @@ KEXT_STATIC bool TryInsertOrUpdateEntry_ExclusiveLocked(
             }
         }
         
-        return true;
+        return 0;
+    }
+    
+    // Eviction and Robin Hood displacement both move existing entries to other slots, which lock-free
+    // readers have to be told about. Most inserts just fill an empty slot, so only bump the shard's
+    // sequence once an entry is actually about to move.
+    VnodeCacheShard& shard = GetShardForIndex(vnodeHashIndex);
+    bool relocatingEntries = false;
+    uint32_t entriesSequence = 0;
+    
+    uint32_t evictedEntries = 0;
+    if (!ProbeWindowHasEmptySlot_Locked(vnodeHashIndex))
+    {
+        // Rather than wiping the whole cache, make room by evicting a single entry
+        entriesSequence = BeginEntriesRelocation_ExclusiveLocked(shard);
+        relocatingEntries = true;
+        EvictEntryFromProbeWindow_ExclusiveLocked(vnodeHashIndex);
+        ++evictedEntries;
+    }
+    
+    // Robin Hood insertion: walk forward from the home index, and whenever the entry we are
+    // carrying is further from its home than the entry in the slot, swap the two
+    vnode_t carriedVnode = vnode;
+    uint32_t carriedVid = vnodeVid;
+    VirtualizationRootHandle carriedRoot = rootHandle;
+    uint8_t carriedRootGeneration = rootGeneration;
+    uint8_t carriedReferenced = 0;
+    uintptr_t carriedProbeDistance = 0;
+    vnodeIndex = vnodeHashIndex;
+    while (true)
+    {
+        if (carriedProbeDistance >= MaxVnodeCacheProbeLength)
+        {
+            // The entry displaced last can't be stored within the probe limit, so it has to go.
+            // This is rare as EvictEntryFromProbeWindow_ExclusiveLocked normally leaves a slot
+            // close enough to the vnode's home index.
+            atomic_fetch_sub_explicit(&shard.stats.cacheEntries, 1U, memory_order_relaxed);
+            ++evictedEntries;
+            break;
+        }
+        
+        VnodeCacheEntry& entry = s_entries[vnodeIndex];
+        if (NULLVP == entry.vnode)
+        {
+            WriteEntry_ExclusiveLocked(vnodeIndex, carriedVnode, carriedVid, carriedRoot, carriedRootGeneration);
+            s_entriesReferenced[vnodeIndex] = carriedReferenced;
+            break;
+        }
+        
+        uintptr_t entryProbeDistance = ComputeProbeDistance(entry.vnode, vnodeIndex);
+        if (entryProbeDistance < carriedProbeDistance)
+        {
+            if (!relocatingEntries)
+            {
+                entriesSequence = BeginEntriesRelocation_ExclusiveLocked(shard);
+                relocatingEntries = true;
+            }
+            
+            vnode_t displacedVnode = entry.vnode;
+            uint32_t displacedVid = entry.vid;
+            VirtualizationRootHandle displacedRoot = entry.virtualizationRoot;
+            uint8_t displacedRootGeneration = entry.rootGeneration;
+            uint8_t displacedReferenced = s_entriesReferenced[vnodeIndex];
+            
+            WriteEntry_ExclusiveLocked(vnodeIndex, carriedVnode, carriedVid, carriedRoot, carriedRootGeneration);
+            s_entriesReferenced[vnodeIndex] = carriedReferenced;
+            
+            carriedVnode = displacedVnode;
+            carriedVid = displacedVid;
+            carriedRoot = displacedRoot;
+            carriedRootGeneration = displacedRootGeneration;
+            carriedReferenced = displacedReferenced;
+            carriedProbeDistance = entryProbeDistance;
+        }
+        
+        ++carriedProbeDistance;
+        vnodeIndex = AdvanceIndexInShard(vnodeIndex, 1);
+    }
+    
+    if (relocatingEntries)
+    {
+        EndEntriesRelocation_ExclusiveLocked(shard, entriesSequence);
+    }
+    
+    atomic_fetch_add_explicit(&shard.stats.cacheEntries, 1U, memory_order_relaxed);
+    AtomicFetchAddCacheHealthStat(shard, VnodeCacheHealthStat_TotalEvictions, evictedEntries);
+    return evictedEntries;
+}
+
+KEXT_STATIC bool ProbeWindowHasEmptySlot_Locked(uintptr_t vnodeHashIndex)
+{
+    uintptr_t index = vnodeHashIndex;
+    for (uint32_t i = 0; i < MaxVnodeCacheProbeLength; ++i)
+    {
+        if (NULLVP == s_entries[index].vnode)
+        {
+            return true;
+        }
+        
+        index = AdvanceIndexInShard(index, 1);
     }
     
     return false;
 }
 
-KEXT_STATIC_INLINE void InitCacheStats()
+// Picks a single victim among the MaxVnodeCacheProbeLength entries following vnodeHashIndex using
+// the CLOCK (second chance) algorithm: entries that were referenced since the hand last passed them
+// have their reference bit cleared and are skipped.  Starting at a rotating offset spreads evictions
+// across the window.
+KEXT_STATIC void EvictEntryFromProbeWindow_ExclusiveLocked(uintptr_t vnodeHashIndex)
+{
+    VnodeCacheShard& shard = GetShardForIndex(vnodeHashIndex);
+    uint32_t handOffset = shard.clockHand;
+    shard.clockHand = (shard.clockHand + 1) % MaxVnodeCacheProbeLength;
+    
+    uintptr_t victimIndex = AdvanceIndexInShard(vnodeHashIndex, handOffset);
+    for (uint32_t i = 0; i < MaxVnodeCacheProbeLength; ++i)
+    {
+        uintptr_t index = AdvanceIndexInShard(vnodeHashIndex, (handOffset + i) % MaxVnodeCacheProbeLength);
+        if (0 == s_entriesReferenced[index])
+        {
+            victimIndex = index;
+            break;
+        }
+        
+        s_entriesReferenced[index] = 0;
+    }
+    
+    RemoveEntry_ExclusiveLocked(victimIndex);
+}
+
+// Removes the entry at vnodeIndex using backward shift deletion, which keeps the Robin Hood
+// invariant intact without needing tombstones
+KEXT_STATIC void RemoveEntry_ExclusiveLocked(uintptr_t vnodeIndex)
 {
-    atomic_store_explicit(&s_cacheStats.cacheEntries, 0U, memory_order_relaxed);
+    assert(NULLVP != s_entries[vnodeIndex].vnode);
     
-    for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
+    // In a full shard every entry might be away from its home slot, so never go further than once around
+    uintptr_t maxShiftCount = s_shardModBitmask;
+    uintptr_t nextIndex = AdvanceIndexInShard(vnodeIndex, 1);
+    for (uintptr_t shiftCount = 0;
+         shiftCount < maxShiftCount &&
+         NULLVP != s_entries[nextIndex].vnode &&
+         0 != ComputeProbeDistance(s_entries[nextIndex].vnode, nextIndex);
+         ++shiftCount)
     {
-        atomic_store_explicit(&s_cacheStats.healthStats[i], 0ULL, memory_order_relaxed);
+        const VnodeCacheEntry& nextEntry = s_entries[nextIndex];
+        WriteEntry_ExclusiveLocked(vnodeIndex, nextEntry.vnode, nextEntry.vid, nextEntry.virtualizationRoot, nextEntry.rootGeneration);
+        s_entriesReferenced[vnodeIndex] = s_entriesReferenced[nextIndex];
+        
+        vnodeIndex = nextIndex;
+        nextIndex = AdvanceIndexInShard(nextIndex, 1);
+    }
+    
+    WriteEntry_ExclusiveLocked(vnodeIndex, NULLVP, 0, 0, 0);
+    s_entriesReferenced[vnodeIndex] = 0;
+    atomic_fetch_sub_explicit(&GetShardForIndex(vnodeIndex).stats.cacheEntries, 1U, memory_order_relaxed);
+}
+
+KEXT_STATIC_INLINE void MarkEntryReferenced(uintptr_t vnodeIndex)
+{
+    // Only write when the bit is clear, so that repeated hits on the same entry don't dirty its
+    // cache line.  This may race with other readers and the CLOCK hand, but a lost update only
+    // affects which entry is picked for eviction.
+    if (0 == s_entriesReferenced[vnodeIndex])
+    {
+        s_entriesReferenced[vnodeIndex] = 1;
+    }
+}
+
+KEXT_STATIC_INLINE void WriteEntry_ExclusiveLocked(
+    uintptr_t vnodeIndex,
+    vnode_t _Nullable vnode,
+    uint32_t vnodeVid,
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration)
+{
+    VnodeCacheEntry& entry = s_entries[vnodeIndex];
+    
+    // An odd sequence number tells lock-free readers that the entry is being modified
+    uint8_t sequence = atomic_load_explicit(&entry.sequence, memory_order_relaxed);
+    atomic_store_explicit(&entry.sequence, static_cast<uint8_t>(sequence + 1), memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    entry.vnode = vnode;
+    entry.vid = vnodeVid;
+    entry.virtualizationRoot = rootHandle;
+    entry.rootGeneration = rootGeneration;
+    
+    atomic_store_explicit(&entry.sequence, static_cast<uint8_t>(sequence + 2), memory_order_release);
+}
+
+KEXT_STATIC_INLINE uint32_t ComputeProbeLengthHistogramBucket(uint64_t probeLength)
+{
+    // Bucket 0 counts lookups that found their answer at the home index, bucket N (N > 0)
+    // counts probe lengths in [2^(N-1), 2^N), and the last bucket counts everything above that
+    uint32_t bucket = 0;
+    while (probeLength > 0 && bucket < PrjFSVnodeCacheProbeLengthHistogramBuckets - 1)
+    {
+        probeLength >>= 1;
+        ++bucket;
+    }
+    
+    return bucket;
+}
+
+// Returns how many lookups the current one stands for in the stats, or 0 if it shouldn't be counted.
+// The low bits of the clock pick the sample, as any shared counter would be written by every lookup.
+KEXT_STATIC_INLINE uint64_t SampleLookupStats()
+{
+    uint32_t sampleInterval = s_lookupStatsSampleInterval;
+    if (sampleInterval > 1 && 0 != (mach_absolute_time() & (sampleInterval - 1)))
+    {
+        return 0;
+    }
+    
+    return sampleInterval;
+}
+
+KEXT_STATIC_INLINE void RecordLookup(VnodeCacheShard& shard, uint64_t probeLength)
+{
+    uint64_t sampleWeight = SampleLookupStats();
+    if (0 == sampleWeight)
+    {
+        return;
+    }
+    
+    AtomicFetchAddCacheHealthStat(shard, VnodeCacheHealthStat_TotalCacheLookups, sampleWeight);
+    AtomicFetchAddCacheHealthStat(shard, VnodeCacheHealthStat_TotalLookupCollisions, probeLength * sampleWeight);
+    atomic_fetch_add_explicit(
+        &shard.stats.probeLengthHistogram[ComputeProbeLengthHistogramBucket(probeLength)],
+        sampleWeight,
+        memory_order_relaxed);
+}
+
+KEXT_STATIC_INLINE void InitCacheStats()
+{
+    for (uint32_t shardIndex = 0; shardIndex < PrjFSVnodeCacheMaxShards; ++shardIndex)
+    {
+        VnodeCacheStats& shardStats = s_shards[shardIndex].stats;
+        atomic_store_explicit(&shardStats.cacheEntries, 0U, memory_order_relaxed);
+        
+        for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
+        {
+            atomic_store_explicit(&shardStats.healthStats[i], 0ULL, memory_order_relaxed);
+        }
+        
+        for (uint32_t i = 0; i < PrjFSVnodeCacheProbeLengthHistogramBuckets; ++i)
+        {
+            atomic_store_explicit(&shardStats.probeLengthHistogram[i], 0ULL, memory_order_relaxed);
+        }
     }
 }
 
-KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat healthStat, uint64_t value)
+KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheShard& shard, VnodeCacheHealthStat healthStat, uint64_t value)
 {
-    uint64_t statValue = atomic_fetch_add_explicit(&s_cacheStats.healthStats[healthStat], value, memory_order_relaxed);
+    uint64_t statValue = atomic_fetch_add_explicit(&shard.stats.healthStats[healthStat], value, memory_order_relaxed);
     if (statValue > (UINT64_MAX - 1000))
     {
         // The logging daemon is not fetching stats quickly enough (or not running at all)
@@ -529,6 +1196,6 @@ KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat healt
                 VnodeCacheHealthStatNames[healthStat],
                 statValue);
         
-        atomic_store_explicit(&s_cacheStats.healthStats[healthStat], 0ULL, memory_order_relaxed);
+        atomic_store_explicit(&shard.stats.healthStats[healthStat], 0ULL, memory_order_relaxed);
     }
 }
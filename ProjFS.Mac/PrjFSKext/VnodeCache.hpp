@@ -3,7 +3,9 @@
 #include <sys/kernel_types.h>
 #include "VirtualizationRoots.hpp"
 
-kern_return_t VnodeCache_Init();
+// shardCount is rounded up to a power of 2 (capped at PrjFSVnodeCacheMaxShards). Each shard has its
+// own lock, so inserts into one shard don't block lookups and inserts in the others.
+kern_return_t VnodeCache_Init(uint32_t shardCount);
 
 kern_return_t VnodeCache_Cleanup();
 
@@ -36,4 +38,23 @@ VirtualizationRootHandle VnodeCache_InvalidateVnodeRootAndGetLatestRoot(
         vnode_t _Nonnull vnode,
         vfs_context_t _Nonnull context);
 
+// Only consults the cache, and unlike VnodeCache_FindRootForVnode never walks the vnode's ancestors.
+// Returns false if the cache has no up-to-date entry for the vnode.
+bool VnodeCache_TryGetCachedRootForVnode(vnode_t _Nonnull vnode, /* out */ VirtualizationRootHandle& rootHandle);
+
+// Refreshes the root of a directory that has just been renamed.  If the rename moved the directory
+// to a different root, the entries of the root it was previously in are invalidated (as the
+// directory's descendants are amongst them).
+VirtualizationRootHandle VnodeCache_RefreshRootForRenamedDirectory(
+        PerfTracer* _Nonnull perfTracer,
+        PrjFSPerfCounter cacheHitCounter,
+        PrjFSPerfCounter cacheMissCounter,
+        PrjFSPerfCounter cacheMissFallbackFunctionCounter,
+        PrjFSPerfCounter cacheMissFallbackFunctionInnerLoopCounter,
+        vnode_t _Nonnull directoryVnode,
+        vfs_context_t _Nonnull context);
+
+// Invalidates every entry that maps to rootHandle in O(1), by bumping the root's generation
+void VnodeCache_InvalidateRoot(PerfTracer* _Nonnull perfTracer, VirtualizationRootHandle rootHandle);
+
 void VnodeCache_InvalidateCache(PerfTracer* _Nonnull perfTracer);
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "kernel-header-wrappers/stdatomic.h"
+#include "Locks.hpp"
 #include "public/ArrayUtils.hpp"
+#include "public/PrjFSVnodeCacheHealth.h"
 
 enum UpdateCacheBehavior
 {
@@ -17,13 +19,41 @@ enum UpdateCacheBehavior
     UpdateCacheBehavior_InvalidateEntry,
 };
 
+// Entries are exactly a quarter of a cache line, and s_entries is cache line aligned, so no entry
+// straddles two lines and a lookup that resolves within VnodeCacheEntriesPerCacheLine slots of a
+// line-aligned home index reads a single line.  The vnode pointer is itself the key, so a separate
+// tag would not save the pointer compare.
 struct VnodeCacheEntry
 {
     vnode_t vnode;
     uint32_t vid;   // vnode generation number
     VirtualizationRootHandle virtualizationRoot;
+    
+    // Generation of virtualizationRoot at the time the entry was written.  The entry is stale once
+    // its root's generation has moved on (see VnodeCache_InvalidateRoot).
+    uint8_t rootGeneration;
+    
+    // Per-entry sequence number used by the lock-free read path.  Writers (which hold their
+    // shard's entriesLock exclusively) make the sequence odd while they update the entry and
+    // even again once they are done, so readers can detect torn reads and retry.
+    _Atomic(uint8_t) sequence;
 };
 
+KEXT_STATIC const uint32_t VnodeCacheLineSize = 64;
+KEXT_STATIC const uint32_t VnodeCacheEntriesPerCacheLine = VnodeCacheLineSize / sizeof(VnodeCacheEntry);
+static_assert(sizeof(VnodeCacheEntry) == 16, "VnodeCacheEntry should be 16 bytes so that entries pack evenly into cache lines");
+static_assert(VnodeCacheLineSize % sizeof(VnodeCacheEntry) == 0, "VnodeCacheEntry must not straddle cache lines");
+
+// Number of root generation counters.  The special (negative) root handles each have a counter of their own
+// at the top of the table, and the real roots are mapped onto the rest modulo their count, so roots that
+// share a counter are invalidated together (which is safe, just less precise).
+KEXT_STATIC const uint32_t VnodeCacheRootGenerationSlots = 256;
+// One for each VirtualizationRootSpecialHandle, from RootHandle_None down to RootHandle_ProviderTemporaryDirectory
+KEXT_STATIC const uint32_t VnodeCacheSpecialRootGenerationSlots = 3;
+
+// 2^64 / golden ratio, see ComputeVnodeHashIndex
+KEXT_STATIC const uint64_t VnodeHashMultiplier = 0x9E3779B97F4A7C15ULL;
+
 enum VnodeCacheHealthStat : int32_t
 {
     VnodeCacheHealthStat_InvalidateEntireCacheCount,
@@ -33,29 +63,68 @@ enum VnodeCacheHealthStat : int32_t
     VnodeCacheHealthStat_TotalFindRootForVnodeMisses,
     VnodeCacheHealthStat_TotalRefreshRootForVnode,
     VnodeCacheHealthStat_TotalInvalidateVnodeRoot,
+    VnodeCacheHealthStat_TotalEvictions,
+    VnodeCacheHealthStat_InvalidateRootGenerationCount,
     
     VnodeCacheHealthStat_Count
 };
 
 static constexpr const char* const VnodeCacheHealthStatNames[VnodeCacheHealthStat_Count] =
 {
-    [VnodeCacheHealthStat_InvalidateEntireCacheCount]  = "InvalidateEntireCacheCount",
-    [VnodeCacheHealthStat_TotalCacheLookups]           = "TotalCacheLookups",
-    [VnodeCacheHealthStat_TotalLookupCollisions]       = "TotalLookupCollisions",
-    [VnodeCacheHealthStat_TotalFindRootForVnodeHits]   = "TotalFindRootForVnodeHits",
-    [VnodeCacheHealthStat_TotalFindRootForVnodeMisses] = "TotalFindRootForVnodeMisses",
-    [VnodeCacheHealthStat_TotalRefreshRootForVnode]    = "TotalRefreshRootForVnode",
-    [VnodeCacheHealthStat_TotalInvalidateVnodeRoot]    = "TotalInvalidateVnodeRoot",
+    [VnodeCacheHealthStat_InvalidateEntireCacheCount]    = "InvalidateEntireCacheCount",
+    [VnodeCacheHealthStat_TotalCacheLookups]             = "TotalCacheLookups",
+    [VnodeCacheHealthStat_TotalLookupCollisions]         = "TotalLookupCollisions",
+    [VnodeCacheHealthStat_TotalFindRootForVnodeHits]     = "TotalFindRootForVnodeHits",
+    [VnodeCacheHealthStat_TotalFindRootForVnodeMisses]   = "TotalFindRootForVnodeMisses",
+    [VnodeCacheHealthStat_TotalRefreshRootForVnode]      = "TotalRefreshRootForVnode",
+    [VnodeCacheHealthStat_TotalInvalidateVnodeRoot]      = "TotalInvalidateVnodeRoot",
+    [VnodeCacheHealthStat_TotalEvictions]                = "TotalEvictions",
+    [VnodeCacheHealthStat_InvalidateRootGenerationCount] = "InvalidateRootGenerationCount",
 };
 
 struct VnodeCacheStats
 {
     _Atomic(uint32_t) cacheEntries;
     _Atomic(uint64_t) healthStats[VnodeCacheHealthStat_Count];
+    _Atomic(uint64_t) probeLengthHistogram[PrjFSVnodeCacheProbeLengthHistogramBuckets];
+};
+
+// The cache is split into shards, each owning a contiguous, power of 2 sized range of s_entries.  A
+// vnode's shard is selected by the high bits of its hash index, and probing wraps around within the
+// shard, so each shard can be locked, evicted from, and invalidated independently of the others.
+struct alignas(VnodeCacheLineSize) VnodeCacheShard
+{
+    // Only serializes writers; readers use the lock-free path in TryGetVnodeRootFromCache and
+    // only take this lock shared if they repeatedly race with writers
+    RWLock entriesLock;
+    
+    // Offset into the probe window where EvictEntryFromProbeWindow_ExclusiveLocked starts its sweep
+    uint32_t clockHand;
+    
+    // Sequence number for the shard's entries as a whole. It is odd while entries are being wiped or
+    // moved between slots, which allows the lock-free read path to detect that it raced with a move.
+    // Every lookup reads it, so it has a cache line to itself that only relocating entries writes to.
+    alignas(VnodeCacheLineSize) _Atomic(uint32_t) entriesSequence;
+    
+    alignas(VnodeCacheLineSize) VnodeCacheStats stats;
 };
 
 static_assert(AllArrayElementsInitialized(VnodeCacheHealthStatNames), "There must be an initialization of VnodeCacheHealthStatNames elements corresponding to each VnodeCacheHealthStat enum value");
 
-// Allow cache the cache to use between 4 MB and 64 MB of memory (assuming 16 bytes per VnodeCacheEntry)
+// Cache hits and lookups are only counted for about one in this many, chosen at random, and the
+// counts scaled up to match; counting every one would have all lookups in a shard writing to its
+// stats. Must be a power of 2.
+KEXT_STATIC const uint32_t VnodeCacheLookupStatsSampleInterval = 16;
+
+// Number of times TryGetVnodeRootFromCache will retry its lock-free read before
+// falling back to acquiring the shard's entriesLock shared
+KEXT_STATIC const uint32_t MaxLockFreeReadAttempts = 4;
+
+// Maximum distance (in slots) between an entry and its home index. Lookups never probe further than
+// this, and inserts that would need to place an entry further away evict an entry instead.
+KEXT_STATIC const uint32_t MaxVnodeCacheProbeLength = 16;
+
+// Allow cache the cache to use between 4 MB and 64 MB of memory (assuming 16 bytes per VnodeCacheEntry),
+// plus one byte per entry for its CLOCK reference bit
 KEXT_STATIC const uint32_t MinPow2VnodeCacheCapacity = 0x040000;
 KEXT_STATIC const uint32_t MaxPow2VnodeCacheCapacity = 0x400000;
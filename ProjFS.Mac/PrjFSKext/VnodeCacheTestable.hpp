@@ -1,6 +1,7 @@
 #include "public/PrjFSCommon.h"
 #include "public/FsidInode.h"
 #include "public/PrjFSPerfCounter.h"
+#include "kernel-header-wrappers/stdatomic.h"
 #include <sys/kernel_types.h>
 
 #ifndef __cplusplus
@@ -14,10 +15,19 @@
 // Forward declarations for unit testing
 class PerfTracer;
 struct VnodeCacheEntry;
+struct VnodeCacheShard;
 
-KEXT_STATIC_INLINE void InvalidateCache_ExclusiveLocked();
+KEXT_STATIC_INLINE void InvalidateShard_ExclusiveLocked(uint32_t shardIndex);
+KEXT_STATIC_INLINE uint32_t BeginEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard);
+KEXT_STATIC_INLINE void EndEntriesRelocation_ExclusiveLocked(VnodeCacheShard& shard, uint32_t sequence);
 KEXT_STATIC_INLINE uintptr_t ComputeVnodeHashIndex(vnode_t _Nonnull vnode);
 KEXT_STATIC_INLINE uint32_t ComputePow2CacheCapacity(int expectedVnodeCount);
+KEXT_STATIC_INLINE uint32_t ComputePow2ShardCount(uint32_t requestedShardCount);
+KEXT_STATIC_INLINE VnodeCacheShard& GetShardForIndex(uintptr_t vnodeIndex);
+KEXT_STATIC_INLINE uintptr_t AdvanceIndexInShard(uintptr_t vnodeIndex, uintptr_t distance);
+KEXT_STATIC_INLINE uint32_t GetRootGenerationSlot(VirtualizationRootHandle rootHandle);
+KEXT_STATIC_INLINE uint8_t LoadRootGeneration(VirtualizationRootHandle rootHandle);
+KEXT_STATIC_INLINE void SnapshotRootGenerations(uint8_t* _Nonnull rootGenerations);
 
 KEXT_STATIC bool TryGetVnodeRootFromCache(
     vnode_t _Nonnull vnode,
@@ -26,6 +36,21 @@ KEXT_STATIC bool TryGetVnodeRootFromCache(
     /* out parameters */
     VirtualizationRootHandle& rootHandle);
 
+KEXT_STATIC bool TryGetVnodeRootFromCache_LockFree(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    bool& rootFound,
+    VirtualizationRootHandle& rootHandle);
+
+KEXT_STATIC bool TryGetVnodeRootFromCache_Locked(
+    vnode_t _Nonnull vnode,
+    uintptr_t vnodeHashIndex,
+    uint32_t vnodeVid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle);
+
 KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
     PerfTracer* _Nonnull perfTracer,
     PrjFSPerfCounter cacheMissFallbackFunctionCounter,
@@ -38,11 +63,11 @@ KEXT_STATIC void FindVnodeRootFromDiskAndUpdateCache(
     /* out parameters */
     VirtualizationRootHandle& rootHandle);
 
-KEXT_STATIC void InsertEntryToInvalidatedCache_ExclusiveLocked(
-    vnode_t _Nonnull vnode,
-    uintptr_t vnodeHashIndex,
-    uint32_t vnodeVid,
-    VirtualizationRootHandle rootHandle);
+KEXT_STATIC bool TryGetAncestorRootFromCache(
+    vnode_t _Nonnull directoryVnode,
+    uint32_t vid,
+    /* out parameters */
+    VirtualizationRootHandle& rootHandle);
 
 KEXT_STATIC bool TryFindVnodeIndex_Locked(
     vnode_t _Nonnull vnode,
@@ -50,19 +75,42 @@ KEXT_STATIC bool TryFindVnodeIndex_Locked(
     /* out parameters */
     uintptr_t& vnodeIndex);
 
-KEXT_STATIC bool TryInsertOrUpdateEntry_ExclusiveLocked(
+KEXT_STATIC uint32_t InsertOrUpdateEntry_ExclusiveLocked(
     vnode_t _Nonnull vnode,
     uintptr_t vnodeHash,
     uint32_t vnodeVid,
     bool forceRefreshEntry,
-    VirtualizationRootHandle rootHandle);
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration);
+
+KEXT_STATIC bool ProbeWindowHasEmptySlot_Locked(uintptr_t vnodeHashIndex);
+KEXT_STATIC void EvictEntryFromProbeWindow_ExclusiveLocked(uintptr_t vnodeHashIndex);
+KEXT_STATIC void RemoveEntry_ExclusiveLocked(uintptr_t vnodeIndex);
+KEXT_STATIC_INLINE uintptr_t ComputeProbeDistance(vnode_t _Nonnull entryVnode, uintptr_t entryIndex);
+KEXT_STATIC_INLINE void MarkEntryReferenced(uintptr_t vnodeIndex);
+
+KEXT_STATIC_INLINE void WriteEntry_ExclusiveLocked(
+    uintptr_t vnodeIndex,
+    vnode_t _Nullable vnode,
+    uint32_t vnodeVid,
+    VirtualizationRootHandle rootHandle,
+    uint8_t rootGeneration);
 
+KEXT_STATIC_INLINE uint32_t ComputeProbeLengthHistogramBucket(uint64_t probeLength);
+KEXT_STATIC_INLINE uint64_t SampleLookupStats();
+KEXT_STATIC_INLINE void RecordLookup(VnodeCacheShard& shard, uint64_t probeLength);
 KEXT_STATIC_INLINE void InitCacheStats();
-KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat healthStat, uint64_t value);
+KEXT_STATIC_INLINE void AtomicFetchAddCacheHealthStat(VnodeCacheShard& shard, VnodeCacheHealthStat healthStat, uint64_t value);
 
 // Static variables used for maintaining Vnode cache state
 extern uint32_t s_entriesCapacity;
-extern uintptr_t s_ModBitmask;
+extern uint32_t s_hashBits;
+extern uint32_t s_shardIndexBits;
+extern uintptr_t s_shardModBitmask;
 extern VnodeCacheEntry* _Nullable s_entries;
-extern VnodeCacheStats s_cacheStats;
+extern uint8_t* _Nullable s_entriesReferenced;
+extern uint32_t s_shardCount;
+extern VnodeCacheShard s_shards[PrjFSVnodeCacheMaxShards];
+extern _Atomic(uint8_t) s_rootGenerations[VnodeCacheRootGenerationSlots];
+extern uint32_t s_lookupStatsSampleInterval;
 
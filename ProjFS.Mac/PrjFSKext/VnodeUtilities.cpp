@@ -1,3 +1,4 @@
+#include <kern/assert.h>
 #include "VnodeUtilities.hpp"
 #include "KextLog.hpp"
 #include "kernel-header-wrappers/vnode.h"
@@ -24,6 +25,29 @@ FsidInode Vnode_GetFsidAndInode(vnode_t vnode, vfs_context_t _Nonnull context, b
     return { statfs->f_fsid, attrs.va_linkid };
 }
 
+errno_t Vnode_GetAttributes(vnode_t vnode, vfs_context_t _Nonnull context, VnodeAttributes* attributes)
+{
+    vnode_attr attrs;
+    VATTR_INIT(&attrs);
+    VATTR_WANTED(&attrs, va_flags);
+    VATTR_WANTED(&attrs, va_linkid);
+    
+    *attributes = {};
+    errno_t error = vnode_getattr(vnode, &attrs, context);
+    if (0 != error)
+    {
+        return error;
+    }
+    
+    assert(VATTR_IS_SUPPORTED(&attrs, va_flags));
+    attributes->fileFlags = attrs.va_flags;
+    
+    // The fsid comes from the mount rather than va_fsid, so that it matches the fsid reported by Vnode_GetFsidAndInode
+    vfsstatfs* statfs = vfs_statfs(vnode_mount(vnode));
+    attributes->fsidInode = { statfs->f_fsid, attrs.va_linkid };
+    return 0;
+}
+
 SizeOrError Vnode_ReadXattr(vnode_t vnode, const char* xattrName, void* buffer, size_t bufferSize)
 {
     size_t actualSize = bufferSize;
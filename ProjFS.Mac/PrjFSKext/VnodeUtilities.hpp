@@ -10,6 +10,15 @@ struct SizeOrError
     errno_t error;
 };
 
+// The attributes the kauth vnode handler needs for a vnode, fetched with a single vnode_getattr call
+struct VnodeAttributes
+{
+    uint32_t fileFlags;
+    // Uses linkid for the inode, as this is used for getting the path in the provider
+    FsidInode fsidInode;
+};
+
 SizeOrError Vnode_ReadXattr(vnode_t _Nonnull vnode, const char* _Nonnull xattrName, void* _Nullable buffer, size_t bufferSize);
 FsidInode Vnode_GetFsidAndInode(vnode_t _Nonnull vnode, vfs_context_t _Nonnull context, bool useLinkIDForInode);
+errno_t Vnode_GetAttributes(vnode_t _Nonnull vnode, vfs_context_t _Nonnull context, VnodeAttributes* _Nonnull attributes);
 const char* _Nonnull Vnode_GetTypeAsString(vnode_t _Nullable vnode);
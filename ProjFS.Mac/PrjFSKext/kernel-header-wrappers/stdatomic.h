@@ -8,9 +8,14 @@ using std::atomic_uint_least64_t;
 using std::atomic_int;
 using std::memory_order_seq_cst;
 using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::atomic_load_explicit;
+using std::atomic_thread_fence;
 using std::atomic_store_explicit;
 using std::atomic_exchange_explicit;
 using std::atomic_fetch_add_explicit;
+using std::atomic_fetch_sub_explicit;
 #else
 #include <stdatomic.h>
 #endif
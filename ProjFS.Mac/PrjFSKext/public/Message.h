@@ -23,6 +23,8 @@ typedef enum
     MessageType_KtoU_NotifyDirectoryRenamed,
     MessageType_KtoU_NotifyFileHardLinkCreated,
     MessageType_KtoU_NotifyFilePreConvertToFull,
+    // Notifications to the provider had to be dropped, so it should resynchronise its state
+    MessageType_KtoU_NotifyNotificationsDropped,
     
     // Responses
     MessageType_Response_Success,
@@ -41,6 +43,23 @@ enum MessagePathField
     MessagePath_Count,
 };
 
+// How urgently the provider should handle a message, which follows from its type (see Message_GetPriority).
+// Lower values go first.
+typedef enum
+{
+    // A file system operation can't proceed until the placeholder has been filled in
+    MessagePriority_Blocking = 0,
+    // The kernel waits for the provider before deleting or modifying a file
+    MessagePriority_PreOperation,
+    // Tells the provider about an operation that has already happened
+    MessagePriority_Informational,
+    
+    MessagePriority_Count,
+} MessagePriority;
+
+// Notifications that the kernel doesn't wait for carry this message id, and must not be responded to
+static const uint64_t MessageId_NoResponse = 0;
+
 struct MessageHeader
 {
     // The message id is used to correlate a response to its request
@@ -70,5 +89,6 @@ struct Message
 
 
 uint32_t Message_EncodedSize(const MessageHeader* messageHeader);
+MessagePriority Message_GetPriority(MessageType messageType);
 
 #endif /* Message_h */
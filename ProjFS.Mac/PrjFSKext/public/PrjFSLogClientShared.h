@@ -9,6 +9,11 @@ enum PrjFSLogUserClientSelector
     
     LogSelector_FetchProfilingData,
     LogSelector_FetchVnodeCacheHealth,
+    LogSelector_FetchProviderQueueStats,
+    // Replaces the process policies (PrjFSProcessPolicyTable structure input). Administrators only.
+    LogSelector_SetProcessPolicies,
+    // Returns the process policies in effect, with their denial counts (PrjFSProcessPolicyTable)
+    LogSelector_FetchProcessPolicies,
 };
 
 enum PrjFSLogUserClientMemoryType
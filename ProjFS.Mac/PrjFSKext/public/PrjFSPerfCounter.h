@@ -8,13 +8,18 @@ enum PrjFSPerfCounter : int32_t
     PrjFSPerfCounter_VnodeOp,
         PrjFSPerfCounter_VnodeOp_GetPath,
         PrjFSPerfCounter_VnodeOp_BasicVnodeChecks,
+        PrjFSPerfCounter_VnodeOp_GetAttr,
         PrjFSPerfCounter_VnodeOp_ShouldHandle,
             PrjFSPerfCounter_VnodeOp_ShouldHandle_IsVnodeAccessCheck,
                 PrjFSPerfCounter_VnodeOp_ShouldHandle_IgnoredVnodeAccessCheck,
+            PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckOutsideRootsCache,
+                PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Hit,
+                PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Miss,
             PrjFSPerfCounter_VnodeOp_ShouldHandle_ReadFileFlags,
                 PrjFSPerfCounter_VnodeOp_ShouldHandle_NotInAnyRoot,
             PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckFileSystemCrawler,
                 PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedFileSystemCrawler,
+                PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedEnumeration,
         PrjFSPerfCounter_VnodeOp_GetVirtualizationRoot,
             PrjFSPerfCounter_VnodeOp_Vnode_Cache_Hit,
             PrjFSPerfCounter_VnodeOp_Vnode_Cache_Miss,
@@ -30,8 +35,14 @@ enum PrjFSPerfCounter : int32_t
         PrjFSPerfCounter_VnodeOp_RecursivelyEnumerateDirectory,
         PrjFSPerfCounter_VnodeOp_HydrateFile,
         PrjFSPerfCounter_VnodeOp_PreConvertToFull,
+        PrjFSPerfCounter_VnodeOp_PurgeAuthorizationCache,
     
     PrjFSPerfCounter_FileOp,
+        PrjFSPerfCounter_FileOp_Open_CheckOutsideRoots,
+            PrjFSPerfCounter_FileOp_Open_NoProviderOnMount,
+            PrjFSPerfCounter_FileOp_Open_FileOutsideRootsCache_Hit,
+            PrjFSPerfCounter_FileOp_Open_ParentOutsideRootsCache_Hit,
+            PrjFSPerfCounter_FileOp_Open_OutsideRootsCache_Miss,
         PrjFSPerfCounter_FileOp_ShouldHandle,
             PrjFSPerfCounter_FileOp_ShouldHandle_FindVirtualizationRoot,
                 PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
@@ -46,12 +57,14 @@ enum PrjFSPerfCounter : int32_t
                 PrjFSPerfCounter_FileOp_ShouldHandle_OriginatedByProvider,
         PrjFSPerfCounter_FileOp_Renamed,
         PrjFSPerfCounter_FileOp_HardLinkCreated,
+        PrjFSPerfCounter_FileOp_FileModifiedAlreadyReported,
         PrjFSPerfCounter_FileOp_FileModified,
         PrjFSPerfCounter_FileOp_FileCreated,
 
     PrjFSPerfCounter_CacheCapacity,
     PrjFSPerfCounter_CacheInvalidateCount,
-    PrjFSPerfCounter_CacheFullCount,
+    PrjFSPerfCounter_CacheInvalidateRootCount,
+    PrjFSPerfCounter_CacheEvictionCount,
     PrjFSPerfCounter_Count,
 };
 
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <sys/param.h>
+#include <stdint.h>
+
+// What happens when a process accesses a placeholder that hasn't been hydrated yet
+enum PrjFSProcessPolicyAction : uint32_t
+{
+    ProcessPolicyAction_Invalid = 0,
+    
+    // Access is denied rather than hydrating the file or enumerating the directory. Used for
+    // file system crawlers such as Spotlight, which would otherwise hydrate everything.
+    ProcessPolicyAction_DenyHydrate,
+    // The process is treated like any other
+    ProcessPolicyAction_Allow,
+    // Files are hydrated, but access to directories that haven't been enumerated yet is denied
+    ProcessPolicyAction_AllowWithoutEnumerate,
+    
+    ProcessPolicyAction_Count,
+};
+
+// Upper limit on the number of policies in PrjFSProcessPolicyTable. Up to 8 of these are
+// taken by the kext's built-in policies for file system crawlers, which user space can override
+// but not remove, so fewer can be set.
+#define PrjFSProcessPolicyMaxCount 64
+#define PrjFSProcessPolicyMaxSettableCount (PrjFSProcessPolicyMaxCount - 8)
+
+struct PrjFSProcessPolicy
+{
+    // Nul-terminated name of the process's executable, as reported by proc_name()
+    char processName[MAXCOMLEN + 1];
+    uint8_t reserved[3];
+    uint32_t action; // values of type PrjFSProcessPolicyAction
+    
+    // Only reported by the kext: accesses the policy has denied since the policies were last set
+    uint64_t denialCount;
+};
+
+struct PrjFSProcessPolicyTable
+{
+    // Only the first policyCount elements of policies are valid
+    uint32_t policyCount;
+    uint32_t reserved;
+    PrjFSProcessPolicy policies[PrjFSProcessPolicyMaxCount];
+};
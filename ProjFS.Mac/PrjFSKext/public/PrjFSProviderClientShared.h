@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 // External method selectors for provider user clients
 enum PrjFSProviderUserClientSelector
 {
@@ -7,13 +9,23 @@ enum PrjFSProviderUserClientSelector
     
     ProviderSelector_RegisterVirtualizationRootPath,
     ProviderSelector_KernelMessageResponse,
+    // Tells the kext that new entries have been written to the response ring
+    ProviderSelector_ResponseRingDoorbell,
+    // Replaces the message queue with one of the requested capacity (scalar input, in bytes),
+    // returning the capacity actually used. Only possible before the queue is mapped.
+    ProviderSelector_SetMessageQueueCapacity,
 };
 
+// Limits on the message queue capacity a provider may ask for. The minimum is also the default.
+static const uint32_t ProviderMessageQueueMinCapacityBytes = 100 * 1024;
+static const uint32_t ProviderMessageQueueMaxCapacityBytes = 4 * 1024 * 1024;
+
 enum PrjFSProviderUserClientMemoryType
 {
     ProviderMemoryType_Invalid = 0,
     
     ProviderMemoryType_MessageQueue,
+    ProviderMemoryType_ResponseRing,
 };
 
 enum PrjFSProviderUserClientPortType
@@ -22,3 +34,32 @@ enum PrjFSProviderUserClientPortType
     
     ProviderPortType_MessageQueue,
 };
+
+struct ProviderResponseRingEntry
+{
+    uint64_t messageId;
+    uint32_t responseType; // values of type MessageType
+    uint32_t reserved;
+};
+
+static const uint32_t ProviderResponseRingCapacity = 1024;
+
+// Shared memory (ProviderMemoryType_ResponseRing) through which the provider can pass responses to
+// kernel messages in batches, rather than making one ProviderSelector_KernelMessageResponse call
+// for each. The provider fills in entries and advances writeIndex, then rings the doorbell; the
+// kext consumes the entries up to writeIndex and advances readIndex. Each side only writes its own
+// index, and both indices wrap around freely, so writeIndex - readIndex is the number of entries
+// waiting. The indices are on separate cache lines, as they're written from different CPUs.
+struct ProviderResponseRing
+{
+    uint32_t writeIndex;
+    uint32_t padding0[15];
+    uint32_t readIndex;
+    uint32_t padding1[15];
+    // Set by the kext when a message didn't fit into the message queue. When the provider sees it
+    // set after dequeueing a message, it clears it and rings the doorbell, so that senders waiting
+    // for space in the queue are woken.
+    uint32_t messageQueueSpaceWanted;
+    uint32_t padding2[15];
+    ProviderResponseRingEntry entries[ProviderResponseRingCapacity];
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Upper limit on the number of providers reported in PrjFSProviderQueueStatsReport
+#define PrjFSProviderQueueStatsMaxProviders 64
+
+struct PrjFSProviderQueueStats
+{
+    int32_t providerPid;
+    int16_t rootHandle;
+    uint16_t reserved;
+
+    // Size of the provider's kernel -> user message queue
+    uint32_t queueCapacityBytes;
+
+    // Largest number of bytes occupied in the message queue since the stats were last fetched
+    uint32_t queueHighWaterBytes;
+
+    // Number of messages that didn't fit into the queue since the stats were last fetched.
+    // Requests wait for space and retry, notifications are dropped.
+    uint64_t enqueueFailures;
+
+    // Maximum number of requests that may be awaiting a response from the provider at once
+    uint32_t inFlightRequestWindow;
+
+    // Largest number of requests awaiting a response at once since the stats were last fetched
+    uint32_t inFlightRequestHighWater;
+};
+
+struct PrjFSProviderQueueStatsReport
+{
+    // Only the first providerCount elements of providers are valid
+    uint32_t providerCount;
+    uint32_t reserved;
+    PrjFSProviderQueueStats providers[PrjFSProviderQueueStatsMaxProviders];
+};
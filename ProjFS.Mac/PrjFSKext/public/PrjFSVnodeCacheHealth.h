@@ -1,8 +1,29 @@
 #pragma once
 
-struct PrjFSVnodeCacheHealth
+#include <stdint.h>
+
+// Number of log2-scale buckets in PrjFSVnodeCacheHealth::probeLengthHistogram
+#define PrjFSVnodeCacheProbeLengthHistogramBuckets 8
+
+// Upper limit on the number of independently locked shards the vnode cache is split into
+#define PrjFSVnodeCacheMaxShards 64
+
+struct PrjFSVnodeCacheShardHealth
+{
+    // Number of entries in the shard
+    uint32_t cacheEntries;
+    
+    uint64_t totalCacheLookups;
+    uint64_t totalLookupCollisions;
+    uint64_t totalFindRootForVnodeHits;
+    uint64_t totalFindRootForVnodeMisses;
+    uint64_t totalEvictions;
+};
+
+// Totals across all shards
+struct PrjFSVnodeCacheHealthSummary
 {
-    // Total capacity of the vnode cache
+    // Total capacity of the vnode cache (across all shards)
     uint32_t cacheCapacity;
     
     // Number of entries in the cache (i.e. the number of slots in use)
@@ -11,12 +32,15 @@ struct PrjFSVnodeCacheHealth
     // Number of times that the entire cache has been invalidated
     uint64_t invalidateEntireCacheCount;
     
+    // Number of times that the entries of a single virtualization root have been invalidated
+    uint64_t invalidateRootGenerationCount;
+    
     // Number of (internal) lookups in the cache array.  This value tracks how many times
     // the VnodeCache functions had to perform a lookup in the cache
     uint64_t totalCacheLookups;
     
     // Number of collisions that occurred when looking up entries in the cache.  Each step
-    // of the linear probe counts as a collision.
+    // of the (Robin Hood) probe counts as a collision.
     uint64_t totalLookupCollisions;
     
     // Number of times that VnodeCache_FindRootForVnode found an up-to-date vnode in the cache
@@ -31,4 +55,24 @@ struct PrjFSVnodeCacheHealth
     
     // Number of times VnodeCache_InvalidateVnodeRootAndGetLatestRoot was called
     uint64_t totalInvalidateVnodeRoot;
+    
+    // Number of entries evicted to make room for new entries
+    uint64_t totalEvictions;
+    
+    // Histogram of probe lengths of cache lookups. Bucket 0 counts lookups that were resolved
+    // at the vnode's home index, bucket N counts probe lengths in [2^(N-1), 2^N).
+    uint64_t probeLengthHistogram[PrjFSVnodeCacheProbeLengthHistogramBuckets];
+    
+    uint32_t shardCount;
 };
+
+struct PrjFSVnodeCacheHealth : PrjFSVnodeCacheHealthSummary
+{
+    // Per-shard breakdowns of the totals.  Only the first shardCount elements are valid.
+    PrjFSVnodeCacheShardHealth shards[PrjFSVnodeCacheMaxShards];
+};
+
+// The kext fills in the summary and the shards separately, so the shards must directly follow the summary
+static_assert(
+    sizeof(PrjFSVnodeCacheHealth) == sizeof(PrjFSVnodeCacheHealthSummary) + PrjFSVnodeCacheMaxShards * sizeof(PrjFSVnodeCacheShardHealth),
+    "PrjFSVnodeCacheHealth::shards must directly follow PrjFSVnodeCacheHealthSummary");
@@ -1,5 +1,6 @@
 #include "../PrjFSKext/public/PrjFSLogClientShared.h"
 #include "../PrjFSKext/public/PrjFSVnodeCacheHealth.h"
+#include "../PrjFSKext/public/PrjFSProviderQueueStats.h"
 #include "../PrjFSLib/Json/JsonWriter.hpp"
 #include "../PrjFSLib/PrjFSUser.hpp"
 #include <atomic>
@@ -22,6 +23,7 @@ using std::lock_guard;
 using std::mutex;
 using std::ostringstream;
 using std::string;
+using std::to_string;
 
 static const char PrjFSKextLogDaemon_OSLogSubsystem[] = "org.vfsforgit.prjfs.PrjFSKextLogDaemon";
 static const char PanicLogDirectory[] = "/Library/Logs/DiagnosticReports";
@@ -39,7 +41,8 @@ enum class MessageType
 {
     Info,
     Error,
-    VnodeCacheHealth
+    VnodeCacheHealth,
+    ProviderQueueStats
 };
 
 static mutex s_messageListenerMutex;
@@ -55,6 +58,7 @@ static void SetupExitSignalHandler();
 
 static dispatch_source_t StartPeriodicLoggingTimer(io_connect_t connection);
 static void FetchAndLogKextHealthData(io_connect_t connection);
+static void FetchAndLogProviderQueueStats(io_connect_t connection);
 
 static void ReportDroppedKextMessages();
 
@@ -62,6 +66,7 @@ static void ReportDroppedKextMessages();
 static void LogDaemonError(const string& message);
 static void LogKextMessage(os_log_type_t messageLogType, uint32_t messageFlags, const char* message, int messageLength);
 static void LogKextHealthData(const PrjFSVnodeCacheHealth& healthData);
+static void LogProviderQueueStats(const PrjFSProviderQueueStatsReport& report);
 
 static void CreatePipeToMessageListener();
 static void ClosePipeToMessageListener_Locked();
@@ -377,6 +382,7 @@ static dispatch_source_t StartPeriodicLoggingTimer(io_connect_t connection)
         // Every time the timer fires attempt to connect (if not already connected)
         CreatePipeToMessageListener();
         FetchAndLogKextHealthData(connection);
+        FetchAndLogProviderQueueStats(connection);
         ReportDroppedKextMessages();
     });
     dispatch_resume(timer);
@@ -404,6 +410,27 @@ static void FetchAndLogKextHealthData(io_connect_t connection)
     }
 }
 
+static void FetchAndLogProviderQueueStats(io_connect_t connection)
+{
+    PrjFSProviderQueueStatsReport report;
+    size_t out_size = sizeof(report);
+    IOReturn ret = IOConnectCallStructMethod(connection, LogSelector_FetchProviderQueueStats, nullptr, 0, &report, &out_size);
+    if (ret == kIOReturnUnsupported)
+    {
+        LogDaemonError("FetchAndLogProviderQueueStats: IOConnectCallStructMethod failed for LogSelector_FetchProviderQueueStats, ret: kIOReturnUnsupported");
+    }
+    else if (ret == kIOReturnSuccess)
+    {
+        LogProviderQueueStats(report);
+    }
+    else
+    {
+        ostringstream errorMessage;
+        errorMessage << "FetchAndLogProviderQueueStats: Fetching provider queue stats from kernel failed, ret: 0x" << hex << ret;
+        LogDaemonError(errorMessage.str());
+    }
+}
+
 static void ReportDroppedKextMessages()
 {
     // We should only report the number of drops reported during the last time interval (i.e. since the last
@@ -459,30 +486,95 @@ static void LogKextHealthData(const PrjFSVnodeCacheHealth& healthData)
 {
     os_log(
         s_kextLogger,
-        "PrjFS Vnode Cache Health: CacheCapacity=%u, CacheEntries=%u, InvalidationCount=%llu, CacheLookups=%llu, LookupCollisions=%llu, FindRootHits=%llu, FindRootMisses=%llu, RefreshRoot=%llu, InvalidateRoot=%llu",
+        "PrjFS Vnode Cache Health: CacheCapacity=%u, CacheEntries=%u, Shards=%u, InvalidationCount=%llu, RootGenerationInvalidationCount=%llu, CacheLookups=%llu, LookupCollisions=%llu, FindRootHits=%llu, FindRootMisses=%llu, RefreshRoot=%llu, InvalidateRoot=%llu, Evictions=%llu",
         healthData.cacheCapacity,
         healthData.cacheEntries,
+        healthData.shardCount,
         healthData.invalidateEntireCacheCount,
+        healthData.invalidateRootGenerationCount,
         healthData.totalCacheLookups,
         healthData.totalLookupCollisions,
         healthData.totalFindRootForVnodeHits,
         healthData.totalFindRootForVnodeMisses,
         healthData.totalRefreshRootForVnode,
-        healthData.totalInvalidateVnodeRoot);
+        healthData.totalInvalidateVnodeRoot,
+        healthData.totalEvictions);
     
     JsonWriter healthDataWriter;
     healthDataWriter.Add("CacheCapacity", healthData.cacheCapacity);
     healthDataWriter.Add("CacheEntries", healthData.cacheEntries);
     healthDataWriter.Add("InvalidationCount", healthData.invalidateEntireCacheCount);
+    healthDataWriter.Add("RootGenerationInvalidationCount", healthData.invalidateRootGenerationCount);
     healthDataWriter.Add("CacheLookups", healthData.totalCacheLookups);
     healthDataWriter.Add("LookupCollisions", healthData.totalLookupCollisions);
     healthDataWriter.Add("FindRootHits", healthData.totalFindRootForVnodeHits);
     healthDataWriter.Add("FindRootMisses", healthData.totalFindRootForVnodeMisses);
     healthDataWriter.Add("RefreshRoot", healthData.totalRefreshRootForVnode);
     healthDataWriter.Add("InvalidateRoot", healthData.totalInvalidateVnodeRoot);
+    healthDataWriter.Add("Evictions", healthData.totalEvictions);
+    
+    // Keys are the (inclusive) lower bound of each bucket's probe length range
+    JsonWriter probeLengthWriter;
+    for (uint32_t i = 0; i < PrjFSVnodeCacheProbeLengthHistogramBuckets; ++i)
+    {
+        uint64_t bucketLowerBound = (0 == i) ? 0 : (UINT64_C(1) << (i - 1));
+        probeLengthWriter.Add(to_string(bucketLowerBound), healthData.probeLengthHistogram[i]);
+    }
+    
+    healthDataWriter.Add("ProbeLengthHistogram", probeLengthWriter);
+    
+    JsonWriter shardsWriter;
+    for (uint32_t i = 0; i < healthData.shardCount && i < PrjFSVnodeCacheMaxShards; ++i)
+    {
+        const PrjFSVnodeCacheShardHealth& shardHealth = healthData.shards[i];
+        
+        JsonWriter shardWriter;
+        shardWriter.Add("CacheEntries", shardHealth.cacheEntries);
+        shardWriter.Add("CacheLookups", shardHealth.totalCacheLookups);
+        shardWriter.Add("LookupCollisions", shardHealth.totalLookupCollisions);
+        shardWriter.Add("FindRootHits", shardHealth.totalFindRootForVnodeHits);
+        shardWriter.Add("FindRootMisses", shardHealth.totalFindRootForVnodeMisses);
+        shardWriter.Add("Evictions", shardHealth.totalEvictions);
+        shardsWriter.Add(to_string(i), shardWriter);
+    }
+    
+    healthDataWriter.Add("Shards", shardsWriter);
     WriteJsonToMessageListener(MessageType::VnodeCacheHealth, healthDataWriter);
 }
 
+static void LogProviderQueueStats(const PrjFSProviderQueueStatsReport& report)
+{
+    JsonWriter providersWriter;
+    for (uint32_t i = 0; i < report.providerCount && i < PrjFSProviderQueueStatsMaxProviders; ++i)
+    {
+        const PrjFSProviderQueueStats& stats = report.providers[i];
+        os_log(
+            s_kextLogger,
+            "PrjFS Provider Queue Stats: Root=%d, PID=%d, QueueCapacity=%u, QueueHighWater=%u, EnqueueFailures=%llu, InFlightWindow=%u, InFlightHighWater=%u",
+            stats.rootHandle,
+            stats.providerPid,
+            stats.queueCapacityBytes,
+            stats.queueHighWaterBytes,
+            stats.enqueueFailures,
+            stats.inFlightRequestWindow,
+            stats.inFlightRequestHighWater);
+        
+        JsonWriter providerWriter;
+        providerWriter.Add("PID", stats.providerPid);
+        providerWriter.Add("QueueCapacity", stats.queueCapacityBytes);
+        providerWriter.Add("QueueHighWater", stats.queueHighWaterBytes);
+        providerWriter.Add("EnqueueFailures", stats.enqueueFailures);
+        providerWriter.Add("InFlightWindow", stats.inFlightRequestWindow);
+        providerWriter.Add("InFlightHighWater", stats.inFlightRequestHighWater);
+        providersWriter.Add(to_string(stats.rootHandle), providerWriter);
+    }
+    
+    JsonWriter reportWriter;
+    reportWriter.Add("ProviderCount", report.providerCount);
+    reportWriter.Add("Providers", providersWriter);
+    WriteJsonToMessageListener(MessageType::ProviderQueueStats, reportWriter);
+}
+
 static void CreatePipeToMessageListener()
 {
     lock_guard<mutex> lock(s_messageListenerMutex);
@@ -553,6 +645,9 @@ static string MessageTypeToString(MessageType messageType)
             
         case MessageType::VnodeCacheHealth:
             return "health.vnodeCache";
+            
+        case MessageType::ProviderQueueStats:
+            return "health.providerQueues";
     }
     
     return "invalid";
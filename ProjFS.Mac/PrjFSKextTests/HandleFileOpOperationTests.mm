@@ -153,7 +153,7 @@ class PrjFSProviderUserClient
     
     XCTAssertTrue(
        MockCalls::DidCallFunction(
-            ProviderMessaging_TrySendRequestAndWaitForResponse,
+            ProviderMessaging_TrySendNotification,
             _,
             MessageType_KtoU_NotifyFileCreated,
             testFileVnode.get(),
@@ -161,7 +161,6 @@ class PrjFSProviderUserClient
             _,
             _,
             _,
-            _,
             _));
 }
 
@@ -178,7 +177,81 @@ class PrjFSProviderUserClient
         0,
         0);
     
-    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
+}
+
+- (void) testOpenOnMountWithoutProvider {
+    // Opens on mounts without any active provider must be dismissed without looking for a root
+    shared_ptr<mount> otherMount = mount::Create();
+    shared_ptr<vnode> otherMountFile = otherMount->CreateVnodeTree("/Volumes/Other/file");
+    otherMountFile->attrValues.va_flags = 0;
+    
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_OPEN,
+        reinterpret_cast<uintptr_t>(otherMountFile.get()),
+        reinterpret_cast<uintptr_t>("/Volumes/Other/file"),
+        0,
+        0);
+    
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
+    VirtualizationRootHandle cachedRoot;
+    XCTAssertFalse(VnodeCache_TryGetCachedRootForVnode(otherMountFile.get(), cachedRoot));
+}
+
+- (void) testOpenAfterAllProvidersDisconnected {
+    [self tearDownProviders];
+    testFileVnode->attrValues.va_flags = 0;
+    
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_OPEN,
+        reinterpret_cast<uintptr_t>(testFileVnode.get()),
+        reinterpret_cast<uintptr_t>(filePath),
+        0,
+        0);
+    
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
+    VirtualizationRootHandle cachedRoot;
+    XCTAssertFalse(VnodeCache_TryGetCachedRootForVnode(testFileVnode.get(), cachedRoot));
+}
+
+- (void) testOpenInDirectoryKnownToBeOutsideRoots {
+    nonRepoFileVnode->attrValues.va_flags = 0;
+    
+    // The first open looks up the root, which caches the file's directory as being outside all roots
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_OPEN,
+        reinterpret_cast<uintptr_t>(nonRepoFileVnode.get()),
+        reinterpret_cast<uintptr_t>(nonRepoFilePath),
+        0,
+        0);
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
+    
+    VirtualizationRootHandle cachedRoot;
+    XCTAssertTrue(VnodeCache_TryGetCachedRootForVnode(nonRepoFileVnode.get(), cachedRoot));
+    XCTAssertEqual(cachedRoot, RootHandle_None);
+    
+    // A sibling is then dismissed based on the directory alone, without looking up its own root
+    const char* siblingPath = "/Users/test/code/NotInRepo/sibling";
+    shared_ptr<vnode> siblingVnode = testMount->CreateVnodeTree(siblingPath);
+    siblingVnode->attrValues.va_flags = 0;
+    
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_OPEN,
+        reinterpret_cast<uintptr_t>(siblingVnode.get()),
+        reinterpret_cast<uintptr_t>(siblingPath),
+        0,
+        0);
+    
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
+    XCTAssertFalse(VnodeCache_TryGetCachedRootForVnode(siblingVnode.get(), cachedRoot));
 }
 
 - (void) testCloseWithModifed {
@@ -195,7 +268,7 @@ class PrjFSProviderUserClient
     
     XCTAssertTrue(
        MockCalls::DidCallFunction(
-            ProviderMessaging_TrySendRequestAndWaitForResponse,
+            ProviderMessaging_TrySendNotification,
             _,
             MessageType_KtoU_NotifyFileModified,
             testFileVnode.get(),
@@ -203,7 +276,6 @@ class PrjFSProviderUserClient
             filePath,
             _,
             _,
-            _,
             _));
 }
 
@@ -221,7 +293,7 @@ class PrjFSProviderUserClient
     
     XCTAssertTrue(
        MockCalls::DidCallFunction(
-            ProviderMessaging_TrySendRequestAndWaitForResponse,
+            ProviderMessaging_TrySendNotification,
             _,
             MessageType_KtoU_NotifyFileModified,
             testFileVnode.get(),
@@ -229,10 +301,76 @@ class PrjFSProviderUserClient
             filePath,
             _,
             _,
-            _,
             _));
 }
 
+- (void) testRepeatedCloseWithModifedNotifiesOnce {
+    testFileVnode->attrValues.va_flags = FileFlags_IsInVirtualizationRoot;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        HandleFileOpOperation(
+            nullptr,
+            nullptr,
+            KAUTH_FILEOP_CLOSE,
+            reinterpret_cast<uintptr_t>(testFileVnode.get()),
+            reinterpret_cast<uintptr_t>(filePath),
+            KAUTH_FILEOP_CLOSE_MODIFIED,
+            0);
+    }
+    
+    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
+}
+
+- (void) testCloseWithModifedNotifiesAgainAfterProviderReconnects {
+    testFileVnode->attrValues.va_flags = FileFlags_IsInVirtualizationRoot;
+
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_CLOSE,
+        reinterpret_cast<uintptr_t>(testFileVnode.get()),
+        reinterpret_cast<uintptr_t>(filePath),
+        KAUTH_FILEOP_CLOSE_MODIFIED,
+        0);
+    
+    ActiveProvider_Disconnect(self->repoHandle, &dummyClient);
+    VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&dummyClient, dummyClientPid, repoPath);
+    XCTAssertEqual(result.error, 0);
+    self->repoHandle = result.root;
+
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_CLOSE,
+        reinterpret_cast<uintptr_t>(testFileVnode.get()),
+        reinterpret_cast<uintptr_t>(filePath),
+        KAUTH_FILEOP_CLOSE_MODIFIED,
+        0);
+    
+    // The new provider hasn't heard about the modification yet
+    XCTAssertEqual(2, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
+}
+
+- (void) testCloseWithModifedNotifiesAgainAfterFailedNotification {
+    testFileVnode->attrValues.va_flags = FileFlags_IsInVirtualizationRoot;
+    ProviderMessageMock_SetDefaultRequestResult(false);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        HandleFileOpOperation(
+            nullptr,
+            nullptr,
+            KAUTH_FILEOP_CLOSE,
+            reinterpret_cast<uintptr_t>(testFileVnode.get()),
+            reinterpret_cast<uintptr_t>(filePath),
+            KAUTH_FILEOP_CLOSE_MODIFIED,
+            0);
+    }
+    
+    XCTAssertEqual(2, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
+}
+
 - (void) testCloseWithModifedOnDirectory {
     testFileVnode->attrValues.va_flags = FileFlags_IsInVirtualizationRoot;
 
@@ -245,7 +383,7 @@ class PrjFSProviderUserClient
         KAUTH_FILEOP_CLOSE_MODIFIED,
         0);
     
-    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
 }
 
 
@@ -261,7 +399,7 @@ class PrjFSProviderUserClient
         0,
         0);
     
-    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
 }
 
 - (void)testFileopHardlink
@@ -277,9 +415,9 @@ class PrjFSProviderUserClient
         0);
     
     // from & target repos are the same, should message exactly once
-    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
@@ -298,7 +436,7 @@ class PrjFSProviderUserClient
         0);
     
     // neither from & target are in a root, should not message anyone
-    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertFalse(MockCalls::DidCallFunction(ProviderMessaging_TrySendNotification));
 }
 
 - (void)testFileopHardlinkIntoRepo
@@ -314,9 +452,9 @@ class PrjFSProviderUserClient
         0);
     
     // fromPath is outside repo, filePath is inside, should message exactly once
-    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
@@ -337,12 +475,12 @@ class PrjFSProviderUserClient
     
     // fromPath is for another repo than filePath, should message both providers
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->otherRepoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
@@ -365,16 +503,16 @@ class PrjFSProviderUserClient
     
     // fromPath is in an offline repo, which can't be messaged
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
     XCTAssertFalse(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->otherRepoHandle,
         _,
         _));
-    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
 }
 
 - (void)testFileopHardlinkOutOfRepo
@@ -390,9 +528,9 @@ class PrjFSProviderUserClient
         0);
     
     // filePath is outside repo, fromPath is inside, should message exactly once
-    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendRequestAndWaitForResponse));
+    XCTAssertEqual(1, MockCalls::CallCount(ProviderMessaging_TrySendNotification));
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
@@ -417,12 +555,12 @@ class PrjFSProviderUserClient
     
     // fromPath is for another repo than filePath, but this is the target provider's PID, so only message "from" provider
     XCTAssertFalse(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         _,
         _));
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->otherRepoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
@@ -447,12 +585,12 @@ class PrjFSProviderUserClient
     
     // fromPath is for another repo than filePath, but this is the "from" provider's PID, so only message target provider
     XCTAssertTrue(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->repoHandle,
         MessageType_KtoU_NotifyFileHardLinkCreated,
         _));
     XCTAssertFalse(MockCalls::DidCallFunction(
-        ProviderMessaging_TrySendRequestAndWaitForResponse,
+        ProviderMessaging_TrySendNotification,
         self->otherRepoHandle,
         _,
         _));
@@ -4,6 +4,7 @@
 #include "../PrjFSKext/VirtualizationRootsTestable.hpp"
 #include "../PrjFSKext/VnodeCachePrivate.hpp"
 #include "../PrjFSKext/VnodeCacheTestable.hpp"
+#include "../PrjFSKext/VnodeUtilities.hpp"
 #include "../PrjFSKext/PerformanceTracing.hpp"
 #include "../PrjFSKext/public/Message.h"
 #include "../PrjFSKext/ProviderMessaging.hpp"
@@ -185,10 +186,43 @@ static void TestForAllSupportedDarwinVersions(void(^testBlock)(void))
                 _,
                 _,
                 nullptr));
+        // Once hydrated, the vnode's cached authorization can be kept
+        XCTAssertFalse(MockCalls::DidCallFunction(cache_purge));
         MockCalls::Clear();
     }
 }
 
+- (void) testHydrationFetchesVnodeAttributesOnce
+{
+    testFileVnode->attrValues.va_flags = FileFlags_IsEmpty | FileFlags_IsInVirtualizationRoot;
+    SetPrjFSFileXattrData(testFileVnode);
+    
+    XCTAssertTrue(HandleVnodeOperation(
+        nullptr,
+        nullptr,
+        KAUTH_VNODE_READ_DATA | KAUTH_VNODE_WRITE_DATA,
+        reinterpret_cast<uintptr_t>(context),
+        reinterpret_cast<uintptr_t>(testFileVnode.get()),
+        0,
+        0) == KAUTH_RESULT_DEFER);
+    XCTAssertTrue(
+        MockCalls::DidCallFunction(
+            ProviderMessaging_TrySendRequestAndWaitForResponse,
+            _,
+            MessageType_KtoU_HydrateFile,
+            testFileVnode.get(),
+            _,
+            _,
+            _,
+            _,
+            _,
+            _,
+            nullptr));
+    
+    // Flags, fsid and inode for the hydration and pre-convert messages all come from the same fetch
+    XCTAssertEqual(MockCalls::CallCount(Vnode_GetAttributes), 1);
+}
+
 - (void) testFileDeleteHydratesOnlyWhenNecessary
 {
     testFileVnode->attrValues.va_flags = FileFlags_IsEmpty | FileFlags_IsInVirtualizationRoot;
@@ -309,6 +343,7 @@ static void TestForAllSupportedDarwinVersions(void(^testBlock)(void))
                 _,
                 _,
                 nullptr));
+        XCTAssertFalse(MockCalls::DidCallFunction(cache_purge));
         MockCalls::Clear();
     }
 }
@@ -1323,6 +1358,8 @@ static void TestForAllSupportedDarwinVersions(void(^testBlock)(void))
                 _,
                 _,
                 nullptr));
+        // Denying access leaves the file empty, so nothing may be authorized from the cache either
+        XCTAssertTrue(MockCalls::DidCallFunction(cache_purge, testFileVnode.get()));
         MockCalls::Clear();
     }
 }
@@ -1482,6 +1519,8 @@ static void TestForAllSupportedDarwinVersions(void(^testBlock)(void))
                 _,
                 _,
                 nullptr));
+        // The file is still empty, so the next access must not be authorized from the cache
+        XCTAssertTrue(MockCalls::DidCallFunction(cache_purge, testFileVnode.get()));
         MockCalls::Clear();
     }
 
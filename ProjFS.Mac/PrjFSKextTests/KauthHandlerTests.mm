@@ -2,6 +2,8 @@
 #include "../PrjFSKext/KauthHandlerTestable.hpp"
 #include "../PrjFSKext/PerformanceTracing.hpp"
 #include "../PrjFSKext/VirtualizationRootsTestable.hpp"
+#include "../PrjFSKext/VnodeCache.hpp"
+#include "../PrjFSKext/VnodeUtilities.hpp"
 #import "KextAssertIntegration.h"
 #import <sys/stat.h>
 #include "KextLogMock.h"
@@ -10,8 +12,45 @@
 #include "MockProc.hpp"
 #include "VnodeCacheEntriesWrapper.hpp"
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 using std::shared_ptr;
 using std::string;
+using std::vector;
+
+// Each thread repeatedly authorises a rename's delete, as well as a plain delete, as happens during a
+// large "git mv". Returns the number of rename + delete pairs that were told apart correctly.
+static uint64_t RunConcurrentRenamesAndDeletes(vnode_t testVnode, uint32_t threadCount, uint32_t renamesPerThread)
+{
+    std::atomic<uint64_t> totalPairsDetected(0);
+    vector<std::thread> threads;
+    for (uint32_t t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&totalPairsDetected, t, testVnode, renamesPerThread]()
+        {
+            MockProcess_SetCurrentThreadIndex(t);
+            uint64_t pairsDetected = 0;
+            for (uint32_t i = 0; i < renamesPerThread; ++i)
+            {
+                RecordPendingRenameOperation(testVnode);
+                bool renameDetected = DeleteOpIsForRename(testVnode);
+                bool deleteDetected = !DeleteOpIsForRename(testVnode);
+                pairsDetected += renameDetected && deleteDetected;
+            }
+            
+            totalPairsDetected += pairsDetected;
+        });
+    }
+    
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    
+    return totalPairsDetected.load();
+}
 
 @interface KauthHandlerTests : PFSKextTestCase
 @end
@@ -31,9 +70,13 @@ using std::string;
     MockProcess_AddContext(context, 501 /*pid*/);
     MockProcess_SetSelfInfo(501, "Test");
     MockProcess_AddProcess(501 /*pid*/, 1 /*credentialId*/, 1 /*ppid*/, "test" /*name*/);
+    XCTAssertTrue(InitHydrationDecisions());
+    XCTAssertTrue(InitProcessPolicies());
 }
 
 - (void) tearDown {
+    CleanupProcessPolicies();
+    CleanupHydrationDecisions();
     MockProcess_Reset();
     self->cacheWrapper.FreeCache();
     MockVnodes_CheckAndClear();
@@ -50,6 +93,20 @@ using std::string;
     XCTAssertFalse(ActionBitIsSet(KAUTH_VNODE_WRITE_DATA, KAUTH_VNODE_READ_DATA));
 }
 
+static bool IsFileSystemCrawler(const char* procname)
+{
+    uint32_t policySlot;
+    return ProcessPolicyAction_DenyHydrate == GetProcessPolicyAction(procname, &policySlot);
+}
+
+static PrjFSProcessPolicy MakeProcessPolicy(const char* processName, PrjFSProcessPolicyAction action)
+{
+    PrjFSProcessPolicy policy = {};
+    strlcpy(policy.processName, processName, sizeof(policy.processName));
+    policy.action = action;
+    return policy;
+}
+
 - (void)testIsFileSystemCrawler {
     XCTAssertTrue(IsFileSystemCrawler("mds"));
     XCTAssertTrue(IsFileSystemCrawler("mdworker"));
@@ -62,6 +119,119 @@ using std::string;
     XCTAssertFalse(IsFileSystemCrawler("git"));
 }
 
+- (void)testSetProcessPolicies {
+    PrjFSProcessPolicyTable table = {};
+    table.policies[table.policyCount++] = MakeProcessPolicy("codesearchd", ProcessPolicyAction_DenyHydrate);
+    table.policies[table.policyCount++] = MakeProcessPolicy("backupd", ProcessPolicyAction_AllowWithoutEnumerate);
+    table.policies[table.policyCount++] = MakeProcessPolicy("mdworker", ProcessPolicyAction_Allow);
+    XCTAssertTrue(KauthHandler_SetProcessPolicies(table));
+    
+    uint32_t policySlot;
+    XCTAssertEqual(GetProcessPolicyAction("codesearchd", &policySlot), ProcessPolicyAction_DenyHydrate);
+    XCTAssertEqual(GetProcessPolicyAction("backupd", &policySlot), ProcessPolicyAction_AllowWithoutEnumerate);
+    // Defaults can be overridden, but otherwise still apply
+    XCTAssertEqual(GetProcessPolicyAction("mdworker", &policySlot), ProcessPolicyAction_Allow);
+    XCTAssertEqual(GetProcessPolicyAction("mds", &policySlot), ProcessPolicyAction_DenyHydrate);
+    XCTAssertEqual(GetProcessPolicyAction("git", &policySlot), ProcessPolicyAction_Allow);
+    XCTAssertEqual(policySlot, UINT32_MAX);
+    
+    PrjFSProcessPolicyTable reportedTable;
+    KauthHandler_GetProcessPolicies(reportedTable);
+    XCTAssertEqual(reportedTable.policyCount, 8);
+    
+    // Setting policies again replaces the previous ones
+    table.policyCount = 1;
+    XCTAssertTrue(KauthHandler_SetProcessPolicies(table));
+    XCTAssertEqual(GetProcessPolicyAction("codesearchd", &policySlot), ProcessPolicyAction_DenyHydrate);
+    XCTAssertEqual(GetProcessPolicyAction("backupd", &policySlot), ProcessPolicyAction_Allow);
+    XCTAssertEqual(GetProcessPolicyAction("mdworker", &policySlot), ProcessPolicyAction_DenyHydrate);
+}
+
+- (void)testSetProcessPoliciesRejectsInvalidPolicies {
+    PrjFSProcessPolicyTable table = {};
+    table.policies[table.policyCount++] = MakeProcessPolicy("codesearchd", ProcessPolicyAction_DenyHydrate);
+    table.policies[table.policyCount++] = MakeProcessPolicy("backupd", ProcessPolicyAction_Invalid);
+    XCTAssertFalse(KauthHandler_SetProcessPolicies(table));
+    XCTAssertTrue(MockCalls::DidCallFunction(KextMessageLogged, KEXTLOG_ERROR));
+    MockCalls::Clear();
+    
+    table.policies[1] = MakeProcessPolicy("", ProcessPolicyAction_Allow);
+    XCTAssertFalse(KauthHandler_SetProcessPolicies(table));
+    MockCalls::Clear();
+    
+    // Names must be nul-terminated
+    memset(table.policies[1].processName, 'a', sizeof(table.policies[1].processName));
+    XCTAssertFalse(KauthHandler_SetProcessPolicies(table));
+    MockCalls::Clear();
+    
+    table.policyCount = PrjFSProcessPolicyMaxSettableCount + 1;
+    XCTAssertFalse(KauthHandler_SetProcessPolicies(table));
+    
+    // Nothing was changed
+    uint32_t policySlot;
+    XCTAssertEqual(GetProcessPolicyAction("codesearchd", &policySlot), ProcessPolicyAction_Allow);
+}
+
+- (void)testShouldHandleVnodeOpEventAppliesProcessPolicies {
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testFileVnode = vnode::Create(testMount, "/foo");
+    shared_ptr<vnode> testDirVnode = vnode::Create(testMount, "/bar", VDIR);
+    testFileVnode->attrValues.va_flags = FileFlags_IsEmpty | FileFlags_IsInVirtualizationRoot;
+    testDirVnode->attrValues.va_flags = FileFlags_IsEmpty | FileFlags_IsInVirtualizationRoot;
+    PerfTracer perfTracer;
+    
+    VnodeAttributes vnodeAttributes;
+    int pid;
+    char procname[MAXCOMLEN + 1] = "";
+    int kauthResult;
+    int kauthError;
+    
+    PrjFSProcessPolicyTable table = {};
+    table.policies[table.policyCount++] = MakeProcessPolicy("backupd", ProcessPolicyAction_AllowWithoutEnumerate);
+    XCTAssertTrue(KauthHandler_SetProcessPolicies(table));
+    
+    MockProcess_Reset();
+    MockProcess_SetSelfInfo(501, "Test");
+    MockProcess_AddContext(context, 501 /*pid*/);
+    MockProcess_AddProcess(501 /*pid*/, 1 /*credentialId*/, 1 /*ppid*/, "backupd" /*name*/);
+    
+    // Files may be hydrated...
+    XCTAssertTrue(
+        ShouldHandleVnodeOpEvent(
+            &perfTracer,
+            context,
+            testFileVnode.get(),
+            KAUTH_VNODE_READ_DATA,
+            &vnodeAttributes,
+            &pid,
+            procname,
+            &kauthResult,
+            &kauthError));
+    XCTAssertEqual(kauthResult, KAUTH_RESULT_DEFER);
+    
+    // ...but directories aren't enumerated
+    XCTAssertFalse(
+        ShouldHandleVnodeOpEvent(
+            &perfTracer,
+            context,
+            testDirVnode.get(),
+            KAUTH_VNODE_LIST_DIRECTORY,
+            &vnodeAttributes,
+            &pid,
+            procname,
+            &kauthResult,
+            &kauthError));
+    XCTAssertEqual(kauthResult, KAUTH_RESULT_DENY);
+    
+    PrjFSProcessPolicyTable reportedTable;
+    KauthHandler_GetProcessPolicies(reportedTable);
+    for (uint32_t i = 0; i < reportedTable.policyCount; ++i)
+    {
+        const PrjFSProcessPolicy& policy = reportedTable.policies[i];
+        XCTAssertEqual(policy.denialCount, 0 == strcmp(policy.processName, "backupd") ? 1 : 0);
+    }
+}
+
 - (void)testFileFlagsBitIsSet {
     XCTAssertTrue(FileFlagsBitIsSet(FileFlags_IsEmpty, FileFlags_IsEmpty));
     XCTAssertTrue(FileFlagsBitIsSet(FileFlags_IsInVirtualizationRoot, FileFlags_IsInVirtualizationRoot));
@@ -124,7 +294,7 @@ using std::string;
     kauth_action_t action = KAUTH_VNODE_READ_DATA;
     
     // Out Parameters
-    uint32_t vnodeFileFlags;
+    VnodeAttributes vnodeAttributes;
     int pid;
     char procname[MAXCOMLEN + 1] = "";
     int kauthResult;
@@ -138,7 +308,7 @@ using std::string;
             context,
             testVnode.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -153,7 +323,7 @@ using std::string;
             context,
             testVnode.get(),
             KAUTH_VNODE_ACCESS,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -167,7 +337,7 @@ using std::string;
             context,
             testVnode.get(),
             KAUTH_VNODE_ACCESS | KAUTH_VNODE_READ_DATA,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -183,7 +353,7 @@ using std::string;
             context,
             testVnodeNone.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -199,7 +369,7 @@ using std::string;
             context,
             testVnodeInvalidType.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -215,7 +385,7 @@ using std::string;
             context,
             testVnode.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -233,7 +403,7 @@ using std::string;
             context,
             testVnode.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -255,7 +425,7 @@ using std::string;
             context,
             testVnode.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -273,7 +443,70 @@ using std::string;
             context,
             testVnode.get(),
             action,
-            &vnodeFileFlags,
+            &vnodeAttributes,
+            &pid,
+            procname,
+            &kauthResult,
+            &kauthError));
+    XCTAssertEqual(kauthResult, KAUTH_RESULT_DEFER);
+}
+
+- (void)testShouldHandleVnodeOpEvent_VnodeCachedOutsideRoots {
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testVnode = vnode::Create(testMount, "/foo");
+    testVnode->attrValues.va_flags = FileFlags_IsInVirtualizationRoot;
+    PerfTracer perfTracer;
+    
+    VnodeAttributes vnodeAttributes;
+    int pid;
+    char procname[MAXCOMLEN + 1] = "";
+    int kauthResult;
+    int kauthError;
+    
+    vnode_t vnode = testVnode.get();
+    InsertOrUpdateEntry_ExclusiveLocked(vnode, ComputeVnodeHashIndex(vnode), vnode_vid(vnode), false, RootHandle_None, LoadRootGeneration(RootHandle_None));
+    
+    // The flags are never read for vnodes that the cache knows to be outside of every root, so a
+    // failing getattr would go unnoticed
+    testVnode->errors.getattr = EBADF;
+    XCTAssertFalse(
+        ShouldHandleVnodeOpEvent(
+            &perfTracer,
+            context,
+            vnode,
+            KAUTH_VNODE_READ_DATA,
+            &vnodeAttributes,
+            &pid,
+            procname,
+            &kauthResult,
+            &kauthError));
+    XCTAssertEqual(kauthResult, KAUTH_RESULT_DEFER);
+    
+    // Once the cache entry is invalidated, the flags are read again
+    VnodeCache_InvalidateRoot(&perfTracer, RootHandle_None);
+    XCTAssertFalse(
+        ShouldHandleVnodeOpEvent(
+            &perfTracer,
+            context,
+            vnode,
+            KAUTH_VNODE_READ_DATA,
+            &vnodeAttributes,
+            &pid,
+            procname,
+            &kauthResult,
+            &kauthError));
+    XCTAssertEqual(kauthResult, KAUTH_RESULT_DENY);
+    testVnode->errors.getattr = 0;
+    
+    // Vnodes cached as being inside a root still have their flags checked
+    InsertOrUpdateEntry_ExclusiveLocked(vnode, ComputeVnodeHashIndex(vnode), vnode_vid(vnode), true, 0, LoadRootGeneration(0));
+    XCTAssertTrue(
+        ShouldHandleVnodeOpEvent(
+            &perfTracer,
+            context,
+            vnode,
+            KAUTH_VNODE_READ_DATA,
+            &vnodeAttributes,
             &pid,
             procname,
             &kauthResult,
@@ -321,6 +554,9 @@ using std::string;
     MockProcess_AddProcess(501 /*pid*/, 2 /*credentialId*/, 1 /*ppid*/, "test" /*name*/);
     XCTAssertTrue(CurrentProcessIsAllowedToHydrate());
     MockProcess_Reset();
+    // The next scenario only changes the parent's UID, which real processes can't do without a new pid
+    CleanupHydrationDecisions();
+    XCTAssertTrue(InitHydrationDecisions());
 
     // Process and it's parent are service users
     MockProcess_AddContext(context, 502 /*pid*/);
@@ -332,6 +568,53 @@ using std::string;
     XCTAssertFalse(CurrentProcessIsAllowedToHydrate());
 }
 
+- (void)testCurrentProcessIsAllowedToHydrateCachesAncestry {
+    MockProcess_Reset();
+    MockProcess_AddContext(context, 503 /*pid*/);
+    MockProcess_SetSelfInfo(503, "Test");
+    MockProcess_AddCredential(1 /*credentialId*/, 1 /*UID*/);
+    MockProcess_AddCredential(2 /*credentialId*/, 501 /*UID*/);
+    MockProcess_AddProcess(503 /*pid*/, 1 /*credentialId*/, 502 /*ppid*/, "test" /*name*/);
+    MockProcess_AddProcess(502 /*pid*/, 1 /*credentialId*/, 501 /*ppid*/, "test" /*name*/);
+    MockProcess_AddProcess(501 /*pid*/, 2 /*credentialId*/, 1 /*ppid*/, "test" /*name*/);
+    
+    XCTAssertTrue(CurrentProcessIsAllowedToHydrate());
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 2);
+    
+    // Subsequent checks don't walk the ancestors again
+    for (int i = 0; i < 10; ++i)
+    {
+        XCTAssertTrue(CurrentProcessIsAllowedToHydrate());
+    }
+    
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 2);
+    
+    // Same pid, but a different process whose parent is owned by a service user
+    MockProcess_Reset();
+    MockProcess_SetSelfInfo(503, "Test");
+    MockProcess_AddCredential(1 /*credentialId*/, 1 /*UID*/);
+    MockProcess_AddProcess(503 /*pid*/, 1 /*credentialId*/, 600 /*ppid*/, "test" /*name*/);
+    MockProcess_AddProcess(600 /*pid*/, 1 /*credentialId*/, 1 /*ppid*/, "test" /*name*/);
+    XCTAssertFalse(CurrentProcessIsAllowedToHydrate());
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 1);
+    XCTAssertFalse(CurrentProcessIsAllowedToHydrate());
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 1);
+}
+
+- (void)testCurrentProcessIsAllowedToHydrateRetriesIncompleteAncestry {
+    MockProcess_Reset();
+    MockProcess_AddContext(context, 503 /*pid*/);
+    MockProcess_SetSelfInfo(503, "Test");
+    MockProcess_AddCredential(1 /*credentialId*/, 1 /*UID*/);
+    MockProcess_AddProcess(503 /*pid*/, 1 /*credentialId*/, 502 /*ppid*/, "test" /*name*/);
+    
+    // Parent can't be found, which isn't remembered
+    XCTAssertFalse(CurrentProcessIsAllowedToHydrate());
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 1);
+    XCTAssertFalse(CurrentProcessIsAllowedToHydrate());
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 2);
+}
+
 - (void)testUseMainForkIfNamedStream {
     shared_ptr<mount> testMount = mount::Create();
     const char* filePath = "/Users/test/code/Repo/file";
@@ -370,6 +653,7 @@ using std::string;
     shared_ptr<vnode> testFile = testMount->CreateVnodeTree(filePath);
 
     InitPendingRenames();
+    s_pendingRenameSlotCount = 0; // pretend the slots are all taken
     ResizePendingRenames(16);
     s_pendingRenameCount = 16; // pretend we're full
     XCTAssertFalse(MockCalls::DidCallFunction(KextMessageLogged, KEXTLOG_ERROR));
@@ -404,4 +688,69 @@ using std::string;
     CleanupPendingRenames();
 }
 
+- (void)testPendingRenamesPreferSlotsOverArray
+{
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testFile = testMount->CreateVnodeTree("/Users/test/code/Repo/file");
+
+    InitPendingRenames();
+    XCTAssertGreaterThanOrEqual(s_pendingRenameSlotCount, 64);
+    RecordPendingRenameOperation(testFile.get());
+    XCTAssertEqual(s_pendingRenameCount, 0);
+    XCTAssertTrue(DeleteOpIsForRename(testFile.get()));
+    XCTAssertFalse(DeleteOpIsForRename(testFile.get()));
+    CleanupPendingRenames();
+}
+
+- (void)testPendingRenamesFallBackToArrayWhenSlotsTaken
+{
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testFile1 = testMount->CreateVnodeTree("/Users/test/code/Repo/file1");
+    shared_ptr<vnode> testFile2 = testMount->CreateVnodeTree("/Users/test/code/Repo/file2");
+
+    InitPendingRenames();
+    RecordPendingRenameOperation(testFile1.get());
+    uint32_t slotCount = s_pendingRenameSlotCount;
+    s_pendingRenameSlotCount = 0; // pretend the slots are all taken
+    MockProcess_SetCurrentThreadIndex(1);
+    RecordPendingRenameOperation(testFile2.get());
+    XCTAssertEqual(s_pendingRenameCount, 1);
+    XCTAssertTrue(DeleteOpIsForRename(testFile2.get()));
+    XCTAssertEqual(s_pendingRenameCount, 0);
+    s_pendingRenameSlotCount = slotCount;
+    MockProcess_SetCurrentThreadIndex(0);
+    XCTAssertTrue(DeleteOpIsForRename(testFile1.get()));
+    CleanupPendingRenames();
+}
+
+- (void)testPendingRenames_ConcurrentRenameAndDelete
+{
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testFile = testMount->CreateVnodeTree("/Users/test/code/Repo/file");
+    const uint32_t renamesPerThread = 1000;
+    
+    InitPendingRenames();
+    for (uint32_t threadCount : { 1u, 4u, 16u })
+    {
+        XCTAssertEqual(RunConcurrentRenamesAndDeletes(testFile.get(), threadCount, renamesPerThread), static_cast<uint64_t>(threadCount) * renamesPerThread);
+    }
+    
+    XCTAssertEqual(s_pendingRenameCount, 0);
+    CleanupPendingRenames();
+}
+
+- (void)testPendingRenames_ConcurrentRenameAndDeletePerformance
+{
+    shared_ptr<mount> testMount = mount::Create();
+    shared_ptr<vnode> testFile = testMount->CreateVnodeTree("/Users/test/code/Repo/file");
+    vnode_t testVnode = testFile.get();
+    
+    InitPendingRenames();
+    [self measureBlock:^{
+        RunConcurrentRenamesAndDeletes(testVnode, 16, 200000);
+    }];
+    
+    CleanupPendingRenames();
+}
+
 @end
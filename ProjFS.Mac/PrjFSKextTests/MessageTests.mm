@@ -1,6 +1,11 @@
 #import "KextAssertIntegration.h"
 
 #include "../PrjFSKext/Message_Kernel.hpp"
+#include "../PrjFSKext/OutstandingMessages.hpp"
+#include "../PrjFSKext/ProviderResponseRing.hpp"
+#include "../PrjFSKext/ProviderMessageQueue.hpp"
+#include <memory>
+#include "ProviderMessagingMock.hpp"
 
 @interface MessageTests : PFSKextTestCase
 
@@ -44,4 +49,272 @@
     
 }
 
+- (void)testMessageGetPriority
+{
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_HydrateFile), MessagePriority_Blocking);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_EnumerateDirectory), MessagePriority_Blocking);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_RecursivelyEnumerateDirectory), MessagePriority_Blocking);
+    
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyFilePreDelete), MessagePriority_PreOperation);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyFilePreDeleteFromRename), MessagePriority_PreOperation);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyDirectoryPreDelete), MessagePriority_PreOperation);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyFilePreConvertToFull), MessagePriority_PreOperation);
+    
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyFileModified), MessagePriority_Informational);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyFileRenamed), MessagePriority_Informational);
+    XCTAssertEqual(Message_GetPriority(MessageType_KtoU_NotifyNotificationsDropped), MessagePriority_Informational);
+}
+
+- (void)testOutstandingMessages_ConcurrentWaitersAllComplete
+{
+    // More waiters than fit into the in-flight window, so some of them have to wait for it to open up
+    XCTAssertGreaterThan(ProviderMessageMock_MeasureOutstandingMessageThroughput(64, 10, 1, 16), 0.0);
+    XCTAssertGreaterThan(ProviderMessageMock_MeasureOutstandingMessageThroughput(64, 10, 4, ProviderInFlightMessageWindow), 0.0);
+}
+
+- (void)testOutstandingMessages_ConcurrentWaitersPerformance
+{
+    [self measureBlock:^{
+        ProviderMessageMock_MeasureOutstandingMessageThroughput(256, 200, 4, ProviderInFlightMessageWindow);
+    }];
+}
+
+- (void)testOutstandingMessageBuckets_FindCoalescable
+{
+    OutstandingMessageBuckets table;
+    OutstandingMessageBuckets_Init(table);
+    
+    const FsidInode fileId = { .fsid = { .val = { 1, 2 } }, .inode = 1234 };
+    const FsidInode otherFileId = { .fsid = { .val = { 1, 2 } }, .inode = 1234 + OutstandingMessageBucketCount };
+    
+    OutstandingMessage hydrate = { .rootHandle = 3 };
+    hydrate.request.messageId = 10;
+    hydrate.request.messageType = MessageType_KtoU_HydrateFile;
+    hydrate.request.fsidInode = fileId;
+    OutstandingMessageBuckets_Insert(table, &hydrate);
+    XCTAssertTrue(hydrate.isCoalescable);
+    
+    OutstandingMessage notification = { .rootHandle = 3 };
+    notification.request.messageId = 11;
+    notification.request.messageType = MessageType_KtoU_NotifyFileModified;
+    notification.request.fsidInode = fileId;
+    OutstandingMessageBuckets_Insert(table, &notification);
+    XCTAssertFalse(notification.isCoalescable);
+    
+    XCTAssertEqual(&hydrate, OutstandingMessageBuckets_FindCoalescable(table, 3, MessageType_KtoU_HydrateFile, fileId));
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_FindCoalescable(table, 4, MessageType_KtoU_HydrateFile, fileId));
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_FindCoalescable(table, 3, MessageType_KtoU_EnumerateDirectory, fileId));
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_FindCoalescable(table, 3, MessageType_KtoU_HydrateFile, otherFileId));
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_FindCoalescable(table, 3, MessageType_KtoU_NotifyFileModified, fileId));
+    
+    // Response lookup is unaffected by the coalescing index
+    XCTAssertEqual(&hydrate, OutstandingMessageBuckets_Find(table, 3, 10));
+    XCTAssertEqual(&notification, OutstandingMessageBuckets_Find(table, 3, 11));
+    
+    OutstandingMessageBuckets_Remove(&hydrate);
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_FindCoalescable(table, 3, MessageType_KtoU_HydrateFile, fileId));
+    XCTAssertEqual(nullptr, OutstandingMessageBuckets_Find(table, 3, 10));
+    
+    OutstandingMessageBuckets_Remove(&notification);
+}
+
+- (void)testOutstandingMessage_IsCoalescable
+{
+    const FsidInode fileId = { .fsid = { .val = { 1, 2 } }, .inode = 1234 };
+    const FsidInode noFsid = { .inode = 1234 };
+    
+    XCTAssertTrue(OutstandingMessage_IsCoalescable(MessageType_KtoU_HydrateFile, fileId));
+    XCTAssertTrue(OutstandingMessage_IsCoalescable(MessageType_KtoU_EnumerateDirectory, fileId));
+    XCTAssertTrue(OutstandingMessage_IsCoalescable(MessageType_KtoU_RecursivelyEnumerateDirectory, fileId));
+    XCTAssertFalse(OutstandingMessage_IsCoalescable(MessageType_KtoU_NotifyFilePreDelete, fileId));
+    XCTAssertFalse(OutstandingMessage_IsCoalescable(MessageType_KtoU_HydrateFile, noFsid));
+}
+
+- (void)testProviderResponseRing_TakeResponses
+{
+    std::unique_ptr<ProviderResponseRing> ring(new ProviderResponseRing{});
+    ProviderResponseRingEntry responses[ProviderResponseRingDrainBatchSize];
+    uint32_t responseCount = UINT32_MAX;
+    
+    // Start just short of the index wrapping around
+    uint32_t readIndex = UINT32_MAX - 2;
+    ring->writeIndex = readIndex;
+    XCTAssertTrue(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(0, responseCount);
+    
+    const uint32_t publishedCount = ProviderResponseRingDrainBatchSize + 5;
+    for (uint32_t i = 0; i < publishedCount; ++i)
+    {
+        ProviderResponseRingEntry& entry = ring->entries[(ring->writeIndex + i) % ProviderResponseRingCapacity];
+        entry.messageId = 100 + i;
+        entry.responseType = MessageType_Response_Success;
+    }
+    ring->writeIndex += publishedCount;
+    
+    XCTAssertTrue(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(ProviderResponseRingDrainBatchSize, responseCount);
+    XCTAssertEqual(100, responses[0].messageId);
+    XCTAssertEqual(100 + ProviderResponseRingDrainBatchSize - 1, responses[ProviderResponseRingDrainBatchSize - 1].messageId);
+    XCTAssertEqual(readIndex, ring->readIndex);
+    
+    XCTAssertTrue(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(5, responseCount);
+    XCTAssertEqual(100 + ProviderResponseRingDrainBatchSize, responses[0].messageId);
+    XCTAssertEqual(ring->writeIndex, readIndex);
+    XCTAssertEqual(ring->writeIndex, ring->readIndex);
+}
+
+- (void)testProviderResponseRing_TakeResponsesIgnoresSharedReadIndex
+{
+    std::unique_ptr<ProviderResponseRing> ring(new ProviderResponseRing{});
+    ProviderResponseRingEntry responses[ProviderResponseRingDrainBatchSize];
+    uint32_t responseCount;
+    uint32_t readIndex = 0;
+    
+    ring->entries[0].messageId = 7;
+    ring->writeIndex = 1;
+    // Only the kernel's copy of the read index counts
+    ring->readIndex = 1;
+    
+    XCTAssertTrue(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(1, responseCount);
+    XCTAssertEqual(7, responses[0].messageId);
+}
+
+- (void)testProviderResponseRing_TakeResponsesRejectsBadWriteIndex
+{
+    std::unique_ptr<ProviderResponseRing> ring(new ProviderResponseRing{});
+    ProviderResponseRingEntry responses[ProviderResponseRingDrainBatchSize];
+    uint32_t responseCount = UINT32_MAX;
+    uint32_t readIndex = 10;
+    
+    // Claims more entries than the ring can hold
+    ring->writeIndex = readIndex + ProviderResponseRingCapacity + 1;
+    XCTAssertFalse(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(0, responseCount);
+    XCTAssertEqual(10, readIndex);
+    
+    // Behind the read index
+    ring->writeIndex = readIndex - 1;
+    XCTAssertFalse(ProviderResponseRing_TakeResponses(ring.get(), readIndex, responses, ProviderResponseRingDrainBatchSize, responseCount));
+    XCTAssertEqual(10, readIndex);
+}
+
+static const uint32_t TestMessageQueueSize = 64;
+
+static IODataQueueMemory* CreateTestMessageQueue(std::unique_ptr<uint8_t[]>& memory)
+{
+    memory.reset(new uint8_t[TestMessageQueueSize + DATA_QUEUE_MEMORY_HEADER_SIZE]());
+    IODataQueueMemory* queueMemory = reinterpret_cast<IODataQueueMemory*>(memory.get());
+    queueMemory->queueSize = TestMessageQueueSize;
+    return queueMemory;
+}
+
+static uint32_t EntrySizeAt(IODataQueueMemory* queueMemory, uint32_t offset)
+{
+    return reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(queueMemory->queue) + offset)->size;
+}
+
+- (void)testProviderMessageQueue_ReserveAppends
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    void* data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 0, 0, 12, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(12, EntrySizeAt(queueMemory, 0));
+    XCTAssertEqual(16, tailAfterEntry);
+    
+    data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 0, tailAfterEntry, 4, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + 16 + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(4, EntrySizeAt(queueMemory, 16));
+    XCTAssertEqual(24, tailAfterEntry);
+}
+
+- (void)testProviderMessageQueue_ReserveFillsToEnd
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    // Exactly fits between the tail and the end of the queue, so doesn't wrap
+    void* data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 8, 48, 12, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + 48 + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(TestMessageQueueSize, tailAfterEntry);
+    
+    // Nothing more fits at the end, nor at the start without catching up with the head
+    tailAfterEntry = 0;
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 8, TestMessageQueueSize, 4, tailAfterEntry));
+    XCTAssertEqual(0, tailAfterEntry);
+}
+
+- (void)testProviderMessageQueue_ReserveWrapsAround
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    // 8 bytes left at the end, so a 16 byte entry goes to the start, with a marker left at the old tail
+    void* data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 20, 56, 12, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(12, EntrySizeAt(queueMemory, 0));
+    XCTAssertEqual(12, EntrySizeAt(queueMemory, 56));
+    XCTAssertEqual(16, tailAfterEntry);
+}
+
+- (void)testProviderMessageQueue_ReserveWrapsAroundWithoutRoomForMarker
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    const uint32_t tail = TestMessageQueueSize - 2;
+    memset(reinterpret_cast<uint8_t*>(queueMemory->queue) + tail, 0xab, 2);
+    void* data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 20, tail, 12, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(16, tailAfterEntry);
+    
+    // Nothing may be written past the end of the queue
+    XCTAssertEqual(0xab, reinterpret_cast<uint8_t*>(queueMemory->queue)[tail]);
+    XCTAssertEqual(0xab, reinterpret_cast<uint8_t*>(queueMemory->queue)[tail + 1]);
+}
+
+- (void)testProviderMessageQueue_ReserveFull
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    // Wrapping around would make the tail catch up with the head, so the queue would look empty
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 16, 56, 12, tailAfterEntry));
+    XCTAssertEqual(0, EntrySizeAt(queueMemory, 56));
+    
+    // Same for the tail behind the head
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 24, 8, 12, tailAfterEntry));
+    XCTAssertEqual(0, EntrySizeAt(queueMemory, 8));
+    XCTAssertEqual(0, tailAfterEntry);
+    
+    // One byte more between them is enough
+    void* data = ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 25, 8, 12, tailAfterEntry);
+    XCTAssertEqual(reinterpret_cast<uint8_t*>(queueMemory->queue) + 8 + DATA_QUEUE_ENTRY_HEADER_SIZE, data);
+    XCTAssertEqual(24, tailAfterEntry);
+    
+    // Larger than the whole queue
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 0, 0, TestMessageQueueSize, tailAfterEntry));
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 0, 0, UINT32_MAX, tailAfterEntry));
+}
+
+- (void)testProviderMessageQueue_ReserveRejectsBadOffsets
+{
+    std::unique_ptr<uint8_t[]> memory;
+    IODataQueueMemory* queueMemory = CreateTestMessageQueue(memory);
+    uint32_t tailAfterEntry = 0;
+    
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, TestMessageQueueSize + 1, 0, 4, tailAfterEntry));
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, UINT32_MAX, 0, 4, tailAfterEntry));
+    XCTAssertEqual(nullptr, ProviderMessageQueue_Reserve(queueMemory, TestMessageQueueSize, 0, TestMessageQueueSize + 1, 4, tailAfterEntry));
+    XCTAssertEqual(0, tailAfterEntry);
+}
+
 @end
@@ -15,7 +15,8 @@ static map<vfs_context_t /*context*/, int /*pid*/> s_contextMap;
 static map<int /*process Id*/, proc> s_processMap;
 static int s_selfPid;
 static string s_selfName;
-static uint16_t s_currentThreadIndex = 0;
+static uint32_t s_procFindCallCount = 0;
+static thread_local uint16_t s_currentThreadIndex = 0;
 static thread s_threadPool[MockProcess_ThreadPoolSize] = {};
 
 void MockProcess_Reset()
@@ -23,6 +24,7 @@ void MockProcess_Reset()
     s_processMap.clear();
     s_credentialMap.clear();
     s_contextMap.clear();
+    s_procFindCallCount = 0;
     MockProcess_SetCurrentThreadIndex(0);
 }
 
@@ -129,6 +131,7 @@ int proc_ppid(proc_t p)
 
 proc_t proc_find(int pid)
 {
+    ++s_procFindCallCount;
     map<int /*process Id*/, proc>::iterator procIter = s_processMap.find(pid);
     if (procIter == s_processMap.end())
     {
@@ -156,6 +159,11 @@ void proc_selfname(char* buf, int size)
     strlcpy(buf, s_selfName.c_str(), size);
 }
 
+uint32_t MockProcess_GetProcFindCallCount()
+{
+    return s_procFindCallCount;
+}
+
 void MockProcess_AddCredential(uintptr_t credentialId, uid_t UID)
 {
     s_credentialMap.insert(make_pair(credentialId, UID));
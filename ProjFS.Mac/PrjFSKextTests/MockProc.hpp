@@ -36,7 +36,10 @@ void MockProcess_AddCredential(uintptr_t credentialId, uid_t UID);
 void MockProcess_AddContext(vfs_context_t context, int pid);
 void MockProcess_AddProcess(int pid, uintptr_t credentialId, int ppid, std::string procName);
 void MockProcess_Reset();
+// Number of proc_find() calls since the last reset
+uint32_t MockProcess_GetProcFindCallCount();
 
 // Tests will only need to simulate a small number of threads, so we provide an existing, indexed pool.
-constexpr uint16_t MockProcess_ThreadPoolSize = 2;
+// The current index is per real thread, so concurrent tests can give each thread its own identity.
+constexpr uint16_t MockProcess_ThreadPoolSize = 32;
 void MockProcess_SetCurrentThreadIndex(uint16_t threadIndex);
@@ -233,6 +233,21 @@ FsidInode Vnode_GetFsidAndInode(vnode_t vnode, vfs_context_t vfsContext, bool us
     return FsidInode{ vnode->GetMountPoint()->GetFsid(), vnode->GetInode() };
 }
 
+errno_t Vnode_GetAttributes(vnode_t vnode, vfs_context_t vfsContext, VnodeAttributes* attributes)
+{
+    MockCalls::RecordFunctionCall(Vnode_GetAttributes, vnode, vfsContext, attributes);
+    
+    *attributes = {};
+    if (vnode->errors.getattr != 0)
+    {
+        return vnode->errors.getattr;
+    }
+    
+    attributes->fileFlags = vnode->attrValues.va_flags;
+    attributes->fsidInode = FsidInode{ vnode->GetMountPoint()->GetFsid(), vnode->GetInode() };
+    return 0;
+}
+
 errno_t vnode_lookup(const char* path, int flags, vnode_t* foundVnode, vfs_context_t vfsContext)
 {
     PathToVnodeMap::const_iterator found = s_vnodesByPath.find(path);
@@ -326,6 +341,11 @@ void vfs_setauthcache_ttl(mount_t mountPoint, int ttl)
     MockCalls::RecordFunctionCall(vfs_setauthcache_ttl, mountPoint, ttl);
 }
 
+void cache_purge(vnode_t vnode)
+{
+    MockCalls::RecordFunctionCall(cache_purge, vnode);
+}
+
 void MockVnodes_CheckAndClear()
 {
     // All of the vnodes in s_allVnodes should have been destroyed by the time MockVnodes_CheckAndClear is called
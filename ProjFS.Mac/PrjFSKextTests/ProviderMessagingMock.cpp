@@ -1,7 +1,9 @@
 #include "../PrjFSKext/ProviderMessaging.hpp"
 #include "../PrjFSKext/Locks.hpp"
 #include "../PrjFSKext/VirtualizationRoots.hpp"
+#include "../PrjFSKext/OutstandingMessages.hpp"
 #include "../PrjFSKext/kernel-header-wrappers/kauth.h"
+#include "../PrjFSKext/public/PrjFSProviderQueueStats.h"
 #include "KextLogMock.h"
 #include "KextMockUtilities.hpp"
 
@@ -10,6 +12,14 @@
 #include <sys/kauth.h>
 #include "ProviderMessagingMock.hpp"
 #include <functional>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 using std::function;
 using std::move;
@@ -54,6 +64,10 @@ void ProviderMessaging_HandleKernelMessageResponse(VirtualizationRootHandle prov
 {
 }
 
+void ProviderMessaging_HandleKernelMessageResponses(VirtualizationRootHandle providerVirtualizationRootHandle, const ProviderResponseRingEntry* responses, uint32_t responseCount)
+{
+}
+
 void ProviderMessaging_AbortOutstandingEventsForProvider(VirtualizationRootHandle providerVirtualizationRootHandle)
 {
 }
@@ -109,6 +123,166 @@ bool ProviderMessaging_TrySendRequestAndWaitForResponse(
     return result;
 }
 
+bool ProviderMessaging_TrySendNotification(
+    VirtualizationRootHandle root,
+    MessageType messageType,
+    const vnode_t vnode,
+    const FsidInode& vnodeFsidInode,
+    const char* vnodePath,
+    const char* fromPath,
+    int pid,
+    const char* procname)
+{
+    MockCalls::RecordFunctionCall(
+        ProviderMessaging_TrySendNotification,
+        root,
+        messageType,
+        vnode,
+        vnodeFsidInode,
+        vnodePath,
+        fromPath,
+        pid,
+        procname);
+    
+    return s_defaultRequestResult;
+}
+
 void ProviderMessaging_AbortAllOutstandingEvents()
 {
 }
+
+void ProviderMessaging_MessageQueueSpaceAvailable(VirtualizationRootHandle providerVirtualizationRootHandle)
+{
+}
+
+void ProviderMessaging_GetInFlightRequestStats(VirtualizationRootHandle providerVirtualizationRootHandle, PrjFSProviderQueueStats& stats)
+{
+    stats.inFlightRequestWindow = ProviderInFlightMessageWindow;
+}
+
+// User-space model of the kernel's outstanding message bookkeeping: waiter threads register a
+// message in the sharded table and block until a responder thread (standing in for the provider)
+// looks the message up by (root, message ID) and completes it. Each provider has at most inFlightWindow
+// requests outstanding at once, like ProviderInFlightMessageWindow in the kernel. Returns completed requests per second.
+double ProviderMessageMock_MeasureOutstandingMessageThroughput(uint32_t waiterCount, uint32_t requestsPerWaiter, uint32_t providerCount, uint16_t inFlightWindow)
+{
+    static const uint32_t shardCount = 16;
+    struct Shard
+    {
+        std::mutex mutex;
+        OutstandingMessageBuckets messages;
+        std::condition_variable windowAvailable;
+    };
+
+    std::vector<Shard> shards(shardCount);
+    for (Shard& shard : shards)
+    {
+        OutstandingMessageBuckets_Init(shard.messages);
+    }
+
+    // As in the kernel, each provider's in-flight count is protected by its shard's mutex
+    std::vector<uint16_t> inFlightCounts(providerCount, 0);
+
+    std::vector<std::condition_variable> waiterWakeups(waiterCount);
+    std::atomic<uint64_t> nextMessageId(1);
+
+    std::mutex queueMutex;
+    std::condition_variable queueNonEmpty;
+    std::deque<std::pair<VirtualizationRootHandle, uint64_t>> queue;
+    bool doneSending = false;
+
+    auto waiter = [&](uint32_t waiterIndex)
+    {
+        VirtualizationRootHandle root = static_cast<VirtualizationRootHandle>(waiterIndex % providerCount);
+        Shard& shard = shards[root % shardCount];
+        uint16_t& inFlightCount = inFlightCounts[root];
+
+        for (uint32_t i = 0; i < requestsPerWaiter; ++i)
+        {
+            OutstandingMessage message = {};
+            message.request.messageId = nextMessageId++;
+            message.request.pid = static_cast<int32_t>(waiterIndex);
+            message.rootHandle = root;
+
+            std::unique_lock<std::mutex> shardLock(shard.mutex);
+            shard.windowAvailable.wait(shardLock, [&] { return inFlightCount < inFlightWindow; });
+            ++inFlightCount;
+            OutstandingMessageBuckets_Insert(shard.messages, &message);
+            shardLock.unlock();
+
+            {
+                std::lock_guard<std::mutex> queueLock(queueMutex);
+                queue.emplace_back(root, message.request.messageId);
+            }
+            queueNonEmpty.notify_one();
+
+            shardLock.lock();
+            waiterWakeups[waiterIndex].wait(shardLock, [&] { return message.receivedResult; });
+            OutstandingMessageBuckets_Remove(&message);
+            if (inFlightCount-- == inFlightWindow)
+            {
+                shard.windowAvailable.notify_all();
+            }
+        }
+    };
+
+    auto responder = [&]()
+    {
+        while (true)
+        {
+            std::pair<VirtualizationRootHandle, uint64_t> request;
+            {
+                std::unique_lock<std::mutex> queueLock(queueMutex);
+                queueNonEmpty.wait(queueLock, [&] { return !queue.empty() || doneSending; });
+                if (queue.empty())
+                {
+                    return;
+                }
+
+                request = queue.front();
+                queue.pop_front();
+            }
+
+            Shard& shard = shards[request.first % shardCount];
+            std::lock_guard<std::mutex> shardLock(shard.mutex);
+            OutstandingMessage* message = OutstandingMessageBuckets_Find(shard.messages, request.first, request.second);
+            assert(message != nullptr);
+            message->result = MessageType_Response_Success;
+            message->receivedResult = true;
+            waiterWakeups[message->request.pid].notify_one();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> responders;
+    for (uint32_t i = 0; i < providerCount; ++i)
+    {
+        responders.emplace_back(responder);
+    }
+
+    std::vector<std::thread> waiters;
+    for (uint32_t i = 0; i < waiterCount; ++i)
+    {
+        waiters.emplace_back(waiter, i);
+    }
+
+    for (std::thread& thread : waiters)
+    {
+        thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> queueLock(queueMutex);
+        doneSending = true;
+    }
+    queueNonEmpty.notify_all();
+
+    for (std::thread& thread : responders)
+    {
+        thread.join();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(waiterCount) * requestsPerWaiter / elapsed.count();
+}
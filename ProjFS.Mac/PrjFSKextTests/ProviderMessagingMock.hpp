@@ -1,7 +1,10 @@
 #include <functional>
+#include <stdint.h>
 
 void ProvidermessageMock_ResetResultCount();
 void ProviderMessageMock_SetDefaultRequestResult(bool success);
 
 void ProviderMessageMock_SetRequestSideEffect(std::function<void()> sideEffectFunction);
 void ProviderMessageMock_SetSecondRequestResult(bool secondRequestResult);
+
+double ProviderMessageMock_MeasureOutstandingMessageThroughput(uint32_t waiterCount, uint32_t requestsPerWaiter, uint32_t providerCount, uint16_t inFlightWindow);
@@ -272,8 +272,8 @@ class PrjFSProviderUserClient
     XCTAssertEqual(rootHandle, self->cacheWrapper[ComputeVnodeHashIndex(self->testVnodeFile.get())].virtualizationRoot);
     
     // KAUTH_FILEOP_RENAME (directory)
-    // Directory KAUTH_FILEOP_RENAME events should invalidate the entire cache and then insert
-    // only the directory vnode into the cache
+    // When the directory's previous root isn't in the cache, directory KAUTH_FILEOP_RENAME events
+    // should invalidate the entire cache and then insert only the directory vnode into the cache
     self->cacheWrapper.FillAllEntries();
     XCTAssertTrue(
         ShouldHandleFileOpEvent(
@@ -305,6 +305,44 @@ class PrjFSProviderUserClient
         }
     }
     
+    // KAUTH_FILEOP_RENAME (directory moved in from another root)
+    // When the directory's previous root is in the cache, only the entries of that root should be invalidated
+    VirtualizationRootHandle previousRootHandle = rootHandle + 1;
+    self->cacheWrapper[directoryVnodeHash].virtualizationRoot = previousRootHandle;
+    uintptr_t fileVnodeHash = ComputeVnodeHashIndex(self->testVnodeFile.get());
+    InsertOrUpdateEntry_ExclusiveLocked(
+        self->testVnodeFile.get(),
+        fileVnodeHash,
+        self->testVnodeFile->GetVid(),
+        false, // forceRefreshEntry
+        previousRootHandle,
+        LoadRootGeneration(previousRootHandle));
+    XCTAssertTrue(
+        ShouldHandleFileOpEvent(
+            &self->perfTracer,
+            self->context,
+            testVnodeDirectory.get(),
+            nullptr, // path
+            KAUTH_FILEOP_RENAME,
+            true, // isDirectory,
+            &rootHandle,
+            &pid));
+    XCTAssertEqual(rootHandle, testRootResult.root);
+    XCTAssertEqual(rootHandle, self->cacheWrapper[directoryVnodeHash].virtualizationRoot);
+    XCTAssertEqual(1, LoadRootGeneration(previousRootHandle));
+    
+    // The file's entry is left in the cache, but it is no longer valid
+    uintptr_t fileVnodeIndex;
+    XCTAssertTrue(TryFindVnodeIndex_Locked(self->testVnodeFile.get(), fileVnodeHash, fileVnodeIndex));
+    
+    VirtualizationRootHandle cachedRootHandle;
+    XCTAssertFalse(
+        TryGetVnodeRootFromCache(
+            self->testVnodeFile.get(),
+            fileVnodeHash,
+            self->testVnodeFile->GetVid(),
+            cachedRootHandle));
+    
     if (VirtualizationRoot_IsValidRootHandle(testRootResult.root))
     {
         ActiveProvider_Disconnect(testRootResult.root, &userClient);
@@ -9,6 +9,7 @@
 #include "../PrjFSKext/public/PrjFSXattrs.h"
 #include "KextMockUtilities.hpp"
 #include "MockVnodeAndMount.hpp"
+#include "MockProc.hpp"
 
 #import "KextAssertIntegration.h"
 #include <vector>
@@ -40,6 +41,29 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     vnode->xattrs.insert(make_pair(PrjFSVirtualizationRootXAttrName, rootXattrData));
 }
 
+static vnode_t s_knownAncestorVnode;
+static const VirtualizationRootHandle KnownAncestorRootHandle = 7;
+
+static bool TryGetKnownAncestorRoot(vnode_t directoryVnode, uint32_t vid, VirtualizationRootHandle& rootHandle)
+{
+    MockCalls::RecordFunctionCall(TryGetKnownAncestorRoot, directoryVnode, vid);
+    if (directoryVnode == s_knownAncestorVnode)
+    {
+        rootHandle = KnownAncestorRootHandle;
+        return true;
+    }
+    
+    return false;
+}
+
+struct RegisteredRoots
+{
+    vector<shared_ptr<vnode>> rootVnodes;
+    vector<VirtualizationRootHandle> rootHandles;
+    shared_ptr<vnode> fileVnode;
+    std::string filePath;
+};
+
 @interface VirtualizationRootsTests : PFSKextTestCase
 
 @end
@@ -155,13 +179,14 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     s_virtualizationRoots[rootIndex].rootVNodeVid = vnode_vid(vnode.get());
     s_virtualizationRoots[rootIndex].rootFsid = self->testMountPoint->GetFsid();
     s_virtualizationRoots[rootIndex].rootInode = vnode->GetInode();
+    RebuildVirtualizationRootIndex_Locked();
     
     VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, path);
     XCTAssertEqual(result.error, 0);
     XCTAssertEqual(result.root, rootIndex);
     XCTAssertEqual(s_virtualizationRoots[result.root].providerUserClient, &self->dummyClient);
 
-    XCTAssertTrue(MockCalls::DidCallFunction(vfs_setauthcache_ttl, _, 0));
+    XCTAssertFalse(MockCalls::DidCallFunction(vfs_setauthcache_ttl));
     XCTAssertTrue(MockCalls::DidCallFunction(ProviderUserClient_UpdatePathProperty, &self->dummyClient, _));
     
     ActiveProvider_Disconnect(result.root, &self->dummyClient);
@@ -190,6 +215,7 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     
     s_virtualizationRoots[rootIndex].providerUserClient = &existingClient;
     s_virtualizationRoots[rootIndex].providerPid = existingClientPid;
+    RebuildVirtualizationRootIndex_Locked();
     
     VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, path);
     XCTAssertEqual(result.error, EBUSY);
@@ -217,7 +243,7 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     {
         XCTAssertEqual(s_virtualizationRoots[result.root].providerUserClient, &self->dummyClient);
 
-        XCTAssertTrue(MockCalls::DidCallFunction(vfs_setauthcache_ttl));
+        XCTAssertFalse(MockCalls::DidCallFunction(vfs_setauthcache_ttl));
         XCTAssertTrue(MockCalls::DidCallFunction(ProviderUserClient_UpdatePathProperty));
     
         ActiveProvider_Disconnect(result.root, &self->dummyClient);
@@ -248,7 +274,6 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     {
         XCTAssertEqual(s_virtualizationRoots[result.root].providerUserClient, &self->dummyClient);
 
-        XCTAssertTrue(MockCalls::DidCallFunction(vfs_setauthcache_ttl, self->testMountPoint.get(), _));
         XCTAssertTrue(MockCalls::DidCallFunction(ProviderUserClient_UpdatePathProperty, &self->dummyClient, _));
     
         ActiveProvider_Disconnect(result.root, &self->dummyClient);
@@ -258,7 +283,6 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     {
         XCTAssertEqual(s_virtualizationRoots[result2.root].providerUserClient, &dummyClient2);
 
-        XCTAssertTrue(MockCalls::DidCallFunction(vfs_setauthcache_ttl, secondMountPoint.get(), 0));
         XCTAssertTrue(MockCalls::DidCallFunction(ProviderUserClient_UpdatePathProperty, &dummyClient2, _));
     
         ActiveProvider_Disconnect(result2.root, &dummyClient2);
@@ -266,9 +290,37 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     
     XCTAssertTrue(MockCalls::DidCallFunctionsInOrder(
         ProviderUserClient_UpdatePathProperty, make_tuple(&self->dummyClient, _),
-        vfs_setauthcache_ttl,                  make_tuple(self->testMountPoint.get(), _),
-        ProviderUserClient_UpdatePathProperty, _,
-        vfs_setauthcache_ttl));
+        ProviderUserClient_UpdatePathProperty, make_tuple(&dummyClient2, _)));
+    
+    // Registering a provider must not disable the authorization cache for the whole volume
+    XCTAssertFalse(MockCalls::DidCallFunction(vfs_setauthcache_ttl));
+}
+
+- (void)testMountMayHaveActiveProvider
+{
+    const char* path1 = "/Users/test/code/Repo";
+    shared_ptr<vnode> vnode1 = vnode::Create(self->testMountPoint, path1, VDIR);
+    const char* path2 = "/Users/test/code/OtherRepo";
+    shared_ptr<vnode> vnode2 = vnode::Create(self->testMountPoint, path2, VDIR);
+    shared_ptr<mount> otherMountPoint = mount::Create();
+    
+    XCTAssertFalse(VirtualizationRoots_MountMayHaveActiveProvider(self->testMountPoint.get()));
+    
+    VirtualizationRootResult result1 = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, path1);
+    XCTAssertEqual(result1.error, 0);
+    PrjFSProviderUserClient dummyClient2;
+    VirtualizationRootResult result2 = VirtualizationRoot_RegisterProviderForPath(&dummyClient2, 1000, path2);
+    XCTAssertEqual(result2.error, 0);
+    
+    XCTAssertTrue(VirtualizationRoots_MountMayHaveActiveProvider(self->testMountPoint.get()));
+    XCTAssertFalse(VirtualizationRoots_MountMayHaveActiveProvider(otherMountPoint.get()));
+    
+    // The mount keeps its entry until its last provider disconnects
+    ActiveProvider_Disconnect(result1.root, &self->dummyClient);
+    XCTAssertTrue(VirtualizationRoots_MountMayHaveActiveProvider(self->testMountPoint.get()));
+    
+    ActiveProvider_Disconnect(result2.root, &dummyClient2);
+    XCTAssertFalse(VirtualizationRoots_MountMayHaveActiveProvider(self->testMountPoint.get()));
 }
 
 - (void)testRegisterProviderForPath_ArrayFull
@@ -278,8 +330,10 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     shared_ptr<vnode> vnode = vnode::Create(self->testMountPoint, path, VDIR);
     
     Memory_FreeArray(s_virtualizationRoots, s_maxVirtualizationRoots);
+    Memory_FreeArray(s_virtualizationRootBuckets, s_maxVirtualizationRoots);
     s_maxVirtualizationRoots = INT16_MAX + 1;
     s_virtualizationRoots = Memory_AllocArray<VirtualizationRoot>(INT16_MAX + 1);
+    s_virtualizationRootBuckets = Memory_AllocArray<VirtualizationRootBucket>(INT16_MAX + 1);
     memset(s_virtualizationRoots, 0, s_maxVirtualizationRoots * sizeof(s_virtualizationRoots[0]));
     
     for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
@@ -287,6 +341,8 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
         s_virtualizationRoots[i].inUse = true;
     }
     
+    RebuildVirtualizationRootIndex_Locked();
+    
     VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, path);
     XCTAssertEqual(result.error, ENOMEM);
     XCTAssertFalse(VirtualizationRoot_IsValidRootHandle(result.root));
@@ -303,8 +359,10 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     
     // Start with 4 "full" array items, forcing resize on next insertion
     Memory_FreeArray(s_virtualizationRoots, s_maxVirtualizationRoots);
+    Memory_FreeArray(s_virtualizationRootBuckets, s_maxVirtualizationRoots);
     s_maxVirtualizationRoots = 4;
     s_virtualizationRoots = Memory_AllocArray<VirtualizationRoot>(s_maxVirtualizationRoots);
+    s_virtualizationRootBuckets = Memory_AllocArray<VirtualizationRootBucket>(s_maxVirtualizationRoots);
     memset(s_virtualizationRoots, 0, s_maxVirtualizationRoots * sizeof(s_virtualizationRoots[0]));
     
     for (uint32_t i = 0; i < s_maxVirtualizationRoots; ++i)
@@ -312,6 +370,8 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
         s_virtualizationRoots[i].inUse = true;
     }
     
+    RebuildVirtualizationRootIndex_Locked();
+    
     VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, path);
     XCTAssertEqual(result.error, 0);
     XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(result.root));
@@ -338,6 +398,7 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     s_virtualizationRoots[rootIndex].rootFsid = self->testMountPoint->GetFsid();
     uint64_t inode = oldVnode->GetInode();
     s_virtualizationRoots[rootIndex].rootInode = inode;
+    RebuildVirtualizationRootIndex_Locked();
     
     oldVnode->StartRecycling();
     
@@ -350,7 +411,7 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     XCTAssertEqual(s_virtualizationRoots[result.root].rootVNode, newVnode.get());
     XCTAssertEqual(s_virtualizationRoots[result.root].rootVNodeVid, newVnode->GetVid());
 
-    XCTAssertTrue(MockCalls::DidCallFunction(vfs_setauthcache_ttl, self->testMountPoint.get(), 0));
+    XCTAssertFalse(MockCalls::DidCallFunction(vfs_setauthcache_ttl));
     XCTAssertTrue(MockCalls::DidCallFunction(ProviderUserClient_UpdatePathProperty));
     
     ActiveProvider_Disconnect(result.root, &self->dummyClient);
@@ -498,6 +559,83 @@ static void SetRootXattrData(shared_ptr<vnode> vnode)
     }
 }
 
+// Check that the search ends at an ancestor whose root the caller already knows, and that
+// only the ancestors below it are reported as visited
+- (void)testFindForVnode_StopsAtAncestorWithKnownRoot
+{
+    const char* filePath = "/Users/test/code/Repo/some/nested/file";
+    
+    shared_ptr<vnode> testFileVnode = self->testMountPoint->CreateVnodeTree(filePath);
+    shared_ptr<vnode> nestedVnode = testFileVnode->GetParentVnode();
+    shared_ptr<vnode> someVnode = nestedVnode->GetParentVnode();
+    shared_ptr<vnode> repoVnode = someVnode->GetParentVnode();
+    s_knownAncestorVnode = repoVnode.get();
+    
+    VirtualizationRootAncestors ancestors = { .tryGetKnownRoot = TryGetKnownAncestorRoot };
+    VirtualizationRootHandle foundRoot = VirtualizationRoot_FindForVnode(&self->dummyTracer, PrjFSPerfCounter_VnodeOp_FindRoot, PrjFSPerfCounter_VnodeOp_FindRoot_Iteration, testFileVnode.get(), self->dummyVFSContext, &ancestors);
+    
+    XCTAssertEqual(foundRoot, KnownAncestorRootHandle);
+    XCTAssertEqual(ancestors.visitedCount, 2U);
+    XCTAssertEqual(ancestors.visitedVnodes[0], nestedVnode.get());
+    XCTAssertEqual(ancestors.visitedVids[0], nestedVnode->GetVid());
+    XCTAssertEqual(ancestors.visitedVnodes[1], someVnode.get());
+    XCTAssertTrue(MockCalls::DidCallFunction(TryGetKnownAncestorRoot, repoVnode.get(), _));
+    XCTAssertFalse(MockCalls::DidCallFunction(TryGetKnownAncestorRoot, repoVnode->GetParentVnode().get(), _));
+    
+    s_knownAncestorVnode = nullptr;
+}
+
+// A root that is found on the way up takes precedence over a known root further up
+- (void)testFindForVnode_DetectedRootTakesPrecedenceOverKnownAncestorRoot
+{
+    const char* repoPath = "/Users/test/code/Repo";
+    const char* filePath = "/Users/test/code/Repo/file";
+    
+    shared_ptr<vnode> repoRootVnode = self->testMountPoint->CreateVnodeTree(repoPath, VDIR);
+    shared_ptr<vnode> testFileVnode = self->testMountPoint->CreateVnodeTree(filePath);
+    SetRootXattrData(repoRootVnode);
+    s_knownAncestorVnode = repoRootVnode->GetParentVnode().get();
+    
+    VirtualizationRootAncestors ancestors = { .tryGetKnownRoot = TryGetKnownAncestorRoot };
+    VirtualizationRootHandle foundRoot = VirtualizationRoot_FindForVnode(&self->dummyTracer, PrjFSPerfCounter_VnodeOp_FindRoot, PrjFSPerfCounter_VnodeOp_FindRoot_Iteration, testFileVnode.get(), self->dummyVFSContext, &ancestors);
+    
+    XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(foundRoot));
+    XCTAssertNotEqual(foundRoot, KnownAncestorRootHandle);
+    XCTAssertEqual(ancestors.visitedCount, 1U);
+    XCTAssertEqual(ancestors.visitedVnodes[0], repoRootVnode.get());
+    
+    s_knownAncestorVnode = nullptr;
+}
+
+// Check that roots are found when the walk up the tree needs more than one batch of ancestors
+- (void)testFindForVnode_RootAboveFirstAncestorBatch
+{
+    const char* repoPath = "/Users/test/code/Repo";
+    std::string filePath = repoPath;
+    for (uint32_t i = 0; i < VirtualizationRootAncestorBatchSize + 4; ++i)
+    {
+        filePath += "/dir" + std::to_string(i);
+    }
+    filePath += "/file";
+    
+    shared_ptr<vnode> repoRootVnode = self->testMountPoint->CreateVnodeTree(repoPath, VDIR);
+    shared_ptr<vnode> testFileVnode = self->testMountPoint->CreateVnodeTree(filePath);
+    SetRootXattrData(repoRootVnode);
+    
+    VirtualizationRootAncestors ancestors = {};
+    VirtualizationRootHandle foundRoot = VirtualizationRoot_FindForVnode(&self->dummyTracer, PrjFSPerfCounter_VnodeOp_FindRoot, PrjFSPerfCounter_VnodeOp_FindRoot_Iteration, testFileVnode.get(), self->dummyVFSContext, &ancestors);
+    
+    XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(foundRoot));
+    if (VirtualizationRoot_IsValidRootHandle(foundRoot))
+    {
+        XCTAssertEqual(s_virtualizationRoots[foundRoot].rootInode, repoRootVnode->GetInode());
+    }
+    
+    // Only the nearest ancestors are reported
+    XCTAssertEqual(ancestors.visitedCount, VirtualizationRootAncestorBatchSize);
+    XCTAssertEqual(ancestors.visitedVnodes[0], testFileVnode->GetParentVnode().get());
+}
+
 // This helper function is defined in the kernel, not in stdlib. Returns 1 if s2 is a prefix of s1
 int strprefix(const char* string1, const char* string2)
 {
@@ -530,6 +668,106 @@ int strprefix(const char* string1, const char* string2)
     XCTAssertFalse(PathInsideDirectory("/some/directory/with/sub/directories", "/some/directory"));
 }
 
+- (void)testActiveProvider_FindForPath
+{
+    const char* repoPath = "/Users/test/code/Repo";
+    const char* otherRepoPath = "/Users/test/code/RepoTwo";
+    shared_ptr<vnode> repoVnode = vnode::Create(self->testMountPoint, repoPath, VDIR);
+    shared_ptr<vnode> otherRepoVnode = vnode::Create(self->testMountPoint, otherRepoPath, VDIR);
+    
+    VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, repoPath);
+    XCTAssertEqual(result.error, 0);
+    PrjFSProviderUserClient otherClient;
+    VirtualizationRootResult otherResult = VirtualizationRoot_RegisterProviderForPath(&otherClient, 1000, otherRepoPath);
+    XCTAssertEqual(otherResult.error, 0);
+    
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/Repo"), result.root);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/Repo/some/file"), result.root);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/RepoTwo/file"), otherResult.root);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/Rep"), RootHandle_None);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/RepoThree/file"), RootHandle_None);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test"), RootHandle_None);
+    
+    // Only roots with an active provider are found
+    ActiveProvider_Disconnect(result.root, &self->dummyClient);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/Repo/some/file"), RootHandle_None);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/RepoTwo/file"), otherResult.root);
+    
+    ActiveProvider_Disconnect(otherResult.root, &otherClient);
+    XCTAssertEqual(ActiveProvider_FindForPath("/Users/test/code/RepoTwo/file"), RootHandle_None);
+}
+
+// Registers rootCount roots, and creates a file in the most recently registered one
+- (RegisteredRoots)registerRoots:(uint32_t)rootCount
+{
+    RegisteredRoots roots;
+    std::string rootPathPrefix = "/Users/test/manyroots" + std::to_string(rootCount) + "/Repo";
+    for (uint32_t i = 0; i < rootCount; ++i)
+    {
+        std::string rootPath = rootPathPrefix + std::to_string(i);
+        roots.rootVnodes.push_back(self->testMountPoint->CreateVnodeTree(rootPath, VDIR));
+        
+        VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(&self->dummyClient, self->dummyClientPid, rootPath.c_str());
+        XCTAssertEqual(result.error, 0);
+        roots.rootHandles.push_back(result.root);
+    }
+    
+    roots.filePath = rootPathPrefix + std::to_string(rootCount - 1) + "/some/nested/file";
+    roots.fileVnode = self->testMountPoint->CreateVnodeTree(roots.filePath);
+    return roots;
+}
+
+- (void)disconnectRoots:(const RegisteredRoots&)roots
+{
+    for (VirtualizationRootHandle rootHandle : roots.rootHandles)
+    {
+        ActiveProvider_Disconnect(rootHandle, &self->dummyClient);
+    }
+    
+    MockCalls::Clear();
+}
+
+- (void)testFindRoot_FindsMostRecentlyRegisteredOfManyRoots
+{
+    // Looks up the most recently registered root by vnode (as the VnodeCache does on a miss) and by
+    // path (as the rename handlers do)
+    for (uint32_t rootCount : { 1u, 16u, 1024u })
+    {
+        RegisteredRoots roots = [self registerRoots:rootCount];
+        XCTAssertEqual(
+            roots.rootHandles.back(),
+            VirtualizationRoot_FindForVnode(&self->dummyTracer, PrjFSPerfCounter_VnodeOp_FindRoot, PrjFSPerfCounter_VnodeOp_FindRoot_Iteration, roots.fileVnode.get(), self->dummyVFSContext));
+        XCTAssertEqual(roots.rootHandles.back(), ActiveProvider_FindForPath(roots.filePath.c_str()));
+        [self disconnectRoots:roots];
+    }
+}
+
+- (void)testFindForVnode_ManyRegisteredRootsPerformance
+{
+    RegisteredRoots roots = [self registerRoots:1024];
+    [self measureBlock:^{
+        for (uint32_t i = 0; i < 20000; ++i)
+        {
+            VirtualizationRoot_FindForVnode(&self->dummyTracer, PrjFSPerfCounter_VnodeOp_FindRoot, PrjFSPerfCounter_VnodeOp_FindRoot_Iteration, roots.fileVnode.get(), self->dummyVFSContext);
+        }
+    }];
+    
+    [self disconnectRoots:roots];
+}
+
+- (void)testFindForPath_ManyRegisteredRootsPerformance
+{
+    RegisteredRoots roots = [self registerRoots:1024];
+    [self measureBlock:^{
+        for (uint32_t i = 0; i < 20000; ++i)
+        {
+            ActiveProvider_FindForPath(roots.filePath.c_str());
+        }
+    }];
+    
+    [self disconnectRoots:roots];
+}
+
 - (void) testOfflineIOProcessArrayOperations
 {
     XCTAssertTrue(VirtualizationRoots_AddOfflineIOProcess(10));
@@ -592,4 +830,45 @@ int strprefix(const char* string1, const char* string2)
     VirtualizationRoots_RemoveOfflineIOProcess(13);
 }
 
+- (void) testProcessMayAccessOfflineRootsCachesAncestry
+{
+    MockProcess_Reset();
+    MockProcess_SetSelfInfo(30, "test");
+    MockProcess_AddProcess(30 /*pid*/, 1 /*credentialId*/, 29 /*ppid*/, "test" /*name*/);
+    MockProcess_AddProcess(29 /*pid*/, 1 /*credentialId*/, 28 /*ppid*/, "test" /*name*/);
+    MockProcess_AddProcess(28 /*pid*/, 1 /*credentialId*/, 1 /*ppid*/, "test" /*name*/);
+    XCTAssertTrue(VirtualizationRoots_AddOfflineIOProcess(28));
+    
+    // The current process itself isn't looked up by pid, only its ancestors
+    XCTAssertTrue(VirtualizationRoots_ProcessMayAccessOfflineRoots(30));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 1);
+    for (int i = 0; i < 10; ++i)
+    {
+        XCTAssertTrue(VirtualizationRoots_ProcessMayAccessOfflineRoots(30));
+    }
+    
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 1);
+    
+    // Other processes take a single lookup once their decision is cached
+    XCTAssertTrue(VirtualizationRoots_ProcessMayAccessOfflineRoots(29));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 2);
+    XCTAssertTrue(VirtualizationRoots_ProcessMayAccessOfflineRoots(29));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 3);
+    
+    // Unregistering invalidates the decisions
+    VirtualizationRoots_RemoveOfflineIOProcess(28);
+    XCTAssertFalse(VirtualizationRoots_ProcessMayAccessOfflineRoots(30));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 5);
+    XCTAssertFalse(VirtualizationRoots_ProcessMayAccessOfflineRoots(30));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 5);
+    
+    // As does registering
+    XCTAssertTrue(VirtualizationRoots_AddOfflineIOProcess(29));
+    XCTAssertTrue(VirtualizationRoots_ProcessMayAccessOfflineRoots(30));
+    XCTAssertEqual(MockProcess_GetProcFindCallCount(), 5);
+    VirtualizationRoots_RemoveOfflineIOProcess(29);
+    
+    MockProcess_Reset();
+}
+
 @end
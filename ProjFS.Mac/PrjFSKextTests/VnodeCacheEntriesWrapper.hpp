@@ -3,14 +3,17 @@
 #include "../PrjFSKext/VirtualizationRoots.hpp"
 #include "../PrjFSKext/VnodeCachePrivate.hpp"
 #include "../PrjFSKext/VnodeCacheTestable.hpp"
+#include <cassert>
+#include <vector>
 
-// Helper class for interacting with s_entries, s_entriesCapacity, and s_ModBitmask
+// Helper class for interacting with s_entries, s_entriesReferenced, s_entriesCapacity, s_shards, s_rootGenerations, and the hash/shard bitmasks
 class VnodeCacheEntriesWrapper
 {
 public:
     VnodeCacheEntriesWrapper()
     {
         s_entries = nullptr;
+        s_entriesReferenced = nullptr;
     }
     
     ~VnodeCacheEntriesWrapper()
@@ -18,21 +21,43 @@ public:
         this->FreeCache();
     }
     
-    void AllocateCache()
+    void AllocateCache(uint32_t pow2Capacity = 64, uint32_t pow2ShardCount = 1)
     {
-        s_entriesCapacity = 64;
-        s_ModBitmask = s_entriesCapacity - 1;
+        s_entriesCapacity = pow2Capacity;
+        s_hashBits = __builtin_ctz(s_entriesCapacity);
+        s_shardCount = pow2ShardCount;
+        s_shardIndexBits = s_hashBits - __builtin_ctz(s_shardCount);
+        s_shardModBitmask = (1U << s_shardIndexBits) - 1;
         s_entries = new VnodeCacheEntry[s_entriesCapacity];
         
         for (uint32_t i = 0; i < s_entriesCapacity; ++i)
         {
             memset(&(s_entries[i]), 0, sizeof(VnodeCacheEntry));
         }
+        
+        s_entriesReferenced = new uint8_t[s_entriesCapacity];
+        memset(s_entriesReferenced, 0, s_entriesCapacity);
+        
+        // Count every lookup, so that tests can check the stats exactly
+        s_lookupStatsSampleInterval = 1;
+        
+        for (uint32_t i = 0; i < s_shardCount; ++i)
+        {
+            s_shards[i].clockHand = 0;
+            atomic_store_explicit(&s_shards[i].entriesSequence, 0U, memory_order_relaxed);
+        }
+        
+        for (uint32_t i = 0; i < VnodeCacheRootGenerationSlots; ++i)
+        {
+            atomic_store_explicit(&s_rootGenerations[i], static_cast<uint8_t>(0), memory_order_relaxed);
+        }
     }
     
     void FreeCache()
     {
         s_entriesCapacity = 0;
+        s_shardCount = 0;
+        s_lookupStatsSampleInterval = VnodeCacheLookupStatsSampleInterval;
         
         if (nullptr != s_entries)
         {
@@ -40,26 +65,62 @@ public:
             s_entries = nullptr;
         }
         
-        this->dummyMount.reset();
-        this->dummyNode.reset();
+        if (nullptr != s_entriesReferenced)
+        {
+            delete[] s_entriesReferenced;
+            s_entriesReferenced = nullptr;
+        }
+        
+        this->dummyVnodeAddresses.clear();
     }
     
+    // Fills every slot with a distinct dummy vnode stored at its home index, so the cache is full
+    // but still satisfies the Robin Hood invariant that lookups rely on.
     void FillAllEntries()
     {
-        // Keep these dummy instances alive until FreeCache is called to ensure that
-        // no subsequent allocations overlap with the vnode we're using to fill the cache
-        this->dummyMount = mount::Create();
-        this->dummyNode = dummyMount->CreateVnodeTree("/DUMMY");
-        
         for (uint32_t i = 0; i < s_entriesCapacity; ++i)
         {
-            s_entries[i].vnode = this->dummyNode.get();
+            s_entries[i].vnode = this->GetDummyVnode(i);
         }
+        
+        for (uint32_t i = 0; i < s_shardCount; ++i)
+        {
+            atomic_store_explicit(&s_shards[i].stats.cacheEntries, static_cast<uint32_t>(s_shardModBitmask + 1), memory_order_relaxed);
+        }
+    }
+    
+    // Returns a distinct (for each value of n) dummy vnode whose hash index is homeIndex.
+    // Dummy vnodes are never dereferenced, only hashed and compared, so addresses inside a buffer
+    // that lives until FreeCache are enough to guarantee that they don't overlap with real vnodes.
+    vnode_t GetDummyVnode(uintptr_t homeIndex, uint32_t n = 0)
+    {
+        if (this->dummyVnodeAddresses.empty())
+        {
+            this->dummyVnodeAddresses.assign(s_entriesCapacity * DummyVnodesPerEntry, 0);
+        }
+        
+        for (uint64_t& address : this->dummyVnodeAddresses)
+        {
+            vnode_t dummyVnode = reinterpret_cast<vnode_t>(&address);
+            if (homeIndex == ComputeVnodeHashIndex(dummyVnode))
+            {
+                if (0 == n)
+                {
+                    return dummyVnode;
+                }
+                
+                --n;
+            }
+        }
+        
+        assert(false);
+        return nullptr;
     }
     
     void MarkEntryAsFree(const uintptr_t entryIndex)
     {
         s_entries[entryIndex].vnode = nullptr;
+        atomic_fetch_sub_explicit(&GetShardForIndex(entryIndex).stats.cacheEntries, 1U, memory_order_relaxed);
     }
     
     VnodeCacheEntry& operator[] (const uintptr_t entryIndex)
@@ -73,6 +134,7 @@ public:
     }
     
 private:
-    std::shared_ptr<mount> dummyMount;
-    std::shared_ptr<vnode> dummyNode;
+    // Enough candidate addresses per cache entry to find several dummy vnodes for any home index
+    static const uint32_t DummyVnodesPerEntry = 64;
+    std::vector<uint64_t> dummyVnodeAddresses;
 };
@@ -7,9 +7,16 @@
 #include "../PrjFSKext/VnodeCache.hpp"
 #include "../PrjFSKext/VnodeCachePrivate.hpp"
 #include "../PrjFSKext/VnodeCacheTestable.hpp"
+#include <atomic>
+#include <cstddef>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 using KextMock::_;
 using std::shared_ptr;
+using std::vector;
 
 @interface VnodeCacheTests : PFSKextTestCase
 @end
@@ -30,6 +37,106 @@ using std::shared_ptr;
 static const VirtualizationRootHandle DummyRootHandle = 51;
 static const VirtualizationRootHandle DummyRootHandleTwo = 52;
 
+static const uint32_t DummyVnodeVid = 1;
+
+// The hash that ComputeVnodeHashIndex used before it switched to Fibonacci hashing, kept for comparison in
+// testComputeVnodeHashIndex_SpreadsZoneAllocatorAddresses
+static uintptr_t ComputeLegacyVnodeHashIndex(vnode_t vnode)
+{
+    return (reinterpret_cast<uintptr_t>(vnode) >> 3) & (s_entriesCapacity - 1);
+}
+
+static uint32_t CountHomeIndexCollisions(const vector<vnode_t>& vnodes, uintptr_t (*hashFunction)(vnode_t))
+{
+    std::unordered_set<uintptr_t> homeIndexes;
+    for (vnode_t vnode : vnodes)
+    {
+        homeIndexes.insert(hashFunction(vnode));
+    }
+    
+    return static_cast<uint32_t>(vnodes.size() - homeIndexes.size());
+}
+
+// Replays the vnode address layouts produced by the kernel's zone allocator: vnodes are packed at a fixed
+// stride inside zone pages, and the pages themselves may be scattered through the kernel map.
+static vector<vnode_t> MakeZoneAllocatorVnodes(uint32_t vnodeCount, uintptr_t elementStride, bool scatterZonePages)
+{
+    const uintptr_t kernelMapBase = 0xffffff8020000000ULL;
+    const uintptr_t zonePageSize = 16384;
+    
+    std::mt19937_64 random(vnodeCount);
+    vector<vnode_t> vnodes;
+    uintptr_t pageAddress = kernelMapBase;
+    while (vnodes.size() < vnodeCount)
+    {
+        for (uintptr_t offset = 0;
+             offset + elementStride <= zonePageSize && vnodes.size() < vnodeCount;
+             offset += elementStride)
+        {
+            vnodes.push_back(reinterpret_cast<vnode_t>(pageAddress + offset));
+        }
+        
+        pageAddress += zonePageSize;
+        if (scatterZonePages)
+        {
+            pageAddress += zonePageSize * (random() % 1024);
+        }
+    }
+    
+    return vnodes;
+}
+
+// Looks up the vnodes from threadCount threads at once, and returns the total number of cache hits
+static uint64_t LookUpVnodesConcurrently(const vector<vnode_t>& vnodes, uint32_t threadCount, uint32_t lookupsPerThread)
+{
+    std::atomic<uint64_t> totalHits(0);
+    vector<std::thread> threads;
+    for (uint32_t t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&vnodes, &totalHits, t, lookupsPerThread]()
+        {
+            uint64_t hits = 0;
+            for (uint32_t i = 0; i < lookupsPerThread; ++i)
+            {
+                vnode_t lookupVnode = vnodes[(i + t) % vnodes.size()];
+                VirtualizationRootHandle rootHandle;
+                if (TryGetVnodeRootFromCache(lookupVnode, ComputeVnodeHashIndex(lookupVnode), DummyVnodeVid, rootHandle))
+                {
+                    ++hits;
+                }
+            }
+            
+            totalHits += hits;
+        });
+    }
+    
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    
+    return totalHits.load();
+}
+
+// Returns how many of the vnodes were found in the cache, over lookupRounds lookups of each
+static uint64_t LookUpEveryVnode(const vector<vnode_t>& vnodes, uint32_t lookupRounds)
+{
+    uint64_t hits = 0;
+    for (uint32_t round = 0; round < lookupRounds; ++round)
+    {
+        for (vnode_t vnode : vnodes)
+        {
+            VirtualizationRootHandle rootHandle;
+            if (TryGetVnodeRootFromCache(vnode, ComputeVnodeHashIndex(vnode), DummyVnodeVid, rootHandle))
+            {
+                ++hits;
+            }
+        }
+    }
+    
+    return hits;
+}
+
 - (void)setUp
 {
     [super setUp];
@@ -66,43 +173,98 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
 - (void)testInitCacheStats {
     // We need to validate that InitCacheStats sets all of the cache health stats to zero, so
     // first set them all to something non-zero
-    atomic_store_explicit(&s_cacheStats.cacheEntries, 1U, memory_order_relaxed);
+    atomic_store_explicit(&s_shards[0].stats.cacheEntries, 1U, memory_order_relaxed);
     
     for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
     {
-        atomic_store_explicit(&s_cacheStats.healthStats[i], 1ULL, memory_order_relaxed);
+        atomic_store_explicit(&s_shards[0].stats.healthStats[i], 1ULL, memory_order_relaxed);
+    }
+    
+    for (uint32_t i = 0; i < PrjFSVnodeCacheProbeLengthHistogramBuckets; ++i)
+    {
+        atomic_store_explicit(&s_shards[0].stats.probeLengthHistogram[i], 1ULL, memory_order_relaxed);
     }
     
     InitCacheStats();
 
-    XCTAssertTrue(s_cacheStats.cacheEntries == 0);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 0);
     
     for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
     {
-        XCTAssertTrue(s_cacheStats.healthStats[i] == 0);
+        XCTAssertTrue(s_shards[0].stats.healthStats[i] == 0);
+    }
+    
+    for (uint32_t i = 0; i < PrjFSVnodeCacheProbeLengthHistogramBuckets; ++i)
+    {
+        XCTAssertTrue(s_shards[0].stats.probeLengthHistogram[i] == 0);
+    }
+}
+
+- (void)testComputeProbeLengthHistogramBucket {
+    XCTAssertEqual(0U, ComputeProbeLengthHistogramBucket(0));
+    XCTAssertEqual(1U, ComputeProbeLengthHistogramBucket(1));
+    XCTAssertEqual(2U, ComputeProbeLengthHistogramBucket(2));
+    XCTAssertEqual(2U, ComputeProbeLengthHistogramBucket(3));
+    XCTAssertEqual(3U, ComputeProbeLengthHistogramBucket(4));
+    XCTAssertEqual(3U, ComputeProbeLengthHistogramBucket(7));
+    XCTAssertEqual(4U, ComputeProbeLengthHistogramBucket(8));
+    XCTAssertEqual(PrjFSVnodeCacheProbeLengthHistogramBuckets - 1, ComputeProbeLengthHistogramBucket(64));
+    XCTAssertEqual(PrjFSVnodeCacheProbeLengthHistogramBuckets - 1, ComputeProbeLengthHistogramBucket(UINT64_MAX));
+}
+
+- (void)testRecordLookup {
+    RecordLookup(s_shards[0], 0);
+    RecordLookup(s_shards[0], 3);
+    RecordLookup(s_shards[0], 3);
+    
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 3);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 6);
+    XCTAssertTrue(s_shards[0].stats.probeLengthHistogram[0] == 1);
+    XCTAssertTrue(s_shards[0].stats.probeLengthHistogram[1] == 0);
+    XCTAssertTrue(s_shards[0].stats.probeLengthHistogram[2] == 2);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testRecordLookupScalesSampledLookups {
+    s_lookupStatsSampleInterval = VnodeCacheLookupStatsSampleInterval;
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        RecordLookup(s_shards[0], 3);
     }
+    
+    uint64_t lookups = s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups];
+    XCTAssertEqual(0U, lookups % VnodeCacheLookupStatsSampleInterval);
+    XCTAssertEqual(lookups * 3, s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions]);
+    XCTAssertEqual(lookups, s_shards[0].stats.probeLengthHistogram[2]);
+}
+
+- (void)testShardSequenceHasItsOwnCacheLine {
+    XCTAssertEqual(0U, offsetof(VnodeCacheShard, entriesSequence) % VnodeCacheLineSize);
+    XCTAssertGreaterThanOrEqual(offsetof(VnodeCacheShard, stats), offsetof(VnodeCacheShard, entriesSequence) + VnodeCacheLineSize);
 }
 
 - (void)testAtomicFetchAddCacheHealthStat {
     for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
     {
-        AtomicFetchAddCacheHealthStat(static_cast<VnodeCacheHealthStat>(i), 1ULL);
-        XCTAssertTrue(s_cacheStats.healthStats[i] == 1);
+        AtomicFetchAddCacheHealthStat(s_shards[0], static_cast<VnodeCacheHealthStat>(i), 1ULL);
+        XCTAssertTrue(s_shards[0].stats.healthStats[i] == 1);
     }
     
     for (int32_t i = 0; i < VnodeCacheHealthStat_Count; ++i)
     {
-        AtomicFetchAddCacheHealthStat(static_cast<VnodeCacheHealthStat>(i), 2ULL);
-        XCTAssertTrue(s_cacheStats.healthStats[i] == 3);
+        AtomicFetchAddCacheHealthStat(s_shards[0], static_cast<VnodeCacheHealthStat>(i), 2ULL);
+        XCTAssertTrue(s_shards[0].stats.healthStats[i] == 3);
     }
     
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
     
-    atomic_store_explicit(&s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount], UINT64_MAX - 1000, memory_order_relaxed);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == UINT64_MAX - 999);
-    AtomicFetchAddCacheHealthStat(VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0ULL);
+    atomic_store_explicit(&s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount], UINT64_MAX - 1000, memory_order_relaxed);
+    AtomicFetchAddCacheHealthStat(s_shards[0], VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == UINT64_MAX - 999);
+    AtomicFetchAddCacheHealthStat(s_shards[0], VnodeCacheHealthStat_InvalidateEntireCacheCount, 1ULL);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0ULL);
     
     XCTAssertTrue(MockCalls::DidCallFunction(KextMessageLogged, KEXTLOG_DEFAULT));
 }
@@ -127,10 +289,14 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 2);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
+    
+    // 4 -> The initial lookup, the lookup of the repo root while walking up the tree, and the
+    // lookups when adding the vnode and the repo root to the cache
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 4);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 0);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -158,15 +324,19 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
+    // One entry each was evicted to make room for the vnode and for the repo root
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == self->cacheWrapper.GetCapacity());
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalEvictions] == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
     
-    // 3 -> The initial lookup, the attempt to update the full cache, the lookup after emptying the cache
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 3);
+    // 4 -> The initial lookup, the lookup of the repo root while walking up the tree, and the
+    // lookups when adding the vnode and the repo root to the cache
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 4);
     
-    // Capacity * 2 -> The first two lookups (before invalidating the cache), will collide with every entry
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == self->cacheWrapper.GetCapacity() * 2);
+    // The cache is full, so every lookup collides at least once (the last one may collide more
+    // often, depending on where the vnode was inserted)
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] >= 4);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -193,9 +363,10 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
+    // The repo root was visited on the way up, so it is cached too
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
     
     uintptr_t vnodeIndex = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[vnodeIndex].vnode);
@@ -211,9 +382,59 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 1);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_FindRootForVnode_CachesVisitedAncestors {
+    VirtualizationRootHandle repoRootHandle = FindOrInsertVirtualizationRoot_LockedMayUnlock(
+        self->repoRootVnode.get(),
+        self->repoRootVnode->GetVid(),
+        FsidInode{ self->repoRootVnode->GetMountPoint()->GetFsid(), self->repoRootVnode->GetInode() },
+        self->repoPath.c_str());
+    XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(repoRootHandle));
+    
+    shared_ptr<vnode> deepFile = self->testMount->CreateVnodeTree(self->repoPath + "/a/b/c/deepFile");
+    shared_ptr<vnode> siblingFile = self->testMount->CreateVnodeTree(self->repoPath + "/a/b/c/siblingFile");
+    vnode_t directoryC = deepFile->GetParentVnode().get();
+    vnode_t directoryA = directoryC->GetParentVnode()->GetParentVnode().get();
+    
+    MockCalls::Clear();
+    
+    XCTAssertTrue(repoRootHandle == VnodeCache_FindRootForVnode(
+        &self->dummyPerfTracer,
+        PrjFSPerfCounter_VnodeOp_Vnode_Cache_Hit,
+        PrjFSPerfCounter_VnodeOp_Vnode_Cache_Miss,
+        PrjFSPerfCounter_VnodeOp_FindRoot,
+        PrjFSPerfCounter_VnodeOp_FindRoot_Iteration,
+        deepFile.get(),
+        self->dummyVFSContext));
+    
+    // deepFile, c, b, a, and the repo root
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 5);
+    
+    VirtualizationRootHandle rootHandle = RootHandle_None;
+    XCTAssertTrue(TryGetVnodeRootFromCache(directoryC, ComputeVnodeHashIndex(directoryC), vnode_vid(directoryC), rootHandle));
+    XCTAssertTrue(repoRootHandle == rootHandle);
+    rootHandle = RootHandle_None;
+    XCTAssertTrue(TryGetVnodeRootFromCache(directoryA, ComputeVnodeHashIndex(directoryA), vnode_vid(directoryA), rootHandle));
+    XCTAssertTrue(repoRootHandle == rootHandle);
+    
+    // The walk for the sibling stops at the cached parent directory, so only the sibling is added
+    XCTAssertTrue(repoRootHandle == VnodeCache_FindRootForVnode(
+        &self->dummyPerfTracer,
+        PrjFSPerfCounter_VnodeOp_Vnode_Cache_Hit,
+        PrjFSPerfCounter_VnodeOp_Vnode_Cache_Miss,
+        PrjFSPerfCounter_VnodeOp_FindRoot,
+        PrjFSPerfCounter_VnodeOp_FindRoot_Iteration,
+        siblingFile.get(),
+        self->dummyVFSContext));
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 6);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 2);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -239,18 +460,19 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     MockCalls::Clear();
 
     // Make sure the cache is empty to start
-    InvalidateCache_ExclusiveLocked();
+    InvalidateShard_ExclusiveLocked(0);
     
     // Insert testFileVnode with DummyRootHandle as its root
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     uint32_t testVnodeVid = self->testVnodeFile1->GetVid();
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -270,8 +492,9 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     XCTAssertTrue(rootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalRefreshRootForVnode] == 1);
+    // The vnode and the repo root, which was visited on the way up
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalRefreshRootForVnode] == 1);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -297,18 +520,19 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     MockCalls::Clear();
 
     // Make sure the cache is empty to start
-    InvalidateCache_ExclusiveLocked();
+    InvalidateShard_ExclusiveLocked(0);
     
     // Insert testFileVnode with DummyRootHandle as its root
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     uint32_t testVnodeVid = self->testVnodeFile1->GetVid();
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -328,8 +552,9 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(RootHandle_Indeterminate == self->cacheWrapper[indexFromHash].virtualizationRoot);
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalInvalidateVnodeRoot] == 1);
+    // The vnode and the repo root, which was visited on the way up
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalInvalidateVnodeRoot] == 1);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -337,7 +562,7 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
 
 - (void)testVnodeCache_InvalidateCache_SetsMemoryToZeros {
     self->cacheWrapper.FillAllEntries();
-    s_cacheStats.cacheEntries = self->cacheWrapper.GetCapacity();
+    s_shards[0].stats.cacheEntries = self->cacheWrapper.GetCapacity();
 
     shared_ptr<VnodeCacheEntry> emptyArray(static_cast<VnodeCacheEntry*>(calloc(self->cacheWrapper.GetCapacity(), sizeof(VnodeCacheEntry))), free);
     XCTAssertTrue(0 != memcmp(emptyArray.get(), s_entries, sizeof(VnodeCacheEntry) * self->cacheWrapper.GetCapacity()));
@@ -345,26 +570,32 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     VnodeCache_InvalidateCache(&self->dummyPerfTracer);
     XCTAssertTrue(0 == memcmp(emptyArray.get(), s_entries, sizeof(VnodeCacheEntry) * self->cacheWrapper.GetCapacity()));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 0);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 1);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 1);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testInvalidateCache_ExclusiveLocked_SetsMemoryToZeros {
+- (void)testInvalidateShard_ExclusiveLocked_SetsMemoryToZeros {
     self->cacheWrapper.FillAllEntries();
-    s_cacheStats.cacheEntries = self->cacheWrapper.GetCapacity();
+    s_shards[0].stats.cacheEntries = self->cacheWrapper.GetCapacity();
+    memset(s_entriesReferenced, 1, self->cacheWrapper.GetCapacity());
     
     shared_ptr<VnodeCacheEntry> emptyArray(static_cast<VnodeCacheEntry*>(calloc(self->cacheWrapper.GetCapacity(), sizeof(VnodeCacheEntry))), free);
     XCTAssertTrue(0 != memcmp(emptyArray.get(), s_entries, sizeof(VnodeCacheEntry) * self->cacheWrapper.GetCapacity()));
     
-    InvalidateCache_ExclusiveLocked();
+    InvalidateShard_ExclusiveLocked(0);
     XCTAssertTrue(0 == memcmp(emptyArray.get(), s_entries, sizeof(VnodeCacheEntry) * self->cacheWrapper.GetCapacity()));
-    XCTAssertTrue(s_cacheStats.cacheEntries == 0);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 0);
+    
+    for (uint32_t i = 0; i < self->cacheWrapper.GetCapacity(); ++i)
+    {
+        XCTAssertTrue(0 == s_entriesReferenced[i]);
+    }
     
     // VnodeCacheHealthStat_InvalidateEntireCacheCount is adjusted by VnodeCache_InvalidateCache
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -386,6 +617,281 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
+- (void)testComputePow2ShardCount {
+    XCTAssertEqual(1U, ComputePow2ShardCount(0));
+    XCTAssertEqual(1U, ComputePow2ShardCount(1));
+    XCTAssertEqual(4U, ComputePow2ShardCount(3));
+    XCTAssertEqual(8U, ComputePow2ShardCount(8));
+    XCTAssertEqual(static_cast<uint32_t>(PrjFSVnodeCacheMaxShards), ComputePow2ShardCount(PrjFSVnodeCacheMaxShards + 1));
+}
+
+- (void)testAdvanceIndexInShard_WrapsWithinShard {
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(64, 4);
+    
+    // 4 shards of 16 entries each
+    XCTAssertTrue(&s_shards[0] == &GetShardForIndex(15));
+    XCTAssertTrue(&s_shards[1] == &GetShardForIndex(16));
+    XCTAssertTrue(&s_shards[3] == &GetShardForIndex(63));
+    
+    XCTAssertEqual(23U, AdvanceIndexInShard(20, 3));
+    XCTAssertEqual(16U, AdvanceIndexInShard(31, 1));
+    XCTAssertEqual(17U, AdvanceIndexInShard(30, 3));
+    XCTAssertEqual(0U, AdvanceIndexInShard(15, 1));
+}
+
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_ProbeWrapsWithinShard {
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(64, 4);
+    
+    // The last index of shard 1
+    uintptr_t vnodeHashIndex = 31;
+    vnode_t firstVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 0);
+    vnode_t secondVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 1);
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(firstVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(secondVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    
+    XCTAssertTrue(firstVnode == self->cacheWrapper[31].vnode);
+    XCTAssertTrue(secondVnode == self->cacheWrapper[16].vnode);
+    XCTAssertTrue(nullptr == self->cacheWrapper[32].vnode);
+    XCTAssertTrue(s_shards[1].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[2].stats.cacheEntries == 0);
+    
+    VirtualizationRootHandle rootHandle;
+    XCTAssertTrue(TryGetVnodeRootFromCache(secondVnode, vnodeHashIndex, 1, rootHandle));
+    XCTAssertTrue(DummyRootHandle == rootHandle);
+    XCTAssertTrue(s_shards[1].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] > 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalCacheLookups] == 0);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testInvalidateShard_ExclusiveLocked_OnlyClearsThatShard {
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(64, 4);
+    self->cacheWrapper.FillAllEntries();
+    
+    uint32_t shardSequence = s_shards[1].entriesSequence;
+    uint32_t otherShardSequence = s_shards[2].entriesSequence;
+    InvalidateShard_ExclusiveLocked(1);
+    
+    for (uintptr_t index = 0; index < self->cacheWrapper.GetCapacity(); ++index)
+    {
+        if (index >= 16 && index < 32)
+        {
+            XCTAssertTrue(nullptr == self->cacheWrapper[index].vnode);
+        }
+        else
+        {
+            XCTAssertTrue(self->cacheWrapper.GetDummyVnode(index) == self->cacheWrapper[index].vnode);
+        }
+    }
+    
+    XCTAssertTrue(s_shards[1].stats.cacheEntries == 0);
+    XCTAssertTrue(s_shards[2].stats.cacheEntries == 16);
+    XCTAssertTrue(shardSequence + 2 == s_shards[1].entriesSequence);
+    XCTAssertTrue(otherShardSequence == s_shards[2].entriesSequence);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_InvalidateCache_ClearsEveryShard {
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(64, 4);
+    self->cacheWrapper.FillAllEntries();
+    
+    VnodeCache_InvalidateCache(&self->dummyPerfTracer);
+    
+    for (uintptr_t index = 0; index < self->cacheWrapper.GetCapacity(); ++index)
+    {
+        XCTAssertTrue(nullptr == self->cacheWrapper[index].vnode);
+    }
+    
+    for (uint32_t shardIndex = 0; shardIndex < 4; ++shardIndex)
+    {
+        XCTAssertTrue(s_shards[shardIndex].stats.cacheEntries == 0);
+    }
+    
+    // The invalidation is only counted once, in the first shard
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 1);
+    XCTAssertTrue(s_shards[1].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_InvalidateRoot_OnlyInvalidatesThatRoot {
+    vnode_t vnode1 = self->testVnodeFile1.get();
+    vnode_t vnode2 = self->testVnodeFile2.get();
+    InsertOrUpdateEntry_ExclusiveLocked(vnode1, ComputeVnodeHashIndex(vnode1), vnode_vid(vnode1), false, DummyRootHandle, LoadRootGeneration(DummyRootHandle));
+    InsertOrUpdateEntry_ExclusiveLocked(vnode2, ComputeVnodeHashIndex(vnode2), vnode_vid(vnode2), false, DummyRootHandleTwo, LoadRootGeneration(DummyRootHandleTwo));
+    
+    VnodeCache_InvalidateRoot(&self->dummyPerfTracer, DummyRootHandle);
+    XCTAssertTrue(1 == LoadRootGeneration(DummyRootHandle));
+    XCTAssertTrue(0 == LoadRootGeneration(DummyRootHandleTwo));
+    
+    VirtualizationRootHandle rootHandle;
+    XCTAssertFalse(TryGetVnodeRootFromCache(vnode1, ComputeVnodeHashIndex(vnode1), vnode_vid(vnode1), rootHandle));
+    XCTAssertTrue(TryGetVnodeRootFromCache(vnode2, ComputeVnodeHashIndex(vnode2), vnode_vid(vnode2), rootHandle));
+    XCTAssertTrue(DummyRootHandleTwo == rootHandle);
+    
+    // Stale entries are left in place until they are next written
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 2);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateRootGenerationCount] == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_InvalidateRoot_InvalidatesCacheWhenGenerationWraps {
+    self->cacheWrapper.FillAllEntries();
+    atomic_store_explicit(&s_rootGenerations[GetRootGenerationSlot(DummyRootHandle)], static_cast<uint8_t>(UINT8_MAX), memory_order_relaxed);
+    
+    VnodeCache_InvalidateRoot(&self->dummyPerfTracer, DummyRootHandle);
+    XCTAssertTrue(0 == LoadRootGeneration(DummyRootHandle));
+    
+    for (uintptr_t index = 0; index < self->cacheWrapper.GetCapacity(); ++index)
+    {
+        XCTAssertTrue(nullptr == self->cacheWrapper[index].vnode);
+    }
+    
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 1);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testGetRootGenerationSlot_SpecialHandlesHaveTheirOwnSlots {
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_None) != GetRootGenerationSlot(0));
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_None) != GetRootGenerationSlot(RootHandle_ProviderTemporaryDirectory));
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_None) < VnodeCacheRootGenerationSlots);
+    XCTAssertTrue(GetRootGenerationSlot(DummyRootHandle) != GetRootGenerationSlot(DummyRootHandleTwo));
+    
+    // No real root shares a slot with a special handle
+    for (VirtualizationRootHandle rootHandle = 0; rootHandle < 2 * VnodeCacheRootGenerationSlots; ++rootHandle)
+    {
+        XCTAssertTrue(GetRootGenerationSlot(rootHandle) < VnodeCacheRootGenerationSlots - VnodeCacheSpecialRootGenerationSlots);
+    }
+    
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_None) == VnodeCacheRootGenerationSlots - 1);
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_Indeterminate) == VnodeCacheRootGenerationSlots - 2);
+    XCTAssertTrue(GetRootGenerationSlot(RootHandle_ProviderTemporaryDirectory) == VnodeCacheRootGenerationSlots - 3);
+}
+
+- (void)testVnodeCache_RefreshRootForRenamedDirectory_InvalidatesPreviousRoot {
+    VirtualizationRootHandle repoRootHandle = FindOrInsertVirtualizationRoot_LockedMayUnlock(
+        self->repoRootVnode.get(),
+        self->repoRootVnode->GetVid(),
+        FsidInode{ self->repoRootVnode->GetMountPoint()->GetFsid(), self->repoRootVnode->GetInode() },
+        self->repoPath.c_str());
+    XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(repoRootHandle));
+    MockCalls::Clear();
+    
+    // Pretend that file1 is a directory that has just been moved into the repo from outside any root,
+    // and file2 is one of its descendants
+    vnode_t directoryVnode = self->testVnodeFile1.get();
+    vnode_t descendantVnode = self->testVnodeFile2.get();
+    vnode_t otherRootVnode = self->testVnodeFile3.get();
+    InsertOrUpdateEntry_ExclusiveLocked(directoryVnode, ComputeVnodeHashIndex(directoryVnode), vnode_vid(directoryVnode), false, RootHandle_None, LoadRootGeneration(RootHandle_None));
+    InsertOrUpdateEntry_ExclusiveLocked(descendantVnode, ComputeVnodeHashIndex(descendantVnode), vnode_vid(descendantVnode), false, RootHandle_None, LoadRootGeneration(RootHandle_None));
+    InsertOrUpdateEntry_ExclusiveLocked(otherRootVnode, ComputeVnodeHashIndex(otherRootVnode), vnode_vid(otherRootVnode), false, DummyRootHandle, LoadRootGeneration(DummyRootHandle));
+    
+    VirtualizationRootHandle rootHandle = VnodeCache_RefreshRootForRenamedDirectory(
+        &self->dummyPerfTracer,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
+        PrjFSPerfCounter_FileOp_FindRoot,
+        PrjFSPerfCounter_FileOp_FindRoot_Iteration,
+        directoryVnode,
+        self->dummyVFSContext);
+    XCTAssertTrue(repoRootHandle == rootHandle);
+    
+    XCTAssertTrue(TryGetVnodeRootFromCache(directoryVnode, ComputeVnodeHashIndex(directoryVnode), vnode_vid(directoryVnode), rootHandle));
+    XCTAssertTrue(repoRootHandle == rootHandle);
+    XCTAssertFalse(TryGetVnodeRootFromCache(descendantVnode, ComputeVnodeHashIndex(descendantVnode), vnode_vid(descendantVnode), rootHandle));
+    XCTAssertTrue(TryGetVnodeRootFromCache(otherRootVnode, ComputeVnodeHashIndex(otherRootVnode), vnode_vid(otherRootVnode), rootHandle));
+    XCTAssertTrue(DummyRootHandle == rootHandle);
+    
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateRootGenerationCount] == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_RefreshRootForRenamedDirectory_SameRootInvalidatesNothing {
+    VirtualizationRootHandle repoRootHandle = FindOrInsertVirtualizationRoot_LockedMayUnlock(
+        self->repoRootVnode.get(),
+        self->repoRootVnode->GetVid(),
+        FsidInode{ self->repoRootVnode->GetMountPoint()->GetFsid(), self->repoRootVnode->GetInode() },
+        self->repoPath.c_str());
+    XCTAssertTrue(VirtualizationRoot_IsValidRootHandle(repoRootHandle));
+    MockCalls::Clear();
+    
+    vnode_t directoryVnode = self->testVnodeFile1.get();
+    InsertOrUpdateEntry_ExclusiveLocked(directoryVnode, ComputeVnodeHashIndex(directoryVnode), vnode_vid(directoryVnode), false, repoRootHandle, LoadRootGeneration(repoRootHandle));
+    
+    VirtualizationRootHandle rootHandle = VnodeCache_RefreshRootForRenamedDirectory(
+        &self->dummyPerfTracer,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
+        PrjFSPerfCounter_FileOp_FindRoot,
+        PrjFSPerfCounter_FileOp_FindRoot_Iteration,
+        directoryVnode,
+        self->dummyVFSContext);
+    XCTAssertTrue(repoRootHandle == rootHandle);
+    XCTAssertTrue(0 == LoadRootGeneration(repoRootHandle));
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateRootGenerationCount] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 0);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testVnodeCache_RefreshRootForRenamedDirectory_UncachedDirectoryInvalidatesCache {
+    vnode_t directoryVnode = self->testVnodeFile1.get();
+    vnode_t otherVnode = self->testVnodeFile2.get();
+    InsertOrUpdateEntry_ExclusiveLocked(otherVnode, ComputeVnodeHashIndex(otherVnode), vnode_vid(otherVnode), false, DummyRootHandle, LoadRootGeneration(DummyRootHandle));
+    
+    VnodeCache_RefreshRootForRenamedDirectory(
+        &self->dummyPerfTracer,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Hit,
+        PrjFSPerfCounter_FileOp_Vnode_Cache_Miss,
+        PrjFSPerfCounter_FileOp_FindRoot,
+        PrjFSPerfCounter_FileOp_FindRoot_Iteration,
+        directoryVnode,
+        self->dummyVFSContext);
+    
+    // Only the freshly looked up entries for the directory and its 4 ancestors below "/" are left
+    VirtualizationRootHandle rootHandle;
+    XCTAssertFalse(TryGetVnodeRootFromCache(otherVnode, ComputeVnodeHashIndex(otherVnode), vnode_vid(otherVnode), rootHandle));
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 5);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_InvalidateEntireCacheCount] == 1);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_ReplacesEntryWithStaleRootGeneration {
+    vnode_t vnode = self->testVnodeFile1.get();
+    uintptr_t indexFromHash = ComputeVnodeHashIndex(vnode);
+    InsertOrUpdateEntry_ExclusiveLocked(vnode, indexFromHash, vnode_vid(vnode), false, DummyRootHandle, LoadRootGeneration(DummyRootHandle));
+    
+    VnodeCache_InvalidateRoot(&self->dummyPerfTracer, DummyRootHandle);
+    
+    // Unlike testInsertOrUpdateEntry_ExclusiveLocked_LogsErrorWhenCacheHasDifferentRoot, the stale
+    // entry is expected to be replaced without logging an error
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(vnode, indexFromHash, vnode_vid(vnode), false, DummyRootHandleTwo, LoadRootGeneration(DummyRootHandleTwo)));
+    XCTAssertTrue(DummyRootHandleTwo == self->cacheWrapper[indexFromHash].virtualizationRoot);
+    XCTAssertTrue(LoadRootGeneration(DummyRootHandleTwo) == self->cacheWrapper[indexFromHash].rootGeneration);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 1);
+    
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
 - (void)testTryGetVnodeRootFromCache_VnodeInCache {
     uintptr_t testIndex = 5;
     self->cacheWrapper[testIndex].vnode = self->testVnodeFile1.get();
@@ -401,6 +907,9 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
             rootHandle));
     XCTAssertTrue(DummyRootHandle == rootHandle);
     
+    // Cache hits give the entry a second chance when the CLOCK hand next passes it
+    XCTAssertTrue(1 == s_entriesReferenced[testIndex]);
+    
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
@@ -419,20 +928,176 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testInsertEntryToInvalidatedCache_ExclusiveLocked_CacheFull {
-    // In production InsertEntryToInvalidatedCache_ExclusiveLocked should never
-    // be called when the cache is full, but by this test doing so we can validate
-    // that InsertEntryToInvalidatedCache_ExclusiveLocked logs an error if it fails to
-    // insert a vnode into the cache
-    self->cacheWrapper.FillAllEntries();
+- (void)testTryGetVnodeRootFromCache_LockFree_FailsWhileEntryIsBeingWritten {
+    uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
+    WriteEntry_ExclusiveLocked(indexFromHash, self->testVnodeFile1.get(), self->testVnodeFile1->GetVid(), DummyRootHandle, 0);
+    XCTAssertTrue(2 == self->cacheWrapper[indexFromHash].sequence);
     
-    InsertEntryToInvalidatedCache_ExclusiveLocked(
-        self->testVnodeFile1.get(),
-        ComputeVnodeHashIndex(self->testVnodeFile1.get()),
-        self->testVnodeFile1->GetVid(),
-        DummyRootHandle);
+    // Simulate a writer in the middle of updating the entry
+    atomic_store_explicit(&self->cacheWrapper[indexFromHash].sequence, static_cast<uint8_t>(3), memory_order_relaxed);
     
-    XCTAssertTrue(MockCalls::DidCallFunction(KextMessageLogged, KEXTLOG_ERROR));
+    bool rootFound = true;
+    VirtualizationRootHandle rootHandle = 1;
+    XCTAssertFalse(
+        TryGetVnodeRootFromCache_LockFree(
+            self->testVnodeFile1.get(),
+            indexFromHash,
+            self->testVnodeFile1->GetVid(),
+            rootFound,
+            rootHandle));
+    
+    // TryGetVnodeRootFromCache should fall back to the locked lookup
+    XCTAssertTrue(
+        TryGetVnodeRootFromCache(
+            self->testVnodeFile1.get(),
+            indexFromHash,
+            self->testVnodeFile1->GetVid(),
+            rootHandle));
+    XCTAssertTrue(DummyRootHandle == rootHandle);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testTryGetVnodeRootFromCache_LockFree_FailsWhileCacheIsBeingInvalidated {
+    uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
+    WriteEntry_ExclusiveLocked(indexFromHash, self->testVnodeFile1.get(), self->testVnodeFile1->GetVid(), DummyRootHandle, 0);
+    
+    bool rootFound;
+    VirtualizationRootHandle rootHandle;
+    XCTAssertTrue(
+        TryGetVnodeRootFromCache_LockFree(
+            self->testVnodeFile1.get(),
+            indexFromHash,
+            self->testVnodeFile1->GetVid(),
+            rootFound,
+            rootHandle));
+    XCTAssertTrue(rootFound);
+    XCTAssertTrue(DummyRootHandle == rootHandle);
+    
+    uint32_t tableSequence = atomic_load_explicit(&s_shards[0].entriesSequence, memory_order_relaxed);
+    atomic_store_explicit(&s_shards[0].entriesSequence, tableSequence + 1, memory_order_relaxed);
+    XCTAssertFalse(
+        TryGetVnodeRootFromCache_LockFree(
+            self->testVnodeFile1.get(),
+            indexFromHash,
+            self->testVnodeFile1->GetVid(),
+            rootFound,
+            rootHandle));
+    atomic_store_explicit(&s_shards[0].entriesSequence, tableSequence + 2, memory_order_relaxed);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testInvalidateShard_ExclusiveLocked_AdvancesEntriesSequence {
+    uint32_t tableSequence = atomic_load_explicit(&s_shards[0].entriesSequence, memory_order_relaxed);
+    InvalidateShard_ExclusiveLocked(0);
+    XCTAssertTrue(tableSequence + 2 == atomic_load_explicit(&s_shards[0].entriesSequence, memory_order_relaxed));
+}
+
+// Fills every other entry of the cache with a dummy vnode at its home index
+- (vector<vnode_t>)insertDummyVnodesIntoHalfOfCache {
+    vector<vnode_t> vnodes;
+    for (uint32_t i = 0; i < self->cacheWrapper.GetCapacity() / 2; ++i)
+    {
+        vnode_t dummyVnode = self->cacheWrapper.GetDummyVnode(i * 2);
+        XCTAssertEqual(0U,
+            InsertOrUpdateEntry_ExclusiveLocked(
+                dummyVnode,
+                ComputeVnodeHashIndex(dummyVnode),
+                DummyVnodeVid,
+                false, // forceRefreshEntry
+                DummyRootHandle,
+                LoadRootGeneration(DummyRootHandle)));
+        vnodes.push_back(dummyVnode);
+    }
+    
+    return vnodes;
+}
+
+// Inserts the vnodes into a fresh cache, and returns the number of entries that had to be evicted to make room
+- (uint32_t)insertVnodesIntoEmptyCache:(const vector<vnode_t>&)vnodes {
+    InvalidateShard_ExclusiveLocked(0);
+    uint32_t evictions = 0;
+    for (vnode_t vnode : vnodes)
+    {
+        evictions += InsertOrUpdateEntry_ExclusiveLocked(vnode, ComputeVnodeHashIndex(vnode), DummyVnodeVid, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle));
+    }
+    
+    return evictions;
+}
+
+- (void)testTryGetVnodeRootFromCache_ConcurrentLookupsAllHit {
+    vector<vnode_t> vnodes = [self insertDummyVnodesIntoHalfOfCache];
+    
+    for (uint32_t threadCount : { 1u, 8u })
+    {
+        const uint32_t lookupsPerThread = 1000;
+        XCTAssertEqual(LookUpVnodesConcurrently(vnodes, threadCount, lookupsPerThread), static_cast<uint64_t>(threadCount) * lookupsPerThread);
+    }
+}
+
+- (void)testTryGetVnodeRootFromCache_SingleThreadPerformance {
+    vector<vnode_t> vnodes = [self insertDummyVnodesIntoHalfOfCache];
+    [self measureBlock:^{
+        LookUpVnodesConcurrently(vnodes, 1, 200000);
+    }];
+}
+
+- (void)testTryGetVnodeRootFromCache_ContentionPerformance {
+    // Cache hits shouldn't get slower per thread as more threads look up the same entries
+    vector<vnode_t> vnodes = [self insertDummyVnodesIntoHalfOfCache];
+    [self measureBlock:^{
+        LookUpVnodesConcurrently(vnodes, 32, 200000);
+    }];
+}
+
+- (void)testComputeVnodeHashIndex_SpreadsZoneAllocatorAddresses {
+    // For each layout of vnode addresses, compares how many vnodes share a home index under the legacy
+    // and Fibonacci hashes, and checks that they can all be found again with the Fibonacci hash.
+    const uint32_t cacheCapacity = 4096;
+    const uint32_t vnodeCount = cacheCapacity / 2;
+    
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(cacheCapacity);
+    
+    struct AddressDistribution
+    {
+        uintptr_t elementStride;
+        bool scatterZonePages;
+    };
+    
+    const AddressDistribution distributions[] =
+    {
+        { 248, true },  // zone pages, 248 byte vnodes
+        { 256, true },  // zone pages, 256 byte vnodes
+        { 256, false }, // contiguous, 256 byte vnodes
+    };
+    
+    for (const AddressDistribution& distribution : distributions)
+    {
+        vector<vnode_t> vnodes = MakeZoneAllocatorVnodes(vnodeCount, distribution.elementStride, distribution.scatterZonePages);
+        
+        // Vnodes packed at a power of 2 stride only ever reach a fraction of the legacy hash's home indexes
+        XCTAssertLessThan(CountHomeIndexCollisions(vnodes, ComputeVnodeHashIndex), CountHomeIndexCollisions(vnodes, ComputeLegacyVnodeHashIndex));
+        
+        uint32_t evictions = [self insertVnodesIntoEmptyCache:vnodes];
+        XCTAssertEqual(LookUpEveryVnode(vnodes, 1) + evictions, static_cast<uint64_t>(vnodeCount));
+    }
+}
+
+- (void)testTryGetVnodeRootFromCache_ZoneAllocatorAddressesPerformance {
+    const uint32_t cacheCapacity = 4096;
+    
+    self->cacheWrapper.FreeCache();
+    self->cacheWrapper.AllocateCache(cacheCapacity);
+    
+    vector<vnode_t> vnodes = MakeZoneAllocatorVnodes(cacheCapacity / 2, 256, true);
+    [self insertVnodesIntoEmptyCache:vnodes];
+    [self measureBlock:^{
+        LookUpEveryVnode(vnodes, 200);
+    }];
 }
 
 - (void)testFindVnodeRootFromDiskAndUpdateCache_RefreshAndInvalidateEntry {
@@ -456,18 +1121,19 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     MockCalls::Clear();
 
     // Make sure the cache is empty
-    InvalidateCache_ExclusiveLocked();
+    InvalidateShard_ExclusiveLocked(0);
     
     // Insert testFileVnode with DummyRootHandle as its root
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     uint32_t testVnodeVid = self->testVnodeFile1->GetVid();
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -540,7 +1206,7 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
     uint32_t testVnodeVid = self->testVnodeFile1->GetVid();
     
     // UpdateCacheBehavior_TrustCurrentEntry will use the current entry if present
-    // In this case there is no entry for the vnode and so the cache will be invalidated
+    // In this case there is no entry for the vnode and so a single entry will be evicted
     // and a new entry added
     VirtualizationRootHandle rootHandle;
     FindVnodeRootFromDiskAndUpdateCache(
@@ -566,12 +1232,13 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         }
         else
         {
-            XCTAssertTrue(nullptr == self->cacheWrapper[index].vnode);
-            XCTAssertTrue(0 == self->cacheWrapper[index].vid);
-            XCTAssertTrue(0 == self->cacheWrapper[index].virtualizationRoot);
+            XCTAssertTrue(self->cacheWrapper.GetDummyVnode(index) == self->cacheWrapper[index].vnode);
         }
     }
     
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == self->cacheWrapper.GetCapacity());
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalEvictions] == 1);
+    
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
@@ -598,12 +1265,12 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         rootHandle);
 }
 
-- (void)testTryFindVnodeIndex_Locked_ReturnsVnodeHashIndexWhenSlotEmpty {
+- (void)testTryFindVnodeIndex_Locked_ReturnsFalseWhenSlotEmpty {
     uintptr_t vnodeHashIndex = 5;
     uintptr_t cacheIndex;
-    XCTAssertTrue(TryFindVnodeIndex_Locked(self->testVnodeFile1.get(), vnodeHashIndex, /* out */ cacheIndex));
+    XCTAssertFalse(TryFindVnodeIndex_Locked(self->testVnodeFile1.get(), vnodeHashIndex, /* out */ cacheIndex));
     XCTAssertTrue(cacheIndex == vnodeHashIndex);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 0);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 0);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
@@ -617,96 +1284,257 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
             self->testVnodeFile1.get(),
             ComputeVnodeHashIndex(self->testVnodeFile1.get()),
             /* out */ vnodeIndex));
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == self->cacheWrapper.GetCapacity());
+    
+    // Every entry is at its home index, and so the probe stops at the entry following the vnode's home index
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 1);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryFindVnodeIndex_Locked_WrapsToBeginningWhenResolvingCollisions {
-    self->cacheWrapper.FillAllEntries();
-    uintptr_t emptyIndex = 2;
-    cacheWrapper.MarkEntryAsFree(emptyIndex);
-    
+- (void)testTryFindVnodeIndex_Locked_StopsAtEntryCloserToItsHomeIndex {
     uintptr_t vnodeHashIndex = 5;
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(self->cacheWrapper.GetDummyVnode(vnodeHashIndex), vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(self->cacheWrapper.GetDummyVnode(vnodeHashIndex + 1), vnodeHashIndex + 1, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    InitCacheStats();
+    
+    // A vnode with the same home index would have displaced the entry at vnodeHashIndex + 1
     uintptr_t vnodeIndex;
-    XCTAssertTrue(TryFindVnodeIndex_Locked(self->testVnodeFile1.get(), vnodeHashIndex, /* out */ vnodeIndex));
-    XCTAssertTrue(emptyIndex == vnodeIndex);
+    XCTAssertFalse(TryFindVnodeIndex_Locked(self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 1), vnodeHashIndex, /* out */ vnodeIndex));
+    XCTAssertTrue(vnodeHashIndex + 1 == vnodeIndex);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 1);
     
-    uint64_t expectedCollisions = (self->cacheWrapper.GetCapacity() - vnodeHashIndex) + emptyIndex;
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == expectedCollisions);
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testTryFindVnodeIndex_Locked_WrapsToBeginningWhenResolvingCollisions {
+    uintptr_t vnodeHashIndex = self->cacheWrapper.GetCapacity() - 1;
+    for (uint32_t i = 0; i < 3; ++i)
+    {
+        vnode_t dummyVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex, i);
+        XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(dummyVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    }
+    
+    InitCacheStats();
+    
+    uintptr_t vnodeIndex;
+    XCTAssertTrue(TryFindVnodeIndex_Locked(self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 2), vnodeHashIndex, /* out */ vnodeIndex));
+    XCTAssertTrue(1 == vnodeIndex);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == 2);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryFindVnodeIndex_Locked_ReturnsLastIndexWhenEmptyAndResolvingCollisions {
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_EvictsSingleEntryWhenFull {
     self->cacheWrapper.FillAllEntries();
-    uintptr_t emptyIndex = cacheWrapper.GetCapacity() - 1;
-    cacheWrapper.MarkEntryAsFree(emptyIndex);
     
+    uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
+    uint32_t shardSequence = s_shards[0].entriesSequence;
+    XCTAssertEqual(1U,
+        InsertOrUpdateEntry_ExclusiveLocked(
+            self->testVnodeFile1.get(),
+            indexFromHash,
+            self->testVnodeFile1->GetVid(),
+            true, // forceRefreshEntry
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
+    
+    // Lock-free readers have to know that an entry moved out of the way
+    XCTAssertTrue(shardSequence + 2 == s_shards[0].entriesSequence);
+    
+    // None of the entries had been referenced, so the CLOCK hand evicts the entry at the vnode's home index
+    XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
+    XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == self->cacheWrapper.GetCapacity());
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalEvictions] == 1);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_DisplacesEntryCloserToItsHomeIndex {
     uintptr_t vnodeHashIndex = 5;
-    uintptr_t vnodeIndex;
-    XCTAssertTrue(TryFindVnodeIndex_Locked(self->testVnodeFile1.get(), vnodeHashIndex, /* out */ vnodeIndex));
-    XCTAssertTrue(emptyIndex == vnodeIndex);
+    vnode_t firstVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex);
+    vnode_t neighborVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex + 1);
+    vnode_t collidingVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 1);
+    
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(firstVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(neighborVnode, vnodeHashIndex + 1, 1, false, DummyRootHandleTwo, LoadRootGeneration(DummyRootHandleTwo)));
+    s_entriesReferenced[vnodeHashIndex + 1] = 1;
+    
+    // Filling empty slots doesn't move any entries, so lock-free readers don't need to retry
+    uint32_t shardSequence = s_shards[0].entriesSequence;
+    XCTAssertTrue(0 == shardSequence);
+    
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(collidingVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    XCTAssertTrue(shardSequence + 2 == s_shards[0].entriesSequence);
+    
+    XCTAssertTrue(firstVnode == self->cacheWrapper[vnodeHashIndex].vnode);
+    XCTAssertTrue(collidingVnode == self->cacheWrapper[vnodeHashIndex + 1].vnode);
+    XCTAssertTrue(neighborVnode == self->cacheWrapper[vnodeHashIndex + 2].vnode);
+    XCTAssertTrue(DummyRootHandleTwo == self->cacheWrapper[vnodeHashIndex + 2].virtualizationRoot);
+    
+    // The reference bit moves along with the displaced entry
+    XCTAssertTrue(0 == s_entriesReferenced[vnodeHashIndex + 1]);
+    XCTAssertTrue(1 == s_entriesReferenced[vnodeHashIndex + 2]);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 3);
+    
+    VirtualizationRootHandle rootHandle;
+    XCTAssertTrue(TryGetVnodeRootFromCache(neighborVnode, vnodeHashIndex + 1, 1, rootHandle));
+    XCTAssertTrue(DummyRootHandleTwo == rootHandle);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
 
-    uint64_t expectedCollisions = (self->cacheWrapper.GetCapacity() - 1) - vnodeHashIndex;
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == expectedCollisions);
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_EvictsWhenProbeWindowFull {
+    uintptr_t vnodeHashIndex = 5;
+    for (uint32_t i = 0; i < MaxVnodeCacheProbeLength; ++i)
+    {
+        XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(self->cacheWrapper.GetDummyVnode(vnodeHashIndex, i), vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    }
+    
+    // The rest of the cache is empty, but the vnode can't be stored further than MaxVnodeCacheProbeLength from its home index
+    vnode_t overflowVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex, MaxVnodeCacheProbeLength);
+    XCTAssertEqual(1U, InsertOrUpdateEntry_ExclusiveLocked(overflowVnode, vnodeHashIndex, 1, false, DummyRootHandleTwo, LoadRootGeneration(DummyRootHandleTwo)));
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == MaxVnodeCacheProbeLength);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalEvictions] == 1);
+    
+    VirtualizationRootHandle rootHandle;
+    XCTAssertTrue(TryGetVnodeRootFromCache(overflowVnode, vnodeHashIndex, 1, rootHandle));
+    XCTAssertTrue(DummyRootHandleTwo == rootHandle);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryInsertOrUpdateEntry_ExclusiveLocked_ReturnsFalseWhenFull {
+- (void)testEvictEntryFromProbeWindow_ExclusiveLocked_SkipsReferencedEntries {
     self->cacheWrapper.FillAllEntries();
+    
+    uintptr_t vnodeHashIndex = 5;
+    s_entriesReferenced[vnodeHashIndex] = 1;
+    s_entriesReferenced[vnodeHashIndex + 1] = 1;
+    
+    EvictEntryFromProbeWindow_ExclusiveLocked(vnodeHashIndex);
+    
+    // Referenced entries get a second chance, but lose their reference bit
+    XCTAssertTrue(nullptr != self->cacheWrapper[vnodeHashIndex].vnode);
+    XCTAssertTrue(nullptr != self->cacheWrapper[vnodeHashIndex + 1].vnode);
+    XCTAssertTrue(nullptr == self->cacheWrapper[vnodeHashIndex + 2].vnode);
+    XCTAssertTrue(0 == s_entriesReferenced[vnodeHashIndex]);
+    XCTAssertTrue(0 == s_entriesReferenced[vnodeHashIndex + 1]);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == self->cacheWrapper.GetCapacity() - 1);
+    
+    // The next eviction starts one entry further into the window
+    XCTAssertTrue(1 == s_shards[0].clockHand);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
 
-    XCTAssertFalse(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
-            self->testVnodeFile1.get(),
-            ComputeVnodeHashIndex(self->testVnodeFile1.get()),
-            self->testVnodeFile1->GetVid(),
-            true, // forceRefreshEntry
-            DummyRootHandle));
+- (void)testRemoveEntry_ExclusiveLocked_ShiftsFollowingEntriesBack {
+    uintptr_t vnodeHashIndex = 5;
+    vnode_t collidingVnodes[] =
+    {
+        self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 0),
+        self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 1),
+        self->cacheWrapper.GetDummyVnode(vnodeHashIndex, 2),
+    };
+    
+    for (vnode_t collidingVnode : collidingVnodes)
+    {
+        XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(collidingVnode, vnodeHashIndex, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    }
     
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalLookupCollisions] == self->cacheWrapper.GetCapacity());
+    // This vnode's home index is occupied by the last colliding vnode
+    vnode_t displacedVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex + 2);
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(displacedVnode, vnodeHashIndex + 2, 1, false, DummyRootHandleTwo, LoadRootGeneration(DummyRootHandleTwo)));
+    XCTAssertTrue(displacedVnode == self->cacheWrapper[vnodeHashIndex + 3].vnode);
+    
+    // An entry at its home index just past the run should not be moved
+    vnode_t homeVnode = self->cacheWrapper.GetDummyVnode(vnodeHashIndex + 4);
+    XCTAssertEqual(0U, InsertOrUpdateEntry_ExclusiveLocked(homeVnode, vnodeHashIndex + 4, 1, false, DummyRootHandle, LoadRootGeneration(DummyRootHandle)));
+    
+    RemoveEntry_ExclusiveLocked(vnodeHashIndex);
+    
+    XCTAssertTrue(collidingVnodes[1] == self->cacheWrapper[vnodeHashIndex].vnode);
+    XCTAssertTrue(collidingVnodes[2] == self->cacheWrapper[vnodeHashIndex + 1].vnode);
+    XCTAssertTrue(displacedVnode == self->cacheWrapper[vnodeHashIndex + 2].vnode);
+    XCTAssertTrue(nullptr == self->cacheWrapper[vnodeHashIndex + 3].vnode);
+    XCTAssertTrue(homeVnode == self->cacheWrapper[vnodeHashIndex + 4].vnode);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 4);
+    
+    VirtualizationRootHandle rootHandle;
+    XCTAssertTrue(TryGetVnodeRootFromCache(displacedVnode, vnodeHashIndex + 2, 1, rootHandle));
+    XCTAssertTrue(DummyRootHandleTwo == rootHandle);
+    XCTAssertFalse(TryGetVnodeRootFromCache(collidingVnodes[0], vnodeHashIndex, 1, rootHandle));
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryInsertOrUpdateEntry_ExclusiveLocked_ReplacesIndeterminateEntry {
+- (void)testRemoveEntry_ExclusiveLocked_ShiftsAtMostOnceAroundFullShard {
+    // Every entry is one slot past its home index, so none of them would stop the backward shift
+    const uint32_t capacity = self->cacheWrapper.GetCapacity();
+    for (uint32_t i = 0; i < capacity; ++i)
+    {
+        self->cacheWrapper[i].vnode = self->cacheWrapper.GetDummyVnode((i + capacity - 1) % capacity);
+    }
+    
+    s_shards[0].stats.cacheEntries = capacity;
+    
+    RemoveEntry_ExclusiveLocked(0);
+    
+    for (uint32_t i = 0; i < capacity - 1; ++i)
+    {
+        XCTAssertTrue(self->cacheWrapper.GetDummyVnode(i) == self->cacheWrapper[i].vnode);
+    }
+    
+    XCTAssertTrue(nullptr == self->cacheWrapper[capacity - 1].vnode);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == capacity - 1);
+    
+    // Sanity check: We don't expect any of the mock functions to have been called
+    XCTAssertFalse(MockCalls::DidCallAnyFunctions());
+}
+
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_ReplacesIndeterminateEntry {
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     uint32_t testVnodeVid = self->testVnodeFile1->GetVid();
 
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
     
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             true, // forceRefreshEntry
-            RootHandle_Indeterminate));
+            RootHandle_Indeterminate,
+            LoadRootGeneration(RootHandle_Indeterminate)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(RootHandle_Indeterminate == self->cacheWrapper[indexFromHash].virtualizationRoot);
     
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             testVnodeVid,
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(testVnodeVid == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -720,37 +1548,39 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 0);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 0);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryInsertOrUpdateEntry_ExclusiveLocked_ReplacesEntryAfterRecyclingVnode {
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_ReplacesEntryAfterRecyclingVnode {
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
     
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             self->testVnodeFile1->GetVid(),
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(self->testVnodeFile1->GetVid() == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
     
     self->testVnodeFile1->StartRecycling();
     
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             self->testVnodeFile1->GetVid(),
             false, // forceRefreshEntry
-            DummyRootHandleTwo));
+            DummyRootHandleTwo,
+            LoadRootGeneration(DummyRootHandleTwo)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(self->testVnodeFile1->GetVid() == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandleTwo == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -764,35 +1594,37 @@ static const VirtualizationRootHandle DummyRootHandleTwo = 52;
         self->testVnodeFile1.get(),
         self->dummyVFSContext));
     
-    XCTAssertTrue(s_cacheStats.cacheEntries == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
-    XCTAssertTrue(s_cacheStats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 0);
+    XCTAssertTrue(s_shards[0].stats.cacheEntries == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeHits] == 1);
+    XCTAssertTrue(s_shards[0].stats.healthStats[VnodeCacheHealthStat_TotalFindRootForVnodeMisses] == 0);
     
     // Sanity check: We don't expect any of the mock functions to have been called
     XCTAssertFalse(MockCalls::DidCallAnyFunctions());
 }
 
-- (void)testTryInsertOrUpdateEntry_ExclusiveLocked_LogsErrorWhenCacheHasDifferentRoot {
+- (void)testInsertOrUpdateEntry_ExclusiveLocked_LogsErrorWhenCacheHasDifferentRoot {
     uintptr_t indexFromHash = ComputeVnodeHashIndex(self->testVnodeFile1.get());
 
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             self->testVnodeFile1->GetVid(),
             false, // forceRefreshEntry
-            DummyRootHandle));
+            DummyRootHandle,
+            LoadRootGeneration(DummyRootHandle)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(self->testVnodeFile1->GetVid() == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
     
-    XCTAssertTrue(
-        TryInsertOrUpdateEntry_ExclusiveLocked(
+    XCTAssertEqual(0U,
+        InsertOrUpdateEntry_ExclusiveLocked(
             self->testVnodeFile1.get(),
             indexFromHash,
             self->testVnodeFile1->GetVid(),
             false, // forceRefreshEntry
-            DummyRootHandleTwo));
+            DummyRootHandleTwo,
+            LoadRootGeneration(DummyRootHandleTwo)));
     XCTAssertTrue(self->testVnodeFile1.get() == self->cacheWrapper[indexFromHash].vnode);
     XCTAssertTrue(self->testVnodeFile1->GetVid() == self->cacheWrapper[indexFromHash].vid);
     XCTAssertTrue(DummyRootHandle == self->cacheWrapper[indexFromHash].virtualizationRoot);
@@ -73,4 +73,7 @@ namespace PrjFSLib.Mac
     public delegate void NotifyFileDeleted(
         string relativePath,
         bool isDirectory);
+
+    // Notifications were lost, so anything kept up to date from them must be rebuilt
+    public delegate void NotifyNotificationsDroppedEvent();
 }
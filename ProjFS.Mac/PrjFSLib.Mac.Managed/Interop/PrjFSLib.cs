@@ -66,6 +66,11 @@ internal static class PrjFSLib
             IntPtr bytes,
             uint byteCount);
 
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_CompleteCommand")]
+        public static extern Result CompleteCommand(
+            ulong commandId,
+            Result result);
+
         [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_RegisterForOfflineIO")]
         public static extern Result RegisterForOfflineIO();
 
@@ -14,6 +14,7 @@ public enum NotificationType
         FileRenamed         = 0x00000080,
         HardLinkCreated     = 0x00000100,
         PreConvertToFull    = 0x00001000,
+        NotificationsDropped = 0x00002000,
 
         PreModify           = 0x10000001,
         FileModified        = 0x10000002,
@@ -23,6 +23,7 @@ public class VirtualizationInstance
         public virtual NotifyNewFileCreatedEvent OnNewFileCreated { get; set; }
         public virtual NotifyFileRenamedEvent OnFileRenamed { get; set; }
         public virtual NotifyHardLinkCreatedEvent OnHardLinkCreated { get; set; }
+        public virtual NotifyNotificationsDroppedEvent OnNotificationsDropped { get; set; }
 
         public static Result ConvertDirectoryToVirtualizationRoot(string fullPath)
         {
@@ -168,7 +169,7 @@ public virtual Result StopVirtualizationInstance()
             ulong commandId,
             Result result)
         {
-            throw new NotImplementedException();
+            return Interop.PrjFSLib.CompleteCommand(commandId, result);
         }
 
         public virtual Result ConvertDirectoryToPlaceholder(
@@ -212,6 +213,10 @@ public virtual Result StopVirtualizationInstance()
 
                 case NotificationType.PreConvertToFull:
                     return this.OnFilePreConvertToFull(relativePath);
+
+                case NotificationType.NotificationsDropped:
+                    this.OnNotificationsDropped?.Invoke();
+                    return Result.Success;
             }
 
             return Result.ENotYetImplemented;
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "../PrjFSKext/public/FsidInode.h"
+#include "../PrjFSKext/public/Message.h"
+#include "PrjFSLib.h"
+
+struct _PrjFS_FileHandle
+{
+    FILE* file;
+};
+
+// Kernel requests to respond to when a command finishes. The first few are kept inline, so that
+// requests joining a command don't normally allocate.
+struct PendingCommandMessageIds
+{
+    static const uint32_t InlineCount = 4;
+
+    uint64_t inlineIds[InlineCount];
+    std::vector<uint64_t> moreIds;
+    uint32_t count = 0;
+
+    void Add(uint64_t messageId);
+    uint64_t Get(uint32_t index) const;
+};
+
+// An enumeration or hydration the provider is working on. It marks the file as in progress while
+// the provider's callback runs, so that no lock is held across the callback. If the provider has
+// been allowed to complete it asynchronously, the kernel message may be gone by the time it does,
+// so this holds everything needed to finish the request.
+struct PendingCommand
+{
+    // 0 while the entry isn't in use
+    uint64_t commandId;
+    FsidInode fsidInode;
+    // Only open for hydrations; the provider writes the file's contents through this until it completes the command
+    PrjFS_FileHandle fileHandle;
+    // The kernel request that started the command, or MessageId_NoResponse if the caller needs the result itself
+    uint64_t messageId;
+    // Other kernel requests for the same file that arrived since, and are responded to when the command finishes
+    PendingCommandMessageIds joinedMessageIds;
+    // Whether the provider was given the commandId, and so may complete it with PrjFS_CompleteCommand
+    bool canCompleteAsynchronously;
+    // Set while the provider's callback is running
+    bool callbackInProgress;
+    // The result passed to PrjFS_CompleteCommand; PrjFS_Result_Invalid until then
+    PrjFS_Result completionResult;
+};
+
+// Enumerations and hydrations in progress, and the locks that serialize checking whether a file needs
+// filling in with starting or finishing a command for it. Each FsidInode maps onto one of a fixed set of
+// stripes, each with its own mutex and a few preallocated commands, so neither a global lock nor any
+// allocation is needed per request. Command ids encode their stripe, so completing one goes straight
+// to it. Unrelated files occasionally share a stripe, so its mutex is never held across a provider
+// callback; a callback that fills in a child of the directory being enumerated could otherwise lock
+// the same mutex again.
+class PendingCommandTable
+{
+public:
+    // Called before asking the provider to fill in a file. isEmpty() checks whether that's still necessary,
+    // with the file's stripe locked. Returns false if it isn't (result is PrjFS_Result_Success), or if the
+    // request has joined a command in progress for the same file (result is PrjFS_Result_Pending, and the
+    // request is responded to when that command finishes).
+    //
+    // Otherwise a command is started, which the caller must pass to End once the provider's callback returns.
+    // No locks are held meanwhile. Requests the kernel is waiting on (messageId is not MessageId_NoResponse)
+    // may be completed later by the provider. Other callers need the outcome straight away, so if there's
+    // a command in progress for the file they wait for it to finish.
+    template <typename IsEmpty>
+    bool Begin(const FsidInode& fsidInode, uint64_t messageId, IsEmpty isEmpty, PrjFS_Result& result, PendingCommand*& command);
+
+    // Called once the provider's callback for a command from Begin has returned. Returns PrjFS_Result_Pending
+    // if the provider is going to complete the command with PrjFS_CompleteCommand. Otherwise finishes the
+    // command and returns its outcome for the caller to report; finish(command, result) does the work of
+    // finishing with the stripe locked, and returns the outcome. The kernel requests that joined the command
+    // are added to messageIds, for the caller to respond to once the lock has been released.
+    template <typename Finish>
+    PrjFS_Result End(PendingCommand* command, PrjFS_Result callbackResult, Finish finish, PendingCommandMessageIds& messageIds);
+
+    // Records the provider's result for an asynchronously completed command. Unless its callback is still
+    // running, in which case End finishes it, the command is finished as by End; the request that started
+    // it is added to messageIds as well, and finishedResult is set to the outcome. Returns
+    // PrjFS_Result_EInvalidArgs if there's no such command, or it can't be completed (again).
+    template <typename Finish>
+    PrjFS_Result Complete(uint64_t commandId, PrjFS_Result result, Finish finish, PendingCommandMessageIds& messageIds, PrjFS_Result& finishedResult);
+
+    static uint32_t GetStripeIndex(const FsidInode& fsidInode);
+    static uint32_t GetStripeIndex(uint64_t commandId);
+
+    static const uint32_t StripeIndexBits = 10;
+    static const uint32_t StripeCount = 1u << StripeIndexBits;
+    // Enough for the usual case of at most one command per file, plus the odd unrelated file sharing the stripe
+    static const uint32_t PreallocatedCommandsPerStripe = 2;
+
+private:
+    // Pad to a cache line so that threads locking neighbouring stripes don't contend
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        // Notified whenever one of the stripe's commands finishes
+        std::condition_variable commandFinished;
+        uint64_t commandSequenceNumber;
+        PendingCommand commands[PreallocatedCommandsPerStripe];
+        // Only used while more commands are in progress for the stripe's files than were preallocated
+        std::vector<std::unique_ptr<PendingCommand>> overflowCommands;
+    };
+
+    PendingCommand* FindForFile_Locked(Stripe& stripe, const FsidInode& fsidInode);
+    PendingCommand* Find_Locked(Stripe& stripe, uint64_t commandId);
+    PendingCommand* Add_Locked(Stripe& stripe, uint32_t stripeIndex, const FsidInode& fsidInode, uint64_t messageId);
+    template <typename Finish>
+    PrjFS_Result Finish_Locked(Stripe& stripe, PendingCommand* command, PrjFS_Result result, bool respondToStartingRequest, Finish finish, PendingCommandMessageIds& messageIds);
+
+    Stripe stripes[StripeCount];
+};
+
+inline void PendingCommandMessageIds::Add(uint64_t messageId)
+{
+    if (this->count < InlineCount)
+    {
+        this->inlineIds[this->count] = messageId;
+    }
+    else
+    {
+        this->moreIds.push_back(messageId);
+    }
+
+    ++this->count;
+}
+
+inline uint64_t PendingCommandMessageIds::Get(uint32_t index) const
+{
+    return index < InlineCount ? this->inlineIds[index] : this->moreIds[index - InlineCount];
+}
+
+template <typename IsEmpty>
+bool PendingCommandTable::Begin(const FsidInode& fsidInode, uint64_t messageId, IsEmpty isEmpty, PrjFS_Result& result, PendingCommand*& command)
+{
+    command = nullptr;
+    uint32_t stripeIndex = GetStripeIndex(fsidInode);
+    Stripe& stripe = this->stripes[stripeIndex];
+    std::unique_lock<std::mutex> lock(stripe.mutex);
+    while (isEmpty())
+    {
+        PendingCommand* pendingForFile = this->FindForFile_Locked(stripe, fsidInode);
+        if (nullptr == pendingForFile)
+        {
+            // Added before calling the provider, as it may complete the command on another thread before the callback returns
+            command = this->Add_Locked(stripe, stripeIndex, fsidInode, messageId);
+            return true;
+        }
+
+        if (MessageId_NoResponse != messageId)
+        {
+            pendingForFile->joinedMessageIds.Add(messageId);
+            result = PrjFS_Result_Pending;
+            return false;
+        }
+
+        // Whoever is filling in the file needs the stripe's lock to finish, which waiting releases
+        uint64_t pendingCommandId = pendingForFile->commandId;
+        stripe.commandFinished.wait(
+            lock,
+            [this, &stripe, pendingCommandId]() { return nullptr == this->Find_Locked(stripe, pendingCommandId); });
+    }
+
+    result = PrjFS_Result_Success;
+    return false;
+}
+
+template <typename Finish>
+PrjFS_Result PendingCommandTable::End(PendingCommand* command, PrjFS_Result callbackResult, Finish finish, PendingCommandMessageIds& messageIds)
+{
+    Stripe& stripe = this->stripes[GetStripeIndex(command->commandId)];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    PrjFS_Result result = callbackResult;
+    command->callbackInProgress = false;
+    if (PrjFS_Result_Pending == callbackResult && command->canCompleteAsynchronously)
+    {
+        if (PrjFS_Result_Invalid == command->completionResult)
+        {
+            return PrjFS_Result_Pending;
+        }
+
+        // The provider completed the command before the callback returned
+        result = command->completionResult;
+    }
+
+    return this->Finish_Locked(stripe, command, result, false /* respondToStartingRequest */, finish, messageIds);
+}
+
+template <typename Finish>
+PrjFS_Result PendingCommandTable::Complete(uint64_t commandId, PrjFS_Result result, Finish finish, PendingCommandMessageIds& messageIds, PrjFS_Result& finishedResult)
+{
+    Stripe& stripe = this->stripes[GetStripeIndex(commandId)];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    PendingCommand* command = this->Find_Locked(stripe, commandId);
+    if (nullptr == command ||
+        !command->canCompleteAsynchronously ||
+        PrjFS_Result_Invalid != command->completionResult)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+
+    command->completionResult = result;
+    if (command->callbackInProgress)
+    {
+        // Completed before the callback returned, so the callback's thread finishes the command
+        finishedResult = PrjFS_Result_Pending;
+        return PrjFS_Result_Success;
+    }
+
+    finishedResult = this->Finish_Locked(stripe, command, result, true /* respondToStartingRequest */, finish, messageIds);
+    return PrjFS_Result_Success;
+}
+
+// Finishes filling in the file and frees the command. The request that started it is only added to
+// messageIds if respondToStartingRequest is set; otherwise the caller reports the outcome itself.
+template <typename Finish>
+PrjFS_Result PendingCommandTable::Finish_Locked(Stripe& stripe, PendingCommand* command, PrjFS_Result result, bool respondToStartingRequest, Finish finish, PendingCommandMessageIds& messageIds)
+{
+    result = finish(*command, result);
+
+    for (uint32_t i = 0; i < command->joinedMessageIds.count; ++i)
+    {
+        messageIds.Add(command->joinedMessageIds.Get(i));
+    }
+
+    if (respondToStartingRequest && MessageId_NoResponse != command->messageId)
+    {
+        messageIds.Add(command->messageId);
+    }
+
+    command->commandId = 0;
+    if (command < stripe.commands || command >= stripe.commands + PreallocatedCommandsPerStripe)
+    {
+        for (size_t i = 0; i < stripe.overflowCommands.size(); ++i)
+        {
+            if (stripe.overflowCommands[i].get() == command)
+            {
+                stripe.overflowCommands[i] = std::move(stripe.overflowCommands.back());
+                stripe.overflowCommands.pop_back();
+                break;
+            }
+        }
+    }
+
+    stripe.commandFinished.notify_all();
+    return result;
+}
+
+inline PendingCommand* PendingCommandTable::FindForFile_Locked(Stripe& stripe, const FsidInode& fsidInode)
+{
+    for (PendingCommand& command : stripe.commands)
+    {
+        if (0 != command.commandId &&
+            command.fsidInode.inode == fsidInode.inode &&
+            command.fsidInode.fsid.val[0] == fsidInode.fsid.val[0] &&
+            command.fsidInode.fsid.val[1] == fsidInode.fsid.val[1])
+        {
+            return &command;
+        }
+    }
+
+    for (const std::unique_ptr<PendingCommand>& command : stripe.overflowCommands)
+    {
+        if (command->fsidInode.inode == fsidInode.inode &&
+            command->fsidInode.fsid.val[0] == fsidInode.fsid.val[0] &&
+            command->fsidInode.fsid.val[1] == fsidInode.fsid.val[1])
+        {
+            return command.get();
+        }
+    }
+
+    return nullptr;
+}
+
+inline PendingCommand* PendingCommandTable::Find_Locked(Stripe& stripe, uint64_t commandId)
+{
+    for (PendingCommand& command : stripe.commands)
+    {
+        if (commandId == command.commandId)
+        {
+            return &command;
+        }
+    }
+
+    for (const std::unique_ptr<PendingCommand>& command : stripe.overflowCommands)
+    {
+        if (commandId == command->commandId)
+        {
+            return command.get();
+        }
+    }
+
+    return nullptr;
+}
+
+inline PendingCommand* PendingCommandTable::Add_Locked(Stripe& stripe, uint32_t stripeIndex, const FsidInode& fsidInode, uint64_t messageId)
+{
+    PendingCommand* command = nullptr;
+    for (PendingCommand& freeCommand : stripe.commands)
+    {
+        if (0 == freeCommand.commandId)
+        {
+            command = &freeCommand;
+            break;
+        }
+    }
+
+    if (nullptr == command)
+    {
+        stripe.overflowCommands.emplace_back(new PendingCommand());
+        command = stripe.overflowCommands.back().get();
+    }
+
+    // Never 0, as the sequence number starts at 1
+    command->commandId = (++stripe.commandSequenceNumber << StripeIndexBits) | stripeIndex;
+    command->fsidInode = fsidInode;
+    command->fileHandle.file = nullptr;
+    command->messageId = messageId;
+    command->joinedMessageIds.count = 0;
+    command->joinedMessageIds.moreIds.clear();
+    command->canCompleteAsynchronously = MessageId_NoResponse != messageId;
+    command->callbackInProgress = true;
+    command->completionResult = PrjFS_Result_Invalid;
+    return command;
+}
+
+inline uint32_t PendingCommandTable::GetStripeIndex(const FsidInode& fsidInode)
+{
+    // Fibonacci hashing; inode numbers are often sequential, so the high bits of the product are used
+    uint64_t key = fsidInode.inode ^ (static_cast<uint64_t>(static_cast<uint32_t>(fsidInode.fsid.val[0])) << 32) ^ static_cast<uint32_t>(fsidInode.fsid.val[1]);
+    return static_cast<uint32_t>((key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - StripeIndexBits));
+}
+
+inline uint32_t PendingCommandTable::GetStripeIndex(uint64_t commandId)
+{
+    return static_cast<uint32_t>(commandId & (StripeCount - 1));
+}
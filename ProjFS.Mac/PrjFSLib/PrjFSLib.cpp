@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cassert>
 #include <stddef.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/param.h>
@@ -15,7 +16,8 @@
 #include <stack>
 #include <memory>
 #include <set>
-#include <map>
+#include <vector>
+#include <algorithm>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IODataQueueClient.h>
 #include <mach/mach_port.h>
@@ -30,6 +32,8 @@
 #include "../PrjFSKext/public/PrjFSXattrs.h"
 #include "../PrjFSKext/public/Message.h"
 #include "PrjFSUser.hpp"
+#include "PendingCommandTable.hpp"
+#include "RequestScheduler.hpp"
 
 #define STRINGIFY(s) #s
 
@@ -42,8 +46,8 @@ using std::hex;
 using std::is_pod;
 using std::lock_guard;
 using std::make_pair;
-using std::make_shared;
-using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::oct;
@@ -51,43 +55,24 @@ using std::ostringstream;
 using std::pair;
 using std::queue;
 using std::set;
-using std::shared_ptr;
 using std::stack;
 using std::string;
+using std::vector;
 
 typedef lock_guard<mutex> mutex_lock;
 
-// Structs
-struct _PrjFS_FileHandle
-{
-    FILE* file;
-};
-
-struct FsidInodeCompare
-{
-    bool operator() (const FsidInode& lhs, const FsidInode& rhs) const
-    {
-        if (lhs.fsid.val[0] !=  rhs.fsid.val[0])
-        {
-            return lhs.fsid.val[0] < rhs.fsid.val[0];
-        }
-        
-        if (lhs.fsid.val[1] !=  rhs.fsid.val[1])
-        {
-            return lhs.fsid.val[1] < rhs.fsid.val[1];
-        }
-        
-        return lhs.inode < rhs.inode;
-    }
-};
+// Constants
+// Each message in the kext's queue is prefixed with its size, and may be followed by two paths
+static const uint64_t MessageQueueCapacityBytesPerPoolThread = 4 * (sizeof(uint32_t) + sizeof(MessageHeader) + MessagePath_Count * PrjFSMaxPath);
+static_assert(
+    static_cast<int>(PrjFS_RequestClass_Blocking) == MessagePriority_Blocking &&
+    static_cast<int>(PrjFS_RequestClass_PreOperation) == MessagePriority_PreOperation &&
+    static_cast<int>(PrjFS_RequestClass_Informational) == MessagePriority_Informational &&
+    static_cast<int>(PrjFS_RequestClass_Count) == MessagePriority_Count,
+    "PrjFS_RequestClass values must match MessagePriority");
 
-struct MutexAndUseCount
-{
-    shared_ptr<mutex> mutex;
-    int useCount;
-};
-
-typedef map<FsidInode, MutexAndUseCount, FsidInodeCompare> FileMutexMap;
+// Placeholders written by PrjFS_WritePlaceholderDirectories/Files are spread across threads in chunks of this many
+static const uint32_t PlaceholderBatchChunkSize = 256;
 
 static fsid_t s_virtualizationRoot_fsid;
 
@@ -97,26 +82,55 @@ static bool IsBitSetInFileFlags(const char* fullPath, uint32_t bit);
 
 static bool InitializeEmptyPlaceholder(const char* fullPath);
 template<typename TPlaceholder> static bool InitializeEmptyPlaceholder(const char* fullPath, TPlaceholder* data, const char* xattrName);
+static bool InitializeEmptyPlaceholder(int fileDescriptor, const char* name);
+template<typename TPlaceholder> static bool InitializeEmptyPlaceholder(int fileDescriptor, const char* name, TPlaceholder* data, const char* xattrName);
 static errno_t AddXAttr(const char* fullPath, const char* name, const void* value, size_t size);
 static bool TryGetXAttr(const char* fullPath, const char* name, size_t expectedSize, _Out_ void* value);
 static errno_t RemoveXAttrWithoutFollowingLinks(const char* fullPath, const char* name);
 
 static inline PrjFS_NotificationType KUMessageTypeToNotificationType(MessageType kuNotificationType);
 
+template<typename TEntry>
+static PrjFS_Result WritePlaceholdersInDirectory(
+    const char* functionName,
+    const char* parentRelativePath,
+    TEntry* entries,
+    uint32_t entryCount,
+    PrjFS_Result (*writePlaceholder)(int parentDirectoryDescriptor, const char* parentRelativePath, TEntry& entry),
+    PrjFS_Result (*finishPlaceholder)(const char* parentRelativePath, TEntry& entry));
+static PrjFS_Result WritePlaceholderDirectoryAt(int parentDirectoryDescriptor, const char* parentRelativePath, PrjFS_PlaceholderDirectoryEntry& entry);
+static PrjFS_Result WritePlaceholderFileAt(int parentDirectoryDescriptor, const char* parentRelativePath, PrjFS_PlaceholderFileEntry& entry);
+static PrjFS_Result HydrateExecutablePlaceholder(const char* parentRelativePath, PrjFS_PlaceholderFileEntry& entry);
+
 static bool IsVirtualizationRoot(const char* fullPath);
 static void CombinePaths(const char* root, const char* relative, char (&combined)[PrjFSMaxPath]);
 static const char* GetRelativePath(const char* fullPath, const char* root);
 
 static errno_t SendKernelMessageResponse(uint64_t messageId, MessageType responseType);
+static errno_t SendKernelMessageResponseDirectly(uint64_t messageId, MessageType responseType);
+static errno_t RingResponseRingDoorbell();
 static errno_t RegisterVirtualizationRootPath(const char* fullPath);
+static void SetMessageQueueCapacity(unsigned int poolThreadCount);
 
 static PrjFS_Result RecursivelyMarkAllChildrenAsInRoot(const char* fullDirectoryPath);
 
+static void DequeueAndHandleKernelMessages(IODataQueueMemory* queueMemory);
+static void SignalMessageQueueSpaceIfWanted();
+static MessagePriority GetPriorityForKernelMessage(const void* messageMemory);
 static void HandleKernelRequest(void* messageMemory, uint32_t messageSize);
-static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath);
+static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath, uint64_t messageId);
 static PrjFS_Result HandleRecursivelyEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath);
 static PrjFS_Result HandleHydrateFileRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath);
-static PrjFS_Result HydrateFile(const char* absolutePath, const char* relativePath, FsidInode fsidInode, pid_t pid, const char* procname);
+static PrjFS_Result HydrateFile(const char* absolutePath, const char* relativePath, FsidInode fsidInode, pid_t pid, const char* procname, uint64_t messageId);
+static bool BeginFillingPlaceholder(
+    const FsidInode& fsidInode,
+    const char* absolutePath,
+    uint64_t messageId,
+    PrjFS_Result& result,
+    PendingCommand*& command);
+static PrjFS_Result EndFillingPlaceholder(PendingCommand* command, const char* absolutePath, PrjFS_Result callbackResult);
+static void RespondToKernelRequests(const PendingCommandMessageIds& messageIds, PrjFS_Result result);
+static PrjFS_Result FinishFillingPlaceholder_FileLocked(const char* absolutePath, PrjFS_FileHandle* fileHandle, PrjFS_Result result);
 static PrjFS_Result HandleNewFileInRootNotification(
     const MessageHeader* request,
     const char* relativePath,
@@ -141,9 +155,6 @@ static Message ParseMessageMemory(const void* messageMemory, uint32_t size);
 static const char* NotificationTypeToString(PrjFS_NotificationType notificationType);
 #endif
 
-static FileMutexMap::iterator CheckoutFileMutexIterator(const FsidInode& fsidInode);
-static void ReturnFileMutexIterator(FileMutexMap::iterator lockIterator);
-
 static void LogError(const char* formatString, ...) __attribute__((__format__ (printf, 1, 2)));
 static void LogWarning(const char* formatString, ...) __attribute__((__format__ (printf, 1, 2)));
 static void LogInfo(const char* formatString, ...) __attribute__((__format__ (printf, 1, 2)));
@@ -153,16 +164,24 @@ static io_connect_t s_kernelServiceConnection = IO_OBJECT_NULL;
 static string s_virtualizationRootFullPath;
 static PrjFS_Callbacks s_callbacks;
 static dispatch_queue_t s_messageQueueDispatchQueue;
-static dispatch_queue_t s_kernelRequestHandlingConcurrentQueue;
+static RequestScheduler s_requestScheduler;
+
+// Responses to kernel requests are batched through this ring where possible; nullptr if it couldn't be mapped
+static ProviderResponseRing* s_responseRing = nullptr;
+// Protects the ring's writeIndex and s_responseRingDoorbellInFlight
+static mutex s_responseRingMutex;
+// Set while a thread is ringing the doorbell; it keeps ringing until the kext has caught up, so other
+// threads can add their responses to the ring and leave them for it.
+static bool s_responseRingDoorbellInFlight = false;
+
 
 static mutex s_kernelServiceOfflineClientMutex;
 static uint32_t s_kernelServiceOfflineClientCount = 0;
 static io_connect_t s_kernelServiceOfflineWriterConnection = IO_OBJECT_NULL;
 
 
-// Map of FsidInode -> MutexAndUseCount for that FsidInode, plus mutex to protect the map itself.
-static FileMutexMap s_fileLocks;
-static mutex s_fileLocksMutex;
+// Enumerations and hydrations in progress
+static PendingCommandTable s_pendingCommands;
 
 // The full API is defined in the header, but only the minimal set of functions needed
 // for the initial MirrorProvider implementation are listed here. Calling any other function
@@ -258,6 +277,9 @@ PrjFS_Result PrjFS_StartVirtualizationInstance(
         return PrjFS_Result_EDriverNotLoaded;
     }
     
+    // Must happen before the queue is mapped
+    SetMessageQueueCapacity(poolThreadCount);
+    
     DataQueueResources dataQueue;
     s_messageQueueDispatchQueue = dispatch_queue_create("PrjFS Kernel Message Handling", DISPATCH_QUEUE_SERIAL);
     if (!PrjFSService_DataQueueInit(&dataQueue, s_kernelServiceConnection, ProviderPortType_MessageQueue, ProviderMemoryType_MessageQueue, s_messageQueueDispatchQueue))
@@ -266,6 +288,24 @@ PrjFS_Result PrjFS_StartVirtualizationInstance(
         return PrjFS_Result_EInvalidOperation;
     }
     
+    mach_vm_address_t responseRingAddress = 0;
+    mach_vm_size_t responseRingSize = 0;
+    IOReturn mapResult = IOConnectMapMemory64(
+        s_kernelServiceConnection,
+        ProviderMemoryType_ResponseRing,
+        mach_task_self(),
+        &responseRingAddress,
+        &responseRingSize,
+        kIOMapAnywhere);
+    if (kIOReturnSuccess == mapResult && responseRingSize >= sizeof(ProviderResponseRing))
+    {
+        s_responseRing = reinterpret_cast<ProviderResponseRing*>(responseRingAddress);
+    }
+    else
+    {
+        LogWarning("PrjFS_StartVirtualizationInstance: Failed to map response ring (0x%08x), responding to kernel requests one at a time.", mapResult);
+    }
+    
     s_virtualizationRootFullPath = virtualizationRootFullPath;
     s_callbacks = callbacks;
     
@@ -284,43 +324,18 @@ PrjFS_Result PrjFS_StartVirtualizationInstance(
     }
     s_virtualizationRoot_fsid = rootAttributes.f_fsid;
     
-    s_kernelRequestHandlingConcurrentQueue = dispatch_queue_create("PrjFS Kernel Request Handling", DISPATCH_QUEUE_CONCURRENT);
+    const uint32_t maxConcurrentRequests[MessagePriority_Count] =
+    {
+        poolThreadCount,
+        max(1u, poolThreadCount / 2),
+        // Notifications aren't waited for by the kernel, so they're handled one at a time in the order they were sent
+        1,
+    };
+    s_requestScheduler.Init(maxConcurrentRequests);
     
     dispatch_source_set_event_handler(dataQueue.dispatchSource, ^{
         DataQueue_ClearMachNotification(dataQueue.notificationPort);
-        
-        while (1)
-        {
-            IODataQueueEntry* entry = DataQueue_Peek(dataQueue.queueMemory);
-            if (nullptr == entry)
-            {
-                // No more items in queue
-                break;
-            }
-            
-            uint32_t messageSize = entry->size;
-            if (messageSize < sizeof(Message))
-            {
-                LogError("PrjFS_StartVirtualizationInstance: Bad message size: got %d bytes, expected minimum of %lu, skipping. Kernel/user version mismatch?", messageSize, sizeof(Message));
-                DataQueue_Dequeue(dataQueue.queueMemory, nullptr, nullptr);
-                continue;
-            }
-            
-            void* messageMemory = malloc(messageSize);
-            uint32_t dequeuedSize = messageSize;
-            IOReturn result = DataQueue_Dequeue(dataQueue.queueMemory, messageMemory, &dequeuedSize);
-            if (kIOReturnSuccess != result || dequeuedSize != messageSize)
-            {
-                LogError("PrjFS_StartVirtualizationInstance: Unexpected result dequeueing message - result 0x%08x dequeued %d/%d bytes", result, dequeuedSize, messageSize);
-                abort();
-            }
-
-            dispatch_async(
-                s_kernelRequestHandlingConcurrentQueue,
-                ^{
-                    HandleKernelRequest(messageMemory, messageSize);
-                });
-        }
+        DequeueAndHandleKernelMessages(dataQueue.queueMemory);
     });
     dispatch_resume(dataQueue.dispatchSource);
 	
@@ -489,7 +504,7 @@ PrjFS_Result PrjFS_WritePlaceholderFile(
         fsidInode.inode = fileAttributes.st_ino;
         fsidInode.fsid = s_virtualizationRoot_fsid;
 
-        if (HydrateFile(fullPath, relativePath, fsidInode, 1, "placeholder") != PrjFS_Result_Success)
+        if (HydrateFile(fullPath, relativePath, fsidInode, 1, "placeholder", MessageId_NoResponse) != PrjFS_Result_Success)
         {
            LogWarning("PrjFS_WritePlaceholderFile: failed to hydrate executable %s", fullPath);
            result = PrjFS_Result_EIOError;
@@ -519,6 +534,36 @@ CleanupAndFail:
     return result;
 }
 
+PrjFS_Result PrjFS_WritePlaceholderDirectories(
+    _In_    const char*                             parentRelativePath,
+    _In_    PrjFS_PlaceholderDirectoryEntry*        entries,
+    _In_    unsigned int                            entryCount)
+{
+#ifdef DEBUG
+    cout
+        << "PrjFS_WritePlaceholderDirectories("
+        << (nullptr == parentRelativePath ? "[NULL]" : parentRelativePath) << ", "
+        << entryCount << ")" << endl;
+#endif
+    
+    return WritePlaceholdersInDirectory("PrjFS_WritePlaceholderDirectories", parentRelativePath, entries, entryCount, WritePlaceholderDirectoryAt, nullptr);
+}
+
+PrjFS_Result PrjFS_WritePlaceholderFiles(
+    _In_    const char*                             parentRelativePath,
+    _In_    PrjFS_PlaceholderFileEntry*             entries,
+    _In_    unsigned int                            entryCount)
+{
+#ifdef DEBUG
+    cout
+        << "PrjFS_WritePlaceholderFiles("
+        << (nullptr == parentRelativePath ? "[NULL]" : parentRelativePath) << ", "
+        << entryCount << ")" << endl;
+#endif
+    
+    return WritePlaceholdersInDirectory("PrjFS_WritePlaceholderFiles", parentRelativePath, entries, entryCount, WritePlaceholderFileAt, HydrateExecutablePlaceholder);
+}
+
 PrjFS_Result PrjFS_WriteSymLink(
     _In_    const char*                             relativePath,
     _In_    const char*                             symLinkTarget)
@@ -718,6 +763,79 @@ PrjFS_Result PrjFS_WriteFileContents(
     return PrjFS_Result_Success;
 }
 
+PrjFS_Result PrjFS_CompleteCommand(
+    _In_    unsigned long                           commandId,
+    _In_    PrjFS_Result                            result)
+{
+#ifdef DEBUG
+    cout
+        << "PrjFS_CompleteCommand("
+        << commandId << ", "
+        << result << ")" << endl;
+#endif
+    
+    if (PrjFS_Result_Invalid == result ||
+        PrjFS_Result_Pending == result)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    PendingCommandMessageIds messageIds;
+    PrjFS_Result finishedResult;
+    PrjFS_Result completeResult = s_pendingCommands.Complete(
+        commandId,
+        result,
+        [](PendingCommand& command, PrjFS_Result commandResult)
+        {
+            // The kernel request that started the command, and with it the path, may be gone by now
+            char absolutePath[PrjFSMaxPath];
+            fsid_t fsid = command.fsidInode.fsid;
+            if (fsgetpath(absolutePath, sizeof(absolutePath), &fsid, command.fsidInode.inode) < 0)
+            {
+                LogWarning("PrjFS_CompleteCommand: fsgetpath failed for inode %llu errno=%d strerror=%s", command.fsidInode.inode, errno, strerror(errno));
+                absolutePath[0] = '\0';
+                commandResult = PrjFS_Result_EIOError;
+            }
+            
+            return FinishFillingPlaceholder_FileLocked(
+                absolutePath,
+                nullptr == command.fileHandle.file ? nullptr : &command.fileHandle,
+                commandResult);
+        },
+        messageIds,
+        finishedResult);
+    
+    if (PrjFS_Result_Success == completeResult)
+    {
+        RespondToKernelRequests(messageIds, finishedResult);
+    }
+    
+    return completeResult;
+}
+
+PrjFS_Result PrjFS_GetRequestClassStatistics(
+    _In_    PrjFS_RequestClass                      requestClass,
+    _Out_   PrjFS_RequestClassStatistics*           statistics)
+{
+    if (static_cast<uint32_t>(requestClass) >= PrjFS_RequestClass_Count || nullptr == statistics)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (s_virtualizationRootFullPath.empty())
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    RequestScheduler::Statistics schedulerStatistics = s_requestScheduler.GetStatistics(static_cast<MessagePriority>(requestClass));
+    statistics->QueueDepth = schedulerStatistics.queueDepth;
+    statistics->RunningCount = schedulerStatistics.runningCount;
+    statistics->StartedCount = schedulerStatistics.startedCount;
+    statistics->TotalWaitNanoseconds = schedulerStatistics.totalWaitNanoseconds;
+    statistics->MaxWaitNanoseconds = schedulerStatistics.maxWaitNanoseconds;
+    return PrjFS_Result_Success;
+}
+
 // Private functions
 
 
@@ -755,6 +873,86 @@ static Message ParseMessageMemory(const void* messageMemory, uint32_t size)
     return parsedMessage;
 }
 
+static void DequeueAndHandleKernelMessages(IODataQueueMemory* queueMemory)
+{
+    while (1)
+    {
+        IODataQueueEntry* entry = DataQueue_Peek(queueMemory);
+        if (nullptr == entry)
+        {
+            // No more items in queue
+            break;
+        }
+        
+        uint32_t messageSize = entry->size;
+        if (messageSize < sizeof(Message))
+        {
+            LogError("PrjFS_StartVirtualizationInstance: Bad message size: got %d bytes, expected minimum of %lu, skipping. Kernel/user version mismatch?", messageSize, sizeof(Message));
+            DataQueue_Dequeue(queueMemory, nullptr, nullptr);
+            SignalMessageQueueSpaceIfWanted();
+            continue;
+        }
+        
+        // Handled from a copy, so that the queue space can be reused straight away rather than once
+        // the message is done with; a single slow hydration would otherwise hold up the whole queue.
+        void* messageMemory = malloc(messageSize);
+        uint32_t dequeuedSize = messageSize;
+        IOReturn result = DataQueue_Dequeue(queueMemory, messageMemory, &dequeuedSize);
+        if (kIOReturnSuccess != result || dequeuedSize != messageSize)
+        {
+            LogError("PrjFS_StartVirtualizationInstance: Unexpected result dequeueing message - result 0x%08x dequeued %d/%d bytes", result, dequeuedSize, messageSize);
+            abort();
+        }
+        
+        SignalMessageQueueSpaceIfWanted();
+
+        s_requestScheduler.Schedule(
+            GetPriorityForKernelMessage(messageMemory),
+            [messageMemory, messageSize]()
+            {
+                HandleKernelRequest(messageMemory, messageSize);
+                free(messageMemory);
+            });
+    }
+}
+
+static void SignalMessageQueueSpaceIfWanted()
+{
+    // Providers without the response ring are polled by the kext instead
+    if (nullptr == s_responseRing)
+    {
+        return;
+    }
+    
+    // Orders the dequeue's store to the head before the load below, so that either a kext sender that
+    // found the queue full sees the new head when it tries again, or we see that it wants to be told.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0 != __atomic_load_n(&s_responseRing->messageQueueSpaceWanted, __ATOMIC_SEQ_CST) &&
+        0 != __atomic_exchange_n(&s_responseRing->messageQueueSpaceWanted, 0u, __ATOMIC_SEQ_CST))
+    {
+        // The doorbell wakes senders waiting for queue space, as well as picking up responses
+        IOConnectCallScalarMethod(
+            s_kernelServiceConnection,
+            ProviderSelector_ResponseRingDoorbell,
+            nullptr, 0,  // no inputs
+            nullptr, nullptr);  // no outputs
+    }
+}
+
+static MessagePriority GetPriorityForKernelMessage(const void* messageMemory)
+{
+    const MessageHeader* messageHeader = static_cast<const MessageHeader*>(messageMemory);
+    if (MessageId_NoResponse == messageHeader->messageId)
+    {
+        // Only handled in the order they were sent if they all go through the same serial queue. The
+        // scheduler holds back later requests until these are done, so a pre-operation request for a
+        // file isn't handled before a notification about an earlier change to it.
+        return MessagePriority_Informational;
+    }
+    
+    return Message_GetPriority(static_cast<MessageType>(messageHeader->messageType));
+}
+
 static void HandleKernelRequest(void* messageMemory, uint32_t messageSize)
 {
     PrjFS_Result result = PrjFS_Result_EIOError;
@@ -765,6 +963,25 @@ static void HandleKernelRequest(void* messageMemory, uint32_t messageSize)
     const char* absolutePath = nullptr;
     const char* relativePath = nullptr;
     
+    if (MessageType_KtoU_NotifyNotificationsDropped == requestHeader->messageType)
+    {
+        // There's no file to go with this one, so it's reported against the root itself
+        LogWarning("HandleKernelRequest: the kernel dropped notifications because the message queue was full");
+        unsigned char emptyId[PrjFS_PlaceholderIdLength] = {};
+        result = s_callbacks.NotifyOperation(
+            0 /* commandId */,
+            "" /* relativePath */,
+            nullptr /* relativeFromPath */,
+            emptyId /* providerId */,
+            emptyId /* contentId */,
+            requestHeader->pid,
+            requestHeader->procname,
+            true /* isDirectory */,
+            PrjFS_NotificationType_NotificationsDropped,
+            nullptr /* destinationRelativePath */);
+        goto CleanupAndReturn;
+    }
+    
     // We expect a non-null request.path for messages sent from the FILEOP handler,
     // whereas messages originating in the kext's vnode handler will only fill
     // the fsid/inode, so we need to look up the path below.
@@ -831,7 +1048,7 @@ static void HandleKernelRequest(void* messageMemory, uint32_t messageSize)
     {
         case MessageType_KtoU_EnumerateDirectory:
         {
-            result = HandleEnumerateDirectoryRequest(requestHeader, absolutePath, relativePath);
+            result = HandleEnumerateDirectoryRequest(requestHeader, absolutePath, relativePath, requestHeader->messageId);
             break;
         }
         
@@ -919,10 +1136,17 @@ static void HandleKernelRequest(void* messageMemory, uint32_t messageSize)
         }
     }
     
-    // async callbacks are not yet implemented
-    assert(PrjFS_Result_Pending != result);
+    if (PrjFS_Result_Pending == result &&
+        MessageType_KtoU_EnumerateDirectory != requestHeader->messageType &&
+        MessageType_KtoU_HydrateFile != requestHeader->messageType)
+    {
+        // The provider was given a commandId of 0, so has nothing to complete the request with later
+        LogError("HandleKernelRequest: provider returned PrjFS_Result_Pending for message type %u, which must complete synchronously", requestHeader->messageType);
+        result = PrjFS_Result_EIOError;
+    }
     
 CleanupAndReturn:
+    // Pending requests are responded to by PrjFS_CompleteCommand
     if (PrjFS_Result_Pending != result)
     {
         MessageType responseType =
@@ -930,13 +1154,15 @@ CleanupAndReturn:
             ? MessageType_Response_Success
             : MessageType_Response_Fail;
         
+        // The kernel isn't waiting for the outcome of notifications
+        if (MessageId_NoResponse != requestHeader->messageId)
+        {
             SendKernelMessageResponse(requestHeader->messageId, responseType);
+        }
     }
-    
-    free(messageMemory);
 }
 
-static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath)
+static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath, uint64_t messageId)
 {
 #ifdef DEBUG
     cout
@@ -954,37 +1180,19 @@ static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request
     }
     
     PrjFS_Result result;
-    FileMutexMap::iterator mutexIterator = CheckoutFileMutexIterator(request->fsidInode);
+    PendingCommand* command;
+    if (!BeginFillingPlaceholder(request->fsidInode, absolutePath, messageId, result, command))
     {
-        mutex_lock lock(*(mutexIterator->second.mutex));
-        if (!IsBitSetInFileFlags(absolutePath, FileFlags_IsEmpty))
-        {
-            result = PrjFS_Result_Success;
-            goto CleanupAndReturn;
-        }
-    
-        result = s_callbacks.EnumerateDirectory(
-            0 /* commandId */,
-            relativePath,
-            request->pid,
-            request->procname);
-        
-        if (PrjFS_Result_Success == result)
-        {
-            if (!SetBitInFileFlags(absolutePath, FileFlags_IsEmpty, false))
-            {
-                // TODO(#1374): how should we handle this scenario where the provider thinks it succeeded, but we were unable to
-                // update placeholder metadata?
-                LogWarning("HandleEnumerateDirectoryRequest: SetBitInFileFlags failed on %s", absolutePath);
-                result = PrjFS_Result_EIOError;
-            }
-        }
+        return result;
     }
-
-CleanupAndReturn:
-    ReturnFileMutexIterator(mutexIterator);
-
-    return result;
+    
+    result = s_callbacks.EnumerateDirectory(
+        command->canCompleteAsynchronously ? command->commandId : 0,
+        relativePath,
+        request->pid,
+        request->procname);
+    
+    return EndFillingPlaceholder(command, absolutePath, result);
 }
 
 static PrjFS_Result HandleRecursivelyEnumerateDirectoryRequest(const MessageHeader* request, const char* absolutePath, const char* relativePath)
@@ -1013,7 +1221,8 @@ static PrjFS_Result HandleRecursivelyEnumerateDirectoryRequest(const MessageHead
         
         CombinePaths(s_virtualizationRootFullPath.c_str(), directoryRelativePath.c_str(), path);
     
-        result = HandleEnumerateDirectoryRequest(request, path, directoryRelativePath.c_str());
+        // The walk needs each directory's contents before it can carry on, so can't let the provider finish later
+        result = HandleEnumerateDirectoryRequest(request, path, directoryRelativePath.c_str(), MessageId_NoResponse);
         if (result != PrjFS_Result_Success)
         {
             LogWarning("HandleRecursivelyEnumerateDirectoryRequest: HandleEnumerateDirectoryRequest failed on %s %d", path, result);
@@ -1053,7 +1262,7 @@ CleanupAndReturn:
     return result;
 }
 
-static PrjFS_Result HydrateFile(const char* absolutePath, const char* relativePath, FsidInode fsidInode, pid_t pid, const char* procname)
+static PrjFS_Result HydrateFile(const char* absolutePath, const char* relativePath, FsidInode fsidInode, pid_t pid, const char* procname, uint64_t messageId)
 {
     PrjFSFileXAttrData xattrData = {};
     if (!TryGetXAttr(absolutePath, PrjFSFileXAttrName, sizeof(PrjFSFileXAttrData), &xattrData))
@@ -1068,79 +1277,142 @@ static PrjFS_Result HydrateFile(const char* absolutePath, const char* relativePa
     }
     
     PrjFS_Result result;
-    PrjFS_FileHandle fileHandle;
+    PendingCommand* command;
+    if (!BeginFillingPlaceholder(fsidInode, absolutePath, messageId, result, command))
+    {
+        return result;
+    }
     
-    FileMutexMap::iterator mutexIterator = CheckoutFileMutexIterator(fsidInode);
+    // Owned by the command, so it stays valid until the provider completes it
+    PrjFS_FileHandle* fileHandle = &command->fileHandle;
     
+    // Mode "rb+" means:
+    //  - The file must already exist
+    //  - The handle is opened for reading and writing
+    //  - We are allowed to seek to somewhere other than end of stream for writing
+    fileHandle->file = fopen(absolutePath, "rb+");
+    if (nullptr == fileHandle->file)
     {
-        mutex_lock lock(*(mutexIterator->second.mutex));
-        if (!IsBitSetInFileFlags(absolutePath, FileFlags_IsEmpty))
-        {
-            result = PrjFS_Result_Success;
-            goto CleanupAndReturn;
-        }
-        
-        // Mode "rb+" means:
-        //  - The file must already exist
-        //  - The handle is opened for reading and writing
-        //  - We are allowed to seek to somewhere other than end of stream for writing
-        fileHandle.file = fopen(absolutePath, "rb+");
-        if (nullptr == fileHandle.file)
-        {
-            LogWarning("HandleHydrateFileRequest: fopen with mode 'rb+' failed %s errno=%d strerror=%s", absolutePath, errno, strerror(errno));
-            result = PrjFS_Result_EIOError;
-            goto CleanupAndReturn;
-        }
-        
-        // Seek back to the beginning so the provider can overwrite the empty contents
-        if (fseek(fileHandle.file, 0, 0))
+        LogWarning("HandleHydrateFileRequest: fopen with mode 'rb+' failed %s errno=%d strerror=%s", absolutePath, errno, strerror(errno));
+        return EndFillingPlaceholder(command, absolutePath, PrjFS_Result_EIOError);
+    }
+    
+    // Seek back to the beginning so the provider can overwrite the empty contents
+    if (fseek(fileHandle->file, 0, 0))
+    {
+        LogWarning("HandleHydrateFileRequest: fseek failed %s errno=%d strerror=%s", absolutePath, errno, strerror(errno));
+        return EndFillingPlaceholder(command, absolutePath, PrjFS_Result_EIOError);
+    }
+    
+    result = s_callbacks.GetFileStream(
+        command->canCompleteAsynchronously ? command->commandId : 0,
+        relativePath,
+        xattrData.providerId,
+        xattrData.contentId,
+        pid,
+        procname,
+        fileHandle);
+    
+    return EndFillingPlaceholder(command, absolutePath, result);
+}
+
+// Called before asking the provider to fill in the placeholder at absolutePath; see PendingCommandTable::Begin
+static bool BeginFillingPlaceholder(
+    const FsidInode& fsidInode,
+    const char* absolutePath,
+    uint64_t messageId,
+    PrjFS_Result& result,
+    PendingCommand*& command)
+{
+    return s_pendingCommands.Begin(
+        fsidInode,
+        messageId,
+        [absolutePath]() { return IsBitSetInFileFlags(absolutePath, FileFlags_IsEmpty); },
+        result,
+        command);
+}
+
+// Called once the provider's callback for a command from BeginFillingPlaceholder has returned. Returns
+// PrjFS_Result_Pending if the provider is going to complete the command with PrjFS_CompleteCommand,
+// otherwise finishes the command and returns its outcome for the caller to report.
+static PrjFS_Result EndFillingPlaceholder(PendingCommand* command, const char* absolutePath, PrjFS_Result callbackResult)
+{
+    PendingCommandMessageIds messageIds;
+    PrjFS_Result result = s_pendingCommands.End(
+        command,
+        callbackResult,
+        [absolutePath](PendingCommand& finishingCommand, PrjFS_Result commandResult)
         {
-            LogWarning("HandleHydrateFileRequest: fseek failed %s errno=%d strerror=%s", absolutePath, errno, strerror(errno));
-            fclose(fileHandle.file);
-            result = PrjFS_Result_EIOError;
-            goto CleanupAndReturn;
-        }
-        
-        result = s_callbacks.GetFileStream(
-            0 /* comandId */,
-            relativePath,
-            xattrData.providerId,
-            xattrData.contentId,
-            pid,
-            procname,
-            &fileHandle);
-        
-        fflush(fileHandle.file);
+            return FinishFillingPlaceholder_FileLocked(
+                absolutePath,
+                nullptr == finishingCommand.fileHandle.file ? nullptr : &finishingCommand.fileHandle,
+                commandResult);
+        },
+        messageIds);
+    
+    if (PrjFS_Result_Pending != result)
+    {
+        RespondToKernelRequests(messageIds, result);
+    }
+    
+    return result;
+}
+
+// Responds to the kernel requests that were waiting on a command, once it has finished
+static void RespondToKernelRequests(const PendingCommandMessageIds& messageIds, PrjFS_Result result)
+{
+    MessageType responseType =
+        PrjFS_Result_Success == result
+        ? MessageType_Response_Success
+        : MessageType_Response_Fail;
+    for (uint32_t i = 0; i < messageIds.count; ++i)
+    {
+        SendKernelMessageResponse(messageIds.Get(i), responseType);
+    }
+}
+
+// Closes the file handle if there is one and, if the provider succeeded, marks the placeholder as no longer empty
+static PrjFS_Result FinishFillingPlaceholder_FileLocked(const char* absolutePath, PrjFS_FileHandle* fileHandle, PrjFS_Result result)
+{
+    if (nullptr != fileHandle)
+    {
+        fflush(fileHandle->file);
         
         // Don't block on closing the file to avoid deadlock with some Antivirus software
-        dispatch_async(s_kernelRequestHandlingConcurrentQueue, ^{
-            if (fclose(fileHandle.file))
+        FILE* file = fileHandle->file;
+        string path(absolutePath);
+        dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            if (fclose(file))
             {
-                LogWarning("HandleHydrateFileRequest: fclose failed %s errno=%d, strerror=%s", absolutePath, errno, strerror(errno));
+                LogWarning("HandleHydrateFileRequest: fclose failed %s errno=%d, strerror=%s", path.c_str(), errno, strerror(errno));
                 // TODO(#1374): under what conditions can fclose fail? How do we recover?
             }
         });
+    }
+    
+    if (PrjFS_Result_Pending == result)
+    {
+        LogError("FinishFillingPlaceholder: provider returned PrjFS_Result_Pending for a request that must complete synchronously, %s", absolutePath);
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (PrjFS_Result_Success == result)
+    {
+        // TODO(#1374): validate that the total bytes written match the size that was reported on the placeholder in the first place
+        // Potential bugs if we don't:
+        //  * The provider writes fewer bytes than expected. The hydrated is left with extra padding up to the original reported size.
+        //  * The provider writes more bytes than expected. The write succeeds, but whatever tool originally opened the file may have already
+        //    allocated the originally reported size, and now the contents appear truncated.
         
-        if (PrjFS_Result_Success == result)
+        if (!SetBitInFileFlags(absolutePath, FileFlags_IsEmpty, false))
         {
-            // TODO(#1374): validate that the total bytes written match the size that was reported on the placeholder in the first place
-            // Potential bugs if we don't:
-            //  * The provider writes fewer bytes than expected. The hydrated is left with extra padding up to the original reported size.
-            //  * The provider writes more bytes than expected. The write succeeds, but whatever tool originally opened the file may have already
-            //    allocated the originally reported size, and now the contents appear truncated.
-            
-            if (!SetBitInFileFlags(absolutePath, FileFlags_IsEmpty, false))
-            {
-                // TODO(#1374): how should we handle this scenario where the provider thinks it succeeded, but we were unable to
-                // update placeholder metadata?
-                LogWarning("HandleHydrateFileRequest: SetBitInFileFlags failed %s", absolutePath);
-                result = PrjFS_Result_EIOError;
-            }
+            // TODO(#1374): how should we handle this scenario where the provider thinks it succeeded, but we were unable to
+            // update placeholder metadata?
+            LogWarning("FinishFillingPlaceholder: SetBitInFileFlags failed %s", absolutePath);
+            return PrjFS_Result_EIOError;
         }
     }
-
-CleanupAndReturn:
-    ReturnFileMutexIterator(mutexIterator);
+    
     return result;
 }
 
@@ -1156,7 +1428,7 @@ static PrjFS_Result HandleHydrateFileRequest(const MessageHeader* request, const
         << endl;
 #endif
 
-    return HydrateFile(absolutePath, relativePath, request->fsidInode, request->pid, request->procname);
+    return HydrateFile(absolutePath, relativePath, request->fsidInode, request->pid, request->procname, request->messageId);
 }
 
 static PrjFS_Result HandleNewFileInRootNotification(
@@ -1339,6 +1611,263 @@ static bool InitializeEmptyPlaceholder(const char* fullPath, TPlaceholder* data,
     return false;
 }
 
+// Sets the placeholder flags on an open file or directory with a single fchflags, rather than resolving its path for each flag
+static bool InitializeEmptyPlaceholder(int fileDescriptor, const char* name)
+{
+    struct stat fileAttributes;
+    if (fstat(fileDescriptor, &fileAttributes))
+    {
+        LogWarning("InitializeEmptyPlaceholder: fstat failed on %s errno=%d, strerror=%s", name, errno, strerror(errno));
+        return false;
+    }
+    
+    if (fchflags(fileDescriptor, fileAttributes.st_flags | FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty))
+    {
+        LogWarning("InitializeEmptyPlaceholder: fchflags failed on %s errno=%d, strerror=%s", name, errno, strerror(errno));
+        return false;
+    }
+    
+    return true;
+}
+
+template<typename TPlaceholder>
+static bool InitializeEmptyPlaceholder(int fileDescriptor, const char* name, TPlaceholder* data, const char* xattrName)
+{
+    if (InitializeEmptyPlaceholder(fileDescriptor, name))
+    {
+        data->header.magicNumber = PlaceholderMagicNumber;
+        data->header.formatVersion = PlaceholderFormatVersion;
+        
+        static_assert(is_pod<TPlaceholder>(), "TPlaceholder must be a POD struct");
+        
+        if (0 == fsetxattr(fileDescriptor, xattrName, data, sizeof(TPlaceholder), 0, 0))
+        {
+            return true;
+        }
+        else
+        {
+            LogError("InitializeEmptyPlaceholder: fsetxattr failed for '%s', error=%d strerror=%s", name, errno, strerror(errno));
+        }
+    }
+    
+    return false;
+}
+
+template<typename TEntry>
+static PrjFS_Result WritePlaceholdersInDirectory(
+    const char* functionName,
+    const char* parentRelativePath,
+    TEntry* entries,
+    uint32_t entryCount,
+    PrjFS_Result (*writePlaceholder)(int parentDirectoryDescriptor, const char* parentRelativePath, TEntry& entry),
+    PrjFS_Result (*finishPlaceholder)(const char* parentRelativePath, TEntry& entry))
+{
+    if (nullptr == parentRelativePath ||
+        (nullptr == entries && entryCount > 0))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    char parentFullPath[PrjFSMaxPath];
+    CombinePaths(s_virtualizationRootFullPath.c_str(), parentRelativePath, parentFullPath);
+    
+    // The children are created relative to the open parent, so their full paths don't each need resolving
+    int parentDirectoryDescriptor = open(parentFullPath, O_RDONLY | O_DIRECTORY);
+    if (parentDirectoryDescriptor < 0)
+    {
+        PrjFS_Result result = PrjFS_Result_EPathNotFound;
+        if (ENOENT != errno)
+        {
+            LogWarning("%s: open failed on %s errno=%d strerror=%s", functionName, parentFullPath, errno, strerror(errno));
+            result = PrjFS_Result_EIOError;
+        }
+        
+        for (uint32_t i = 0; i < entryCount; ++i)
+        {
+            entries[i].Result = result;
+        }
+        
+        return result;
+    }
+    
+    void (^writeChunk)(size_t) = ^(size_t chunkIndex)
+    {
+        uint32_t chunkEnd = min(entryCount, static_cast<uint32_t>(chunkIndex + 1) * PlaceholderBatchChunkSize);
+        for (uint32_t i = static_cast<uint32_t>(chunkIndex) * PlaceholderBatchChunkSize; i < chunkEnd; ++i)
+        {
+            entries[i].Result = writePlaceholder(parentDirectoryDescriptor, parentRelativePath, entries[i]);
+        }
+    };
+    
+    uint32_t chunkCount = (entryCount + PlaceholderBatchChunkSize - 1) / PlaceholderBatchChunkSize;
+    if (chunkCount > 1)
+    {
+        dispatch_apply(chunkCount, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), writeChunk);
+    }
+    else if (chunkCount == 1)
+    {
+        writeChunk(0);
+    }
+    
+    close(parentDirectoryDescriptor);
+    
+    // Entries that need calling back into the provider are finished here, so that its callbacks
+    // only ever run on the thread that called the API, one at a time
+    for (uint32_t i = 0; i < entryCount; ++i)
+    {
+        if (PrjFS_Result_Pending == entries[i].Result && nullptr != finishPlaceholder)
+        {
+            entries[i].Result = finishPlaceholder(parentRelativePath, entries[i]);
+        }
+    }
+    
+    for (uint32_t i = 0; i < entryCount; ++i)
+    {
+        if (PrjFS_Result_Success != entries[i].Result)
+        {
+            return entries[i].Result;
+        }
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+static PrjFS_Result WritePlaceholderDirectoryAt(int parentDirectoryDescriptor, const char* parentRelativePath, PrjFS_PlaceholderDirectoryEntry& entry)
+{
+    if (nullptr == entry.Name)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (mkdirat(parentDirectoryDescriptor, entry.Name, 0777))
+    {
+        if (ENOENT == errno)
+        {
+            return PrjFS_Result_EPathNotFound;
+        }
+        
+        LogWarning("PrjFS_WritePlaceholderDirectories: mkdirat failed for %s in %s errno=%d stderror=%s", entry.Name, parentRelativePath, errno, strerror(errno));
+        return PrjFS_Result_EIOError;
+    }
+    
+    int directoryDescriptor = openat(parentDirectoryDescriptor, entry.Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (directoryDescriptor < 0)
+    {
+        LogWarning("PrjFS_WritePlaceholderDirectories: openat failed for %s in %s errno=%d stderror=%s", entry.Name, parentRelativePath, errno, strerror(errno));
+        return PrjFS_Result_EIOError;
+    }
+    
+    bool initialized = InitializeEmptyPlaceholder(directoryDescriptor, entry.Name);
+    close(directoryDescriptor);
+    
+    // TODO(#1371): cleanup the directory on disk if needed
+    return initialized ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+}
+
+static PrjFS_Result WritePlaceholderFileAt(int parentDirectoryDescriptor, const char* parentRelativePath, PrjFS_PlaceholderFileEntry& entry)
+{
+    if (nullptr == entry.Name)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    PrjFS_Result result = PrjFS_Result_Invalid;
+    PrjFSFileXAttrData fileXattrData = {};
+    
+    // Equivalent of fopen's "wx" mode, as used by PrjFS_WritePlaceholderFile
+    int fileDescriptor = openat(parentDirectoryDescriptor, entry.Name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0666);
+    if (fileDescriptor < 0)
+    {
+        switch(errno)
+        {
+            // TODO(#1371): Return more specific error codes for other failure scenarios
+            case ENOENT:
+                return PrjFS_Result_EPathNotFound;
+            case EEXIST: // The file already exists
+            default:
+                LogWarning("PrjFS_WritePlaceholderFiles: openat failed for %s in %s errno=%d stderror=%s", entry.Name, parentRelativePath, errno, strerror(errno));
+                return PrjFS_Result_EIOError;
+        }
+    }
+    
+    memcpy(fileXattrData.providerId, entry.ProviderId, PrjFS_PlaceholderIdLength);
+    memcpy(fileXattrData.contentId, entry.ContentId, PrjFS_PlaceholderIdLength);
+    
+    if (!InitializeEmptyPlaceholder(
+            fileDescriptor,
+            entry.Name,
+            &fileXattrData,
+            PrjFSFileXAttrName))
+    {
+        result = PrjFS_Result_EIOError;
+        goto CleanupAndReturn;
+    }
+    
+    if ((entry.FileMode & (S_IXUSR|S_IXGRP|S_IXOTH)) != 0)
+    {
+        // Executables are hydrated straight away, by HydrateExecutablePlaceholder on the calling thread.
+        // The mode is set after that, as it may not allow the file to be opened for writing.
+        result = PrjFS_Result_Pending;
+        goto CleanupAndReturn;
+    }
+    
+    // TODO(#1370): Only call fchmod if fileMode is different than the default file mode
+    if (fchmod(fileDescriptor, entry.FileMode))
+    {
+        LogWarning("PrjFS_WritePlaceholderFiles: failed to change permissions for %s in %s errno=%d strerror=%s", entry.Name, parentRelativePath, errno, strerror(errno));
+        result = PrjFS_Result_EIOError;
+        goto CleanupAndReturn;
+    }
+    
+    result = PrjFS_Result_Success;
+    
+CleanupAndReturn:
+    // TODO(#234): on failure we now have a partially created placeholder file, as with PrjFS_WritePlaceholderFile
+    close(fileDescriptor);
+    return result;
+}
+
+static PrjFS_Result HydrateExecutablePlaceholder(const char* parentRelativePath, PrjFS_PlaceholderFileEntry& entry)
+{
+    char relativePath[PrjFSMaxPath];
+    if ('\0' == parentRelativePath[0])
+    {
+        strlcpy(relativePath, entry.Name, sizeof(relativePath));
+    }
+    else
+    {
+        CombinePaths(parentRelativePath, entry.Name, relativePath);
+    }
+    
+    char fullPath[PrjFSMaxPath];
+    CombinePaths(s_virtualizationRootFullPath.c_str(), relativePath, fullPath);
+    
+    struct stat fileAttributes;
+    if (0 != lstat(fullPath, &fileAttributes))
+    {
+        LogWarning("PrjFS_WritePlaceholderFiles: lstat failed on %s errno=%d, strerror=%s", fullPath, errno, strerror(errno));
+        return PrjFS_Result_EIOError;
+    }
+    
+    FsidInode fsidInode;
+    fsidInode.inode = fileAttributes.st_ino;
+    fsidInode.fsid = s_virtualizationRoot_fsid;
+    
+    if (HydrateFile(fullPath, relativePath, fsidInode, 1, "placeholder", MessageId_NoResponse) != PrjFS_Result_Success)
+    {
+        LogWarning("PrjFS_WritePlaceholderFiles: failed to hydrate executable %s", fullPath);
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (chmod(fullPath, entry.FileMode))
+    {
+        LogWarning("PrjFS_WritePlaceholderFiles: failed to change permissions for %s errno=%d strerror=%s", fullPath, errno, strerror(errno));
+        return PrjFS_Result_EIOError;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
 static bool IsVirtualizationRoot(const char* fullPath)
 {
     PrjFSVirtualizationRootXAttrData data = {};
@@ -1457,6 +1986,9 @@ static inline PrjFS_NotificationType KUMessageTypeToNotificationType(MessageType
         case MessageType_KtoU_NotifyFileHardLinkCreated:
             return PrjFS_NotificationType_HardLinkCreated;
         
+        case MessageType_KtoU_NotifyNotificationsDropped:
+            return PrjFS_NotificationType_NotificationsDropped;
+        
         // Non-notification types
         case MessageType_Invalid:
         case MessageType_KtoU_EnumerateDirectory:
@@ -1470,6 +2002,76 @@ static inline PrjFS_NotificationType KUMessageTypeToNotificationType(MessageType
 }
 
 static errno_t SendKernelMessageResponse(uint64_t messageId, MessageType responseType)
+{
+    if (nullptr == s_responseRing)
+    {
+        return SendKernelMessageResponseDirectly(messageId, responseType);
+    }
+    
+    bool ringIsFull = false;
+    bool mustRingDoorbell = false;
+    {
+        lock_guard<mutex> lock(s_responseRingMutex);
+        
+        uint32_t writeIndex = s_responseRing->writeIndex;
+        uint32_t readIndex = __atomic_load_n(&s_responseRing->readIndex, __ATOMIC_ACQUIRE);
+        if (writeIndex - readIndex >= ProviderResponseRingCapacity)
+        {
+            ringIsFull = true;
+        }
+        else
+        {
+            ProviderResponseRingEntry& entry = s_responseRing->entries[writeIndex % ProviderResponseRingCapacity];
+            entry.messageId = messageId;
+            entry.responseType = responseType;
+            
+            // Publishes the entry to the kext
+            __atomic_store_n(&s_responseRing->writeIndex, writeIndex + 1, __ATOMIC_RELEASE);
+            
+            if (!s_responseRingDoorbellInFlight)
+            {
+                s_responseRingDoorbellInFlight = true;
+                mustRingDoorbell = true;
+            }
+        }
+    }
+    
+    if (ringIsFull)
+    {
+        return SendKernelMessageResponseDirectly(messageId, responseType);
+    }
+    
+    return mustRingDoorbell ? RingResponseRingDoorbell() : 0;
+}
+
+static errno_t RingResponseRingDoorbell()
+{
+    while (true)
+    {
+        IOReturn callResult = IOConnectCallScalarMethod(
+            s_kernelServiceConnection,
+            ProviderSelector_ResponseRingDoorbell,
+            nullptr, 0,  // no inputs
+            nullptr, nullptr);  // no outputs
+        
+        lock_guard<mutex> lock(s_responseRingMutex);
+        if (kIOReturnSuccess != callResult)
+        {
+            LogError("RingResponseRingDoorbell: doorbell call failed: 0x%08x", callResult);
+            s_responseRingDoorbellInFlight = false;
+            return EBADMSG;
+        }
+        
+        // Responses added while the kext was draining the ring may not have been picked up
+        if (s_responseRing->writeIndex == __atomic_load_n(&s_responseRing->readIndex, __ATOMIC_ACQUIRE))
+        {
+            s_responseRingDoorbellInFlight = false;
+            return 0;
+        }
+    }
+}
+
+static errno_t SendKernelMessageResponseDirectly(uint64_t messageId, MessageType responseType)
 {
     const uint64_t inputs[] = { messageId, responseType };
     IOReturn callResult = IOConnectCallScalarMethod(
@@ -1496,6 +2098,23 @@ static errno_t RegisterVirtualizationRootPath(const char* fullPath)
     return static_cast<errno_t>(error);
 }
 
+static void SetMessageQueueCapacity(unsigned int poolThreadCount)
+{
+    // Leave room for a few maximum size messages per handler thread; the kext clamps this to its limits
+    const uint64_t requestedCapacity = static_cast<uint64_t>(poolThreadCount) * MessageQueueCapacityBytesPerPoolThread;
+    uint64_t capacity = 0;
+    uint32_t outputCount = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        s_kernelServiceConnection,
+        ProviderSelector_SetMessageQueueCapacity,
+        &requestedCapacity, 1, // scalar input
+        &capacity, &outputCount); // scalar output
+    if (kIOReturnSuccess != callResult)
+    {
+        LogWarning("SetMessageQueueCapacity: setting capacity to %llu bytes failed (0x%08x), using the default", requestedCapacity, callResult);
+    }
+}
+
 static PrjFS_Result RecursivelyMarkAllChildrenAsInRoot(const char* fullDirectoryPath)
 {
     DIR* directory = nullptr;
@@ -1581,6 +2200,8 @@ static const char* NotificationTypeToString(PrjFS_NotificationType notificationT
             return STRINGIFY(PrjFS_NotificationType_HardLinkCreated);
         case PrjFS_NotificationType_PreConvertToFull:
             return STRINGIFY(PrjFS_NotificationType_PreConvertToFull);
+        case PrjFS_NotificationType_NotificationsDropped:
+            return STRINGIFY(PrjFS_NotificationType_NotificationsDropped);
             
         case PrjFS_NotificationType_PreModify:
             return STRINGIFY(PrjFS_NotificationType_PreModify);
@@ -1592,34 +2213,6 @@ static const char* NotificationTypeToString(PrjFS_NotificationType notificationT
 }
 #endif
 
-static FileMutexMap::iterator CheckoutFileMutexIterator(const FsidInode& fsidInode)
-{
-    mutex_lock lock(s_fileLocksMutex);
-    FileMutexMap::iterator iter = s_fileLocks.find(fsidInode);
-    if (iter == s_fileLocks.end())
-    {
-        pair<FileMutexMap::iterator, bool> newEntry = s_fileLocks.insert(
-            FileMutexMap::value_type(fsidInode, { make_shared<mutex>(), 1 }));
-        assert(newEntry.second);
-        return newEntry.first;
-    }
-    else
-    {
-        iter->second.useCount++;
-        return iter;
-    }
-}
-
-static void ReturnFileMutexIterator(FileMutexMap::iterator lockIterator)
-{
-    mutex_lock lock(s_fileLocksMutex);
-    lockIterator->second.useCount--;
-    if (lockIterator->second.useCount == 0)
-    {
-        s_fileLocks.erase(lockIterator);
-    }
-}
-
 static const char* GetRelativePath(const char* fullPath, const char* root)
 {
     // Hardlinks will send an empty path when files are linked outside the virtualization root
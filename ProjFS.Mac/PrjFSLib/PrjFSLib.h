@@ -52,6 +52,11 @@ typedef enum
     PrjFS_NotificationType_HardLinkCreated          = 0x00000100,
     PrjFS_NotificationType_PreConvertToFull         = 0x00001000,
     
+    // Not about any one file: the kernel had to drop notifications for the root because the provider
+    // wasn't keeping up with them. Any state the provider keeps up to date from notifications is
+    // stale, and should be rebuilt from the contents of the root.
+    PrjFS_NotificationType_NotificationsDropped     = 0x00002000,
+    
     PrjFS_NotificationType_PreModify                = 0x10000001,
     PrjFS_NotificationType_FileModified             = 0x10000002,
     PrjFS_NotificationType_FileDeleted              = 0x10000004,
@@ -87,6 +92,37 @@ extern "C" PrjFS_Result PrjFS_WritePlaceholderFile(
     _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
     _In_    uint16_t                                fileMode);
 
+// Batched versions of PrjFS_WritePlaceholderDirectory and PrjFS_WritePlaceholderFile, for filling in
+// a directory's children in one call. Each entry's Name is relative to parentRelativePath, and the
+// outcome for each entry is written to its Result. Returns PrjFS_Result_Success if every entry
+// succeeded, otherwise the Result of the first entry that failed.
+typedef struct
+{
+    _In_    const char*                             Name;
+    _Out_   PrjFS_Result                            Result;
+
+} PrjFS_PlaceholderDirectoryEntry;
+
+typedef struct
+{
+    _In_    const char*                             Name;
+    _In_    unsigned char                           ProviderId[PrjFS_PlaceholderIdLength];
+    _In_    unsigned char                           ContentId[PrjFS_PlaceholderIdLength];
+    _In_    uint16_t                                FileMode;
+    _Out_   PrjFS_Result                            Result;
+
+} PrjFS_PlaceholderFileEntry;
+
+extern "C" PrjFS_Result PrjFS_WritePlaceholderDirectories(
+    _In_    const char*                             parentRelativePath,
+    _In_    PrjFS_PlaceholderDirectoryEntry*        entries,
+    _In_    unsigned int                            entryCount);
+
+extern "C" PrjFS_Result PrjFS_WritePlaceholderFiles(
+    _In_    const char*                             parentRelativePath,
+    _In_    PrjFS_PlaceholderFileEntry*             entries,
+    _In_    unsigned int                            entryCount);
+
 extern "C" PrjFS_Result PrjFS_WriteSymLink(
     _In_    const char*                             relativePath,
     _In_    const char*                             symLinkTarget);
@@ -198,8 +234,40 @@ typedef struct _PrjFS_Callbacks
 
 } PrjFS_Callbacks;
 
-PrjFS_Result PrjFS_CompleteCommand(
+// Callbacks that are passed a non-zero commandId may return PrjFS_Result_Pending, and later report
+// the outcome with PrjFS_CompleteCommand, from any thread other than the one running the callback.
+// For GetFileStream, the file handle remains valid for writing until the command is completed.
+extern "C" PrjFS_Result PrjFS_CompleteCommand(
     _In_    unsigned long                           commandId,
     _In_    PrjFS_Result                            result);
 
+// Kernel requests are handled in these classes, most urgent first. poolThreadCount limits how many
+// Blocking requests are handled at once; PreOperation requests get half as many threads, and
+// Informational notifications are handled one at a time, in order. Requests of the other classes
+// aren't handled until the notifications sent before them have been.
+typedef enum
+{
+    PrjFS_RequestClass_Blocking                     = 0,
+    PrjFS_RequestClass_PreOperation                 = 1,
+    PrjFS_RequestClass_Informational                = 2,
+    
+    PrjFS_RequestClass_Count,
+    
+} PrjFS_RequestClass;
+
+typedef struct
+{
+    _Out_   unsigned int                            QueueDepth;
+    _Out_   unsigned int                            RunningCount;
+    _Out_   unsigned long long                      StartedCount;
+    // Time requests spent queued before being handled, totalled over StartedCount requests
+    _Out_   unsigned long long                      TotalWaitNanoseconds;
+    _Out_   unsigned long long                      MaxWaitNanoseconds;
+
+} PrjFS_RequestClassStatistics;
+
+extern "C" PrjFS_Result PrjFS_GetRequestClassStatistics(
+    _In_    PrjFS_RequestClass                      requestClass,
+    _Out_   PrjFS_RequestClassStatistics*           statistics);
+
 #endif /* PrjFSLib_h */
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <dispatch/dispatch.h>
+#include "../PrjFSKext/public/Message.h"
+
+// Runs kernel requests on GCD by MessagePriority. Each priority has its own queue and a limit on how
+// many of its requests run at once, so that a flood of notifications can't take the threads that
+// blocked I/O is waiting for. Requests of the same priority start in the order
+// they were scheduled; with a limit of 1, they also finish in that order.
+// Informational notifications describe changes that earlier requests for the same files may depend on,
+// so requests of the other priorities don't start until the notifications scheduled before them have
+// finished.
+class RequestScheduler
+{
+public:
+    struct Statistics
+    {
+        // Scheduled but not yet started
+        uint32_t queueDepth;
+        uint32_t runningCount;
+        uint64_t startedCount;
+        // Time between being scheduled and starting, over all started requests
+        uint64_t totalWaitNanoseconds;
+        uint64_t maxWaitNanoseconds;
+    };
+
+    void Init(const uint32_t (&maxConcurrency)[MessagePriority_Count]);
+    void Schedule(MessagePriority priority, std::function<void()> request);
+    Statistics GetStatistics(MessagePriority priority);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct ScheduledRequest
+    {
+        std::function<void()> run;
+        Clock::time_point scheduledTime;
+        // Number of notifications that must have finished before this request may start
+        uint64_t notificationsBefore;
+    };
+
+    struct PriorityQueue
+    {
+        RequestScheduler* scheduler;
+        MessagePriority priority;
+        std::mutex mutex;
+        std::deque<ScheduledRequest> requests;
+        uint32_t maxConcurrency;
+        // Set when the runners stopped because the first request is waiting for notifications to finish
+        bool waitingForNotifications;
+        dispatch_queue_t dispatchQueue;
+        Statistics statistics;
+    };
+
+    static void RunScheduledRequests(void* context);
+    bool CanStart_Locked(const PriorityQueue& queue) const;
+    uint32_t ReserveRunners_Locked(PriorityQueue& queue);
+    void StartRunners(PriorityQueue& queue, uint32_t runnerCount);
+    void ResumeRequestsWaitingForNotifications();
+
+    PriorityQueue queues[MessagePriority_Count];
+    std::atomic<uint64_t> scheduledNotificationCount;
+    std::atomic<uint64_t> finishedNotificationCount;
+};
+
+inline void RequestScheduler::Init(const uint32_t (&maxConcurrency)[MessagePriority_Count])
+{
+    static const dispatch_qos_class_t qosClasses[MessagePriority_Count] =
+    {
+        QOS_CLASS_USER_INITIATED,
+        QOS_CLASS_DEFAULT,
+        // Not any lower than the requests that wait for notifications to finish
+        QOS_CLASS_DEFAULT,
+    };
+    static const char* const queueLabels[MessagePriority_Count] =
+    {
+        "PrjFS Blocking Request Handling",
+        "PrjFS Pre-Operation Request Handling",
+        "PrjFS Notification Handling",
+    };
+
+    this->scheduledNotificationCount = 0;
+    this->finishedNotificationCount = 0;
+
+    for (uint32_t priority = 0; priority < MessagePriority_Count; ++priority)
+    {
+        PriorityQueue& queue = this->queues[priority];
+        queue.scheduler = this;
+        queue.priority = static_cast<MessagePriority>(priority);
+        queue.maxConcurrency = maxConcurrency[priority] > 0 ? maxConcurrency[priority] : 1;
+        queue.waitingForNotifications = false;
+        queue.statistics = Statistics{};
+        queue.dispatchQueue = dispatch_queue_create(
+            queueLabels[priority],
+            dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_CONCURRENT, qosClasses[priority], 0));
+    }
+}
+
+inline void RequestScheduler::Schedule(MessagePriority priority, std::function<void()> request)
+{
+    PriorityQueue& queue = this->queues[priority];
+    uint64_t notificationsBefore =
+        MessagePriority_Informational == priority ?
+        this->scheduledNotificationCount++ :
+        this->scheduledNotificationCount.load();
+
+    bool startRunner = false;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.requests.push_back(ScheduledRequest{ std::move(request), Clock::now(), notificationsBefore });
+        ++queue.statistics.queueDepth;
+
+        // Runners keep going until the queue is empty, so one is only needed if there's room for more,
+        // and none while they're waiting for notifications to finish
+        if (!queue.waitingForNotifications && queue.statistics.runningCount < queue.maxConcurrency)
+        {
+            ++queue.statistics.runningCount;
+            startRunner = true;
+        }
+    }
+
+    if (startRunner)
+    {
+        dispatch_async_f(queue.dispatchQueue, &queue, RunScheduledRequests);
+    }
+}
+
+inline bool RequestScheduler::CanStart_Locked(const PriorityQueue& queue) const
+{
+    return
+        !queue.requests.empty() &&
+        queue.requests.front().notificationsBefore <= this->finishedNotificationCount.load();
+}
+
+// Counts as running as many new runners as there is room for, up to one per queued request
+inline uint32_t RequestScheduler::ReserveRunners_Locked(PriorityQueue& queue)
+{
+    uint32_t runnerCount = 0;
+    while (queue.statistics.runningCount < queue.maxConcurrency &&
+           queue.statistics.runningCount < queue.statistics.queueDepth)
+    {
+        ++queue.statistics.runningCount;
+        ++runnerCount;
+    }
+
+    return runnerCount;
+}
+
+inline void RequestScheduler::StartRunners(PriorityQueue& queue, uint32_t runnerCount)
+{
+    for (uint32_t i = 0; i < runnerCount; ++i)
+    {
+        dispatch_async_f(queue.dispatchQueue, &queue, RunScheduledRequests);
+    }
+}
+
+// Called after each notification finishes, to start requests that were waiting for it
+inline void RequestScheduler::ResumeRequestsWaitingForNotifications()
+{
+    for (uint32_t priority = 0; priority < MessagePriority_Count; ++priority)
+    {
+        PriorityQueue& queue = this->queues[priority];
+        if (MessagePriority_Informational == priority)
+        {
+            continue;
+        }
+
+        uint32_t runnerCount = 0;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.waitingForNotifications && this->CanStart_Locked(queue))
+            {
+                queue.waitingForNotifications = false;
+                runnerCount = this->ReserveRunners_Locked(queue);
+            }
+        }
+
+        this->StartRunners(queue, runnerCount);
+    }
+}
+
+inline RequestScheduler::Statistics RequestScheduler::GetStatistics(MessagePriority priority)
+{
+    PriorityQueue& queue = this->queues[priority];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    return queue.statistics;
+}
+
+inline void RequestScheduler::RunScheduledRequests(void* context)
+{
+    PriorityQueue& queue = *static_cast<PriorityQueue*>(context);
+    RequestScheduler& scheduler = *queue.scheduler;
+    while (true)
+    {
+        ScheduledRequest request;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.requests.empty())
+            {
+                --queue.statistics.runningCount;
+                return;
+            }
+
+            if (!scheduler.CanStart_Locked(queue))
+            {
+                // Requests start in order, so the rest have to wait as well; the notification runner
+                // starts new runners once the notifications have finished.
+                queue.waitingForNotifications = true;
+                --queue.statistics.runningCount;
+                return;
+            }
+
+            request = std::move(queue.requests.front());
+            queue.requests.pop_front();
+
+            uint64_t waitNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - request.scheduledTime).count();
+            --queue.statistics.queueDepth;
+            ++queue.statistics.startedCount;
+            queue.statistics.totalWaitNanoseconds += waitNanoseconds;
+            if (waitNanoseconds > queue.statistics.maxWaitNanoseconds)
+            {
+                queue.statistics.maxWaitNanoseconds = waitNanoseconds;
+            }
+        }
+
+        request.run();
+
+        if (MessagePriority_Informational == queue.priority)
+        {
+            ++scheduler.finishedNotificationCount;
+            scheduler.ResumeRequestsWaitingForNotifications();
+        }
+    }
+}
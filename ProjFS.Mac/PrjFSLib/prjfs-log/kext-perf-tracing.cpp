@@ -32,13 +32,18 @@ static constexpr const char* const PerfCounterNames[PrjFSPerfCounter_Count] =
     [PrjFSPerfCounter_VnodeOp]                                              = "HandleVnodeOperation",
     [PrjFSPerfCounter_VnodeOp_GetPath]                                      = " |--GetPath",
     [PrjFSPerfCounter_VnodeOp_BasicVnodeChecks]                             = " |--BasicVnodeChecks",
+    [PrjFSPerfCounter_VnodeOp_GetAttr]                                      = " |--vnode_getattr",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle]                                 = " |--ShouldHandleVnodeOpEvent",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle_IsVnodeAccessCheck]              = " |  |--IsVnodeAccessCheck",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle_IgnoredVnodeAccessCheck]         = " |  |  |--IgnoredVnodeAccessCheck",
+    [PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckOutsideRootsCache]          = " |  |--CheckOutsideRootsCache",
+    [PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Hit]           = " |  |  |--Hit",
+    [PrjFSPerfCounter_VnodeOp_ShouldHandle_OutsideRootsCache_Miss]          = " |  |  |--Miss",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle_ReadFileFlags]                   = " |  |--TryReadVNodeFileFlags",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle_NotInAnyRoot]                    = " |  |  |--NotInAnyRoot",
-    [PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckFileSystemCrawler]          = " |  |--IsFileSystemCrawler",
+    [PrjFSPerfCounter_VnodeOp_ShouldHandle_CheckFileSystemCrawler]          = " |  |--GetProcessPolicyAction",
     [PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedFileSystemCrawler]         = " |     |--Denied",
+    [PrjFSPerfCounter_VnodeOp_ShouldHandle_DeniedEnumeration]               = " |     |--DeniedEnumeration",
     [PrjFSPerfCounter_VnodeOp_GetVirtualizationRoot]                        = " |--TryGetVirtualizationRoot",
     [PrjFSPerfCounter_VnodeOp_Vnode_Cache_Hit]                              = " |  |--VnodeCacheHit",
     [PrjFSPerfCounter_VnodeOp_Vnode_Cache_Miss]                             = " |  |--VnodeCacheMiss",
@@ -54,7 +59,13 @@ static constexpr const char* const PerfCounterNames[PrjFSPerfCounter_Count] =
     [PrjFSPerfCounter_VnodeOp_RecursivelyEnumerateDirectory]                = " |--RaiseRecursivelyEnumerateEvent",
     [PrjFSPerfCounter_VnodeOp_HydrateFile]                                  = " |--RaiseHydrateFileEvent",
     [PrjFSPerfCounter_VnodeOp_PreConvertToFull]                             = " |--RaisePreConvertToFull",
+    [PrjFSPerfCounter_VnodeOp_PurgeAuthorizationCache]                      = " |--PurgeAuthorizationCache",
     [PrjFSPerfCounter_FileOp]                                               = "HandleFileOpOperation",
+    [PrjFSPerfCounter_FileOp_Open_CheckOutsideRoots]                        = " |--OpenCheckOutsideRoots",
+    [PrjFSPerfCounter_FileOp_Open_NoProviderOnMount]                        = " |  |--NoProviderOnMount",
+    [PrjFSPerfCounter_FileOp_Open_FileOutsideRootsCache_Hit]                = " |  |--FileOutsideRootsHit",
+    [PrjFSPerfCounter_FileOp_Open_ParentOutsideRootsCache_Hit]              = " |  |--ParentOutsideRootsHit",
+    [PrjFSPerfCounter_FileOp_Open_OutsideRootsCache_Miss]                   = " |  |--Miss",
     [PrjFSPerfCounter_FileOp_ShouldHandle]                                  = " |--ShouldHandleFileOpEvent",
     [PrjFSPerfCounter_FileOp_ShouldHandle_FindVirtualizationRoot]           = " |  |--FindVirtualizationRoot",
     [PrjFSPerfCounter_FileOp_Vnode_Cache_Hit]                               = " |  |  |--VnodeCacheHit",
@@ -69,11 +80,13 @@ static constexpr const char* const PerfCounterNames[PrjFSPerfCounter_Count] =
     [PrjFSPerfCounter_FileOp_ShouldHandle_OriginatedByProvider]             = " |     |--OriginatedByProvider",
     [PrjFSPerfCounter_FileOp_Renamed]                                       = " |--RaiseRenamedEvent",
     [PrjFSPerfCounter_FileOp_HardLinkCreated]                               = " |--RaiseHardLinkCreatedEvent",
+    [PrjFSPerfCounter_FileOp_FileModifiedAlreadyReported]                   = " |--FileModifiedAlreadyReported",
     [PrjFSPerfCounter_FileOp_FileModified]                                  = " |--RaiseFileModifiedEvent",
     [PrjFSPerfCounter_FileOp_FileCreated]                                   = " |--RaiseFileCreatedEvent",
     [PrjFSPerfCounter_CacheCapacity]                                        = "VnodeCacheCapacity",
     [PrjFSPerfCounter_CacheInvalidateCount]                                 = "VnodeCacheInvalidationCount",
-    [PrjFSPerfCounter_CacheFullCount]                                       = "VnodeCacheFullCount",
+    [PrjFSPerfCounter_CacheInvalidateRootCount]                             = "VnodeCacheInvalidateRootCount",
+    [PrjFSPerfCounter_CacheEvictionCount]                                   = "VnodeCacheEvictionCount",
 };
 
 static_assert(AllArrayElementsInitialized(PerfCounterNames), "There must be an initialization of PerfCounterNames elements corresponding to each PrjFSPerfCounter enum value");
@@ -1,7 +1,12 @@
 #include "PrjFSUser.hpp"
 #include "kext-perf-tracing.hpp"
 #include "../../PrjFSKext/public/PrjFSLogClientShared.h"
+#include "../../PrjFSKext/public/PrjFSProviderQueueStats.h"
+#include "../../PrjFSKext/public/PrjFSProcessPolicy.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <dispatch/queue.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
@@ -11,15 +16,39 @@ static const char* KextLogLevelAsString(KextLog_Level level);
 static uint64_t NanosecondsFromAbsoluteTime(uint64_t machAbsoluteTime);
 static dispatch_source_t StartKextProfilingDataPolling(io_connect_t connection);
 static void ProcessLogMessagesOnConnection(io_connect_t connection, io_service_t prjfsService);
+static void FetchAndPrintProviderQueueStats(io_connect_t connection);
+static bool TryReadProcessPolicies(const char* path, PrjFSProcessPolicyTable& table);
+static void SetProcessPolicies(io_connect_t connection);
+static void FetchAndPrintProcessPolicies(io_connect_t connection);
 
 static mach_timebase_info_data_t s_machTimebase;
 static uint64_t s_machStartTime;
 static IONotificationPortRef s_notificationPort;
+// Pushed to the kext whenever we connect, if given on the command line
+static PrjFSProcessPolicyTable s_processPolicies;
+static bool s_haveProcessPolicies = false;
 
 int main(int argc, const char * argv[])
 {
     mach_timebase_info(&s_machTimebase);
     s_machStartTime = mach_absolute_time();
+    
+    if (argc == 3 && 0 == strcmp(argv[1], "--process-policies"))
+    {
+        if (!TryReadProcessPolicies(argv[2], s_processPolicies))
+        {
+            return 1;
+        }
+        
+        s_haveProcessPolicies = true;
+    }
+    else if (argc != 1)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--process-policies <file>]\n"
+            << "  Each line of the policy file names a process and its policy for accessing placeholders:\n"
+            << "  deny-hydrate, allow, or allow-without-enumerate. Setting policies requires root.\n";
+        return 1;
+    }
 
 
     s_notificationPort = IONotificationPortCreate(kIOMasterPortDefault);
@@ -80,6 +109,11 @@ static void ProcessLogMessagesOnConnection(io_connect_t connection, io_service_t
     fflush(stdout);
     ++logState->lineCount;
     
+    if (s_haveProcessPolicies)
+    {
+        SetProcessPolicies(connection);
+    }
+    
     dispatch_source_set_event_handler(logState->dataQueue.dispatchSource, ^{
         DataQueue_ClearMachNotification(logState->dataQueue.notificationPort);
         
@@ -161,8 +195,130 @@ static dispatch_source_t StartKextProfilingDataPolling(io_connect_t connection)
     dispatch_source_set_timer(timer, DISPATCH_TIME_NOW, 15 * NSEC_PER_SEC, 10 * NSEC_PER_SEC);
     dispatch_source_set_event_handler(timer, ^{
         PrjFSLog_FetchAndPrintKextProfilingData(connection);
+        FetchAndPrintProviderQueueStats(connection);
+        FetchAndPrintProcessPolicies(connection);
     });
     dispatch_resume(timer);
     return timer;
 }
 
+static void FetchAndPrintProviderQueueStats(io_connect_t connection)
+{
+    PrjFSProviderQueueStatsReport report;
+    size_t out_size = sizeof(report);
+    IOReturn ret = IOConnectCallStructMethod(connection, LogSelector_FetchProviderQueueStats, nullptr, 0, &report, &out_size);
+    if (ret != kIOReturnSuccess)
+    {
+        // Older kexts don't support this
+        return;
+    }
+    
+    printf("   Provider queues: Root  PID     [Capacity ][High water][Enqueue failures][In-flight window][In-flight high water]\n");
+    for (uint32_t i = 0; i < report.providerCount && i < PrjFSProviderQueueStatsMaxProviders; ++i)
+    {
+        const PrjFSProviderQueueStats& stats = report.providers[i];
+        printf(
+            "                    %5d %-7d [%10u][%10u][%16llu][%16u][%21u]\n",
+            stats.rootHandle,
+            stats.providerPid,
+            stats.queueCapacityBytes,
+            stats.queueHighWaterBytes,
+            stats.enqueueFailures,
+            stats.inFlightRequestWindow,
+            stats.inFlightRequestHighWater);
+    }
+    
+    fflush(stdout);
+}
+
+static bool TryReadProcessPolicies(const char* path, PrjFSProcessPolicyTable& table)
+{
+    std::ifstream policyFile(path);
+    if (!policyFile)
+    {
+        std::cerr << "Failed to open process policy file " << path << "\n";
+        return false;
+    }
+    
+    table = PrjFSProcessPolicyTable{};
+    std::string line;
+    for (unsigned lineNumber = 1; std::getline(policyFile, line); ++lineNumber)
+    {
+        std::istringstream lineStream(line);
+        std::string processName, actionName;
+        if (!(lineStream >> processName) || processName[0] == '#')
+        {
+            continue;
+        }
+        
+        PrjFSProcessPolicyAction action = ProcessPolicyAction_Invalid;
+        lineStream >> actionName;
+        if (actionName == "deny-hydrate")
+        {
+            action = ProcessPolicyAction_DenyHydrate;
+        }
+        else if (actionName == "allow")
+        {
+            action = ProcessPolicyAction_Allow;
+        }
+        else if (actionName == "allow-without-enumerate")
+        {
+            action = ProcessPolicyAction_AllowWithoutEnumerate;
+        }
+        
+        if (action == ProcessPolicyAction_Invalid || processName.length() > MAXCOMLEN || table.policyCount >= PrjFSProcessPolicyMaxSettableCount)
+        {
+            std::cerr << path << ":" << lineNumber << ": invalid process policy, or too many policies\n";
+            return false;
+        }
+        
+        PrjFSProcessPolicy& policy = table.policies[table.policyCount];
+        strlcpy(policy.processName, processName.c_str(), sizeof(policy.processName));
+        policy.action = action;
+        ++table.policyCount;
+    }
+    
+    return true;
+}
+
+static void SetProcessPolicies(io_connect_t connection)
+{
+    IOReturn ret = IOConnectCallStructMethod(connection, LogSelector_SetProcessPolicies, &s_processPolicies, sizeof(s_processPolicies), nullptr, nullptr);
+    if (ret != kIOReturnSuccess)
+    {
+        std::cerr << "Failed to set process policies; result = 0x" << std::hex << ret << std::dec << std::endl;
+    }
+}
+
+static void FetchAndPrintProcessPolicies(io_connect_t connection)
+{
+    PrjFSProcessPolicyTable table;
+    size_t out_size = sizeof(table);
+    IOReturn ret = IOConnectCallStructMethod(connection, LogSelector_FetchProcessPolicies, nullptr, 0, &table, &out_size);
+    if (ret != kIOReturnSuccess)
+    {
+        // Older kexts don't support this
+        return;
+    }
+    
+    static const char* const actionNames[ProcessPolicyAction_Count] =
+    {
+        [ProcessPolicyAction_Invalid] = "invalid",
+        [ProcessPolicyAction_DenyHydrate] = "deny-hydrate",
+        [ProcessPolicyAction_Allow] = "allow",
+        [ProcessPolicyAction_AllowWithoutEnumerate] = "allow-without-enumerate",
+    };
+    
+    printf("   Process policies: Process          Action                   [Denials   ]\n");
+    for (uint32_t i = 0; i < table.policyCount && i < PrjFSProcessPolicyMaxCount; ++i)
+    {
+        const PrjFSProcessPolicy& policy = table.policies[i];
+        printf(
+            "                     %-16.16s %-24s [%10llu]\n",
+            policy.processName,
+            policy.action < ProcessPolicyAction_Count ? actionNames[policy.action] : "unknown",
+            policy.denialCount);
+    }
+    
+    fflush(stdout);
+}
@@ -0,0 +1,350 @@
+#include "../PrjFSLib/PendingCommandTable.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+#import <XCTest/XCTest.h>
+
+using std::atomic;
+using std::set;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+static const uint32_t HydrationThreadCount = 8;
+static const uint32_t HydrationsPerThread = 20000;
+
+// Static like the table in PrjFSLib, which also avoids needing an over-aligned heap allocation
+static PendingCommandTable s_pendingCommands;
+
+// Stands in for a placeholder file: the empty flag, and how often the provider was asked to hydrate it
+struct MockPlaceholder
+{
+    atomic<bool> isEmpty;
+    atomic<uint32_t> hydrateCallbackCount;
+};
+
+static FsidInode MakeFsidInode(uint64_t inode)
+{
+    FsidInode fsidInode = {};
+    fsidInode.fsid.val[0] = 0x1000004;
+    fsidInode.fsid.val[1] = 0x1a;
+    fsidInode.inode = inode;
+    return fsidInode;
+}
+
+// Mock of the provider's GetFileStream callback; copies some data as a stand-in for writing the file contents
+static void MockGetFileStream(MockPlaceholder& placeholder)
+{
+    volatile uint8_t buffer[256];
+    for (uint32_t i = 0; i < sizeof(buffer); ++i)
+    {
+        buffer[i] = static_cast<uint8_t>(i);
+    }
+
+    placeholder.hydrateCallbackCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Goes through the same steps as HandleHydrateFileRequest in PrjFSLib, with the placeholder's empty flag standing in for the file's
+static void MockHydrateFile(PendingCommandTable& pendingCommands, const FsidInode& fsidInode, MockPlaceholder& placeholder)
+{
+    if (!placeholder.isEmpty.load(std::memory_order_acquire))
+    {
+        return;
+    }
+
+    PrjFS_Result result;
+    PendingCommand* command;
+    if (!pendingCommands.Begin(
+            fsidInode,
+            MessageId_NoResponse,
+            [&placeholder]() { return placeholder.isEmpty.load(std::memory_order_acquire); },
+            result,
+            command))
+    {
+        return;
+    }
+
+    MockGetFileStream(placeholder);
+
+    PendingCommandMessageIds messageIds;
+    pendingCommands.End(
+        command,
+        PrjFS_Result_Success,
+        [&placeholder](PendingCommand&, PrjFS_Result commandResult)
+        {
+            placeholder.isEmpty.store(false, std::memory_order_release);
+            return commandResult;
+        },
+        messageIds);
+}
+
+// With distinctFiles, each thread hydrates its own placeholderCount placeholders; otherwise all threads share the same ones
+static void RunConcurrentHydrations(PendingCommandTable& pendingCommands, bool distinctFiles, uint32_t placeholderCount)
+{
+    uint32_t placeholderSetCount = distinctFiles ? HydrationThreadCount : 1;
+    unique_ptr<MockPlaceholder[]> placeholders(new MockPlaceholder[placeholderSetCount * placeholderCount]);
+    for (uint32_t i = 0; i < placeholderSetCount * placeholderCount; ++i)
+    {
+        placeholders[i].isEmpty = true;
+        placeholders[i].hydrateCallbackCount = 0;
+    }
+
+    vector<thread> threads;
+    for (uint32_t threadIndex = 0; threadIndex < HydrationThreadCount; ++threadIndex)
+    {
+        threads.emplace_back(
+            [&pendingCommands, &placeholders, distinctFiles, placeholderCount, threadIndex]()
+            {
+                uint32_t firstPlaceholder = distinctFiles ? threadIndex * placeholderCount : 0;
+                for (uint32_t i = 0; i < HydrationsPerThread; ++i)
+                {
+                    uint32_t placeholderIndex = firstPlaceholder + (i % placeholderCount);
+                    MockHydrateFile(pendingCommands, MakeFsidInode(placeholderIndex), placeholders[placeholderIndex]);
+                }
+            });
+    }
+
+    for (thread& hydrationThread : threads)
+    {
+        hydrationThread.join();
+    }
+
+    for (uint32_t i = 0; i < placeholderSetCount * placeholderCount; ++i)
+    {
+        XCTAssertEqual(placeholders[i].hydrateCallbackCount.load(), 1);
+    }
+}
+
+@interface PendingCommandTableTests : XCTestCase
+@end
+
+@implementation PendingCommandTableTests
+
+- (void) testSameFileUsesSameStripe
+{
+    FsidInode fsidInode = MakeFsidInode(1234);
+    XCTAssertEqual(PendingCommandTable::GetStripeIndex(fsidInode), PendingCommandTable::GetStripeIndex(MakeFsidInode(1234)));
+    XCTAssertLessThan(PendingCommandTable::GetStripeIndex(fsidInode), PendingCommandTable::StripeCount);
+}
+
+- (void) testCommandIdsMapOntoTheirFilesStripe
+{
+    // More commands than are preallocated for the stripe, all in progress at once
+    FsidInode fsidInodes[PendingCommandTable::PreallocatedCommandsPerStripe + 2];
+    uint32_t stripeIndex = PendingCommandTable::GetStripeIndex(MakeFsidInode(1));
+    uint32_t fileCount = 0;
+    for (uint64_t inode = 1; fileCount < sizeof(fsidInodes) / sizeof(fsidInodes[0]); ++inode)
+    {
+        if (PendingCommandTable::GetStripeIndex(MakeFsidInode(inode)) == stripeIndex)
+        {
+            fsidInodes[fileCount++] = MakeFsidInode(inode);
+        }
+    }
+
+    PendingCommand* commands[sizeof(fsidInodes) / sizeof(fsidInodes[0])];
+    set<uint64_t> commandIds;
+    for (uint32_t i = 0; i < fileCount; ++i)
+    {
+        PrjFS_Result result;
+        XCTAssertTrue(s_pendingCommands.Begin(fsidInodes[i], 100 + i, []() { return true; }, result, commands[i]));
+        XCTAssertNotEqual(commands[i]->commandId, 0);
+        XCTAssertEqual(PendingCommandTable::GetStripeIndex(commands[i]->commandId), stripeIndex);
+        commandIds.insert(commands[i]->commandId);
+    }
+
+    XCTAssertEqual(commandIds.size(), fileCount);
+
+    for (uint32_t i = 0; i < fileCount; ++i)
+    {
+        PendingCommandMessageIds messageIds;
+        XCTAssertEqual(
+            s_pendingCommands.End(commands[i], PrjFS_Result_Success, [](PendingCommand&, PrjFS_Result commandResult) { return commandResult; }, messageIds),
+            PrjFS_Result_Success);
+        XCTAssertEqual(messageIds.count, 0);
+    }
+}
+
+- (void) testCompleteBeforeCallbackReturns
+{
+    PrjFS_Result result;
+    PendingCommand* command;
+    XCTAssertTrue(s_pendingCommands.Begin(MakeFsidInode(2000), 7, []() { return true; }, result, command));
+    uint64_t commandId = command->commandId;
+    
+    uint32_t finishCount = 0;
+    auto finish = [&finishCount](PendingCommand&, PrjFS_Result commandResult) { ++finishCount; return commandResult; };
+    
+    // The callback's thread is still running, so it finishes the command once the callback returns
+    PendingCommandMessageIds messageIds;
+    PrjFS_Result finishedResult = PrjFS_Result_Invalid;
+    XCTAssertEqual(s_pendingCommands.Complete(commandId, PrjFS_Result_EIOError, finish, messageIds, finishedResult), PrjFS_Result_Success);
+    XCTAssertEqual(finishedResult, PrjFS_Result_Pending);
+    XCTAssertEqual(finishCount, 0);
+    XCTAssertEqual(messageIds.count, 0);
+    
+    // The provider's completion result wins over the callback's Pending, and the caller responds to the starting request itself
+    XCTAssertEqual(s_pendingCommands.End(command, PrjFS_Result_Pending, finish, messageIds), PrjFS_Result_EIOError);
+    XCTAssertEqual(finishCount, 1);
+    XCTAssertEqual(messageIds.count, 0);
+    
+    XCTAssertEqual(s_pendingCommands.Complete(commandId, PrjFS_Result_Success, finish, messageIds, finishedResult), PrjFS_Result_EInvalidArgs);
+    XCTAssertEqual(finishCount, 1);
+}
+
+- (void) testCompleteTwice
+{
+    PrjFS_Result result;
+    PendingCommand* command;
+    XCTAssertTrue(s_pendingCommands.Begin(MakeFsidInode(2001), 7, []() { return true; }, result, command));
+    uint64_t commandId = command->commandId;
+    
+    uint32_t finishCount = 0;
+    auto finish = [&finishCount](PendingCommand&, PrjFS_Result commandResult) { ++finishCount; return commandResult; };
+    
+    PendingCommandMessageIds messageIds;
+    XCTAssertEqual(s_pendingCommands.End(command, PrjFS_Result_Pending, finish, messageIds), PrjFS_Result_Pending);
+    XCTAssertEqual(finishCount, 0);
+    
+    PrjFS_Result finishedResult = PrjFS_Result_Invalid;
+    XCTAssertEqual(s_pendingCommands.Complete(commandId, PrjFS_Result_Success, finish, messageIds, finishedResult), PrjFS_Result_Success);
+    XCTAssertEqual(finishedResult, PrjFS_Result_Success);
+    XCTAssertEqual(finishCount, 1);
+    XCTAssertEqual(messageIds.count, 1);
+    XCTAssertEqual(messageIds.Get(0), 7);
+    
+    PendingCommandMessageIds secondMessageIds;
+    XCTAssertEqual(s_pendingCommands.Complete(commandId, PrjFS_Result_Success, finish, secondMessageIds, finishedResult), PrjFS_Result_EInvalidArgs);
+    XCTAssertEqual(finishCount, 1);
+    XCTAssertEqual(secondMessageIds.count, 0);
+}
+
+- (void) testCompleteSynchronousCommandFails
+{
+    PrjFS_Result result;
+    PendingCommand* command;
+    XCTAssertTrue(s_pendingCommands.Begin(MakeFsidInode(2002), MessageId_NoResponse, []() { return true; }, result, command));
+    
+    auto finish = [](PendingCommand&, PrjFS_Result commandResult) { return commandResult; };
+    PendingCommandMessageIds messageIds;
+    PrjFS_Result finishedResult = PrjFS_Result_Invalid;
+    XCTAssertEqual(s_pendingCommands.Complete(command->commandId, PrjFS_Result_Success, finish, messageIds, finishedResult), PrjFS_Result_EInvalidArgs);
+    XCTAssertEqual(s_pendingCommands.End(command, PrjFS_Result_Success, finish, messageIds), PrjFS_Result_Success);
+}
+
+- (void) testRequestsForTheSameFileJoinThePendingCommand
+{
+    FsidInode fsidInode = MakeFsidInode(2003);
+    PrjFS_Result result;
+    PendingCommand* command;
+    XCTAssertTrue(s_pendingCommands.Begin(fsidInode, 1, []() { return true; }, result, command));
+    
+    // More than are kept inline
+    const uint64_t joinedCount = PendingCommandMessageIds::InlineCount + 2;
+    for (uint64_t messageId = 2; messageId < 2 + joinedCount; ++messageId)
+    {
+        PendingCommand* joinedCommand = nullptr;
+        XCTAssertFalse(s_pendingCommands.Begin(fsidInode, messageId, []() { return true; }, result, joinedCommand));
+        XCTAssertEqual(result, PrjFS_Result_Pending);
+        XCTAssertEqual(joinedCommand, nullptr);
+    }
+    
+    uint32_t finishCount = 0;
+    PendingCommandMessageIds messageIds;
+    XCTAssertEqual(
+        s_pendingCommands.End(
+            command,
+            PrjFS_Result_Success,
+            [&finishCount](PendingCommand&, PrjFS_Result commandResult) { ++finishCount; return commandResult; },
+            messageIds),
+        PrjFS_Result_Success);
+    XCTAssertEqual(finishCount, 1);
+    XCTAssertEqual(messageIds.count, joinedCount);
+    for (uint32_t i = 0; i < joinedCount; ++i)
+    {
+        XCTAssertEqual(messageIds.Get(i), 2 + i);
+    }
+    
+    // Once filled in, later requests don't start or join anything
+    XCTAssertFalse(s_pendingCommands.Begin(fsidInode, 100, []() { return false; }, result, command));
+    XCTAssertEqual(result, PrjFS_Result_Success);
+}
+
+- (void) testSynchronousCallersWaitForThePendingCommand
+{
+    FsidInode fsidInode = MakeFsidInode(2004);
+    atomic<bool> isEmpty(true);
+    auto checkIsEmpty = [&isEmpty]() { return isEmpty.load(); };
+    
+    PrjFS_Result result;
+    PendingCommand* command;
+    XCTAssertTrue(s_pendingCommands.Begin(fsidInode, 1, checkIsEmpty, result, command));
+    
+    atomic<bool> waiterReturned(false);
+    bool waiterStartedCommand = true;
+    PrjFS_Result waiterResult = PrjFS_Result_Invalid;
+    thread waiter(
+        [&]()
+        {
+            PendingCommand* waiterCommand;
+            waiterStartedCommand = s_pendingCommands.Begin(fsidInode, MessageId_NoResponse, checkIsEmpty, waiterResult, waiterCommand);
+            waiterReturned = true;
+        });
+    
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    XCTAssertFalse(waiterReturned.load());
+    
+    PendingCommandMessageIds messageIds;
+    s_pendingCommands.End(
+        command,
+        PrjFS_Result_Success,
+        [&isEmpty](PendingCommand&, PrjFS_Result commandResult) { isEmpty = false; return commandResult; },
+        messageIds);
+    waiter.join();
+    
+    XCTAssertFalse(waiterStartedCommand);
+    XCTAssertEqual(waiterResult, PrjFS_Result_Success);
+    XCTAssertEqual(messageIds.count, 0);
+}
+
+- (void) testSequentialInodesSpreadAcrossStripes
+{
+    set<uint32_t> usedStripes;
+    for (uint64_t inode = 1000; inode < 1000 + PendingCommandTable::StripeCount; ++inode)
+    {
+        usedStripes.insert(PendingCommandTable::GetStripeIndex(MakeFsidInode(inode)));
+    }
+
+    XCTAssertGreaterThan(usedStripes.size(), PendingCommandTable::StripeCount / 2);
+}
+
+- (void) testFilesOnDifferentVolumesSpreadAcrossStripes
+{
+    FsidInode fsidInode = MakeFsidInode(1234);
+    set<uint32_t> usedStripes;
+    for (int32_t fsid = 0; fsid < 64; ++fsid)
+    {
+        fsidInode.fsid.val[0] = fsid;
+        usedStripes.insert(PendingCommandTable::GetStripeIndex(fsidInode));
+    }
+
+    XCTAssertGreaterThan(usedStripes.size(), 32);
+}
+
+- (void) testConcurrentHydrationOfDistinctFilesPerformance
+{
+    [self measureBlock:^{
+        RunConcurrentHydrations(s_pendingCommands, true /* distinctFiles */, HydrationsPerThread);
+    }];
+}
+
+- (void) testConcurrentHydrationOfIdenticalFilesPerformance
+{
+    [self measureBlock:^{
+        RunConcurrentHydrations(s_pendingCommands, false /* distinctFiles */, 64);
+    }];
+}
+
+@end
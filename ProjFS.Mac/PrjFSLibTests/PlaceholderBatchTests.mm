@@ -0,0 +1,206 @@
+#include "../PrjFSLib/PrjFSLib.h"
+#include "../PrjFSKext/public/PrjFSCommon.h"
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <vector>
+#import <XCTest/XCTest.h>
+
+using std::string;
+using std::to_string;
+using std::vector;
+
+static const uint32_t BenchmarkPlaceholderCount = 2000;
+
+// Without a running virtualization instance, relative paths passed to PrjFSLib are relative to "/"
+static string GetRelativePath(const string& fullPath)
+{
+    return fullPath.substr(1);
+}
+
+static vector<PrjFS_PlaceholderFileEntry> MakeFileEntries(const vector<string>& names, uint16_t fileMode)
+{
+    vector<PrjFS_PlaceholderFileEntry> entries(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        entries[i].Name = names[i].c_str();
+        memset(entries[i].ProviderId, 1, sizeof(entries[i].ProviderId));
+        memset(entries[i].ContentId, static_cast<int>(i), sizeof(entries[i].ContentId));
+        entries[i].FileMode = fileMode;
+        entries[i].Result = PrjFS_Result_Invalid;
+    }
+
+    return entries;
+}
+
+static vector<string> MakeNames(uint32_t count)
+{
+    vector<string> names;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        names.push_back("placeholder" + to_string(i));
+    }
+
+    return names;
+}
+
+static bool IsEmptyPlaceholder(const string& fullPath)
+{
+    struct stat attributes;
+    if (0 != lstat(fullPath.c_str(), &attributes))
+    {
+        return false;
+    }
+
+    const uint32_t placeholderFlags = FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty;
+    return (attributes.st_flags & placeholderFlags) == placeholderFlags;
+}
+
+@interface PlaceholderBatchTests : XCTestCase
+@end
+
+@implementation PlaceholderBatchTests
+{
+    string testDirectoryPath;
+    uint32_t benchmarkRunCount;
+}
+
+- (void) setUp
+{
+    [super setUp];
+
+    string pathTemplate = string([NSTemporaryDirectory() fileSystemRepresentation]) + "/PlaceholderBatchTests.XXXXXX";
+    vector<char> path(pathTemplate.begin(), pathTemplate.end());
+    path.push_back('\0');
+    XCTAssertTrue(nullptr != mkdtemp(path.data()));
+    self->testDirectoryPath = path.data();
+    self->benchmarkRunCount = 0;
+}
+
+- (void) tearDown
+{
+    [[NSFileManager defaultManager] removeItemAtPath:[NSString stringWithUTF8String:self->testDirectoryPath.c_str()] error:nil];
+    [super tearDown];
+}
+
+// Returns the relative path of a new, empty directory to create placeholders in
+- (string) makeBenchmarkDirectory
+{
+    string fullPath = self->testDirectoryPath + "/run" + to_string(self->benchmarkRunCount++);
+    XCTAssertEqual(mkdir(fullPath.c_str(), 0777), 0);
+    return GetRelativePath(fullPath);
+}
+
+- (void) testWritePlaceholderFilesInitializesEveryEntry
+{
+    vector<string> names = MakeNames(600);
+    vector<PrjFS_PlaceholderFileEntry> entries = MakeFileEntries(names, 0644);
+
+    XCTAssertEqual(
+        PrjFS_WritePlaceholderFiles(GetRelativePath(self->testDirectoryPath).c_str(), entries.data(), static_cast<uint32_t>(entries.size())),
+        PrjFS_Result_Success);
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        string fullPath = self->testDirectoryPath + "/" + names[i];
+        XCTAssertEqual(entries[i].Result, PrjFS_Result_Success);
+        XCTAssertTrue(IsEmptyPlaceholder(fullPath));
+
+        PrjFSFileXAttrData xattrData = {};
+        XCTAssertEqual(getxattr(fullPath.c_str(), PrjFSFileXAttrName, &xattrData, sizeof(xattrData), 0, XATTR_NOFOLLOW), static_cast<ssize_t>(sizeof(xattrData)));
+        XCTAssertEqual(xattrData.header.magicNumber, PlaceholderMagicNumber);
+        XCTAssertEqual(xattrData.contentId[0], static_cast<unsigned char>(i));
+
+        struct stat attributes;
+        XCTAssertEqual(lstat(fullPath.c_str(), &attributes), 0);
+        XCTAssertEqual(attributes.st_mode & 0777, 0644);
+    }
+}
+
+- (void) testWritePlaceholderDirectoriesInitializesEveryEntry
+{
+    vector<string> names = MakeNames(10);
+    vector<PrjFS_PlaceholderDirectoryEntry> entries(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        entries[i].Name = names[i].c_str();
+        entries[i].Result = PrjFS_Result_Invalid;
+    }
+
+    XCTAssertEqual(
+        PrjFS_WritePlaceholderDirectories(GetRelativePath(self->testDirectoryPath).c_str(), entries.data(), static_cast<uint32_t>(entries.size())),
+        PrjFS_Result_Success);
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        string fullPath = self->testDirectoryPath + "/" + names[i];
+        struct stat attributes;
+        XCTAssertEqual(entries[i].Result, PrjFS_Result_Success);
+        XCTAssertEqual(lstat(fullPath.c_str(), &attributes), 0);
+        XCTAssertTrue(S_ISDIR(attributes.st_mode));
+        XCTAssertTrue(IsEmptyPlaceholder(fullPath));
+    }
+}
+
+- (void) testExistingFileOnlyFailsItsOwnEntry
+{
+    string existingPath = self->testDirectoryPath + "/placeholder1";
+    FILE* existingFile = fopen(existingPath.c_str(), "w");
+    XCTAssertTrue(nullptr != existingFile);
+    fclose(existingFile);
+
+    vector<string> names = MakeNames(3);
+    vector<PrjFS_PlaceholderFileEntry> entries = MakeFileEntries(names, 0644);
+    XCTAssertEqual(
+        PrjFS_WritePlaceholderFiles(GetRelativePath(self->testDirectoryPath).c_str(), entries.data(), static_cast<uint32_t>(entries.size())),
+        PrjFS_Result_EIOError);
+
+    XCTAssertEqual(entries[0].Result, PrjFS_Result_Success);
+    XCTAssertEqual(entries[1].Result, PrjFS_Result_EIOError);
+    XCTAssertEqual(entries[2].Result, PrjFS_Result_Success);
+    XCTAssertFalse(IsEmptyPlaceholder(existingPath));
+}
+
+- (void) testMissingParentDirectoryFailsEveryEntry
+{
+    vector<string> names = MakeNames(3);
+    vector<PrjFS_PlaceholderFileEntry> entries = MakeFileEntries(names, 0644);
+    string missingDirectory = GetRelativePath(self->testDirectoryPath) + "/missing";
+    XCTAssertEqual(
+        PrjFS_WritePlaceholderFiles(missingDirectory.c_str(), entries.data(), static_cast<uint32_t>(entries.size())),
+        PrjFS_Result_EPathNotFound);
+
+    for (const PrjFS_PlaceholderFileEntry& entry : entries)
+    {
+        XCTAssertEqual(entry.Result, PrjFS_Result_EPathNotFound);
+    }
+}
+
+- (void) testPerEntryPlaceholderCreationPerformance
+{
+    vector<string> names = MakeNames(BenchmarkPlaceholderCount);
+    __block vector<PrjFS_PlaceholderFileEntry> entries = MakeFileEntries(names, 0644);
+    [self measureBlock:^{
+        string directory = [self makeBenchmarkDirectory];
+        for (PrjFS_PlaceholderFileEntry& entry : entries)
+        {
+            string relativePath = directory + "/" + entry.Name;
+            XCTAssertEqual(PrjFS_WritePlaceholderFile(relativePath.c_str(), entry.ProviderId, entry.ContentId, entry.FileMode), PrjFS_Result_Success);
+        }
+    }];
+}
+
+- (void) testBatchedPlaceholderCreationPerformance
+{
+    vector<string> names = MakeNames(BenchmarkPlaceholderCount);
+    __block vector<PrjFS_PlaceholderFileEntry> entries = MakeFileEntries(names, 0644);
+    [self measureBlock:^{
+        string directory = [self makeBenchmarkDirectory];
+        XCTAssertEqual(
+            PrjFS_WritePlaceholderFiles(directory.c_str(), entries.data(), static_cast<uint32_t>(entries.size())),
+            PrjFS_Result_Success);
+    }];
+}
+
+@end
@@ -0,0 +1,231 @@
+#include "../PrjFSLib/RequestScheduler.hpp"
+#include <atomic>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+#import <XCTest/XCTest.h>
+
+using std::atomic;
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+static const uint32_t ConcurrencyLimits[MessagePriority_Count] = { 4, 2, 1 };
+
+// Schedules requestCount requests that each take a while, and returns the most that ran at once
+static uint32_t RunRequestsAndMeasureConcurrency(RequestScheduler& scheduler, MessagePriority priority, uint32_t requestCount)
+{
+    atomic<uint32_t> runningCount(0);
+    atomic<uint32_t> maxRunningCount(0);
+    dispatch_group_t group = dispatch_group_create();
+    for (uint32_t i = 0; i < requestCount; ++i)
+    {
+        dispatch_group_enter(group);
+        scheduler.Schedule(
+            priority,
+            [&runningCount, &maxRunningCount, group]()
+            {
+                uint32_t running = ++runningCount;
+                uint32_t maxRunning = maxRunningCount.load();
+                while (running > maxRunning && !maxRunningCount.compare_exchange_weak(maxRunning, running))
+                {
+                }
+
+                usleep(2000);
+                --runningCount;
+                dispatch_group_leave(group);
+            });
+    }
+
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    return maxRunningCount.load();
+}
+
+// Runners touch the scheduler briefly after their last request finishes, so wait for them before it goes out of scope
+static void WaitForIdle(RequestScheduler& scheduler)
+{
+    for (uint32_t priority = 0; priority < MessagePriority_Count; ++priority)
+    {
+        while (scheduler.GetStatistics(static_cast<MessagePriority>(priority)).runningCount > 0)
+        {
+            usleep(100);
+        }
+    }
+}
+
+@interface RequestSchedulerTests : XCTestCase
+@end
+
+@implementation RequestSchedulerTests
+
+- (void) testConcurrencyIsLimitedPerPriority
+{
+    RequestScheduler scheduler;
+    scheduler.Init(ConcurrencyLimits);
+
+    for (uint32_t priority = 0; priority < MessagePriority_Count; ++priority)
+    {
+        uint32_t maxRunningCount = RunRequestsAndMeasureConcurrency(scheduler, static_cast<MessagePriority>(priority), 32);
+        XCTAssertGreaterThan(maxRunningCount, 0);
+        XCTAssertLessThanOrEqual(maxRunningCount, ConcurrencyLimits[priority]);
+    }
+
+    WaitForIdle(scheduler);
+}
+
+- (void) testSerialPriorityRunsRequestsInOrder
+{
+    RequestScheduler scheduler;
+    scheduler.Init(ConcurrencyLimits);
+
+    mutex orderMutex;
+    vector<uint32_t> order;
+    dispatch_group_t group = dispatch_group_create();
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        dispatch_group_enter(group);
+        scheduler.Schedule(
+            MessagePriority_Informational,
+            [&orderMutex, &order, group, i]()
+            {
+                {
+                    lock_guard<mutex> lock(orderMutex);
+                    order.push_back(i);
+                }
+
+                dispatch_group_leave(group);
+            });
+    }
+
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssertEqual(order.size(), 1000);
+    for (uint32_t i = 0; i < order.size(); ++i)
+    {
+        XCTAssertEqual(order[i], i);
+    }
+
+    WaitForIdle(scheduler);
+}
+
+- (void) testRequestsWaitForEarlierNotifications
+{
+    RequestScheduler scheduler;
+    scheduler.Init(ConcurrencyLimits);
+
+    // A slow notification, followed by requests of the other priorities that must not overtake it
+    atomic<bool> notificationFinished(false);
+    atomic<uint32_t> overtakingCount(0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_enter(group);
+    scheduler.Schedule(
+        MessagePriority_Informational,
+        [&notificationFinished, group]()
+        {
+            usleep(20000);
+            notificationFinished = true;
+            dispatch_group_leave(group);
+        });
+
+    for (uint32_t i = 0; i < 10; ++i)
+    {
+        MessagePriority priority = 0 == i % 2 ? MessagePriority_Blocking : MessagePriority_PreOperation;
+        dispatch_group_enter(group);
+        scheduler.Schedule(
+            priority,
+            [&notificationFinished, &overtakingCount, group]()
+            {
+                if (!notificationFinished)
+                {
+                    ++overtakingCount;
+                }
+
+                dispatch_group_leave(group);
+            });
+    }
+
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssertEqual(overtakingCount.load(), 0);
+    XCTAssertEqual(scheduler.GetStatistics(MessagePriority_Blocking).startedCount, 5);
+    XCTAssertEqual(scheduler.GetStatistics(MessagePriority_PreOperation).startedCount, 5);
+
+    WaitForIdle(scheduler);
+}
+
+- (void) testRequestsDontWaitForLaterNotifications
+{
+    RequestScheduler scheduler;
+    scheduler.Init(ConcurrencyLimits);
+
+    dispatch_semaphore_t requestFinished = dispatch_semaphore_create(0);
+    dispatch_semaphore_t release = dispatch_semaphore_create(0);
+    dispatch_group_t group = dispatch_group_create();
+
+    // Blocks the notification lane until the pre-operation request scheduled before it has run
+    dispatch_group_enter(group);
+    scheduler.Schedule(
+        MessagePriority_PreOperation,
+        [requestFinished, group]()
+        {
+            dispatch_semaphore_signal(requestFinished);
+            dispatch_group_leave(group);
+        });
+    dispatch_group_enter(group);
+    scheduler.Schedule(
+        MessagePriority_Informational,
+        [release, group]()
+        {
+            dispatch_semaphore_wait(release, DISPATCH_TIME_FOREVER);
+            dispatch_group_leave(group);
+        });
+
+    XCTAssertEqual(0, dispatch_semaphore_wait(requestFinished, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)));
+    dispatch_semaphore_signal(release);
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+    WaitForIdle(scheduler);
+}
+
+- (void) testStatisticsReportQueuedAndStartedRequests
+{
+    RequestScheduler scheduler;
+    scheduler.Init(ConcurrencyLimits);
+
+    // Hold up the only notification thread so that the rest queue up behind it
+    dispatch_semaphore_t release = dispatch_semaphore_create(0);
+    dispatch_group_t group = dispatch_group_create();
+    for (uint32_t i = 0; i < 5; ++i)
+    {
+        dispatch_group_enter(group);
+        scheduler.Schedule(
+            MessagePriority_Informational,
+            [release, group, i]()
+            {
+                if (0 == i)
+                {
+                    dispatch_semaphore_wait(release, DISPATCH_TIME_FOREVER);
+                }
+
+                dispatch_group_leave(group);
+            });
+    }
+
+    RequestScheduler::Statistics statistics = scheduler.GetStatistics(MessagePriority_Informational);
+    XCTAssertEqual(statistics.runningCount, 1);
+    XCTAssertEqual(statistics.queueDepth + statistics.startedCount, 5);
+    XCTAssertLessThanOrEqual(statistics.startedCount, 1);
+
+    usleep(10000);
+    dispatch_semaphore_signal(release);
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+    statistics = scheduler.GetStatistics(MessagePriority_Informational);
+    XCTAssertEqual(statistics.queueDepth, 0);
+    XCTAssertEqual(statistics.startedCount, 5);
+    XCTAssertGreaterThanOrEqual(statistics.maxWaitNanoseconds, 10000000);
+    XCTAssertGreaterThanOrEqual(statistics.totalWaitNanoseconds, statistics.maxWaitNanoseconds);
+    XCTAssertEqual(scheduler.GetStatistics(MessagePriority_Blocking).startedCount, 0);
+
+    WaitForIdle(scheduler);
+}
+
+@end
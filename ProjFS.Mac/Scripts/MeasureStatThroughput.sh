@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Measures how quickly files in a directory tree can be stat'ed and opened.
+# Run this on a directory outside any virtualization root, once with no provider
+# registered and once while a repo on the same volume is mounted, to check that
+# the kext doesn't slow down I/O elsewhere on the volume.
+
+DIRECTORY=$1
+ITERATIONS=$2
+if [ -z "$DIRECTORY" ]; then
+  echo "Usage: $0 <directory> [iterations]"
+  exit 1
+fi
+
+if [ -z "$ITERATIONS" ]; then
+  ITERATIONS=10
+fi
+
+FILECOUNT=$(find "$DIRECTORY" -type f | wc -l | tr -d ' ')
+if [ "$FILECOUNT" -eq 0 ]; then
+  echo "No files found in $DIRECTORY"
+  exit 1
+fi
+
+# Warm up the vnode and name caches so that only the authorization path is measured
+find "$DIRECTORY" -type f -print0 | xargs -0 stat > /dev/null
+
+START=$(perl -MTime::HiRes=time -e 'print time')
+for ((i = 0; i < ITERATIONS; i++)); do
+  find "$DIRECTORY" -type f -print0 | xargs -0 stat > /dev/null
+  find "$DIRECTORY" -type f -print0 | xargs -0 head -c 1 > /dev/null
+done
+END=$(perl -MTime::HiRes=time -e 'print time')
+
+perl -e "printf(\"%d files x %d iterations: %.0f stat+open/s\\n\", $FILECOUNT, $ITERATIONS, $FILECOUNT * $ITERATIONS / ($END - $START))"